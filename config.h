@@ -31,6 +31,14 @@
 #define HAVE_EPOLL 1
 #endif
 
+/* test for io_uring (IORING_OP_READ/WRITE are available since Linux 5.6) */
+#ifdef __linux__
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
 #if (defined(__APPLE__) && defined(MAC_OS_X_VERSION_10_6)) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined (__NetBSD__)
 #define HAVE_KQUEUE 1
 #endif
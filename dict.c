@@ -327,13 +327,19 @@ void dictRelease(dict *ht)
 }
 
 dictEntry *dictFind(dict *ht, const void *key)
+{
+    return dictFindWithHash(ht, key, dictHashKey(ht, key));
+}
+
+/* Like dictFind() but using an already computed hash of the key, so that
+ * the same key can be searched in many tables of the same type hashing it
+ * a single time. */
+dictEntry *dictFindWithHash(dict *ht, const void *key, unsigned int hash)
 {
     dictEntry *he;
-    unsigned int h;
 
     if (ht->size == 0) return NULL;
-    h = dictHashKey(ht, key) & ht->sizemask;
-    he = ht->table[h];
+    he = ht->table[hash & ht->sizemask];
     while(he) {
         if (dictCompareHashKeys(ht, key, he->key))
             return he;
@@ -342,6 +348,18 @@ dictEntry *dictFind(dict *ht, const void *key)
     return NULL;
 }
 
+/* Hint the CPU to load the bucket of 'hash' in the cache, so that a batch
+ * of lookups can have their cache misses overlapped. */
+void dictPrefetch(dict *ht, unsigned int hash)
+{
+#ifdef __GNUC__
+    if (ht->size) __builtin_prefetch(&ht->table[hash & ht->sizemask]);
+#else
+    (void) ht;
+    (void) hash;
+#endif
+}
+
 dictIterator *dictGetIterator(dict *ht)
 {
     dictIterator *iter = _dictAlloc(sizeof(*iter));
@@ -408,6 +426,59 @@ dictEntry *dictGetRandomKey(dict *ht)
     return he;
 }
 
+/* Reverse the bits of an unsigned long, used by dictScan() */
+static unsigned long rev(unsigned long v) {
+    unsigned long s = 8 * sizeof(v); /* bit size; must be power of 2 */
+    unsigned long mask = ~0UL;
+
+    while ((s >>= 1) > 0) {
+        mask ^= (mask << s);
+        v = ((v >> s) & mask) | ((v << s) & ~mask);
+    }
+    return v;
+}
+
+/* dictScan() is used to iterate over the elements of a dictionary in many
+ * calls, without holding any state but the returned cursor:
+ *
+ * 1) The first call is performed using 0 as cursor.
+ * 2) Every call calls 'fn' against all the entries of a single bucket, and
+ *    returns the cursor to use in the next call.
+ * 3) When the returned cursor is 0 the iteration is complete.
+ *
+ * The cursor is incremented starting from its higher bits, that is, the
+ * bits of the cursor are reversed, the cursor incremented, and the bits
+ * reversed again. Since the table size is always a power of two, when the
+ * table grows every bucket already visited is split into buckets whose
+ * index, reversed, is still lower than the cursor, and when the table
+ * shrinks the buckets are merged into buckets at the same reversed
+ * position. So every element present in the dictionary for the whole
+ * duration of the iteration is returned at least once, even if the table
+ * is resized by dictExpand() or dictResize() between two calls. Elements
+ * may be returned more than once after the table shrinks. */
+unsigned long dictScan(dict *ht, unsigned long v, dictScanFunction *fn,
+                       void *privdata)
+{
+    dictEntry *he;
+
+    if (ht->used == 0) return 0;
+    he = ht->table[v & ht->sizemask];
+    while (he) {
+        dictEntry *next = he->next;
+
+        fn(privdata, he);
+        he = next;
+    }
+
+    /* Set the unmasked bits so incrementing the reversed cursor operates
+     * on the masked bits only, then increment the reversed cursor. */
+    v |= ~ht->sizemask;
+    v = rev(v);
+    v++;
+    v = rev(v);
+    return v;
+}
+
 /* ------------------------- private functions ------------------------------ */
 
 /* Expand the hash table if needed */
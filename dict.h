@@ -72,6 +72,8 @@ typedef struct dictIterator {
     dictEntry *entry, *nextEntry;
 } dictIterator;
 
+typedef void dictScanFunction(void *privdata, const dictEntry *de);
+
 /* This is the initial size of every hash table */
 #define DICT_HT_INITIAL_SIZE     4
 
@@ -119,6 +121,8 @@ int dictDelete(dict *ht, const void *key);
 int dictDeleteNoFree(dict *ht, const void *key);
 void dictRelease(dict *ht);
 dictEntry * dictFind(dict *ht, const void *key);
+dictEntry *dictFindWithHash(dict *ht, const void *key, unsigned int hash);
+void dictPrefetch(dict *ht, unsigned int hash);
 int dictResize(dict *ht);
 dictIterator *dictGetIterator(dict *ht);
 dictEntry *dictNext(dictIterator *iter);
@@ -127,6 +131,8 @@ dictEntry *dictGetRandomKey(dict *ht);
 void dictPrintStats(dict *ht);
 unsigned int dictGenHashFunction(const unsigned char *buf, int len);
 void dictEmpty(dict *ht);
+unsigned long dictScan(dict *ht, unsigned long v, dictScanFunction *fn,
+                       void *privdata);
 
 /* Hash table types */
 extern dictType dictTypeHeapStringCopyKey;
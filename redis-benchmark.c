@@ -28,6 +28,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE /* pthread_setaffinity_np */
 #include "fmacros.h"
 
 #include <stdio.h>
@@ -38,6 +39,12 @@
 #include <sys/time.h>
 #include <signal.h>
 #include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#include <numa.h>
+#endif
 
 #include "ae.h"
 #include "anet.h"
@@ -54,44 +61,183 @@
 #define CLIENT_SENDQUERY 1
 #define CLIENT_READREPLY 2
 
-#define MAX_LATENCY 5000
+#define OUTPUT_TEXT 0
+#define OUTPUT_CSV 1
+#define OUTPUT_JSON 2
+
+/* Latencies are recorded in microseconds in a log-linear histogram: values
+ * below LATENCY_SUB_COUNT get a bucket each, then every power of two range
+ * is split in LATENCY_SUB_COUNT/2 linear buckets, so the error of a bucket
+ * is below 1/64 (~1.6%) of its value at any scale. */
+#define LATENCY_SUB_BITS 7
+#define LATENCY_SUB_COUNT (1<<LATENCY_SUB_BITS)
+#define LATENCY_MAX_US (60*1000000LL) /* Longer latencies are clamped */
+
+/* Operations of the --mix workload. The last ones are never picked from the
+ * mix: they follow a SET getting a TTL, or an LPUSH keeping the list at
+ * --collsize elements, and are reported on their own. */
+#define OP_GET 0
+#define OP_SET 1
+#define OP_DEL 2
+#define OP_INCR 3
+#define OP_LPUSH 4
+#define OP_LPOP 5
+#define OP_LRANGE 6
+#define OP_SADD 7
+#define OP_SISMEMBER 8
+#define OP_ZADD 9
+#define OP_ZRANGE 10
+#define OP_HSET 11
+#define OP_HGET 12
+#define OP_MIXABLE 13
+#define OP_EXPIRE 13
+#define OP_LTRIM 14
+#define OP_COUNT 15
+
+/* Every data type gets its own keys, named "<prefix>:<n>" */
+#define KEY_STRING 0
+#define KEY_COUNTER 1
+#define KEY_LIST 2
+#define KEY_SET 3
+#define KEY_ZSET 4
+#define KEY_HASH 5
+
+#define KEYDIST_UNIFORM 0
+#define KEYDIST_ZIPF 1
+#define KEYDIST_HOTSPOT 2
 
 #define REDIS_NOTUSED(V) ((void) V)
 
+typedef struct latencyHist {
+    int *buckets;       /* See latencyIndex() */
+    long long count, min, max, sum;
+} latencyHist;
+
+/* Every thread runs its own event loop with its own share of the clients
+ * and of the requests, and collects latencies in its own histogram: the
+ * threads don't share anything while the benchmark runs. Without --threads
+ * there is a single one, run by the main thread. */
+typedef struct benchThread {
+    int id;
+    pthread_t thread;
+    aeEventLoop *el;
+    list *clients;
+    int numclients;     /* Clients this thread keeps connected */
+    int liveclients;
+    int requests;       /* Requests this thread has to perform */
+    int donerequests;
+    int issued;         /* Requests generated so far by the workload */
+    latencyHist lat;
+    latencyHist *oplat; /* Per operation histograms of the workload */
+    unsigned long long rng; /* State of the workload random generator */
+    int cpu;            /* CPU the thread is pinned to, -1 if not pinned */
+} benchThread;
+
 static struct config {
     int debug;
     int numclients;
     int requests;
-    int liveclients;
-    int donerequests;
     int keysize;
     int datasize;
     int randomkeys;
     int randomkeys_keyspacelen;
-    aeEventLoop *el;
     char *hostip;
     int hostport;
     int keepalive;
-    long long start;
+    long long start;    /* start time in microseconds */
     long long totlatency;
-    int *latency;
-    list *clients;
+    latencyHist lat;    /* Histograms of all the threads, merged at the end */
+    latencyHist oplat[OP_COUNT];
+    int latency_buckets;
+    int output;         /* OUTPUT_TEXT, OUTPUT_CSV or OUTPUT_JSON */
+    int rate;           /* Requests per second to send, 0 for no limit */
     int quiet;
     int loop;
     int idlemode;
+    int pipeline;
+    int numthreads;
+    benchThread *threads;
+    int *cpus;          /* CPUs the threads are pinned to, round robin */
+    int numcpus;
+    int numanode;       /* NUMA node to run the threads on, -1 for any */
+    int replies;        /* Replies to every query, more for MULTI/EXEC */
+    sds *tests;         /* Tests selected with -t, NULL for all of them */
+    int numtests;
+    struct randField *randfields; /* Placeholders of the command template */
+    int numrandfields;
+    int querylen;       /* Length of the query, before pipelining it */
 } config;
 
+/* A placeholder of the command template, replaced by random digits at
+ * every request, see randomizeClientKey(). */
+typedef struct randField {
+    int offset;         /* Offset of the digits in the query */
+    int width;
+} randField;
+
+static char *placeholders[] = {"__rand_key__", "__rand_member__",
+                               "__rand_score__"};
+
+typedef struct valueSize {
+    int min, max;       /* Sizes are picked uniformly in [min,max] */
+    int weight;
+} valueSize;
+
+/* The --mix workload: every query picks an operation according to the mix,
+ * a key according to the key distribution and, for writes, a value size
+ * according to the size profile. */
+static struct workload {
+    int enabled;
+    int opweight[OP_MIXABLE];
+    int totweight;
+    long keyspace;
+    int keydist;        /* KEYDIST_* */
+    double theta, zetan, eta, alpha; /* Zipfian distribution constants */
+    double hotkeys, hotops; /* Hotspot: 'hotops' of the ops hit 'hotkeys' */
+    valueSize *valsizes;
+    int numvalsizes;
+    int valweight;
+    char *valbuf;       /* Value bytes, as long as the largest value */
+    int ttlperc;        /* Percentage of the SETs followed by EXPIRE */
+    int ttl;
+    int collsize;       /* Elements of lists, sets, sorted sets and hashes */
+    int prefill;
+    int prefilling;     /* Running the prefill phase */
+    long prefillnext;   /* Next key to fill, shared by all the threads */
+    int prefillops[OP_MIXABLE]; /* Write operation of every type to fill */
+    int numprefillops;
+} wl;
+
+static struct workloadOp {
+    char *name;
+    int keytype;
+} workloadOps[OP_COUNT] = {
+    {"get",KEY_STRING}, {"set",KEY_STRING}, {"del",KEY_STRING},
+    {"incr",KEY_COUNTER}, {"lpush",KEY_LIST}, {"lpop",KEY_LIST},
+    {"lrange",KEY_LIST}, {"sadd",KEY_SET}, {"sismember",KEY_SET},
+    {"zadd",KEY_ZSET}, {"zrange",KEY_ZSET}, {"hset",KEY_HASH},
+    {"hget",KEY_HASH}, {"expire",KEY_STRING}, {"ltrim",KEY_LIST}
+};
+
+static char *keyprefix[] = {"key","counter","list","set","zset","hash"};
+
 typedef struct _client {
     int state;
     int fd;
     sds obuf;
     sds ibuf;
-    int mbulk;          /* Number of elements in an mbulk reply */
+    int mbulk;          /* Elements left in an mbulk reply, -1 if not in one */
     int readlen;        /* readlen == -1 means read a single line */
     int totreceived;
     unsigned int written;        /* bytes of 'obuf' already written */
     int replytype;
-    long long start;    /* start time in milliseconds */
+    int pending;        /* Replies still to read for the queries in 'obuf' */
+    int replies;        /* Replies still to read for the current query */
+    int numops;         /* Queries in 'obuf' with the workload */
+    int *ops;           /* Operation of each of them, NULL without workload */
+    long long start;    /* start time in microseconds */
+    long long timer;    /* Time event delaying the next query with --rate */
+    benchThread *thread; /* Thread owning the client and its event loop */
 } *client;
 
 /* Prototypes */
@@ -99,111 +245,506 @@ static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 static void createMissingClients(client c);
 
 /* Implementation */
-static long long mstime(void) {
+static long long ustime(void) {
     struct timeval tv;
-    long long mst;
+    long long ust;
 
     gettimeofday(&tv, NULL);
-    mst = ((long)tv.tv_sec)*1000;
-    mst += tv.tv_usec/1000;
-    return mst;
+    ust = ((long long)tv.tv_sec)*1000000;
+    ust += tv.tv_usec;
+    return ust;
+}
+
+static int latencyIndex(long long us) {
+    int shift = 0;
+
+    if (us < 0) us = 0;
+    if (us > LATENCY_MAX_US) us = LATENCY_MAX_US;
+    while ((us >> shift) >= LATENCY_SUB_COUNT) shift++;
+    return shift*(LATENCY_SUB_COUNT/2) + (int)(us >> shift);
+}
+
+/* Highest latency falling in the bucket at 'index'. */
+static long long latencyBucketMax(int index) {
+    int shift;
+
+    if (index < LATENCY_SUB_COUNT) return index;
+    shift = index/(LATENCY_SUB_COUNT/2) - 1;
+    return ((long long)(index - shift*(LATENCY_SUB_COUNT/2) + 1) << shift) - 1;
+}
+
+static void histReset(latencyHist *h) {
+    memset(h->buckets,0,sizeof(int)*config.latency_buckets);
+    h->count = h->max = h->sum = 0;
+    h->min = LATENCY_MAX_US;
+}
+
+static void histInit(latencyHist *h) {
+    h->buckets = zmalloc(sizeof(int)*config.latency_buckets);
+    histReset(h);
+}
+
+static void histRecord(latencyHist *h, long long us) {
+    h->buckets[latencyIndex(us)]++;
+    h->count++;
+    if (us < h->min) h->min = us;
+    if (us > h->max) h->max = us;
+    h->sum += us;
+}
+
+static void histMerge(latencyHist *dst, latencyHist *src) {
+    int j;
+
+    for (j = 0; j < config.latency_buckets; j++)
+        dst->buckets[j] += src->buckets[j];
+    dst->count += src->count;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+    dst->sum += src->sum;
 }
 
 static void freeClient(client c) {
+    benchThread *t = c->thread;
     listNode *ln;
 
-    aeDeleteFileEvent(config.el,c->fd,AE_WRITABLE);
-    aeDeleteFileEvent(config.el,c->fd,AE_READABLE);
+    if (c->timer != -1) aeDeleteTimeEvent(t->el,c->timer);
+    aeDeleteFileEvent(t->el,c->fd,AE_WRITABLE);
+    aeDeleteFileEvent(t->el,c->fd,AE_READABLE);
     sdsfree(c->ibuf);
     sdsfree(c->obuf);
+    if (c->ops) zfree(c->ops);
     close(c->fd);
     zfree(c);
-    config.liveclients--;
-    ln = listSearchKey(config.clients,c);
+    t->liveclients--;
+    ln = listSearchKey(t->clients,c);
     assert(ln != NULL);
-    listDelNode(config.clients,ln);
+    listDelNode(t->clients,ln);
 }
 
 static void freeAllClients(void) {
-    listNode *ln = config.clients->head, *next;
+    int j;
+
+    for (j = 0; j < config.numthreads; j++) {
+        listNode *ln = config.threads[j].clients->head, *next;
+
+        while(ln) {
+            next = ln->next;
+            freeClient(ln->value);
+            ln = next;
+        }
+    }
+}
+
+static int sendQueryTimer(aeEventLoop *el, long long id, void *privdata) {
+    client c = privdata;
+    long long now = ustime();
+    REDIS_NOTUSED(id);
+
+    /* Timers have millisecond resolution: wait until the query is due */
+    if (now < c->start) return (int)((c->start-now+999)/1000);
+    c->timer = -1;
+    aeCreateFileEvent(el,c->fd,AE_WRITABLE,writeHandler,c);
+    return AE_NOMORE;
+}
+
+/* xorshift64* generator: every thread has its own state, so the workload
+ * doesn't contend on the lock of random(). */
+static unsigned long long rngNext(benchThread *t) {
+    unsigned long long x = t->rng;
 
-    while(ln) {
-        next = ln->next;
-        freeClient(ln->value);
-        ln = next;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    t->rng = x;
+    return x * 2685821657736338717ULL;
+}
+
+/* Uniform double in [0,1) */
+static double rngDouble(benchThread *t) {
+    return (rngNext(t) >> 11) * (1.0/9007199254740992.0);
+}
+
+/* Pick the number of a key according to the key distribution. With the
+ * Zipfian one key 0 is the most popular, then key 1 and so forth: this is
+ * the algorithm of "Quickly Generating Billion-Record Synthetic Databases"
+ * (Gray et al.) also used by YCSB, drawing a key in constant time. */
+static long pickKey(benchThread *t) {
+    long hot;
+    double u, uz;
+
+    switch(wl.keydist) {
+    case KEYDIST_ZIPF:
+        u = rngDouble(t);
+        uz = u*wl.zetan;
+        if (uz < 1) return 0;
+        if (uz < 1+pow(0.5,wl.theta)) return 1;
+        hot = (long)(wl.keyspace*pow(wl.eta*u-wl.eta+1,wl.alpha));
+        return hot < wl.keyspace ? hot : wl.keyspace-1;
+    case KEYDIST_HOTSPOT:
+        hot = (long)(wl.keyspace*wl.hotkeys);
+        if (hot < 1) hot = 1;
+        if (hot == wl.keyspace || rngDouble(t) < wl.hotops)
+            return rngNext(t) % hot;
+        return hot + rngNext(t) % (wl.keyspace-hot);
+    default:
+        return rngNext(t) % wl.keyspace;
+    }
+}
+
+static int pickOp(benchThread *t) {
+    int r = rngNext(t) % wl.totweight, j;
+
+    for (j = 0; j < OP_MIXABLE; j++) {
+        r -= wl.opweight[j];
+        if (r < 0) break;
     }
+    return j;
+}
+
+static int pickValueSize(benchThread *t) {
+    int r = rngNext(t) % wl.valweight;
+    valueSize *v = wl.valsizes;
+
+    while((r -= v->weight) >= 0) v++;
+    return v->min + (v->max > v->min ? rngNext(t) % (v->max-v->min+1) : 0);
 }
 
+/* The workload sends its queries in the multi bulk protocol, so that any
+ * argument can be binary safe and of any size. */
+static sds catArgCount(sds s, int argc) {
+    return sdscatprintf(s,"*%d\r\n",argc);
+}
+
+static sds catArgLen(sds s, char *p, size_t len) {
+    s = sdscatprintf(s,"$%zu\r\n",len);
+    s = sdscatlen(s,p,len);
+    return sdscatlen(s,"\r\n",2);
+}
+
+static sds catArg(sds s, char *p) {
+    return catArgLen(s,p,strlen(p));
+}
+
+static sds catArgLong(sds s, long l) {
+    char buf[32];
+
+    snprintf(buf,sizeof(buf),"%ld",l);
+    return catArg(s,buf);
+}
+
+static sds catValue(sds s, benchThread *t) {
+    return catArgLen(s,wl.valbuf,pickValueSize(t));
+}
+
+static void addOp(client c, int op) {
+    c->ops[c->numops++] = op;
+    c->thread->issued++;
+}
+
+/* Append a query of the mix, followed by the EXPIRE or LTRIM it may need if
+ * the thread has requests left for it. */
+static void workloadCommand(client c) {
+    benchThread *t = c->thread;
+    int op = pickOp(t);
+    char key[64], member[32];
+    sds s = c->obuf;
+
+    snprintf(key,sizeof(key),"%s:%ld",keyprefix[workloadOps[op].keytype],
+        pickKey(t));
+    snprintf(member,sizeof(member),"m:%d",(int)(rngNext(t) % wl.collsize));
+    switch(op) {
+    case OP_GET: case OP_DEL: case OP_INCR: case OP_LPOP:
+        s = catArgCount(s,2);
+        s = catArg(s,op == OP_GET ? "GET" : op == OP_DEL ? "DEL" :
+                     op == OP_INCR ? "INCR" : "LPOP");
+        s = catArg(s,key);
+        break;
+    case OP_SET: case OP_LPUSH:
+        s = catArgCount(s,3);
+        s = catArg(s,op == OP_SET ? "SET" : "LPUSH");
+        s = catArg(s,key);
+        s = catValue(s,t);
+        break;
+    case OP_LRANGE: case OP_ZRANGE:
+        s = catArgCount(s,4);
+        s = catArg(s,op == OP_LRANGE ? "LRANGE" : "ZRANGE");
+        s = catArg(s,key);
+        s = catArg(s,"0");
+        s = catArgLong(s,wl.collsize-1);
+        break;
+    case OP_SADD: case OP_SISMEMBER: case OP_HGET:
+        s = catArgCount(s,3);
+        s = catArg(s,op == OP_SADD ? "SADD" :
+                     op == OP_SISMEMBER ? "SISMEMBER" : "HGET");
+        s = catArg(s,key);
+        s = catArg(s,member);
+        break;
+    case OP_ZADD:
+        s = catArgCount(s,4);
+        s = catArg(s,"ZADD");
+        s = catArg(s,key);
+        s = catArgLong(s,rngNext(t) % (wl.collsize*1000L));
+        s = catArg(s,member);
+        break;
+    case OP_HSET:
+        s = catArgCount(s,4);
+        s = catArg(s,"HSET");
+        s = catArg(s,key);
+        s = catArg(s,member);
+        s = catValue(s,t);
+        break;
+    }
+    addOp(c,op);
+
+    if (t->issued == t->requests) {
+        /* No room for a follow up query */
+    } else if (op == OP_SET && wl.ttlperc &&
+               (int)(rngNext(t) % 100) < wl.ttlperc) {
+        s = catArgCount(s,3);
+        s = catArg(s,"EXPIRE");
+        s = catArg(s,key);
+        s = catArgLong(s,wl.ttl);
+        addOp(c,OP_EXPIRE);
+    } else if (op == OP_LPUSH) {
+        s = catArgCount(s,4);
+        s = catArg(s,"LTRIM");
+        s = catArg(s,key);
+        s = catArg(s,"0");
+        s = catArgLong(s,wl.collsize-1);
+        addOp(c,OP_LTRIM);
+    }
+    c->obuf = s;
+}
+
+/* Append the query creating the next key of the prefill phase: every type
+ * used by the mix gets 'keyspace' keys, collections with --collsize
+ * elements each. Threads take the keys from a shared counter. */
+static void prefillCommand(client c) {
+    benchThread *t = c->thread;
+    long next = __sync_fetch_and_add(&wl.prefillnext,1);
+    int op = wl.prefillops[next / wl.keyspace], j;
+    char key[64], member[32];
+    sds s = c->obuf;
+
+    snprintf(key,sizeof(key),"%s:%ld",keyprefix[workloadOps[op].keytype],
+        next % wl.keyspace);
+    switch(op) {
+    case OP_SET:
+        s = catArgCount(s,3);
+        s = catArg(s,"SET");
+        s = catArg(s,key);
+        s = catValue(s,t);
+        break;
+    case OP_LPUSH: case OP_SADD:
+        s = catArgCount(s,2+wl.collsize);
+        s = catArg(s,op == OP_LPUSH ? "RPUSH" : "SADD");
+        s = catArg(s,key);
+        for (j = 0; j < wl.collsize; j++) {
+            if (op == OP_LPUSH) {
+                s = catValue(s,t);
+            } else {
+                snprintf(member,sizeof(member),"m:%d",j);
+                s = catArg(s,member);
+            }
+        }
+        break;
+    case OP_ZADD: case OP_HSET:
+        s = catArgCount(s,2+wl.collsize*2);
+        s = catArg(s,op == OP_ZADD ? "ZADD" : "HSET");
+        s = catArg(s,key);
+        for (j = 0; j < wl.collsize; j++) {
+            snprintf(member,sizeof(member),"m:%d",j);
+            if (op == OP_ZADD) {
+                s = catArgLong(s,j);
+                s = catArg(s,member);
+            } else {
+                s = catArg(s,member);
+                s = catValue(s,t);
+            }
+        }
+        break;
+    }
+    addOp(c,op);
+    c->obuf = s;
+}
+
+/* Fill the output buffer of the client with a new batch of -P queries of
+ * the workload, never exceeding the requests of its thread: 'pending' is
+ * zero when the thread has none left, and the client should stay idle. */
+static void workloadQuery(client c) {
+    benchThread *t = c->thread;
+    int j;
+
+    c->obuf = sdscpylen(c->obuf,"",0);
+    c->numops = 0;
+    for (j = 0; j < config.pipeline && t->issued < t->requests; j++) {
+        if (wl.prefilling)
+            prefillCommand(c);
+        else
+            workloadCommand(c);
+    }
+    c->pending = c->numops;
+}
+
+/* Prepare the client to send its query again. With --rate every client
+ * sends its queries at fixed intervals: the next query is due one interval
+ * after the previous one was due, and its latency is measured from that
+ * time, even if the client is late because the server was slow to reply.
+ * This way a server stall is accounted for all the requests that should
+ * have been sent meanwhile, and not just for the one waiting (the
+ * "coordinated omission" of closed loop benchmarks). */
 static void resetClient(client c) {
-    aeDeleteFileEvent(config.el,c->fd,AE_WRITABLE);
-    aeDeleteFileEvent(config.el,c->fd,AE_READABLE);
-    aeCreateFileEvent(config.el,c->fd, AE_WRITABLE,writeHandler,c);
+    aeEventLoop *el = c->thread->el;
+    long long now = ustime();
+
+    aeDeleteFileEvent(el,c->fd,AE_WRITABLE);
+    aeDeleteFileEvent(el,c->fd,AE_READABLE);
     sdsfree(c->ibuf);
     c->ibuf = sdsempty();
-    c->readlen = (c->replytype == REPLY_BULK ||
-                  c->replytype == REPLY_MBULK) ? -1 : 0;
+    c->readlen = -1;
     c->mbulk = -1;
+    c->pending = config.pipeline;
     c->written = 0;
     c->totreceived = 0;
     c->state = CLIENT_SENDQUERY;
-    c->start = mstime();
+    if (wl.enabled) {
+        workloadQuery(c);
+        if (c->pending == 0) return;
+    }
+    if (config.rate) {
+        long long interval = 1000000LL*config.numclients*config.pipeline/
+                             config.rate;
+
+        c->start += interval;
+        if (c->start > now) {
+            c->timer = aeCreateTimeEvent(el,(c->start-now+999)/1000,
+                sendQueryTimer,c,NULL);
+        } else {
+            aeCreateFileEvent(el,c->fd,AE_WRITABLE,writeHandler,c);
+        }
+    } else {
+        aeCreateFileEvent(el,c->fd,AE_WRITABLE,writeHandler,c);
+        c->start = now;
+    }
     createMissingClients(c);
 }
 
+/* Replace the digits following every "_rand" in the query buffer, so that
+ * each of the pipelined queries gets its own random key. The placeholders
+ * of a command template get random numbers too, zero padded to their
+ * width so that the length of the query doesn't change. */
 static void randomizeClientKey(client c) {
-    char *p;
+    char *p = c->obuf;
     char buf[32];
     long r;
+    int j, k;
+
+    while (config.randomkeys && (p = strstr(p, "_rand")) != NULL) {
+        p += 5;
+        r = random() % config.randomkeys_keyspacelen;
+        sprintf(buf,"%ld",r);
+        memcpy(p,buf,strlen(buf));
+    }
+    for (k = 0; k < config.pipeline; k++) {
+        for (j = 0; j < config.numrandfields; j++) {
+            randField *f = config.randfields+j;
 
-    p = strstr(c->obuf, "_rand");
-    if (!p) return;
-    p += 5;
-    r = random() % config.randomkeys_keyspacelen;
-    sprintf(buf,"%ld",r);
-    memcpy(p,buf,strlen(buf));
+            r = random() % config.randomkeys_keyspacelen;
+            sprintf(buf,"%0*ld",f->width,r);
+            memcpy(c->obuf+k*config.querylen+f->offset,buf,f->width);
+        }
+    }
 }
 
+/* Called once on the first client of every benchmark, when its query is
+ * ready: with -P the query is repeated to fill the pipeline. The other
+ * clients copy the already pipelined buffer in createMissingClients(). */
 static void prepareClientForReply(client c, int type) {
-    if (type == REPLY_BULK) {
-        c->replytype = REPLY_BULK;
-        c->readlen = -1;
-    } else if (type == REPLY_MBULK) {
-        c->replytype = REPLY_MBULK;
-        c->readlen = -1;
-        c->mbulk = -1;
-    } else {
-        c->replytype = type;
-        c->readlen = 0;
+    if (config.pipeline > 1) {
+        sds query = sdsdup(c->obuf);
+        int j;
+
+        for (j = 1; j < config.pipeline; j++)
+            c->obuf = sdscatlen(c->obuf,query,sdslen(query));
+        sdsfree(query);
     }
+    c->replytype = type;
+    c->readlen = -1;
+    c->mbulk = -1;
 }
 
-static void clientDone(client c) {
+/* Called every time a reply is received. All the queries of a pipeline are
+ * written together, so the latency of every one of them is measured from
+ * the time the batch was sent. Returns 1 when the client is done with the
+ * batch (or was freed), 0 if there are more replies to read. */
+static int clientDone(client c) {
     static int last_tot_received = 1;
+    benchThread *t = c->thread;
+    long long latency = ustime() - c->start;
 
-    long long latency;
-    config.donerequests ++;
-    latency = mstime() - c->start;
-    if (latency > MAX_LATENCY) latency = MAX_LATENCY;
-    config.latency[latency]++;
+    t->donerequests ++;
+    histRecord(&t->lat,latency);
+    if (c->ops) histRecord(&t->oplat[c->ops[c->numops-c->pending]],latency);
 
     if (config.debug && last_tot_received != c->totreceived) {
         printf("Tot bytes received: %d\n", c->totreceived);
         last_tot_received = c->totreceived;
     }
-    if (config.donerequests == config.requests) {
+    if (t->donerequests == t->requests) {
         freeClient(c);
-        aeStop(config.el);
-        return;
+        aeStop(t->el);
+        return 1;
     }
+    if (--c->pending > 0) return 0;
     if (config.keepalive) {
         resetClient(c);
-        if (config.randomkeys) randomizeClientKey(c);
+        if (config.randomkeys || config.numrandfields) randomizeClientKey(c);
     } else {
-        config.liveclients--;
+        t->liveclients--;
         createMissingClients(c);
-        config.liveclients++;
+        t->liveclients++;
         freeClient(c);
     }
+    return 1;
+}
+
+/* Consume a single complete reply from the head of the input buffer,
+ * leaving whatever follows it (the replies of the next pipelined queries)
+ * in place. Returns 1 if a reply was consumed, 0 if more data is needed. */
+static int processReply(client c) {
+    while(1) {
+        if (c->readlen == -1) {
+            /* Header line: status, error, integer, or the count of a bulk
+             * or multi bulk reply. */
+            char *p = strchr(c->ibuf,'\n');
+            char type;
+            long count;
+
+            if (p == NULL) return 0;
+            type = c->ibuf[0];
+            count = strtol(c->ibuf+1,NULL,10);
+            c->ibuf = sdsrange(c->ibuf,(p-c->ibuf)+1,-1);
+            if (type == '$' && count >= 0) {
+                c->readlen = count+2;
+                continue;
+            } else if (type == '*' && c->mbulk == -1) {
+                /* Empty and null multi bulk replies are complete already */
+                if (count <= 0) return 1;
+                c->mbulk = count;
+                continue;
+            }
+            /* A single line reply or a null bulk: fall through to count it
+             * as an element of the current reply. */
+        } else {
+            /* bulk read, did we read everything? */
+            if ((unsigned)c->readlen > sdslen(c->ibuf)) return 0;
+            c->ibuf = sdsrange(c->ibuf,c->readlen,-1);
+            c->readlen = -1;
+        }
+        if (c->mbulk > 0 && --c->mbulk > 0) continue;
+        c->mbulk = -1;
+        return 1;
+    }
 }
 
 static void readHandler(aeEventLoop *el, int fd, void *privdata, int mask)
@@ -229,80 +770,11 @@ static void readHandler(aeEventLoop *el, int fd, void *privdata, int mask)
     c->totreceived += nread;
     c->ibuf = sdscatlen(c->ibuf,buf,nread);
 
-processdata:
-    /* Are we waiting for the first line of the command of for  sdf 
-     * count in bulk or multi bulk operations? */
-    if (c->replytype == REPLY_INT ||
-        c->replytype == REPLY_RETCODE ||
-        (c->replytype == REPLY_BULK && c->readlen == -1) ||
-        (c->replytype == REPLY_MBULK && c->readlen == -1) ||
-        (c->replytype == REPLY_MBULK && c->mbulk == -1)) {
-        char *p;
-
-        /* Check if the first line is complete. This is only true if
-         * there is a newline inside the buffer. */
-        if ((p = strchr(c->ibuf,'\n')) != NULL) {
-            if (c->replytype == REPLY_BULK ||
-                (c->replytype == REPLY_MBULK && c->mbulk != -1))
-            {
-                /* Read the count of a bulk reply (being it a single bulk or
-                 * a multi bulk reply). "$<count>" for the protocol spec. */
-                *p = '\0';
-                *(p-1) = '\0';
-                c->readlen = atoi(c->ibuf+1)+2;
-                // printf("BULK ATOI: %s\n", c->ibuf+1);
-                /* Handle null bulk reply "$-1" */
-                if (c->readlen-2 == -1) {
-                    clientDone(c);
-                    return;
-                }
-                /* Leave all the rest in the input buffer */
-                c->ibuf = sdsrange(c->ibuf,(p-c->ibuf)+1,-1);
-                /* fall through to reach the point where the code will try
-                 * to check if the bulk reply is complete. */
-            } else if (c->replytype == REPLY_MBULK && c->mbulk == -1) {
-                /* Read the count of a multi bulk reply. That is, how many
-                 * bulk replies we have to read next. "*<count>" protocol. */
-                *p = '\0';
-                *(p-1) = '\0';
-                c->mbulk = atoi(c->ibuf+1);
-                /* Handle null bulk reply "*-1" */
-                if (c->mbulk == -1) {
-                    clientDone(c);
-                    return;
-                }
-                // printf("%p) %d elements list\n", c, c->mbulk);
-                /* Leave all the rest in the input buffer */
-                c->ibuf = sdsrange(c->ibuf,(p-c->ibuf)+1,-1);
-                goto processdata;
-            } else {
-                c->ibuf = sdstrim(c->ibuf,"\r\n");
-                clientDone(c);
-                return;
-            }
-        }
-    }
-    /* bulk read, did we read everything? */
-    if (((c->replytype == REPLY_MBULK && c->mbulk != -1) || 
-         (c->replytype == REPLY_BULK)) && c->readlen != -1 &&
-          (unsigned)c->readlen <= sdslen(c->ibuf))
-    {
-        // printf("BULKSTATUS mbulk:%d readlen:%d sdslen:%d\n",
-        //    c->mbulk,c->readlen,sdslen(c->ibuf));
-        if (c->replytype == REPLY_BULK) {
-            clientDone(c);
-        } else if (c->replytype == REPLY_MBULK) {
-            // printf("%p) %d (%d)) ",c, c->mbulk, c->readlen);
-            // fwrite(c->ibuf,c->readlen,1,stdout);
-            // printf("\n");
-            if (--c->mbulk == 0) {
-                clientDone(c);
-            } else {
-                c->ibuf = sdsrange(c->ibuf,c->readlen,-1);
-                c->readlen = -1;
-                goto processdata;
-            }
-        }
+    while(processReply(c)) {
+        /* A MULTI/EXEC block is a single request, done with its last reply */
+        if (--c->replies > 0) continue;
+        c->replies = config.replies;
+        if (clientDone(c)) return;
     }
 }
 
@@ -315,7 +787,7 @@ static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask)
 
     if (c->state == CLIENT_CONNECTING) {
         c->state = CLIENT_SENDQUERY;
-        c->start = mstime();
+        c->start = ustime();
     }
     if (sdslen(c->obuf) > c->written) {
         void *ptr = c->obuf+c->written;
@@ -329,14 +801,14 @@ static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask)
         }
         c->written += nwritten;
         if (sdslen(c->obuf) == c->written) {
-            aeDeleteFileEvent(config.el,c->fd,AE_WRITABLE);
-            aeCreateFileEvent(config.el,c->fd,AE_READABLE,readHandler,c);
+            aeDeleteFileEvent(c->thread->el,c->fd,AE_WRITABLE);
+            aeCreateFileEvent(c->thread->el,c->fd,AE_READABLE,readHandler,c);
             c->state = CLIENT_READREPLY;
         }
     }
 }
 
-static client createClient(void) {
+static client createClient(benchThread *t) {
     client c = zmalloc(sizeof(struct _client));
     char err[ANET_ERR_LEN];
 
@@ -350,73 +822,588 @@ static client createClient(void) {
     c->obuf = sdsempty();
     c->ibuf = sdsempty();
     c->mbulk = -1;
-    c->readlen = 0;
+    c->readlen = -1;
+    c->pending = config.pipeline;
+    c->replies = config.replies;
+    c->numops = 0;
+    c->ops = wl.enabled ? zmalloc(sizeof(int)*config.pipeline*2) : NULL;
     c->written = 0;
     c->totreceived = 0;
     c->state = CLIENT_CONNECTING;
-    aeCreateFileEvent(config.el, c->fd, AE_WRITABLE, writeHandler, c);
-    config.liveclients++;
-    listAddNodeTail(config.clients,c);
+    c->timer = -1;
+    c->thread = t;
+    aeCreateFileEvent(t->el, c->fd, AE_WRITABLE, writeHandler, c);
+    t->liveclients++;
+    listAddNodeTail(t->clients,c);
     return c;
 }
 
 static void createMissingClients(client c) {
-    while(config.liveclients < config.numclients) {
-        client new = createClient();
+    benchThread *t = c->thread;
+
+    while(t->liveclients < t->numclients) {
+        client new = createClient(t);
         if (!new) continue;
+        if (wl.enabled) {
+            workloadQuery(new);
+            if (new->pending == 0)
+                aeDeleteFileEvent(t->el,new->fd,AE_WRITABLE);
+            continue;
+        }
         sdsfree(new->obuf);
         new->obuf = sdsdup(c->obuf);
-        if (config.randomkeys) randomizeClientKey(c);
-        prepareClientForReply(new,c->replytype);
+        if (config.randomkeys || config.numrandfields) randomizeClientKey(new);
+        new->replytype = c->replytype;
     }
 }
 
-static void showLatencyReport(char *title) {
-    int j, seen = 0;
-    float perc, reqpersec;
+/* Latency below which the specified percentage of the requests fall. */
+static long long latencyPercentile(latencyHist *h, double perc) {
+    long long threshold, seen = 0;
+    int j;
+
+    if (h->count == 0) return 0;
+    threshold = (long long)((perc/100)*h->count+0.5);
+    if (threshold < 1) threshold = 1;
+    for (j = 0; j < config.latency_buckets; j++) {
+        seen += h->buckets[j];
+        if (seen >= threshold) {
+            long long max = latencyBucketMax(j);
+            return max < h->max ? max : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* Print 's' as a quoted CSV or JSON string. */
+static void printQuoted(char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (config.output == OUTPUT_CSV && *s == '"') {
+            printf("\"\"");
+        } else if (config.output == OUTPUT_JSON && (*s == '"' || *s == '\\')) {
+            printf("\\%c", *s);
+        } else if (config.output == OUTPUT_JSON && (unsigned char)*s < 32) {
+            printf("\\u%04x", (unsigned char)*s);
+        } else {
+            putchar(*s);
+        }
+    }
+    putchar('"');
+}
 
-    reqpersec = (float)config.donerequests/((float)config.totlatency/1000);
-    if (!config.quiet) {
+static double percentiles[] = {50, 90, 99, 99.9, 99.99};
+#define NUM_PERCENTILES (sizeof(percentiles)/sizeof(double))
+
+static void showLatencyReport(char *title, latencyHist *h) {
+    unsigned int j;
+    float reqpersec;
+    double avg;
+    long long min = h->count ? h->min : 0;
+
+    reqpersec = (float)h->count/((float)config.totlatency/1000000);
+    avg = h->count ? (double)h->sum/h->count : 0;
+    if (config.output == OUTPUT_CSV) {
+        printQuoted(title);
+        printf(",\"%.2f\"", reqpersec);
+        for (j = 0; j < NUM_PERCENTILES; j++)
+            printf(",\"%lld\"", latencyPercentile(h,percentiles[j]));
+        printf(",\"%lld\",\"%.2f\"\n", h->max, avg);
+    } else if (config.output == OUTPUT_JSON) {
+        printf("{\"test\":");
+        printQuoted(title);
+        printf(",\"requests\":%lld,\"seconds\":%.3f,\"rps\":%.2f,"
+               "\"latency_usec\":{\"min\":%lld,\"avg\":%.2f",
+            h->count, (float)config.totlatency/1000000, reqpersec, min, avg);
+        for (j = 0; j < NUM_PERCENTILES; j++)
+            printf(",\"p%g\":%lld", percentiles[j],
+                latencyPercentile(h,percentiles[j]));
+        printf(",\"max\":%lld}}\n", h->max);
+    } else if (!config.quiet) {
         printf("====== %s ======\n", title);
-        printf("  %d requests completed in %.2f seconds\n", config.donerequests,
-            (float)config.totlatency/1000);
+        printf("  %lld requests completed in %.2f seconds\n", h->count,
+            (float)config.totlatency/1000000);
         printf("  %d parallel clients\n", config.numclients);
-        printf("  %d bytes payload\n", config.datasize);
+        printf("  %d threads\n", config.numthreads);
+        if (!wl.enabled) printf("  %d bytes payload\n", config.datasize);
         printf("  keep alive: %d\n", config.keepalive);
+        printf("  pipeline: %d\n", config.pipeline);
+        if (config.rate) printf("  rate: %d requests per second\n", config.rate);
         printf("\n");
-        for (j = 0; j <= MAX_LATENCY; j++) {
-            if (config.latency[j]) {
-                seen += config.latency[j];
-                perc = ((float)seen*100)/config.donerequests;
-                printf("%.2f%% <= %d milliseconds\n", perc, j);
-            }
-        }
+        printf("Latency percentiles (microseconds):\n");
+        for (j = 0; j < NUM_PERCENTILES; j++)
+            printf("  %7.3f%% <= %lld\n", percentiles[j],
+                latencyPercentile(h,percentiles[j]));
+        printf("  100.000%% <= %lld\n", h->max);
+        printf("  min %lld, avg %.2f\n", min, avg);
         printf("%.2f requests per second\n\n", reqpersec);
     } else {
-        printf("%s: %.2f requests per second\n", title, reqpersec);
+        printf("%s: %.2f requests per second, p50=%lld p99=%lld usec\n", title,
+            reqpersec, latencyPercentile(h,50), latencyPercentile(h,99));
+    }
+    fflush(stdout);
+}
+
+/* Report of every operation of the workload: a line each in the default
+ * output, a test named "<title> <op>" each otherwise. */
+static void showOpsReport(char *title) {
+    int j;
+
+    if (config.output == OUTPUT_TEXT && !config.quiet)
+        printf("Per operation (microseconds):\n");
+    for (j = 0; j < OP_COUNT; j++) {
+        latencyHist *h = config.oplat+j;
+
+        if (h->count == 0) continue;
+        if (config.output == OUTPUT_TEXT && !config.quiet) {
+            printf("  %-10s %8lld requests, %9.2f rps, p50 %lld, p99 %lld, "
+                   "p99.9 %lld, max %lld\n", workloadOps[j].name, h->count,
+                (float)h->count/((float)config.totlatency/1000000),
+                latencyPercentile(h,50), latencyPercentile(h,99),
+                latencyPercentile(h,99.9), h->max);
+        } else {
+            sds optitle = sdscatprintf(sdsempty(),"%s %s",title,
+                workloadOps[j].name);
+            showLatencyReport(optitle,h);
+            sdsfree(optitle);
+        }
     }
+    if (config.output == OUTPUT_TEXT && !config.quiet) printf("\n");
+    fflush(stdout);
 }
 
 static void prepareForBenchmark(void)
 {
-    memset(config.latency,0,sizeof(int)*(MAX_LATENCY+1));
-    config.start = mstime();
-    config.donerequests = 0;
+    int j, k;
+
+    for (j = 0; j < config.numthreads; j++) {
+        benchThread *t = config.threads+j;
+
+        histReset(&t->lat);
+        if (wl.enabled) {
+            for (k = 0; k < OP_COUNT; k++) histReset(t->oplat+k);
+        }
+        t->donerequests = 0;
+        t->issued = 0;
+        t->requests = config.requests/config.numthreads +
+                      (j < config.requests%config.numthreads);
+    }
+    config.start = ustime();
 }
 
 static void endBenchmark(char *title) {
-    config.totlatency = mstime()-config.start;
-    showLatencyReport(title);
+    int j, k;
+
+    config.totlatency = ustime()-config.start;
+    histReset(&config.lat);
+    for (k = 0; k < OP_COUNT; k++) histReset(config.oplat+k);
+    for (j = 0; j < config.numthreads; j++) {
+        benchThread *t = config.threads+j;
+
+        histMerge(&config.lat,&t->lat);
+        if (wl.enabled) {
+            for (k = 0; k < OP_COUNT; k++)
+                histMerge(config.oplat+k,t->oplat+k);
+        }
+    }
+    showLatencyReport(title,&config.lat);
+    if (wl.enabled && !wl.prefilling) showOpsReport(title);
     freeAllClients();
 }
 
-void parseOptions(int argc, char **argv) {
+static void pinThread(benchThread *t) {
+#ifdef __linux__
+    if (config.numanode != -1 && numa_run_on_node(config.numanode) == -1) {
+        fprintf(stderr,"Can't run thread %d on NUMA node %d\n",
+            t->id, config.numanode);
+        config.numanode = -1;
+    }
+    if (t->cpu != -1) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(t->cpu,&set);
+        if (pthread_setaffinity_np(pthread_self(),sizeof(set),&set) != 0) {
+            fprintf(stderr,"Can't pin thread %d to CPU %d\n", t->id, t->cpu);
+            t->cpu = -1; /* don't try again at every benchmark */
+        }
+    }
+#else
+    REDIS_NOTUSED(t);
+#endif
+}
+
+static void *benchThreadMain(void *arg) {
+    benchThread *t = arg;
+
+    pinThread(t);
+    aeMain(t->el);
+    return NULL;
+}
+
+/* Run the event loops of all the threads having requests to perform,
+ * returning when all of them are done. A single thread is run directly
+ * by the caller. */
+static void runThreads(void) {
+    int j;
+
+    if (config.numthreads == 1) {
+        benchThreadMain(config.threads);
+        return;
+    }
+    for (j = 0; j < config.numthreads; j++) {
+        benchThread *t = config.threads+j;
+
+        if (listLength(t->clients) == 0) continue;
+        if (pthread_create(&t->thread,NULL,benchThreadMain,t) != 0) {
+            fprintf(stderr,"Can't create benchmark thread %d\n", j);
+            exit(1);
+        }
+    }
+    for (j = 0; j < config.numthreads; j++) {
+        benchThread *t = config.threads+j;
+
+        if (listLength(t->clients) == 0) continue;
+        pthread_join(t->thread,NULL);
+    }
+}
+
+/* Run a benchmark sending 'cmd' (a complete query in the Redis protocol)
+ * and expecting a reply of the specified type. Every thread gets its own
+ * first client with the query, the others are created from it. */
+static void benchmark(char *title, char *cmd, int replytype) {
+    int j;
+
+    config.querylen = strlen(cmd);
+    prepareForBenchmark();
+    for (j = 0; j < config.numthreads; j++) {
+        benchThread *t = config.threads+j;
+        client c;
+
+        if (t->requests == 0) continue;
+        c = createClient(t);
+        if (!c) exit(1);
+        c->obuf = sdscat(c->obuf,cmd);
+        prepareClientForReply(c,replytype);
+        if (config.numrandfields) randomizeClientKey(c);
+        createMissingClients(c);
+    }
+    runThreads();
+    endBenchmark(title);
+}
+
+/* Is the test 'name' selected by -t? A name also selects the group of
+ * tests it is the prefix of, like "lrange" for "lrange_100", and the
+ * other way around. */
+static int testSelected(char *name) {
+    size_t nl = strlen(name);
+    int j;
+
+    if (config.tests == NULL) return 1;
+    for (j = 0; j < config.numtests; j++) {
+        char *t = config.tests[j];
+        size_t tl = strlen(t);
+
+        if (tl == nl && !strcasecmp(t,name)) return 1;
+        if (tl < nl && !strncasecmp(t,name,tl) && name[tl] == '_') return 1;
+        if (nl < tl && !strncasecmp(t,name,nl) && t[nl] == '_') return 1;
+    }
+    return 0;
+}
+
+/* Send 'count' queries on a blocking connection and wait for all their
+ * replies: used to create the data some of the tests read. */
+static void setupTestData(sds cmds, int count) {
+    struct _client c;
+    char err[ANET_ERR_LEN], buf[1024];
+    int fd, nread;
+
+    fd = anetTcpConnect(err,config.hostip,config.hostport);
+    if (fd == ANET_ERR) {
+        fprintf(stderr,"Connect: %s\n",err);
+        exit(1);
+    }
+    if (anetWrite(fd,cmds,sdslen(cmds)) == -1) {
+        fprintf(stderr,"Writing to socket: %s\n", strerror(errno));
+        exit(1);
+    }
+    memset(&c,0,sizeof(c));
+    c.ibuf = sdsempty();
+    c.readlen = -1;
+    c.mbulk = -1;
+    while(count) {
+        nread = read(fd,buf,sizeof(buf));
+        if (nread <= 0) {
+            fprintf(stderr,"Reading from socket: %s\n",
+                nread ? strerror(errno) : "EOF");
+            exit(1);
+        }
+        c.ibuf = sdscatlen(c.ibuf,buf,nread);
+        while(count && processReply(&c)) count--;
+    }
+    sdsfree(c.ibuf);
+    close(fd);
+}
+
+/* Replace 'key' with a list (RPUSH) or a set (SADD) of 'count' elements,
+ * for the tests reading or popping them. List elements are all 'value',
+ * set members the numbers from 0 to count-1. Elements are added 1000 at a
+ * time to keep the queries small. */
+static void setupCollection(char *cmdname, char *key, long count, sds value) {
+    sds cmd = catArgCount(sdsempty(),2);
+    int queries = 1;
+    long j, k;
+
+    cmd = catArg(cmd,"DEL");
+    cmd = catArg(cmd,key);
+    for (j = 0; j < count; j += 1000) {
+        long n = count-j > 1000 ? 1000 : count-j;
+
+        cmd = catArgCount(cmd,2+n);
+        cmd = catArg(cmd,cmdname);
+        cmd = catArg(cmd,key);
+        for (k = j; k < j+n; k++) {
+            if (!strcasecmp(cmdname,"SADD"))
+                cmd = catArgLong(cmd,k);
+            else
+                cmd = catArgLen(cmd,value,sdslen(value));
+        }
+        queries++;
+    }
+    setupTestData(cmd,queries);
+    sdsfree(cmd);
+}
+
+/* Turn the command given on the command line into a multi bulk query,
+ * recording where its placeholders are: they are replaced by as many
+ * zeros, then by random digits at every request. */
+static sds templateCommand(int argc, char **argv) {
+    sds cmd = catArgCount(sdsempty(),argc);
+    int j, k;
+
+    for (j = 0; j < argc; j++) {
+        sds arg = sdsnew(argv[j]);
+        int first = config.numrandfields;
+
+        for (k = 0; k < (int)(sizeof(placeholders)/sizeof(char*)); k++) {
+            char *p = arg;
+            int width = strlen(placeholders[k]);
+
+            while((p = strstr(p,placeholders[k])) != NULL) {
+                memset(p,'0',width);
+                config.randfields = zrealloc(config.randfields,
+                    sizeof(randField)*(config.numrandfields+1));
+                config.randfields[config.numrandfields].offset = p-arg;
+                config.randfields[config.numrandfields].width = width;
+                config.numrandfields++;
+                p += width;
+            }
+        }
+        cmd = sdscatprintf(cmd,"$%zu\r\n",sdslen(arg));
+        /* Offsets were relative to the argument, make them relative to
+         * the query */
+        for (k = first; k < config.numrandfields; k++)
+            config.randfields[k].offset += sdslen(cmd);
+        cmd = sdscatlen(cmd,arg,sdslen(arg));
+        cmd = sdscatlen(cmd,"\r\n",2);
+        sdsfree(arg);
+    }
+    return cmd;
+}
+
+/* Run the --mix workload: unlike benchmark() every client generates its
+ * own queries. */
+static void workloadBenchmark(char *title) {
+    int j;
+
+    prepareForBenchmark();
+    for (j = 0; j < config.numthreads; j++) {
+        benchThread *t = config.threads+j;
+        client c;
+
+        if (t->requests == 0) continue;
+        c = createClient(t);
+        if (!c) exit(1);
+        workloadQuery(c);
+        createMissingClients(c);
+    }
+    runThreads();
+    endBenchmark(title);
+}
+
+/* Create 'keyspace' keys for every type used by the mix, sending as many
+ * requests as keys at full speed. */
+static void prefillWorkload(void) {
+    int requests = config.requests, rate = config.rate;
+
+    config.requests = (int)(wl.keyspace*wl.numprefillops);
+    config.rate = 0;
+    wl.prefilling = 1;
+    wl.prefillnext = 0;
+    workloadBenchmark("PREFILL");
+    wl.prefilling = 0;
+    config.requests = requests;
+    config.rate = rate;
+}
+
+/* Compute the constants of the key distribution, allocate the value bytes
+ * and find the types of keys the prefill phase has to create. */
+static void initWorkload(void) {
+    static int fillop[] = {OP_SET, -1, OP_LPUSH, OP_SADD, OP_ZADD, OP_HSET};
+    int used[KEY_HASH+1] = {0}, j, maxsize = 0;
+
+    if (wl.keydist == KEYDIST_ZIPF) {
+        long i;
+
+        wl.zetan = 0;
+        for (i = 1; i <= wl.keyspace; i++) wl.zetan += 1/pow(i,wl.theta);
+        wl.alpha = 1/(1-wl.theta);
+        wl.eta = (1-pow(2.0/wl.keyspace,1-wl.theta))/
+                 (1-(1+pow(0.5,wl.theta))/wl.zetan);
+    }
+    if (wl.valsizes == NULL) {
+        wl.valsizes = zmalloc(sizeof(valueSize));
+        wl.valsizes->min = wl.valsizes->max = config.datasize;
+        wl.valsizes->weight = wl.valweight = 1;
+        wl.numvalsizes = 1;
+    }
+    for (j = 0; j < wl.numvalsizes; j++)
+        if (wl.valsizes[j].max > maxsize) maxsize = wl.valsizes[j].max;
+    wl.valbuf = zmalloc(maxsize);
+    memset(wl.valbuf,'x',maxsize);
+
+    for (j = 0; j < OP_MIXABLE; j++)
+        if (wl.opweight[j]) used[workloadOps[j].keytype] = 1;
+    wl.numprefillops = 0;
+    for (j = 0; j <= KEY_HASH; j++)
+        if (used[j] && fillop[j] != -1)
+            wl.prefillops[wl.numprefillops++] = fillop[j];
+}
+
+/* Parse an operation mix like "get:80,set:15,lpush:5": weights are relative
+ * to their sum, so they don't need to add up to 100. */
+static int parseMix(char *s) {
+    char *p = s;
+
+    memset(wl.opweight,0,sizeof(wl.opweight));
+    wl.totweight = 0;
+    while(*p) {
+        char *colon = strchr(p,':'), *end;
+        long weight;
+        int j;
+
+        if (colon == NULL) return -1;
+        for (j = 0; j < OP_MIXABLE; j++) {
+            if ((size_t)(colon-p) == strlen(workloadOps[j].name) &&
+                !strncasecmp(p,workloadOps[j].name,colon-p)) break;
+        }
+        if (j == OP_MIXABLE) return -1;
+        weight = strtol(colon+1,&end,10);
+        if (end == colon+1 || weight < 0) return -1;
+        wl.opweight[j] += weight;
+        wl.totweight += weight;
+        if (*end == ',') end++;
+        else if (*end != '\0') return -1;
+        p = end;
+    }
+    return wl.totweight ? 0 : -1;
+}
+
+/* Parse the key distribution: "uniform", "zipf:<theta>" with theta in
+ * (0,1), or "hotspot:<keys>:<ops>" where the fraction <ops> of the
+ * operations hit the fraction <keys> of the keyspace. */
+static int parseKeyDist(char *s) {
+    if (!strcasecmp(s,"uniform")) {
+        wl.keydist = KEYDIST_UNIFORM;
+    } else if (!strncasecmp(s,"zipf:",5)) {
+        wl.keydist = KEYDIST_ZIPF;
+        wl.theta = strtod(s+5,NULL);
+        if (wl.theta <= 0 || wl.theta >= 1) return -1;
+    } else if (!strncasecmp(s,"hotspot:",8)) {
+        wl.keydist = KEYDIST_HOTSPOT;
+        if (sscanf(s+8,"%lf:%lf",&wl.hotkeys,&wl.hotops) != 2 ||
+            wl.hotkeys <= 0 || wl.hotkeys > 1 ||
+            wl.hotops < 0 || wl.hotops > 1) return -1;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/* Parse a value size profile: a list of sizes or <min>-<max> ranges, each
+ * with an optional weight, like "32" or "16-64:90,1024-4096:10". */
+static int parseValueSizes(char *s) {
+    char *p = s;
+
+    wl.numvalsizes = 0;
+    wl.valweight = 0;
+    while(*p) {
+        valueSize *v;
+        char *end;
+
+        wl.valsizes = zrealloc(wl.valsizes,
+            sizeof(valueSize)*(wl.numvalsizes+1));
+        v = wl.valsizes+wl.numvalsizes++;
+        v->min = v->max = strtol(p,&end,10);
+        if (end == p || v->min < 1) return -1;
+        if (*end == '-') {
+            p = end+1;
+            v->max = strtol(p,&end,10);
+            if (end == p || v->max < v->min) return -1;
+        }
+        if (v->max > 1024*1024) return -1;
+        v->weight = 1;
+        if (*end == ':') {
+            p = end+1;
+            v->weight = strtol(p,&end,10);
+            if (end == p || v->weight < 0) return -1;
+        }
+        wl.valweight += v->weight;
+        if (*end == ',') end++;
+        else if (*end != '\0') return -1;
+        p = end;
+    }
+    return wl.valweight ? 0 : -1;
+}
+
+/* Parse a list of CPUs like "0,2,4-7" into config.cpus. */
+static int parseCpuList(char *s) {
+    char *p = s;
+
+    config.numcpus = 0;
+    while(*p) {
+        char *end;
+        long first, last;
+
+        first = last = strtol(p,&end,10);
+        if (end == p || first < 0) return -1;
+        if (*end == '-') {
+            p = end+1;
+            last = strtol(p,&end,10);
+            if (end == p || last < first) return -1;
+        }
+        for (; first <= last; first++) {
+            config.cpus = zrealloc(config.cpus,sizeof(int)*(config.numcpus+1));
+            config.cpus[config.numcpus++] = first;
+        }
+        if (*end == ',') end++;
+        else if (*end != '\0') return -1;
+        p = end;
+    }
+    return config.numcpus ? 0 : -1;
+}
+
+/* Parse the options, returning the index of the first argument of the
+ * command to benchmark, or 'argc' if there is none. */
+int parseOptions(int argc, char **argv) {
     int i;
 
     for (i = 1; i < argc; i++) {
         int lastarg = i==argc-1;
         
-        if (!strcmp(argv[i],"-c") && !lastarg) {
+        if (argv[i][0] != '-') {
+            break;
+        } else if (!strcmp(argv[i],"-c") && !lastarg) {
             config.numclients = atoi(argv[i+1]);
             i++;
         } else if (!strcmp(argv[i],"-n") && !lastarg) {
@@ -444,9 +1431,74 @@ void parseOptions(int argc, char **argv) {
         } else if (!strcmp(argv[i],"-r") && !lastarg) {
             config.randomkeys = 1;
             config.randomkeys_keyspacelen = atoi(argv[i+1]);
-            if (config.randomkeys_keyspacelen < 0)
-                config.randomkeys_keyspacelen = 0;
+            if (config.randomkeys_keyspacelen < 1)
+                config.randomkeys_keyspacelen = 1;
+            i++;
+        } else if (!strcmp(argv[i],"-t") && !lastarg) {
+            config.tests = sdssplitlen(argv[i+1],strlen(argv[i+1]),",",1,
+                &config.numtests);
+            i++;
+        } else if (!strcmp(argv[i],"-P") && !lastarg) {
+            config.pipeline = atoi(argv[i+1]);
+            if (config.pipeline < 1) config.pipeline = 1;
+            i++;
+        } else if (!strcmp(argv[i],"--threads") && !lastarg) {
+            config.numthreads = atoi(argv[i+1]);
+            if (config.numthreads < 1) config.numthreads = 1;
+            i++;
+        } else if (!strcmp(argv[i],"--cpus") && !lastarg) {
+            if (parseCpuList(argv[i+1]) == -1) {
+                printf("Invalid CPU list '%s'\n", argv[i+1]);
+                exit(1);
+            }
             i++;
+        } else if (!strcmp(argv[i],"--numa-node") && !lastarg) {
+            config.numanode = atoi(argv[i+1]);
+            i++;
+        } else if (!strcmp(argv[i],"--rate") && !lastarg) {
+            config.rate = atoi(argv[i+1]);
+            if (config.rate < 0) config.rate = 0;
+            i++;
+        } else if (!strcmp(argv[i],"--mix") && !lastarg) {
+            if (parseMix(argv[i+1]) == -1) {
+                printf("Invalid operation mix '%s'\n", argv[i+1]);
+                exit(1);
+            }
+            wl.enabled = 1;
+            i++;
+        } else if (!strcmp(argv[i],"--keyspace") && !lastarg) {
+            wl.keyspace = atol(argv[i+1]);
+            if (wl.keyspace < 1) wl.keyspace = 1;
+            i++;
+        } else if (!strcmp(argv[i],"--keydist") && !lastarg) {
+            if (parseKeyDist(argv[i+1]) == -1) {
+                printf("Invalid key distribution '%s'\n", argv[i+1]);
+                exit(1);
+            }
+            i++;
+        } else if (!strcmp(argv[i],"--valsize") && !lastarg) {
+            if (parseValueSizes(argv[i+1]) == -1) {
+                printf("Invalid value sizes '%s'\n", argv[i+1]);
+                exit(1);
+            }
+            i++;
+        } else if (!strcmp(argv[i],"--ttl") && !lastarg) {
+            if (sscanf(argv[i+1],"%d:%d",&wl.ttlperc,&wl.ttl) != 2 ||
+                wl.ttlperc < 0 || wl.ttlperc > 100 || wl.ttl < 1) {
+                printf("Invalid TTL ratio '%s'\n", argv[i+1]);
+                exit(1);
+            }
+            i++;
+        } else if (!strcmp(argv[i],"--collsize") && !lastarg) {
+            wl.collsize = atoi(argv[i+1]);
+            if (wl.collsize < 1) wl.collsize = 1;
+            i++;
+        } else if (!strcmp(argv[i],"--prefill")) {
+            wl.prefill = 1;
+        } else if (!strcmp(argv[i],"--csv")) {
+            config.output = OUTPUT_CSV;
+        } else if (!strcmp(argv[i],"--json")) {
+            config.output = OUTPUT_JSON;
         } else if (!strcmp(argv[i],"-q")) {
             config.quiet = 1;
         } else if (!strcmp(argv[i],"-l")) {
@@ -457,31 +1509,63 @@ void parseOptions(int argc, char **argv) {
             config.idlemode = 1;
         } else {
             printf("Wrong option '%s' or option argument missing\n\n",argv[i]);
-            printf("Usage: redis-benchmark [-h <host>] [-p <port>] [-c <clients>] [-n <requests]> [-k <boolean>]\n\n");
+            printf("Usage: redis-benchmark [-h <host>] [-p <port>] [-c <clients>] [-n <requests]> [-k <boolean>] [-P <numreq>] [command args...]\n\n");
+            printf(" A command given after the options is benchmarked instead of the tests.\n");
+            printf(" Its arguments can contain __rand_key__, __rand_member__ and\n");
+            printf(" __rand_score__, replaced at every request by random numbers below\n");
+            printf(" the -r keyspace length (default 10000).\n\n");
             printf(" -h <hostname>      Server hostname (default 127.0.0.1)\n");
             printf(" -p <hostname>      Server port (default 6379)\n");
             printf(" -c <clients>       Number of parallel connections (default 50)\n");
             printf(" -n <requests>      Total number of requests (default 10000)\n");
             printf(" -d <size>          Data size of SET/GET value in bytes (default 2)\n");
             printf(" -k <boolean>       1=keep alive 0=reconnect (default 1)\n");
-            printf(" -r <keyspacelen>   Use random keys for SET/GET/INCR, random values for SADD\n");
+            printf(" -P <numreq>        Pipeline <numreq> requests, sent with a single write\n");
+            printf("  and counted as <numreq> requests (default 1, no pipeline)\n");
+            printf(" --threads <n>      Run the clients on <n> threads, each with its own\n");
+            printf("  event loop and an equal share of clients and requests (default 1)\n");
+            printf(" --cpus <list>      Pin the threads to these CPUs, round robin (e.g. 0,2,4-7)\n");
+            printf(" --numa-node <node> Run the threads and allocate their memory on <node>\n");
+            printf(" -t <tests>         Only run the comma separated list of tests: ping, set,\n");
+            printf("  get, incr, lpush, lpop, sadd, spop, sinter, zadd, zrank, zrange,\n");
+            printf("  hset, hget (or hset_zipmap, hset_hashtable...), sort, multi,\n");
+            printf("  lrange (or lrange_100, lrange_300, lrange_450, lrange_600)\n");
+            printf(" -r <keyspacelen>   Use random keys for SET/GET/INCR, random values for SADD, ZADD\n");
             printf("  Using this option the benchmark will get/set keys\n");
             printf("  in the form mykey_rand000000012456 instead of constant\n");
             printf("  keys, the <keyspacelen> argument determines the max\n");
             printf("  number of values for the random number. For instance\n");
             printf("  if set to 10 only rand000000000000 - rand000000000009\n");
             printf("  range will be allowed.\n");
-            printf(" -q                 Quiet. Just show query/sec values\n");
+            printf(" --rate <rps>       Send <rps> requests per second in total, measuring\n");
+            printf("  latency from when every request was due (requires -k 1)\n");
+            printf(" --mix <op:weight,...> Run a workload instead of the tests, picking every\n");
+            printf("  request among get, set, del, incr, lpush, lpop, lrange, sadd,\n");
+            printf("  sismember, zadd, zrange, hset, hget with the given weights\n");
+            printf(" --keyspace <keys>  Keys of every type used by the workload (default 10000)\n");
+            printf(" --keydist <dist>   Key popularity: uniform (default), zipf:<theta>\n");
+            printf("  with 0 < theta < 1, or hotspot:<keys>:<ops> where the fraction\n");
+            printf("  <ops> of the requests hit the fraction <keys> of the keyspace\n");
+            printf(" --valsize <sizes>  Value sizes, a list of sizes or min-max ranges with\n");
+            printf("  optional weights, e.g. 16-64:90,4096:10 (default -d)\n");
+            printf(" --ttl <perc:secs>  Follow <perc>%% of the SETs by an EXPIRE of <secs>\n");
+            printf(" --collsize <n>     Elements of lists, sets, zsets, hashes (default 100)\n");
+            printf(" --prefill          Create all the keys of the workload before running it\n");
+            printf(" --csv              Output a CSV line per test, after a header line\n");
+            printf(" --json             Output a JSON object per test, one per line\n");
+            printf(" -q                 Quiet. Just show query/sec and p50/p99 latency\n");
             printf(" -l                 Loop. Run the tests forever\n");
             printf(" -I                 Idle mode. Just open N idle connections and wait.\n");
             printf(" -D                 Debug mode. more verbose.\n");
             exit(1);
         }
     }
+    return i;
 }
 
 int main(int argc, char **argv) {
-    client c;
+    sds cmd, data;
+    int j, k, cmdarg;
 
     signal(SIGHUP, SIG_IGN);
     signal(SIGPIPE, SIG_IGN);
@@ -489,24 +1573,84 @@ int main(int argc, char **argv) {
     config.debug = 0;
     config.numclients = 50;
     config.requests = 10000;
-    config.liveclients = 0;
-    config.el = aeCreateEventLoop();
     config.keepalive = 1;
-    config.donerequests = 0;
     config.datasize = 3;
     config.randomkeys = 0;
-    config.randomkeys_keyspacelen = 0;
+    config.randomkeys_keyspacelen = 10000;
     config.quiet = 0;
     config.loop = 0;
     config.idlemode = 0;
-    config.latency = NULL;
-    config.clients = listCreate();
-    config.latency = zmalloc(sizeof(int)*(MAX_LATENCY+1));
+    config.pipeline = 1;
+    config.numthreads = 1;
+    config.cpus = NULL;
+    config.numcpus = 0;
+    config.numanode = -1;
+    config.output = OUTPUT_TEXT;
+    config.rate = 0;
+    config.latency_buckets = latencyIndex(LATENCY_MAX_US)+1;
+    histInit(&config.lat);
+    for (j = 0; j < OP_COUNT; j++) histInit(config.oplat+j);
+    wl.enabled = 0;
+    wl.keyspace = 10000;
+    wl.keydist = KEYDIST_UNIFORM;
+    wl.valsizes = NULL;
+    wl.ttlperc = 0;
+    wl.collsize = 100;
+    wl.prefill = 0;
+    wl.prefilling = 0;
 
     config.hostip = "127.0.0.1";
     config.hostport = 6379;
 
-    parseOptions(argc,argv);
+    config.replies = 1;
+    config.tests = NULL;
+    config.numtests = 0;
+    config.randfields = NULL;
+    config.numrandfields = 0;
+
+    cmdarg = parseOptions(argc,argv);
+
+    /* Every thread needs at least a client */
+    if (config.numthreads > config.numclients)
+        config.numthreads = config.numclients;
+    if (config.numthreads > 1) zmalloc_enable_thread_safeness();
+    if (config.numanode != -1) {
+        if (!zmalloc_numa_node_available(config.numanode)) {
+            printf("NUMA node %d is not available\n", config.numanode);
+            exit(1);
+        }
+        zmalloc_set_numa_node(config.numanode);
+    }
+    config.threads = zmalloc(sizeof(benchThread)*config.numthreads);
+    for (j = 0; j < config.numthreads; j++) {
+        benchThread *t = config.threads+j;
+
+        t->id = j;
+        t->el = aeCreateEventLoop();
+        t->clients = listCreate();
+        t->numclients = config.numclients/config.numthreads +
+                        (j < config.numclients%config.numthreads);
+        t->liveclients = 0;
+        histInit(&t->lat);
+        t->oplat = NULL;
+        if (wl.enabled) {
+            t->oplat = zmalloc(sizeof(latencyHist)*OP_COUNT);
+            for (k = 0; k < OP_COUNT; k++) histInit(t->oplat+k);
+        }
+        t->rng = (ustime() ^ ((j+1)*0x9E3779B97F4A7C15ULL)) | 1;
+        t->cpu = config.numcpus ? config.cpus[j % config.numcpus] : -1;
+    }
+
+    if (config.rate && !config.keepalive) {
+        printf("--rate requires keep alive (-k 1)\n");
+        exit(1);
+    }
+    if (config.output == OUTPUT_CSV) {
+        printf("\"test\",\"rps\"");
+        for (j = 0; j < (int)NUM_PERCENTILES; j++)
+            printf(",\"p%g_usec\"", percentiles[j]);
+        printf(",\"max_usec\",\"avg_usec\"\n");
+    }
 
     if (config.keepalive == 0) {
         printf("WARNING: keepalive disabled, you probably need 'echo 1 > /proc/sys/net/ipv4/tcp_tw_reuse' for Linux and 'sudo sysctl -w net.inet.tcp.msl=1000' for Mac OS X in order to use a lot of clients/requests\n");
@@ -515,149 +1659,207 @@ int main(int argc, char **argv) {
     if (config.idlemode) {
         printf("Creating %d idle connections and waiting forever (Ctrl+C when done)\n", config.numclients);
         prepareForBenchmark();
-        c = createClient();
-        if (!c) exit(1);
-        c->obuf = sdsempty();
-        prepareClientForReply(c,REPLY_RETCODE); /* will never receive it */
-        createMissingClients(c);
-        aeMain(config.el);
+        for (j = 0; j < config.numthreads; j++) {
+            client c = createClient(config.threads+j);
+            if (!c) exit(1);
+            prepareClientForReply(c,REPLY_RETCODE); /* will never receive it */
+            createMissingClients(c);
+        }
+        runThreads();
         /* and will wait for every */
     }
 
-    do {
-        prepareForBenchmark();
-        c = createClient();
-        if (!c) exit(1);
-        c->obuf = sdscat(c->obuf,"PING\r\n");
-        prepareClientForReply(c,REPLY_RETCODE);
-        createMissingClients(c);
-        aeMain(config.el);
-        endBenchmark("PING");
-
-        prepareForBenchmark();
-        c = createClient();
-        if (!c) exit(1);
-        c->obuf = sdscat(c->obuf,"*1\r\n$4\r\nPING\r\n");
-        prepareClientForReply(c,REPLY_RETCODE);
-        createMissingClients(c);
-        aeMain(config.el);
-        endBenchmark("PING (multi bulk)");
-
-        prepareForBenchmark();
-        c = createClient();
-        if (!c) exit(1);
-        c->obuf = sdscatprintf(c->obuf,"SET foo_rand000000000000 %d\r\n",config.datasize);
-        {
-            char *data = zmalloc(config.datasize+2);
-            memset(data,'x',config.datasize);
-            data[config.datasize] = '\r';
-            data[config.datasize+1] = '\n';
-            c->obuf = sdscatlen(c->obuf,data,config.datasize+2);
-        }
-        prepareClientForReply(c,REPLY_RETCODE);
-        createMissingClients(c);
-        aeMain(config.el);
-        endBenchmark("SET");
-
-        prepareForBenchmark();
-        c = createClient();
-        if (!c) exit(1);
-        c->obuf = sdscat(c->obuf,"GET foo_rand000000000000\r\n");
-        prepareClientForReply(c,REPLY_BULK);
-        createMissingClients(c);
-        aeMain(config.el);
-        endBenchmark("GET");
-
-        prepareForBenchmark();
-        c = createClient();
-        if (!c) exit(1);
-        c->obuf = sdscat(c->obuf,"INCR counter_rand000000000000\r\n");
-        prepareClientForReply(c,REPLY_INT);
-        createMissingClients(c);
-        aeMain(config.el);
-        endBenchmark("INCR");
-
-        prepareForBenchmark();
-        c = createClient();
-        if (!c) exit(1);
-        c->obuf = sdscat(c->obuf,"LPUSH mylist 3\r\nbar\r\n");
-        prepareClientForReply(c,REPLY_INT);
-        createMissingClients(c);
-        aeMain(config.el);
-        endBenchmark("LPUSH");
-
-        prepareForBenchmark();
-        c = createClient();
-        if (!c) exit(1);
-        c->obuf = sdscat(c->obuf,"LPOP mylist\r\n");
-        prepareClientForReply(c,REPLY_BULK);
-        createMissingClients(c);
-        aeMain(config.el);
-        endBenchmark("LPOP");
-
-        prepareForBenchmark();
-        c = createClient();
-        if (!c) exit(1);
-        c->obuf = sdscat(c->obuf,"SADD myset 24\r\ncounter_rand000000000000\r\n");
-        prepareClientForReply(c,REPLY_RETCODE);
-        createMissingClients(c);
-        aeMain(config.el);
-        endBenchmark("SADD");
+    if (wl.enabled) {
+        initWorkload();
+        if (wl.prefill && wl.numprefillops) prefillWorkload();
+        do {
+            workloadBenchmark("WORKLOAD");
+        } while(config.loop);
+        return 0;
+    }
 
-        prepareForBenchmark();
-        c = createClient();
-        if (!c) exit(1);
-        c->obuf = sdscat(c->obuf,"SPOP myset\r\n");
-        prepareClientForReply(c,REPLY_BULK);
-        createMissingClients(c);
-        aeMain(config.el);
-        endBenchmark("SPOP");
+    if (cmdarg < argc) {
+        sds title = sdsempty();
 
-        prepareForBenchmark();
-        c = createClient();
-        if (!c) exit(1);
-        c->obuf = sdscat(c->obuf,"LPUSH mylist 3\r\nbar\r\n");
-        prepareClientForReply(c,REPLY_RETCODE);
-        createMissingClients(c);
-        aeMain(config.el);
-        endBenchmark("LPUSH (again, in order to bench LRANGE)");
+        for (j = cmdarg; j < argc; j++)
+            title = sdscatprintf(title,"%s%s",j == cmdarg ? "" : " ",argv[j]);
+        cmd = templateCommand(argc-cmdarg,argv+cmdarg);
+        do {
+            benchmark(title,cmd,REPLY_BULK);
+        } while(config.loop);
+        return 0;
+    }
 
-        prepareForBenchmark();
-        c = createClient();
-        if (!c) exit(1);
-        c->obuf = sdscat(c->obuf,"LRANGE mylist 0 99\r\n");
-        prepareClientForReply(c,REPLY_MBULK);
-        createMissingClients(c);
-        aeMain(config.el);
-        endBenchmark("LRANGE (first 100 elements)");
+    data = sdsnewlen(NULL,config.datasize);
+    memset(data,'x',config.datasize);
+    do {
+        if (testSelected("ping_inline"))
+            benchmark("PING","PING\r\n",REPLY_RETCODE);
+        if (testSelected("ping_mbulk"))
+            benchmark("PING (multi bulk)","*1\r\n$4\r\nPING\r\n",REPLY_RETCODE);
+        if (testSelected("set")) {
+            cmd = sdscatprintf(sdsempty(),"SET foo_rand000000000000 %d\r\n",
+                config.datasize);
+            cmd = sdscatlen(cmd,data,config.datasize);
+            cmd = sdscatlen(cmd,"\r\n",2);
+            benchmark("SET",cmd,REPLY_RETCODE);
+            sdsfree(cmd);
+        }
+        if (testSelected("get")) {
+            /* The key read when -r is not given */
+            cmd = catArgCount(sdsempty(),3);
+            cmd = catArg(cmd,"SET");
+            cmd = catArg(cmd,"foo_rand000000000000");
+            cmd = catArgLen(cmd,data,config.datasize);
+            setupTestData(cmd,1);
+            sdsfree(cmd);
+            benchmark("GET","GET foo_rand000000000000\r\n",REPLY_BULK);
+        }
+        if (testSelected("incr"))
+            benchmark("INCR","INCR counter_rand000000000000\r\n",REPLY_INT);
+        if (testSelected("lpush"))
+            benchmark("LPUSH","LPUSH mylist 3\r\nbar\r\n",REPLY_INT);
+        if (testSelected("lpop")) {
+            /* An element for every request: the list never gets empty */
+            setupCollection("RPUSH","mylist",config.requests,data);
+            benchmark("LPOP","LPOP mylist\r\n",REPLY_BULK);
+        }
+        if (testSelected("sadd"))
+            benchmark("SADD","SADD myset 24\r\ncounter_rand000000000000\r\n",REPLY_RETCODE);
+        if (testSelected("spop")) {
+            setupCollection("SADD","myset",config.requests,NULL);
+            benchmark("SPOP","SPOP myset\r\n",REPLY_BULK);
+        }
+        if (testSelected("sinter")) {
+            /* Two sets of 200 elements with 100 in common */
+            cmd = catArgCount(sdsempty(),3);
+            cmd = catArg(cmd,"DEL");
+            cmd = catArg(cmd,"sinter:a");
+            cmd = catArg(cmd,"sinter:b");
+            for (k = 0; k < 2; k++) {
+                cmd = catArgCount(cmd,202);
+                cmd = catArg(cmd,"SADD");
+                cmd = catArg(cmd,k ? "sinter:b" : "sinter:a");
+                for (j = k*100; j < k*100+200; j++) cmd = catArgLong(cmd,j);
+            }
+            setupTestData(cmd,3);
+            sdsfree(cmd);
+            benchmark("SINTER (two sets of 200 elements, 100 in common)",
+                "SINTER sinter:a sinter:b\r\n",REPLY_MBULK);
+        }
+        if (testSelected("zadd"))
+            benchmark("ZADD","ZADD myzset 0 24\r\nelement_rand000000000000\r\n",REPLY_RETCODE);
+        if (testSelected("zrank") || testSelected("zrange")) {
+            /* A sorted set of 1000 members, including the one ZRANK looks
+             * up when -r is not given */
+            cmd = catArgCount(sdsempty(),2);
+            cmd = catArg(cmd,"DEL");
+            cmd = catArg(cmd,"myzset");
+            cmd = catArgCount(cmd,2+1000*2);
+            cmd = catArg(cmd,"ZADD");
+            cmd = catArg(cmd,"myzset");
+            for (j = 0; j < 1000; j++) {
+                char member[32];
 
-        prepareForBenchmark();
-        c = createClient();
-        if (!c) exit(1);
-        c->obuf = sdscat(c->obuf,"LRANGE mylist 0 299\r\n");
-        prepareClientForReply(c,REPLY_MBULK);
-        createMissingClients(c);
-        aeMain(config.el);
-        endBenchmark("LRANGE (first 300 elements)");
+                snprintf(member,sizeof(member),"element_rand%012d",j);
+                cmd = catArgLong(cmd,j);
+                cmd = catArg(cmd,member);
+            }
+            setupTestData(cmd,2);
+            sdsfree(cmd);
+        }
+        if (testSelected("zrank"))
+            benchmark("ZRANK","ZRANK myzset 24\r\nelement_rand000000000000\r\n",REPLY_RETCODE);
+        if (testSelected("zrange_100"))
+            benchmark("ZRANGE (first 100 elements)","ZRANGE myzset 0 99\r\n",REPLY_MBULK);
+        if (testSelected("hset") || testSelected("hget")) {
+            /* Hashes of 32 and 128 fields: below and above the default
+             * hash-max-zipmap-entries of 64 */
+            cmd = catArgCount(sdsempty(),3);
+            cmd = catArg(cmd,"DEL");
+            cmd = catArg(cmd,"myhash:zipmap");
+            cmd = catArg(cmd,"myhash:hashtable");
+            for (k = 0; k < 2; k++) {
+                int fields = k ? 128 : 32;
 
-        prepareForBenchmark();
-        c = createClient();
-        if (!c) exit(1);
-        c->obuf = sdscat(c->obuf,"LRANGE mylist 0 449\r\n");
-        prepareClientForReply(c,REPLY_MBULK);
-        createMissingClients(c);
-        aeMain(config.el);
-        endBenchmark("LRANGE (first 450 elements)");
+                cmd = catArgCount(cmd,2+fields*2);
+                cmd = catArg(cmd,"HSET");
+                cmd = catArg(cmd,k ? "myhash:hashtable" : "myhash:zipmap");
+                for (j = 0; j < fields; j++) {
+                    cmd = catArgLong(cmd,j);
+                    cmd = catArgLen(cmd,data,config.datasize);
+                }
+            }
+            setupTestData(cmd,3);
+            sdsfree(cmd);
+        }
+        for (k = 0; k < 2; k++) {
+            char *key = k ? "myhash:hashtable" : "myhash:zipmap";
 
-        prepareForBenchmark();
-        c = createClient();
-        if (!c) exit(1);
-        c->obuf = sdscat(c->obuf,"LRANGE mylist 0 599\r\n");
-        prepareClientForReply(c,REPLY_MBULK);
-        createMissingClients(c);
-        aeMain(config.el);
-        endBenchmark("LRANGE (first 600 elements)");
+            if (testSelected(k ? "hset_hashtable" : "hset_zipmap")) {
+                cmd = catArgCount(sdsempty(),4);
+                cmd = catArg(cmd,"HSET");
+                cmd = catArg(cmd,key);
+                cmd = catArg(cmd,"16");
+                cmd = catArgLen(cmd,data,config.datasize);
+                benchmark(k ? "HSET (hashtable encoding)" :
+                              "HSET (zipmap encoding)",cmd,REPLY_INT);
+                sdsfree(cmd);
+            }
+            if (testSelected(k ? "hget_hashtable" : "hget_zipmap")) {
+                cmd = sdscatprintf(sdsempty(),"HGET %s 2\r\n16\r\n",key);
+                benchmark(k ? "HGET (hashtable encoding)" :
+                              "HGET (zipmap encoding)",cmd,REPLY_BULK);
+                sdsfree(cmd);
+            }
+        }
+        if (testSelected("sort")) {
+            /* A list of 100 ids, each with a weight and an object */
+            cmd = catArgCount(sdsempty(),2);
+            cmd = catArg(cmd,"DEL");
+            cmd = catArg(cmd,"sort:list");
+            cmd = catArgCount(cmd,102);
+            cmd = catArg(cmd,"RPUSH");
+            cmd = catArg(cmd,"sort:list");
+            for (j = 0; j < 100; j++) cmd = catArgLong(cmd,j);
+            cmd = catArgCount(cmd,401);
+            cmd = catArg(cmd,"MSET");
+            for (j = 0; j < 100; j++) {
+                char key[32];
 
+                snprintf(key,sizeof(key),"sort:weight_%d",j);
+                cmd = catArg(cmd,key);
+                cmd = catArgLong(cmd,(j*37)%100);
+                snprintf(key,sizeof(key),"sort:obj_%d",j);
+                cmd = catArg(cmd,key);
+                cmd = catArgLen(cmd,data,config.datasize);
+            }
+            setupTestData(cmd,3);
+            sdsfree(cmd);
+            benchmark("SORT (100 elements BY weight GET object)",
+                "SORT sort:list BY sort:weight_* GET sort:obj_*\r\n",
+                REPLY_MBULK);
+        }
+        if (testSelected("multi")) {
+            /* MULTI, SET, INCR and EXEC count as a single request */
+            cmd = sdscatprintf(sdsempty(),
+                "MULTI\r\nSET foo_rand000000000000 %d\r\n",config.datasize);
+            cmd = sdscatlen(cmd,data,config.datasize);
+            cmd = sdscat(cmd,"\r\nINCR counter_rand000000000000\r\nEXEC\r\n");
+            config.replies = 4;
+            benchmark("MULTI/EXEC (SET + INCR)",cmd,REPLY_MBULK);
+            config.replies = 1;
+            sdsfree(cmd);
+        }
+        if (testSelected("lrange")) setupCollection("RPUSH","mylist",600,data);
+        if (testSelected("lrange_100"))
+            benchmark("LRANGE (first 100 elements)","LRANGE mylist 0 99\r\n",REPLY_MBULK);
+        if (testSelected("lrange_300"))
+            benchmark("LRANGE (first 300 elements)","LRANGE mylist 0 299\r\n",REPLY_MBULK);
+        if (testSelected("lrange_450"))
+            benchmark("LRANGE (first 450 elements)","LRANGE mylist 0 449\r\n",REPLY_MBULK);
+        if (testSelected("lrange_600"))
+            benchmark("LRANGE (first 600 elements)","LRANGE mylist 0 599\r\n",REPLY_MBULK);
         printf("\n");
     } while(config.loop);
 
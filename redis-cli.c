@@ -72,8 +72,8 @@ static struct redisCommand cmdTable[] = {
     {"exists",2,REDIS_CMD_INLINE},
     {"incr",2,REDIS_CMD_INLINE},
     {"decr",2,REDIS_CMD_INLINE},
-    {"rpush",3,REDIS_CMD_BULK},
-    {"lpush",3,REDIS_CMD_BULK},
+    {"rpush",-3,REDIS_CMD_BULK},
+    {"lpush",-3,REDIS_CMD_BULK},
     {"rpop",2,REDIS_CMD_INLINE},
     {"lpop",2,REDIS_CMD_INLINE},
     {"brpop",-3,REDIS_CMD_INLINE},
@@ -85,7 +85,7 @@ static struct redisCommand cmdTable[] = {
     {"ltrim",4,REDIS_CMD_INLINE},
     {"lrem",4,REDIS_CMD_BULK},
     {"rpoplpush",3,REDIS_CMD_BULK},
-    {"sadd",3,REDIS_CMD_BULK},
+    {"sadd",-3,REDIS_CMD_BULK},
     {"srem",3,REDIS_CMD_BULK},
     {"smove",4,REDIS_CMD_BULK},
     {"sismember",3,REDIS_CMD_BULK},
@@ -94,18 +94,21 @@ static struct redisCommand cmdTable[] = {
     {"srandmember",2,REDIS_CMD_INLINE},
     {"sinter",-2,REDIS_CMD_INLINE},
     {"sinterstore",-3,REDIS_CMD_INLINE},
+    {"sintercard",-2,REDIS_CMD_INLINE},
     {"sunion",-2,REDIS_CMD_INLINE},
     {"sunionstore",-3,REDIS_CMD_INLINE},
     {"sdiff",-2,REDIS_CMD_INLINE},
     {"sdiffstore",-3,REDIS_CMD_INLINE},
     {"smembers",2,REDIS_CMD_INLINE},
-    {"zadd",4,REDIS_CMD_BULK},
+    {"sscan",-3,REDIS_CMD_INLINE},
+    {"zadd",-4,REDIS_CMD_BULK},
     {"zincrby",4,REDIS_CMD_BULK},
     {"zrem",3,REDIS_CMD_BULK},
     {"zremrangebyscore",4,REDIS_CMD_INLINE},
     {"zmerge",-3,REDIS_CMD_INLINE},
     {"zmergeweighed",-4,REDIS_CMD_INLINE},
     {"zrange",-4,REDIS_CMD_INLINE},
+    {"zscan",-3,REDIS_CMD_INLINE},
     {"zrank",3,REDIS_CMD_BULK},
     {"zrevrank",3,REDIS_CMD_BULK},
     {"zrangebyscore",-4,REDIS_CMD_INLINE},
@@ -122,6 +125,7 @@ static struct redisCommand cmdTable[] = {
     {"rename",3,REDIS_CMD_INLINE},
     {"renamenx",3,REDIS_CMD_INLINE},
     {"keys",2,REDIS_CMD_INLINE},
+    {"scan",-2,REDIS_CMD_INLINE},
     {"dbsize",1,REDIS_CMD_INLINE},
     {"ping",1,REDIS_CMD_INLINE},
     {"echo",2,REDIS_CMD_BULK},
@@ -148,13 +152,14 @@ static struct redisCommand cmdTable[] = {
     {"multi",1,REDIS_CMD_INLINE},
     {"exec",1,REDIS_CMD_INLINE},
     {"discard",1,REDIS_CMD_INLINE},
-    {"hset",4,REDIS_CMD_MULTIBULK},
+    {"hset",-4,REDIS_CMD_MULTIBULK},
     {"hget",3,REDIS_CMD_BULK},
-    {"hdel",3,REDIS_CMD_BULK},
+    {"hdel",-3,REDIS_CMD_BULK},
     {"hlen",2,REDIS_CMD_INLINE},
     {"hkeys",2,REDIS_CMD_INLINE},
     {"hvals",2,REDIS_CMD_INLINE},
     {"hgetall",2,REDIS_CMD_INLINE},
+    {"hscan",-3,REDIS_CMD_INLINE},
     {"hexists",3,REDIS_CMD_BULK},
     {NULL,0,0}
 };
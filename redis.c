@@ -76,6 +76,8 @@
 #include "lzf.h"    /* LZF compression library */
 #include "pqsort.h" /* Partial qsort for SORT+LIMIT */
 #include "zipmap.h"
+#include "seglist.h" /* Segmented lists, for large lists */
+#include "uring.h"  /* io_uring based swap file I/O */
 
 /* Error codes */
 #define REDIS_OK                0
@@ -99,6 +101,11 @@
 #define REDIS_WRITEV_THRESHOLD      3
 /* Max number of iovecs used for each writev call */
 #define REDIS_WRITEV_IOVEC_COUNT    256
+/* Bulk replies up to REDIS_REPLY_INLINE_MAX bytes are copied into the last
+ * reply object of the client instead of being referenced, as long as that
+ * object does not grow over REDIS_REPLY_CHUNK_BYTES */
+#define REDIS_REPLY_INLINE_MAX      1024
+#define REDIS_REPLY_CHUNK_BYTES     (1024*16)
 
 /* Hash table parameters */
 #define REDIS_HT_MINFILL        10      /* Minimal hash table fill 10% */
@@ -126,9 +133,11 @@
 #define REDIS_ENCODING_INT 1    /* Encoded as integer */
 #define REDIS_ENCODING_ZIPMAP 2 /* Encoded as zipmap */
 #define REDIS_ENCODING_HT 3     /* Encoded as an hash table */
+#define REDIS_ENCODING_LINKEDLIST 4 /* Encoded as a linked list of objects */
+#define REDIS_ENCODING_SEGLIST 5 /* Encoded as a segmented list */
 
 static char* strencoding[] = {
-    "raw", "int", "zipmap", "hashtable"
+    "raw", "int", "zipmap", "hashtable", "linkedlist", "seglist"
 };
 
 /* Object types only used for dumping to disk */
@@ -169,17 +178,28 @@ static char* strencoding[] = {
 #define REDIS_VM_SWAPPING 2     /* Redis is swapping this object on disk */
 #define REDIS_VM_LOADING 3      /* Redis is loading this object from disk */
 
-/* Virtual memory static configuration stuff.
- * Check vmFindContiguousPages() to know more about this magic numbers. */
-#define REDIS_VM_MAX_NEAR_PAGES 65536
-#define REDIS_VM_MAX_RANDOM_JUMP 4096
+/* Virtual memory static configuration stuff. */
 #define REDIS_VM_MAX_THREADS 32
+#define REDIS_VM_URING_ENTRIES 256 /* Max swap I/O requests in the io_uring */
+#define REDIS_VM_DIRECT_IO_ALIGN 4096 /* Alignment required by O_DIRECT */
+#define REDIS_VM_POOL_SIZE 16   /* Swap candidates remembered across ticks */
+#define REDIS_VM_POOL_SAMPLES 5 /* Keys sampled per DB to refresh the pool */
+#define REDIS_VM_SWAP_BATCH 32  /* Max threaded swaps queued per cron tick */
+#define REDIS_VM_CHUNK_ENTRIES 1024 /* Elements per chunk of swapped objects */
+#define REDIS_VM_PREFETCH_MAX 128 /* Max pipelined commands to preload keys for */
+
+/* Virtual memory I/O engines, see vm-io-engine in redis.conf */
+#define REDIS_VM_IO_THREADS 0   /* Blocking I/O performed by I/O threads */
+#define REDIS_VM_IO_URING 1     /* Asynchronous I/O using io_uring */
 #define REDIS_THREAD_STACK_SIZE (1024*1024*4)
 /* The following is the *percentage* of completed I/O jobs to process when the
  * handelr is called. While Virtual Memory I/O operations are performed by
  * threads, this operations must be processed by the main thread when completed
  * in order to take effect. */
 #define REDIS_MAX_COMPLETED_JOBS_PROCESSED 1
+/* ...but at least this number of jobs is processed every time, as the threads
+ * signal the main thread once for every batch of completed jobs. */
+#define REDIS_MIN_COMPLETED_JOBS_PROCESSED 16
 
 /* Client flags */
 #define REDIS_SLAVE 1       /* This client is a slave server */
@@ -212,6 +232,9 @@ static char* strencoding[] = {
 #define REDIS_SORT_ASC 1
 #define REDIS_SORT_DESC 2
 #define REDIS_SORTKEY_MAX 1024
+#define REDIS_SINTER_BATCH 16 /* Elements probed per batch by SINTER */
+#define REDIS_SORT_RADIX_MIN 1024 /* Numeric sorts of at least this length
+                                     are performed with a radix sort */
 
 /* Log levels */
 #define REDIS_DEBUG 0
@@ -234,6 +257,13 @@ static char* strencoding[] = {
 #define REDIS_HASH_MAX_ZIPMAP_ENTRIES 64
 #define REDIS_HASH_MAX_ZIPMAP_VALUE 512
 
+/* Lists related defaults */
+#define REDIS_LIST_MAX_LINKEDLIST_ENTRIES 128
+
+/* Integer replies and bulk / multi bulk length headers in the range
+ * 0 .. shared-integers - 1 are preformatted at startup */
+#define REDIS_SHARED_INTEGERS 10000
+
 /* We can print the stacktrace, so our assert is defined this way: */
 #define redisAssert(_e) ((_e)?(void)0 : (_redisAssert(#_e,__FILE__,__LINE__),_exit(1)))
 static void _redisAssert(char *estr, char *file, int line);
@@ -247,6 +277,12 @@ struct redisObjectVM {
     off_t page;         /* the page at witch the object is stored on disk */
     off_t usedpages;    /* number of pages used on disk */
     time_t atime;       /* Last access time */
+    struct vmChunkIndex *chunks; /* Chunk index of big lists, sets and hashes
+                                  * swapped out, otherwise NULL */
+    unsigned long vlen; /* Length of the value swapped out, see objectLength() */
+    int compressed;     /* True if the value is compressed on the swap file */
+    struct redisObject *tierval; /* vm-tier-node: the swapped value, whose
+                                  * size is stored in 'usedpages' */
 } vm;
 
 /* The actual Redis Object */
@@ -399,41 +435,75 @@ struct redisServer {
     off_t vm_page_size;
     off_t vm_pages;
     unsigned long long vm_max_memory;
+    int vm_io_engine; /* REDIS_VM_IO_THREADS or REDIS_VM_IO_URING */
+    int vm_direct_io; /* Bypass the page cache with the io_uring engine */
     /* Hashes config */
     size_t hash_max_zipmap_entries;
     size_t hash_max_zipmap_value;
+    /* Lists config */
+    size_t list_max_linkedlist_entries;
+    int shared_integers; /* Size of the shared integers and headers tables */
     /* Virtual memory state */
-    FILE *vm_fp;
-    int vm_fd;
-    off_t vm_next_page; /* Next probably empty page */
-    off_t vm_near_pages; /* Number of pages allocated sequentially */
+    int vm_fd; /* Swap file descriptor used by the main thread */
     unsigned char *vm_bitmap; /* Bitmap of free/used pages */
+    /* Free extents (runs of contiguous free pages) of the swap file, indexed
+     * by offset to coalesce them, and by size to allocate pages. */
+    struct vmExtentList *vm_free_byoffset;
+    struct vmExtentList *vm_free_bysize;
     time_t unixtime;    /* Unix time sampled every second. */
     /* Virtual memory I/O threads stuff */
-    /* An I/O thread process an element taken from the io_jobs queue and
-     * put the result of the operation in the io_done list. While the
-     * job is being processed, it's put on io_processing queue. */
-    list *io_newjobs; /* List of VM I/O jobs yet to be processed */
-    list *io_processing; /* List of VM I/O jobs being processed */
+    /* The I/O threads are created once at startup. Every thread takes jobs
+     * from its own queue (or steals them from the queue of another thread
+     * when idle) and puts the result of the operation in the io_processed
+     * list, that is consumed by the main thread. */
+    struct iothread *io_threads; /* Pool of io_threads_num I/O threads */
+    int io_threads_num; /* vm_max_threads, or 0 if the I/O engine is uring */
+    int io_next_thread; /* Round robin index used to queue new jobs */
+    /* With the io_uring engine there are no I/O threads: the main thread
+     * queues the requests in the ring and submits them all before to sleep
+     * in the event loop, and completions are signaled by io_uring_efd. */
+    struct uring *io_uring;
+    int io_uring_fd; /* Swap file descriptor used by the io_uring requests */
+    int io_uring_efd; /* eventfd signaled on io_uring completions */
+    list *io_uring_waiting; /* Jobs waiting for a free slot in the ring */
+    list *io_uring_inflight; /* Jobs queued in the ring, not completed */
     list *io_processed; /* List of VM I/O jobs already processed */
     list *io_ready_clients; /* Clients ready to be unblocked. All keys loaded */
-    pthread_mutex_t io_mutex; /* lock to access io_jobs/io_done/io_thread_job */
+    pthread_mutex_t io_mutex; /* lock to access io_processed */
     pthread_mutex_t obj_freelist_mutex; /* safe redis objects creation/free */
-    pthread_mutex_t io_swapfile_mutex; /* So we can lseek + write */
     pthread_attr_t io_threads_attr; /* attributes for threads creation */
-    int io_active_threads; /* Number of running I/O threads */
-    int vm_max_threads; /* Max number of I/O threads running at the same time */
+    int vm_max_threads; /* Number of I/O threads, 0 means blocking VM */
+    unsigned long vm_chunk_entries; /* Swap big objects in chunks, 0 = off */
+    int vm_compression; /* Compress values written on the swap file */
+    int vm_tier_node;   /* Swap to this NUMA node instead of the swap file */
+    size_t vm_tier_memory; /* Bytes of the values swapped to vm_tier_node */
     /* Our main thread is blocked on the event loop, locking for sockets ready
      * to be read or written, so when a threaded I/O operation is ready to be
      * processed by the main thread, the I/O thread will use a unix pipe to
-     * awake the main thread. The followings are the two pipe FDs. */
+     * awake the main thread. The followings are the two pipe FDs.
+     * Only the thread adding a job to an empty io_processed list writes
+     * to the pipe, so a whole batch of completed jobs costs a single
+     * write(2) and read(2). io_ready_pipe_pending is true if the main thread
+     * was already signaled and did not consume io_processed yet. */
     int io_ready_pipe_read;
     int io_ready_pipe_write;
+    int io_ready_pipe_pending;
+    /* Best swap candidates found so far, ordered by ascending swappability.
+     * Refreshed a few samples at a time at every cron tick. */
+    struct vmSwapCandidate *vm_pool;
+    int vm_pool_len;
     /* Virtual memory stats */
     unsigned long long vm_stats_used_pages;
     unsigned long long vm_stats_swapped_objects;
     unsigned long long vm_stats_swapouts;
     unsigned long long vm_stats_swapins;
+    unsigned long long vm_stats_allocs; /* vmFindContiguousPages() calls */
+    unsigned long long vm_stats_alloc_failures;
+    unsigned long long vm_stats_alloc_usec; /* Time spent allocating pages */
+    unsigned long long vm_stats_alloc_max_usec;
+    unsigned long long vm_stats_chunk_loads; /* Partial loads of objects */
+    unsigned long long vm_stats_compressed_swapouts;
+    unsigned long long vm_stats_tier_stranded; /* Bytes not moved back */
     FILE *devnull;
 };
 
@@ -473,12 +543,17 @@ typedef struct _redisSortOperation {
 
 /* ZSETs use a specialized version of Skiplists */
 
+/* Skiplist nodes are a single allocation: the per level forward pointers
+ * and spans are stored inline, and only 'level' of them are allocated. The
+ * span of level 0 is always 1. */
 typedef struct zskiplistNode {
-    struct zskiplistNode **forward;
-    struct zskiplistNode *backward;
-    unsigned int *span;
-    double score;
     robj *obj;
+    double score;
+    struct zskiplistNode *backward;
+    struct zskiplistLevel {
+        struct zskiplistNode *forward;
+        unsigned int span;
+    } level[];
 } zskiplistNode;
 
 typedef struct zskiplist {
@@ -498,9 +573,11 @@ struct sharedObjectsStruct {
     robj *crlf, *ok, *err, *emptybulk, *czero, *cone, *pong, *space,
     *colon, *nullbulk, *nullmultibulk, *queued,
     *emptymultibulk, *wrongtypeerr, *nokeyerr, *syntaxerr, *sameobjecterr,
-    *outofrangeerr, *plus,
+    *outofrangeerr, *plus, *emptyscan, *invalidcursorerr,
     *select0, *select1, *select2, *select3, *select4,
     *select5, *select6, *select7, *select8, *select9;
+    /* ":<n>\r\n", "$<n>\r\n" and "*<n>\r\n" for n < server.shared_integers */
+    robj **integers, **bulkhdr, **mbulkhdr;
 } shared;
 
 /* Global vars that are actally used as constants. The following double
@@ -517,14 +594,92 @@ typedef struct iojob {
     int type;   /* Request type, REDIS_IOJOB_* */
     redisDb *db;/* Redis database */
     robj *key;  /* This I/O request is about swapping this key */
+    robj *dbkey;/* The key object stored in the DB: two DBs can have keys with
+                 * the same name, so jobs are identified by this pointer. */
     robj *val;  /* the value to swap for REDIS_IOREQ_*_SWAP, otherwise this
                  * field is populated by the I/O thread for REDIS_IOREQ_LOAD. */
     off_t page; /* Swap page where to read/write the object */
     off_t pages; /* Swap pages needed to safe object. PREPARE_SWAP return val */
     int canceled; /* True if this command was canceled by blocking side of VM */
     pthread_t thread; /* ID of the thread processing this entry */
+    void *buf;  /* io_uring engine: buffer to read/write, or NULL */
+    size_t buflen; /* io_uring engine: bytes to read/write */
+    struct vmChunkIndex *chunks; /* DO_SWAP: chunk index of the object */
+    int compressed; /* True if the value is (or will be) compressed on swap */
 } iojob;
 
+/* VM I/O thread. The main thread queues jobs in the 'jobs' list and signals
+ * the condition variable. Idle threads sleep on the condition variable when
+ * there is nothing to do in their queue nor in the queues of other threads. */
+typedef struct iothread {
+    pthread_t thread;
+    pthread_mutex_t mutex;  /* Protects 'jobs' and 'current' */
+    pthread_cond_t cond;    /* Signaled when a new job is queued */
+    list *jobs;             /* Jobs queued to this thread */
+    iojob *current;         /* Job being processed, or NULL if idle */
+    FILE *devnull;          /* Used to compute the serialized objects size */
+    int fd;                 /* Swap file descriptor used by this thread */
+} iothread;
+
+/* Skiplist used to index the free extents of the swap file. Nodes are
+ * ordered by the (key[0],key[1]) pair, that is (page,count) in the offset
+ * index and (count,page) in the size index. */
+typedef struct vmExtentNode {
+    off_t key[2];
+    struct vmExtentNode *forward[];
+} vmExtentNode;
+
+typedef struct vmExtentList {
+    vmExtentNode *header;
+    int level;
+    unsigned long length;
+} vmExtentList;
+
+/* Chunk index of a big list, set or hash swapped out. The object is
+ * serialized as usual, but we remember the offset of every group of
+ * 'entries' elements, so that a single element can be read from the swap
+ * file without loading the whole object. Set and hash elements are
+ * serialized in hash table order, so every chunk covers a range of
+ * buckets: we remember the bucket of the first element of every chunk. */
+typedef struct vmChunkIndex {
+    unsigned long entries;  /* Elements per chunk, the last may have less */
+    unsigned long elements; /* Elements of the object */
+    unsigned long mask;     /* Sets and hashes: hash table size mask */
+    unsigned long chunks;   /* Number of chunks */
+    off_t len;              /* Serialized length of the object */
+    struct vmChunk {
+        off_t offset;           /* Offset of the first element */
+        unsigned long bucket;   /* Sets and hashes: first element bucket */
+    } chunk[];
+} vmChunkIndex;
+
+/* With vm-compression enabled, values are compressed as a whole with LZF
+ * before being written to the swap file, prefixed by this header. Chunked
+ * objects are never compressed, as the chunks must be readable alone. */
+typedef struct vmCompressedHeader {
+    uint32_t clen;  /* Length of the compressed data following the header */
+    uint32_t len;   /* Length of the serialized object */
+} vmCompressedHeader;
+
+/* Swap candidates pool entry. The key is a private copy of the DB key, so
+ * candidates that were deleted or renamed in the meantime are just not
+ * found when the pool is consumed. */
+typedef struct vmSwapCandidate {
+    robj *key;
+    int dbid;
+    double swappability;
+} vmSwapCandidate;
+
+/* List iterator, abstracting the list encoding away. See the List type API
+ * in the Lists section. */
+typedef struct listTypeIterator {
+    robj *subject;
+    int direction;  /* REDIS_HEAD or REDIS_TAIL: where the iteration goes */
+    int advance;    /* Move to the next element before returning it */
+    listNode *ln;   /* REDIS_ENCODING_LINKEDLIST: current node */
+    seglistIter si; /* REDIS_ENCODING_SEGLIST: current element */
+} listTypeIterator;
+
 /*================================ Prototypes =============================== */
 
 static void freeStringObject(robj *o);
@@ -536,6 +691,13 @@ static void freeClient(redisClient *c);
 static int rdbLoad(char *filename);
 static void addReply(redisClient *c, robj *obj);
 static void addReplySds(redisClient *c, sds s);
+static int prepareClientToWrite(redisClient *c);
+static void addReplyBuffer(redisClient *c, char *s, size_t len);
+static void addReplyShared(redisClient *c, robj *o);
+static void addReplyMultiBulkLen(redisClient *c, long count);
+static void setDeferredMultiBulkLen(robj *lenobj, long count);
+static void addReplyBulkBuffer(redisClient *c, char *p, size_t len);
+static robj **createSharedHeaders(char prefix, int count);
 static void incrRefCount(robj *o);
 static int rdbSaveBackground(char *filename);
 static robj *createStringObject(char *ptr, size_t len);
@@ -546,6 +708,11 @@ static int syncWithMaster(void);
 static robj *tryObjectSharing(robj *o);
 static int tryObjectEncoding(robj *o);
 static robj *getDecodedObject(robj *o);
+static int ll2string(char *s, size_t len, long long value);
+static unsigned long listTypeLength(robj *o);
+static void listTypePush(robj *o, robj *ele, int where);
+static void listTypeInitIterator(listTypeIterator *li, robj *o, long index, int direction);
+static int listTypeNext(listTypeIterator *li);
 static int removeExpire(redisDb *db, robj *key);
 static int expireIfNeeded(redisDb *db, robj *key);
 static int deleteIfVolatile(redisDb *db, robj *key);
@@ -560,6 +727,7 @@ static void setupSigSegvAction(void);
 static void rdbRemoveTempFile(pid_t childpid);
 static void aofRemoveTempFile(pid_t childpid);
 static size_t stringObjectLen(robj *o);
+static unsigned long objectLength(robj *o);
 static void processInputBuffer(redisClient *c);
 static zskiplist *zslCreate(void);
 static void zslFree(zskiplist *zsl);
@@ -574,8 +742,14 @@ static void vmInit(void);
 static void vmMarkPagesFree(off_t page, off_t count);
 static robj *vmLoadObject(robj *key);
 static robj *vmPreviewObject(robj *key);
+static size_t vmUsedMemory(void);
+static void vmTierInit(void);
+static int vmTierSwapObject(robj *key, robj *val);
+static robj *vmTierLoadObject(robj *key, int preview);
+static void vmTierFreeObject(robj *key);
 static int vmSwapOneObjectBlocking(void);
-static int vmSwapOneObjectThreaded(void);
+static int vmSwapOneObjectThreaded(size_t *queued);
+static void vmSwapPoolRefresh(void);
 static int vmCanSwapOut(void);
 static int tryFreeOneObjectFromFreelist(void);
 static void acceptHandler(aeEventLoop *el, int fd, void *privdata, int mask);
@@ -586,12 +760,34 @@ static void unlockThreadedIO(void);
 static int vmSwapObjectThreaded(robj *key, robj *val, redisDb *db);
 static void freeIOJob(iojob *j);
 static void queueIOJob(iojob *j);
-static int vmWriteObjectOnSwap(robj *o, off_t page);
-static robj *vmReadObjectFromSwap(off_t page, int type);
+static void spawnIOThread(iothread *t);
+static void lockIOThreads(void);
+static void unlockIOThreads(void);
+static void vmIOThreadsStats(unsigned long *queued, unsigned long *processing);
+static void vmIOJobProcessed(iojob *j);
+static void vmUringInit(void);
+static void vmUringQueueJob(iojob *j);
+static void vmUringSubmit(void);
+static void vmUringWait(void);
+static void vmUringCompletedJob(aeEventLoop *el, int fd, void *privdata, int mask);
+static int vmWriteObjectOnSwap(int fd, robj *o, off_t page,
+                               vmChunkIndex **chunks);
+static robj *vmReadObjectFromSwap(int fd, off_t page, off_t pages, int type,
+                                  int compressed);
 static void waitEmptyIOJobsQueue(void);
 static void vmReopenSwapFile(void);
 static int vmFreePage(off_t page);
+static vmExtentList *vmExtentListCreate(void);
+static vmExtentNode *vmExtentLast(vmExtentList *l);
+static void vmAddFreeExtent(off_t page, off_t count);
 static void zunionInterBlockClientOnSwappedKeys(redisClient *c);
+static void chunkedBlockClientOnSwappedKeys(redisClient *c);
+static void execBlockClientOnSwappedKeys(redisClient *c);
+static int waitForSwappedKey(redisClient *c, robj *key);
+static robj *vmChunkedKey(redisDb *db, robj *key);
+static robj *vmChunkedKeyRead(redisDb *db, robj *key);
+static robj *vmChunkedListIndex(robj *key, long index);
+static int vmChunkedLookup(robj *key, robj *field, robj **val);
 static int blockClientOnSwappedKeys(struct redisCommand *cmd, redisClient *c);
 static int dontWaitForSwappedKey(redisClient *c, robj *key);
 static void handleClientsBlockedOnSwappedKey(redisDb *db, robj *key);
@@ -616,6 +812,7 @@ static void decrbyCommand(redisClient *c);
 static void selectCommand(redisClient *c);
 static void randomkeyCommand(redisClient *c);
 static void keysCommand(redisClient *c);
+static void scanCommand(redisClient *c);
 static void dbsizeCommand(redisClient *c);
 static void lastsaveCommand(redisClient *c);
 static void saveCommand(redisClient *c);
@@ -642,8 +839,10 @@ static void sismemberCommand(redisClient *c);
 static void scardCommand(redisClient *c);
 static void spopCommand(redisClient *c);
 static void srandmemberCommand(redisClient *c);
+static void sscanCommand(redisClient *c);
 static void sinterCommand(redisClient *c);
 static void sinterstoreCommand(redisClient *c);
+static void sintercardCommand(redisClient *c);
 static void sunionCommand(redisClient *c);
 static void sunionstoreCommand(redisClient *c);
 static void sdiffCommand(redisClient *c);
@@ -674,6 +873,7 @@ static void zrevrangeCommand(redisClient *c);
 static void zcardCommand(redisClient *c);
 static void zremCommand(redisClient *c);
 static void zscoreCommand(redisClient *c);
+static void zscanCommand(redisClient *c);
 static void zremrangebyscoreCommand(redisClient *c);
 static void multiCommand(redisClient *c);
 static void execCommand(redisClient *c);
@@ -695,6 +895,7 @@ static void hkeysCommand(redisClient *c);
 static void hvalsCommand(redisClient *c);
 static void hgetallCommand(redisClient *c);
 static void hexistsCommand(redisClient *c);
+static void hscanCommand(redisClient *c);
 
 /*================================= Globals ================================= */
 
@@ -707,38 +908,40 @@ static struct redisCommand cmdTable[] = {
     {"append",appendCommand,3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
     {"substr",substrCommand,4,REDIS_CMD_INLINE,NULL,1,1,1},
     {"del",delCommand,-2,REDIS_CMD_INLINE,NULL,0,0,0},
-    {"exists",existsCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
+    {"exists",existsCommand,2,REDIS_CMD_INLINE,NULL,0,0,0},
     {"incr",incrCommand,2,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,1,1,1},
     {"decr",decrCommand,2,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,1,1,1},
     {"mget",mgetCommand,-2,REDIS_CMD_INLINE,NULL,1,-1,1},
-    {"rpush",rpushCommand,3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
-    {"lpush",lpushCommand,3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
+    {"rpush",rpushCommand,-3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
+    {"lpush",lpushCommand,-3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
     {"rpop",rpopCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
     {"lpop",lpopCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
     {"brpop",brpopCommand,-3,REDIS_CMD_INLINE,NULL,1,1,1},
     {"blpop",blpopCommand,-3,REDIS_CMD_INLINE,NULL,1,1,1},
-    {"llen",llenCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
-    {"lindex",lindexCommand,3,REDIS_CMD_INLINE,NULL,1,1,1},
+    {"llen",llenCommand,2,REDIS_CMD_INLINE,NULL,0,0,0},
+    {"lindex",lindexCommand,3,REDIS_CMD_INLINE,chunkedBlockClientOnSwappedKeys,1,1,1},
     {"lset",lsetCommand,4,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
     {"lrange",lrangeCommand,4,REDIS_CMD_INLINE,NULL,1,1,1},
     {"ltrim",ltrimCommand,4,REDIS_CMD_INLINE,NULL,1,1,1},
     {"lrem",lremCommand,4,REDIS_CMD_BULK,NULL,1,1,1},
     {"rpoplpush",rpoplpushcommand,3,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,1,2,1},
-    {"sadd",saddCommand,3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
+    {"sadd",saddCommand,-3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
     {"srem",sremCommand,3,REDIS_CMD_BULK,NULL,1,1,1},
     {"smove",smoveCommand,4,REDIS_CMD_BULK,NULL,1,2,1},
-    {"sismember",sismemberCommand,3,REDIS_CMD_BULK,NULL,1,1,1},
-    {"scard",scardCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
+    {"sismember",sismemberCommand,3,REDIS_CMD_BULK,chunkedBlockClientOnSwappedKeys,1,1,1},
+    {"scard",scardCommand,2,REDIS_CMD_INLINE,NULL,0,0,0},
     {"spop",spopCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
     {"srandmember",srandmemberCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
     {"sinter",sinterCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,1,-1,1},
     {"sinterstore",sinterstoreCommand,-3,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,2,-1,1},
+    {"sintercard",sintercardCommand,-2,REDIS_CMD_INLINE,NULL,1,-1,1},
     {"sunion",sunionCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,1,-1,1},
     {"sunionstore",sunionstoreCommand,-3,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,2,-1,1},
     {"sdiff",sdiffCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,1,-1,1},
     {"sdiffstore",sdiffstoreCommand,-3,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,2,-1,1},
     {"smembers",sinterCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
-    {"zadd",zaddCommand,4,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
+    {"sscan",sscanCommand,-3,REDIS_CMD_INLINE,NULL,1,1,1},
+    {"zadd",zaddCommand,-4,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
     {"zincrby",zincrbyCommand,4,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
     {"zrem",zremCommand,3,REDIS_CMD_BULK,NULL,1,1,1},
     {"zremrangebyscore",zremrangebyscoreCommand,4,REDIS_CMD_INLINE,NULL,1,1,1},
@@ -746,20 +949,22 @@ static struct redisCommand cmdTable[] = {
     {"zunion",zunionCommand,-4,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,zunionInterBlockClientOnSwappedKeys,0,0,0},
     {"zinter",zinterCommand,-4,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,zunionInterBlockClientOnSwappedKeys,0,0,0},
     {"zrange",zrangeCommand,-4,REDIS_CMD_INLINE,NULL,1,1,1},
+    {"zscan",zscanCommand,-3,REDIS_CMD_INLINE,NULL,1,1,1},
     {"zrangebyscore",zrangebyscoreCommand,-4,REDIS_CMD_INLINE,NULL,1,1,1},
     {"zcount",zcountCommand,4,REDIS_CMD_INLINE,NULL,1,1,1},
     {"zrevrange",zrevrangeCommand,-4,REDIS_CMD_INLINE,NULL,1,1,1},
-    {"zcard",zcardCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
+    {"zcard",zcardCommand,2,REDIS_CMD_INLINE,NULL,0,0,0},
     {"zscore",zscoreCommand,3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
     {"zrank",zrankCommand,3,REDIS_CMD_BULK,NULL,1,1,1},
     {"zrevrank",zrevrankCommand,3,REDIS_CMD_BULK,NULL,1,1,1},
-    {"hset",hsetCommand,4,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
-    {"hget",hgetCommand,3,REDIS_CMD_BULK,NULL,1,1,1},
-    {"hdel",hdelCommand,3,REDIS_CMD_BULK,NULL,1,1,1},
-    {"hlen",hlenCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
+    {"hset",hsetCommand,-4,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
+    {"hget",hgetCommand,3,REDIS_CMD_BULK,chunkedBlockClientOnSwappedKeys,1,1,1},
+    {"hdel",hdelCommand,-3,REDIS_CMD_BULK,NULL,1,1,1},
+    {"hlen",hlenCommand,2,REDIS_CMD_INLINE,NULL,0,0,0},
     {"hkeys",hkeysCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
     {"hvals",hvalsCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
     {"hgetall",hgetallCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
+    {"hscan",hscanCommand,-3,REDIS_CMD_INLINE,NULL,1,1,1},
     {"hexists",hexistsCommand,3,REDIS_CMD_BULK,NULL,1,1,1},
     {"incrby",incrbyCommand,3,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,1,1,1},
     {"decrby",decrbyCommand,3,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,1,1,1},
@@ -774,6 +979,7 @@ static struct redisCommand cmdTable[] = {
     {"expire",expireCommand,3,REDIS_CMD_INLINE,NULL,0,0,0},
     {"expireat",expireatCommand,3,REDIS_CMD_INLINE,NULL,0,0,0},
     {"keys",keysCommand,2,REDIS_CMD_INLINE,NULL,0,0,0},
+    {"scan",scanCommand,-2,REDIS_CMD_INLINE,NULL,0,0,0},
     {"dbsize",dbsizeCommand,1,REDIS_CMD_INLINE,NULL,0,0,0},
     {"auth",authCommand,2,REDIS_CMD_INLINE,NULL,0,0,0},
     {"ping",pingCommand,1,REDIS_CMD_INLINE,NULL,0,0,0},
@@ -783,9 +989,9 @@ static struct redisCommand cmdTable[] = {
     {"bgrewriteaof",bgrewriteaofCommand,1,REDIS_CMD_INLINE,NULL,0,0,0},
     {"shutdown",shutdownCommand,1,REDIS_CMD_INLINE,NULL,0,0,0},
     {"lastsave",lastsaveCommand,1,REDIS_CMD_INLINE,NULL,0,0,0},
-    {"type",typeCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
+    {"type",typeCommand,2,REDIS_CMD_INLINE,NULL,0,0,0},
     {"multi",multiCommand,1,REDIS_CMD_INLINE,NULL,0,0,0},
-    {"exec",execCommand,1,REDIS_CMD_INLINE,NULL,0,0,0},
+    {"exec",execCommand,1,REDIS_CMD_INLINE,execBlockClientOnSwappedKeys,0,0,0},
     {"discard",discardCommand,1,REDIS_CMD_INLINE,NULL,0,0,0},
     {"sync",syncCommand,1,REDIS_CMD_INLINE,NULL,0,0,0},
     {"flushdb",flushdbCommand,1,REDIS_CMD_INLINE,NULL,0,0,0},
@@ -793,7 +999,7 @@ static struct redisCommand cmdTable[] = {
     {"sort",sortCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,1,1,1},
     {"info",infoCommand,1,REDIS_CMD_INLINE,NULL,0,0,0},
     {"monitor",monitorCommand,1,REDIS_CMD_INLINE,NULL,0,0,0},
-    {"ttl",ttlCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
+    {"ttl",ttlCommand,2,REDIS_CMD_INLINE,NULL,0,0,0},
     {"slaveof",slaveofCommand,3,REDIS_CMD_INLINE,NULL,0,0,0},
     {"debug",debugCommand,-2,REDIS_CMD_INLINE,NULL,0,0,0},
     {NULL,NULL,0,0,NULL,0,0,0}
@@ -1003,18 +1209,30 @@ static int dictEncObjKeyCompare(void *privdata, const void *key1,
         const void *key2)
 {
     robj *o1 = (robj*) key1, *o2 = (robj*) key2;
-    int cmp;
+    char buf1[32], buf2[32], *p1, *p2;
+    size_t l1, l2;
+    DICT_NOTUSED(privdata);
 
+    /* Integer encoded objects are equal only if they hold the same value.
+     * Otherwise compare the string representations, formatting integers
+     * on the stack: this is called for every set and sorted set lookup. */
     if (o1->encoding == REDIS_ENCODING_INT &&
-        o2->encoding == REDIS_ENCODING_INT &&
-        o1->ptr == o2->ptr) return 1;
-
-    o1 = getDecodedObject(o1);
-    o2 = getDecodedObject(o2);
-    cmp = sdsDictKeyCompare(privdata,o1->ptr,o2->ptr);
-    decrRefCount(o1);
-    decrRefCount(o2);
-    return cmp;
+        o2->encoding == REDIS_ENCODING_INT) return o1->ptr == o2->ptr;
+    if (o1->encoding == REDIS_ENCODING_INT) {
+        p1 = buf1;
+        l1 = ll2string(buf1,sizeof(buf1),(long)o1->ptr);
+    } else {
+        p1 = o1->ptr;
+        l1 = sdslen(o1->ptr);
+    }
+    if (o2->encoding == REDIS_ENCODING_INT) {
+        p2 = buf2;
+        l2 = ll2string(buf2,sizeof(buf2),(long)o2->ptr);
+    } else {
+        p2 = o2->ptr;
+        l2 = sdslen(o2->ptr);
+    }
+    return l1 == l2 && memcmp(p1,p2,l1) == 0;
 }
 
 static unsigned int dictEncObjHash(const void *key) {
@@ -1027,7 +1245,7 @@ static unsigned int dictEncObjHash(const void *key) {
             char buf[32];
             int len;
 
-            len = snprintf(buf,32,"%ld",(long)o->ptr);
+            len = ll2string(buf,32,(long)o->ptr);
             return dictGenHashFunction((unsigned char*)buf, len);
         } else {
             unsigned int hash;
@@ -1115,6 +1333,40 @@ static void oom(const char *msg) {
     abort();
 }
 
+/* Convert a long long into a string, returning the number of characters
+ * written (not counting the null term). If the buffer is too small the
+ * string is truncated. Digits are produced in reverse order in a local
+ * buffer, this is much faster than snprintf(), that used to be one of the
+ * top functions in the profile of counter heavy workloads. */
+static int ll2string(char *s, size_t len, long long value) {
+    char buf[32], *p;
+    unsigned long long v;
+    size_t l;
+
+    if (len == 0) return 0;
+    v = (value < 0) ? -(unsigned long long)value : (unsigned long long)value;
+    p = buf+31; /* point to the last character */
+    do {
+        *p-- = '0'+(v%10);
+        v /= 10;
+    } while(v);
+    if (value < 0) *p-- = '-';
+    p++;
+    l = 32-(p-buf);
+    if (l+1 > len) l = len-1; /* Make sure it fits, including the nul term */
+    memcpy(s,p,l);
+    s[l] = '\0';
+    return l;
+}
+
+/* Return the UNIX time in microseconds */
+static long long ustime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
 /* ====================== Redis server networking stuff ===================== */
 static void closeTimedoutClients(void) {
     redisClient *c;
@@ -1150,6 +1402,14 @@ static int htNeedsResize(dict *dict) {
             (used*100/size < REDIS_HT_MINFILL));
 }
 
+/* Make room for 'extra' more elements at once, so that commands adding
+ * many elements in a single call don't rehash the table again and again
+ * while it grows. The table is never shrunk here. */
+static void htReserve(dict *dict, unsigned long extra) {
+    if (dictSize(dict)+extra > dictSlots(dict))
+        dictExpand(dict,dictSize(dict)+extra);
+}
+
 /* If the percentage of used slots in the HT reaches REDIS_HT_MINFILL
  * we resize the hash table to save memory */
 static void tryResizeHashTables(void) {
@@ -1357,28 +1617,37 @@ static int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientD
     }
 
     /* Swap a few keys on disk if we are over the memory limit and VM
-     * is enbled. Try to free objects from the free list first. */
-    if (vmCanSwapOut()) {
-        while (server.vm_enabled && zmalloc_used_memory() >
-                server.vm_max_memory)
-        {
+     * is enbled. Try to free objects from the free list first.
+     *
+     * The pool of swap candidates is refreshed at every tick even when we
+     * are below the limit, so that good candidates are already known when
+     * a write burst pushes us over it. */
+    if (server.vm_enabled && vmCanSwapOut()) {
+        size_t queued = 0;
+        int jobs = 0;
+
+        vmSwapPoolRefresh();
+        while (vmUsedMemory() > server.vm_max_memory+queued) {
             int retval;
 
             if (tryFreeOneObjectFromFreelist() == REDIS_OK) continue;
             retval = (server.vm_max_threads == 0) ?
                         vmSwapOneObjectBlocking() :
-                        vmSwapOneObjectThreaded();
+                        vmSwapOneObjectThreaded(&queued);
             if (retval == REDIS_ERR && (loops % 30) == 0 &&
-                zmalloc_used_memory() >
+                vmUsedMemory() >
                 (server.vm_max_memory+server.vm_max_memory/10))
             {
                 redisLog(REDIS_WARNING,"WARNING: vm-max-memory limit exceeded by more than 10%% but unable to swap more objects out!");
             }
-            /* Note that when using threade I/O we free just one object,
-             * because anyway when the I/O thread in charge to swap this
-             * object out will finish, the handler of completed jobs
-             * will try to swap more objects if we are still out of memory. */
-            if (retval == REDIS_ERR || server.vm_max_threads > 0) break;
+            /* When using threaded I/O the memory is released only when
+             * the swap job completes, so we queue a batch of objects large
+             * enough to bring us below the limit ('queued' is the estimated
+             * size of the objects already queued). The handler of completed
+             * jobs will queue more objects if we are still out of memory. */
+            if (retval == REDIS_ERR ||
+                (server.vm_max_threads > 0 && ++jobs == REDIS_VM_SWAP_BATCH))
+                break;
         }
     }
 
@@ -1422,6 +1691,9 @@ static void beforeSleep(struct aeEventLoop *eventLoop) {
                 processInputBuffer(c);
         }
     }
+    /* Submit with a single system call all the swap file I/O requests
+     * queued while processing this batch of events. */
+    if (server.vm_enabled && server.io_uring) vmUringSubmit();
 }
 
 static void createSharedObjects(void) {
@@ -1446,6 +1718,10 @@ static void createSharedObjects(void) {
         "-ERR source and destination objects are the same\r\n"));
     shared.outofrangeerr = createObject(REDIS_STRING,sdsnew(
         "-ERR index out of range\r\n"));
+    shared.emptyscan = createObject(REDIS_STRING,sdsnew(
+        "*2\r\n$1\r\n0\r\n*0\r\n"));
+    shared.invalidcursorerr = createObject(REDIS_STRING,sdsnew(
+        "-ERR invalid cursor\r\n"));
     shared.space = createObject(REDIS_STRING,sdsnew(" "));
     shared.colon = createObject(REDIS_STRING,sdsnew(":"));
     shared.plus = createObject(REDIS_STRING,sdsnew("+"));
@@ -1459,6 +1735,43 @@ static void createSharedObjects(void) {
     shared.select7 = createStringObject("select 7\r\n",10);
     shared.select8 = createStringObject("select 8\r\n",10);
     shared.select9 = createStringObject("select 9\r\n",10);
+    if (server.shared_integers) {
+        shared.integers = createSharedHeaders(':',server.shared_integers);
+        shared.bulkhdr = createSharedHeaders('$',server.shared_integers);
+        shared.mbulkhdr = createSharedHeaders('*',server.shared_integers);
+    }
+}
+
+/* Create the table of the "<prefix><n>\r\n" shared objects for n in the
+ * range 0 .. count-1. There are thousands of them, so instead of calling
+ * createObject() for every entry the objects and their sds strings are
+ * carved out of two big allocations. They are never released: the table
+ * holds a reference to every object, so the refcount never drops to zero. */
+#define REDIS_SHARED_HDR_SLOT (sizeof(struct sdshdr)+24)
+static robj **createSharedHeaders(char prefix, int count) {
+    robj **table = zmalloc(sizeof(robj*)*count);
+    robj *objs = zmalloc(sizeof(robj)*count);
+    char *strs = zmalloc(REDIS_SHARED_HDR_SLOT*count);
+    int j;
+
+    for (j = 0; j < count; j++) {
+        struct sdshdr *sh = (void*)(strs+REDIS_SHARED_HDR_SLOT*j);
+        robj *o = objs+j;
+
+        sh->buf[0] = prefix;
+        sh->len = 1+ll2string(sh->buf+1,20,j);
+        memcpy(sh->buf+sh->len,"\r\n",3);
+        sh->len += 2;
+        sh->free = 0;
+        o->type = REDIS_STRING;
+        o->encoding = REDIS_ENCODING_RAW;
+        o->ptr = sh->buf;
+        o->refcount = 1;
+        o->storage = REDIS_VM_MEMORY;
+        o->vm.atime = 0;
+        table[j] = o;
+    }
+    return table;
 }
 
 static void appendServerSaveParams(time_t seconds, int changes) {
@@ -1505,9 +1818,16 @@ static void initServerConfig() {
     server.vm_pages = 1024*1024*100;    /* 104 millions of pages */
     server.vm_max_memory = 1024LL*1024*1024*1; /* 1 GB of RAM */
     server.vm_max_threads = 4;
+    server.vm_io_engine = REDIS_VM_IO_THREADS;
+    server.vm_direct_io = 0;
+    server.vm_chunk_entries = REDIS_VM_CHUNK_ENTRIES;
+    server.vm_compression = 0;
+    server.vm_tier_node = -1;
     server.vm_blocked_clients = 0;
     server.hash_max_zipmap_entries = REDIS_HASH_MAX_ZIPMAP_ENTRIES;
     server.hash_max_zipmap_value = REDIS_HASH_MAX_ZIPMAP_VALUE;
+    server.list_max_linkedlist_entries = REDIS_LIST_MAX_LINKEDLIST_ENTRIES;
+    server.shared_integers = REDIS_SHARED_INTEGERS;
 
     resetServerSaveParams();
 
@@ -1768,10 +2088,40 @@ static void loadServerConfig(char *filename) {
             server.vm_pages = strtoll(argv[1], NULL, 10);
         } else if (!strcasecmp(argv[0],"vm-max-threads") && argc == 2) {
             server.vm_max_threads = strtoll(argv[1], NULL, 10);
+        } else if (!strcasecmp(argv[0],"vm-io-engine") && argc == 2) {
+            if (!strcasecmp(argv[1],"threads")) {
+                server.vm_io_engine = REDIS_VM_IO_THREADS;
+            } else if (!strcasecmp(argv[1],"uring")) {
+                server.vm_io_engine = REDIS_VM_IO_URING;
+            } else {
+                err = "argument must be 'threads' or 'uring'";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"vm-direct-io") && argc == 2) {
+            if ((server.vm_direct_io = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"vm-chunk-entries") && argc == 2) {
+            server.vm_chunk_entries = strtoul(argv[1], NULL, 10);
+        } else if (!strcasecmp(argv[0],"vm-tier-node") && argc == 2) {
+            server.vm_tier_node = atoi(argv[1]);
+        } else if (!strcasecmp(argv[0],"vm-compression") && argc == 2) {
+            if ((server.vm_compression = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"hash-max-zipmap-entries") && argc == 2){
             server.hash_max_zipmap_entries = strtol(argv[1], NULL, 10);
         } else if (!strcasecmp(argv[0],"hash-max-zipmap-value") && argc == 2){
             server.hash_max_zipmap_value = strtol(argv[1], NULL, 10);
+        } else if (!strcasecmp(argv[0],"list-max-linkedlist-entries") &&
+                   argc == 2)
+        {
+            server.list_max_linkedlist_entries = strtol(argv[1], NULL, 10);
+        } else if (!strcasecmp(argv[0],"shared-integers") && argc == 2) {
+            server.shared_integers = atoi(argv[1]);
+            if (server.shared_integers < 0) {
+                err = "Invalid number of shared integers"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"vm-max-threads") && argc == 2) {
             server.vm_max_threads = strtoll(argv[1], NULL, 10);
         } else {
@@ -2463,12 +2813,19 @@ static redisClient *createClient(int fd) {
     return c;
 }
 
-static void addReply(redisClient *c, robj *obj) {
+/* Install the writable event handler if this is the first reply queued
+ * for the client. Returns REDIS_ERR if the event could not be created. */
+static int prepareClientToWrite(redisClient *c) {
     if (listLength(c->reply) == 0 &&
         (c->replstate == REDIS_REPL_NONE ||
          c->replstate == REDIS_REPL_ONLINE) &&
         aeCreateFileEvent(server.el, c->fd, AE_WRITABLE,
-        sendReplyToClient, c) == AE_ERR) return;
+        sendReplyToClient, c) == AE_ERR) return REDIS_ERR;
+    return REDIS_OK;
+}
+
+static void addReply(redisClient *c, robj *obj) {
+    if (prepareClientToWrite(c) == REDIS_ERR) return;
 
     if (server.vm_enabled && obj->storage != REDIS_VM_MEMORY) {
         obj = dupStringObject(obj);
@@ -2477,6 +2834,64 @@ static void addReply(redisClient *c, robj *obj) {
     listAddNodeTail(c->reply,getDecodedObject(obj));
 }
 
+/* Try to copy 'len' bytes at the end of the last object of the reply list.
+ * This is only possible if the list holds the only reference to the object
+ * (refcount 1): shared objects, including the tables of createSharedHeaders()
+ * that keep a reference of their own, key values and buffers also queued for
+ * a slave all have more. Objects with a NULL ptr are multi bulk lengths that
+ * the command will fill later (see keysCommand()) and are never appended to.
+ * Returns REDIS_ERR if there is no such object or it can't be appended to. */
+static int appendToReplyTail(redisClient *c, char *s, size_t len) {
+    listNode *ln = listLast(c->reply);
+    robj *tail;
+
+    if (ln == NULL) return REDIS_ERR;
+    tail = listNodeValue(ln);
+    if (tail->refcount != 1 || tail->encoding != REDIS_ENCODING_RAW ||
+        tail->ptr == NULL || sdslen(tail->ptr)+len > REDIS_REPLY_CHUNK_BYTES)
+        return REDIS_ERR;
+    tail->ptr = sdscatlen(tail->ptr,s,len);
+    return REDIS_OK;
+}
+
+/* Append 'len' bytes to the reply of the client, at the end of the last
+ * object of the reply list if possible, otherwise in a new object. This way
+ * a long multi bulk reply made of small elements is assembled in a few
+ * contiguous buffers instead of three list nodes and allocations per
+ * element. */
+static void addReplyBuffer(redisClient *c, char *s, size_t len) {
+    if (prepareClientToWrite(c) == REDIS_ERR) return;
+    if (appendToReplyTail(c,s,len) == REDIS_OK) return;
+    listAddNodeTail(c->reply,createObject(REDIS_STRING,sdsnewlen(s,len)));
+}
+
+/* Add a shared reply object: its bytes are copied at the end of the reply
+ * if possible, otherwise the object itself is queued, so that no memory is
+ * allocated in both cases. */
+static void addReplyShared(redisClient *c, robj *o) {
+    if (appendToReplyTail(c,o->ptr,sdslen(o->ptr)) == REDIS_OK) return;
+    addReply(c,o);
+}
+
+/* Add an integer reply, or a "$<n>" / "*<n>" length header, depending on
+ * 'prefix' and the table of shared objects passed. */
+static void addReplyLongWithPrefix(redisClient *c, long long l, char prefix,
+                                   robj **table)
+{
+    char buf[32];
+    size_t len;
+
+    if (l >= 0 && l < server.shared_integers) {
+        addReplyShared(c,table[l]);
+        return;
+    }
+    buf[0] = prefix;
+    len = 1+ll2string(buf+1,sizeof(buf)-3,l);
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    addReplyBuffer(c,buf,len);
+}
+
 static void addReplySds(redisClient *c, sds s) {
     robj *o = createObject(REDIS_STRING,s);
     addReply(c,o);
@@ -2484,41 +2899,73 @@ static void addReplySds(redisClient *c, sds s) {
 }
 
 static void addReplyDouble(redisClient *c, double d) {
-    char buf[128];
+    char buf[160], dbuf[128];
+    int len;
 
-    snprintf(buf,sizeof(buf),"%.17g",d);
-    addReplySds(c,sdscatprintf(sdsempty(),"$%lu\r\n%s\r\n",
-        (unsigned long) strlen(buf),buf));
+    snprintf(dbuf,sizeof(dbuf),"%.17g",d);
+    len = snprintf(buf,sizeof(buf),"$%lu\r\n%s\r\n",
+        (unsigned long) strlen(dbuf),dbuf);
+    addReplyBuffer(c,buf,len);
 }
 
 static void addReplyLong(redisClient *c, long l) {
-    char buf[128];
+    addReplyLongWithPrefix(c,l,':',shared.integers);
+}
+
+static void addReplyLongLong(redisClient *c, long long ll) {
+    addReplyLongWithPrefix(c,ll,':',shared.integers);
+}
+
+static void addReplyUlong(redisClient *c, unsigned long ul) {
+    char buf[32];
     size_t len;
 
-    if (l == 0) {
-        addReply(c,shared.czero);
-        return;
-    } else if (l == 1) {
-        addReply(c,shared.cone);
+    if (ul <= LONG_MAX) {
+        addReplyLong(c,(long)ul);
         return;
     }
-    len = snprintf(buf,sizeof(buf),":%ld\r\n",l);
-    addReplySds(c,sdsnewlen(buf,len));
+    len = snprintf(buf,sizeof(buf),":%lu\r\n",ul);
+    addReplyBuffer(c,buf,len);
 }
 
-static void addReplyUlong(redisClient *c, unsigned long ul) {
-    char buf[128];
+/* Multi bulk reply header "*<count>\r\n" */
+static void addReplyMultiBulkLen(redisClient *c, long count) {
+    addReplyLongWithPrefix(c,count,'*',shared.mbulkhdr);
+}
+
+/* Fill the multi bulk length object queued before the elements of a reply
+ * whose length was not known in advance (see keysCommand()). */
+static void setDeferredMultiBulkLen(robj *lenobj, long count) {
+    char buf[32];
     size_t len;
 
-    if (ul == 0) {
-        addReply(c,shared.czero);
-        return;
-    } else if (ul == 1) {
-        addReply(c,shared.cone);
+    if (count >= 0 && count < server.shared_integers) {
+        lenobj->ptr = sdsdup(shared.mbulkhdr[count]->ptr);
         return;
     }
-    len = snprintf(buf,sizeof(buf),":%lu\r\n",ul);
-    addReplySds(c,sdsnewlen(buf,len));
+    buf[0] = '*';
+    len = 1+ll2string(buf+1,sizeof(buf)-3,count);
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    lenobj->ptr = sdsnewlen(buf,len);
+}
+
+/* Write the "$<len>\r\n" header of a bulk reply in 'buf', that must be at
+ * least 32 bytes, returning the number of bytes written. */
+static size_t bulkHeader(char *buf, size_t len) {
+    robj *hdr;
+    size_t hdrlen;
+
+    if (len < (size_t)server.shared_integers) {
+        hdr = shared.bulkhdr[len];
+        memcpy(buf,hdr->ptr,sdslen(hdr->ptr));
+        return sdslen(hdr->ptr);
+    }
+    buf[0] = '$';
+    hdrlen = 1+ll2string(buf+1,29,len);
+    buf[hdrlen++] = '\r';
+    buf[hdrlen++] = '\n';
+    return hdrlen;
 }
 
 static void addReplyBulkLen(redisClient *c, robj *obj) {
@@ -2527,25 +2974,52 @@ static void addReplyBulkLen(redisClient *c, robj *obj) {
     if (obj->encoding == REDIS_ENCODING_RAW) {
         len = sdslen(obj->ptr);
     } else {
-        long n = (long)obj->ptr;
+        char buf[32];
 
-        /* Compute how many bytes will take this integer as a radix 10 string */
-        len = 1;
-        if (n < 0) {
-            len++;
-            n = -n;
-        }
-        while((n = n/10) != 0) {
-            len++;
-        }
+        len = ll2string(buf,sizeof(buf),(long)obj->ptr);
     }
-    addReplySds(c,sdscatprintf(sdsempty(),"$%lu\r\n",(unsigned long)len));
+    addReplyLongWithPrefix(c,len,'$',shared.bulkhdr);
 }
 
+/* Small values are copied together with the "$<len>\r\n" header and the
+ * trailing CRLF into the reply buffer, see addReplyBuffer(). Big values are
+ * still queued by reference, without copying them. */
 static void addReplyBulk(redisClient *c, robj *obj) {
-    addReplyBulkLen(c,obj);
-    addReply(c,obj);
-    addReply(c,shared.crlf);
+    char buf[REDIS_REPLY_INLINE_MAX+64];
+    size_t hdrlen, len;
+
+    if (obj->encoding == REDIS_ENCODING_INT) {
+        char num[32];
+
+        len = ll2string(num,sizeof(num),(long)obj->ptr);
+        hdrlen = bulkHeader(buf,len);
+        memcpy(buf+hdrlen,num,len);
+        memcpy(buf+hdrlen+len,"\r\n",2);
+        addReplyBuffer(c,buf,hdrlen+len+2);
+    } else if ((len = sdslen(obj->ptr)) <= REDIS_REPLY_INLINE_MAX) {
+        addReplyBulkBuffer(c,obj->ptr,len);
+    } else {
+        addReplyBulkLen(c,obj);
+        addReply(c,obj);
+        addReplyBuffer(c,"\r\n",2);
+    }
+}
+
+/* Like addReplyBulk() but the value is the buffer 'p' of 'len' bytes, that
+ * is copied into the reply. */
+static void addReplyBulkBuffer(redisClient *c, char *p, size_t len) {
+    char buf[REDIS_REPLY_INLINE_MAX+64];
+    size_t hdrlen = bulkHeader(buf,len);
+
+    if (len <= REDIS_REPLY_INLINE_MAX) {
+        memcpy(buf+hdrlen,p,len);
+        memcpy(buf+hdrlen+len,"\r\n",2);
+        addReplyBuffer(c,buf,hdrlen+len+2);
+    } else {
+        addReplyBuffer(c,buf,hdrlen);
+        addReplySds(c,sdsnewlen(p,len));
+        addReplyBuffer(c,"\r\n",2);
+    }
 }
 
 static void acceptHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
@@ -2627,11 +3101,17 @@ static robj *dupStringObject(robj *o) {
     return createStringObject(o->ptr,sdslen(o->ptr));
 }
 
+/* All the Lists start as linked lists of objects. They are converted into
+ * seglists when they get bigger than list-max-linkedlist-entries elements,
+ * see listTypePush(). */
 static robj *createListObject(void) {
     list *l = listCreate();
+    robj *o;
 
     listSetFreeMethod(l,decrRefCount);
-    return createObject(REDIS_LIST,l);
+    o = createObject(REDIS_LIST,l);
+    o->encoding = REDIS_ENCODING_LINKEDLIST;
+    return o;
 }
 
 static robj *createSetObject(void) {
@@ -2664,7 +3144,17 @@ static void freeStringObject(robj *o) {
 }
 
 static void freeListObject(robj *o) {
-    listRelease((list*) o->ptr);
+    switch (o->encoding) {
+    case REDIS_ENCODING_LINKEDLIST:
+        listRelease((list*) o->ptr);
+        break;
+    case REDIS_ENCODING_SEGLIST:
+        seglistRelease((seglist*) o->ptr);
+        break;
+    default:
+        redisAssert(0);
+        break;
+    }
 }
 
 static void freeSetObject(robj *o) {
@@ -2712,7 +3202,11 @@ static void decrRefCount(void *obj) {
         if (o->storage == REDIS_VM_LOADING) vmCancelThreadedIOJob(obj);
         redisAssert(o->type == REDIS_STRING);
         freeStringObject(o);
-        vmMarkPagesFree(o->vm.page,o->vm.usedpages);
+        if (server.vm_tier_node != -1)
+            vmTierFreeObject(o);
+        else
+            vmMarkPagesFree(o->vm.page,o->vm.usedpages);
+        zfree(o->vm.chunks);
         pthread_mutex_lock(&server.obj_freelist_mutex);
         if (listLength(server.objfreelist) > REDIS_OBJFREELIST_MAX ||
             !listAddNodeHead(server.objfreelist,o))
@@ -2798,6 +3292,34 @@ static robj *lookupKeyWriteOrReply(redisClient *c, robj *key, robj *reply) {
     return o;
 }
 
+/* Lookup a key for commands only needing the type and the length of the
+ * value, like TYPE and LLEN. If the value is swapped out the type and the
+ * length stored in the key object are used, so the value is never loaded.
+ * Returns 0 if the key does not exist, otherwise 1 is returned and, if not
+ * NULL, *type and *len are set to the type and the length of the value (as
+ * returned by objectLength()). */
+static int lookupKeyMetadata(redisDb *db, robj *key, int *type,
+                             unsigned long *len)
+{
+    dictEntry *de;
+    robj *o;
+
+    expireIfNeeded(db,key);
+    if ((de = dictFind(db->dict,key)) == NULL) return 0;
+    o = dictGetEntryKey(de);
+    if (server.vm_enabled && (o->storage == REDIS_VM_SWAPPED ||
+                              o->storage == REDIS_VM_LOADING))
+    {
+        if (type) *type = o->vtype;
+        if (len) *len = o->vm.vlen;
+    } else {
+        o = dictGetEntryVal(de);
+        if (type) *type = o->type;
+        if (len) *len = objectLength(o);
+    }
+    return 1;
+}
+
 static int checkType(redisClient *c, robj *o, int type) {
     if (o->type != type) {
         addReply(c,shared.wrongtypeerr);
@@ -2976,6 +3498,21 @@ static size_t stringObjectLen(robj *o) {
     }
 }
 
+/* Return the number of elements of an aggregate value, or the length in
+ * bytes of a string value. */
+static unsigned long objectLength(robj *o) {
+    switch(o->type) {
+    case REDIS_STRING: return stringObjectLen(o);
+    case REDIS_LIST: return listTypeLength(o);
+    case REDIS_SET: return dictSize((dict*)o->ptr);
+    case REDIS_ZSET: return ((zset*)o->ptr)->zsl->length;
+    case REDIS_HASH:
+        return (o->encoding == REDIS_ENCODING_ZIPMAP) ?
+            zipmapLen((unsigned char*)o->ptr) : dictSize((dict*)o->ptr);
+    default: redisAssert(0); return 0;
+    }
+}
+
 /*============================ RDB saving/loading =========================== */
 
 static int rdbSaveType(FILE *fp, unsigned char type) {
@@ -3155,6 +3692,18 @@ static int rdbSaveDoubleValue(FILE *fp, double val) {
     return 0;
 }
 
+/* Save the list element the iterator points to. Seglist elements are saved
+ * straight from the segment, without creating an object. */
+static int rdbSaveListTypeElement(FILE *fp, listTypeIterator *li) {
+    unsigned char *s;
+    unsigned int len;
+
+    if (li->subject->encoding == REDIS_ENCODING_LINKEDLIST)
+        return rdbSaveStringObject(fp,listNodeValue(li->ln));
+    seglistGet(&li->si,&s,&len);
+    return rdbSaveRawString(fp,s,len);
+}
+
 /* Save a Redis object. */
 static int rdbSaveObject(FILE *fp, robj *o) {
     if (o->type == REDIS_STRING) {
@@ -3162,16 +3711,12 @@ static int rdbSaveObject(FILE *fp, robj *o) {
         if (rdbSaveStringObject(fp,o) == -1) return -1;
     } else if (o->type == REDIS_LIST) {
         /* Save a list value */
-        list *list = o->ptr;
-        listIter li;
-        listNode *ln;
-
-        if (rdbSaveLen(fp,listLength(list)) == -1) return -1;
-        listRewind(list,&li);
-        while((ln = listNext(&li))) {
-            robj *eleobj = listNodeValue(ln);
+        listTypeIterator li;
 
-            if (rdbSaveStringObject(fp,eleobj) == -1) return -1;
+        if (rdbSaveLen(fp,listTypeLength(o)) == -1) return -1;
+        listTypeInitIterator(&li,o,0,REDIS_TAIL);
+        while(listTypeNext(&li)) {
+            if (rdbSaveListTypeElement(fp,&li) == -1) return -1;
         }
     } else if (o->type == REDIS_SET) {
         /* Save a set value */
@@ -3546,7 +4091,8 @@ static robj *rdbLoadObject(int type, FILE *fp) {
             if ((ele = rdbLoadStringObject(fp)) == NULL) return NULL;
             tryObjectEncoding(ele);
             if (type == REDIS_LIST) {
-                listAddNodeTail((list*)o->ptr,ele);
+                listTypePush(o,ele,REDIS_TAIL);
+                decrRefCount(ele);
             } else {
                 dictAdd((dict*)o->ptr,ele,NULL);
             }
@@ -3685,7 +4231,7 @@ static int rdbLoad(char *filename) {
         /* Handle swapping while loading big datasets when VM is on */
         loadedkeys++;
         if (server.vm_enabled && (loadedkeys % 5000) == 0) {
-            while (zmalloc_used_memory() > server.vm_max_memory) {
+            while (vmUsedMemory() > server.vm_max_memory) {
                 if (vmSwapOneObjectBlocking() == REDIS_ERR) break;
             }
         }
@@ -3792,7 +4338,7 @@ static void getsetCommand(redisClient *c) {
 static void mgetCommand(redisClient *c) {
     int j;
   
-    addReplySds(c,sdscatprintf(sdsempty(),"*%d\r\n",c->argc-1));
+    addReplyMultiBulkLen(c,c->argc-1);
     for (j = 1; j < c->argc; j++) {
         robj *o = lookupKeyRead(c->db,c->argv[j]);
         if (o == NULL) {
@@ -3857,6 +4403,7 @@ static void msetnxCommand(redisClient *c) {
 static void incrDecrCommand(redisClient *c, long long incr) {
     long long value;
     int retval;
+    char buf[32];
     robj *o;
     
     o = lookupKeyWrite(c->db,c->argv[1]);
@@ -3878,7 +4425,8 @@ static void incrDecrCommand(redisClient *c, long long incr) {
     }
 
     value += incr;
-    o = createObject(REDIS_STRING,sdscatprintf(sdsempty(),"%lld",value));
+    o = createObject(REDIS_STRING,
+        sdsnewlen(buf,ll2string(buf,sizeof(buf),value)));
     tryObjectEncoding(o);
     retval = dictAdd(c->db->dict,c->argv[1],o);
     if (retval == DICT_ERR) {
@@ -3888,9 +4436,7 @@ static void incrDecrCommand(redisClient *c, long long incr) {
         incrRefCount(c->argv[1]);
     }
     server.dirty++;
-    addReply(c,shared.colon);
-    addReply(c,o);
-    addReply(c,shared.crlf);
+    addReplyLongLong(c,value);
 }
 
 static void incrCommand(redisClient *c) {
@@ -3954,7 +4500,7 @@ static void appendCommand(redisClient *c) {
         totlen = sdslen(o->ptr);
     }
     server.dirty++;
-    addReplySds(c,sdscatprintf(sdsempty(),":%lu\r\n",(unsigned long)totlen));
+    addReplyUlong(c,(unsigned long)totlen);
 }
 
 static void substrCommand(redisClient *c) {
@@ -4009,7 +4555,8 @@ static void delCommand(redisClient *c) {
 }
 
 static void existsCommand(redisClient *c) {
-    addReply(c,lookupKeyRead(c->db,c->argv[1]) ? shared.cone : shared.czero);
+    addReply(c,lookupKeyMetadata(c->db,c->argv[1],NULL,NULL) ?
+        shared.cone : shared.czero);
 }
 
 static void selectCommand(redisClient *c) {
@@ -4063,28 +4610,194 @@ static void keysCommand(redisClient *c) {
         }
     }
     dictReleaseIterator(di);
-    lenobj->ptr = sdscatprintf(sdsempty(),"*%lu\r\n",numkeys);
+    setDeferredMultiBulkLen(lenobj,numkeys);
+}
+
+/* This callback is used by scanGenericCommand() in order to collect the
+ * elements returned by dictScan() into a list. For hashes and sorted sets
+ * the value (or the score) is added after every field (or member). */
+static void scanCallback(void *privdata, const dictEntry *de) {
+    void **pd = privdata;
+    list *elements = pd[0];
+    robj *o = pd[1];
+    robj *key = dictGetEntryKey(de), *val = NULL;
+
+    if (o == NULL) {
+        /* Keys of the DB are copied: the key objects also hold the VM state
+         * of the value, and the key may be deleted before we reply. */
+        key = dupStringObject(key);
+    } else {
+        incrRefCount(key);
+        if (o->type == REDIS_HASH) {
+            val = dictGetEntryVal(de);
+            incrRefCount(val);
+        } else if (o->type == REDIS_ZSET) {
+            val = createObject(REDIS_STRING,
+                sdscatprintf(sdsempty(),"%.17g",*(double*)dictGetEntryVal(de)));
+        }
+    }
+    listAddNodeTail(elements,key);
+    if (val) listAddNodeTail(elements,val);
+}
+
+/* Parse the SCAN cursor argument. Returns REDIS_ERR replying to the client
+ * if the cursor is not a valid unsigned number. */
+static int parseScanCursorOrReply(redisClient *c, robj *o,
+                                  unsigned long *cursor)
+{
+    char *eptr;
+
+    errno = 0;
+    *cursor = strtoul(o->ptr,&eptr,10);
+    if (!isdigit(((char*)o->ptr)[0]) ||
+        eptr[0] != '\0' || errno == ERANGE)
+    {
+        addReply(c,shared.invalidcursorerr);
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/* Implements SCAN, SSCAN, HSCAN and ZSCAN. 'o' is the collection to scan,
+ * or NULL to scan the keys of the current DB. The options start at the
+ * argument 'firstopt'.
+ *
+ * Every call visits at least COUNT elements (10 by default) or no more than
+ * ten times COUNT buckets of the hash table, so the amount of work done is
+ * bounded even against huge DBs, unlike KEYS. The MATCH pattern is applied
+ * to the elements after they are collected, so a call may return fewer
+ * elements than COUNT, or none at all, without the iteration being over:
+ * only a returned cursor of 0 means that the scan is complete. Small hashes
+ * using the zipmap encoding are returned in a single call. */
+static void scanGenericCommand(redisClient *c, robj *o, unsigned long cursor,
+                               int firstopt)
+{
+    list *elements = listCreate();
+    listNode *ln, *next;
+    long count = 10;
+    sds pat = NULL;
+    int j, patlen = 0, pairs;
+    dict *ht = NULL;
+    char buf[32];
+    robj *cursorobj;
+
+    listSetFreeMethod(elements,decrRefCount);
+
+    /* Parse the options */
+    for (j = firstopt; j < c->argc; j += 2) {
+        if (!strcasecmp(c->argv[j]->ptr,"count") && j+1 < c->argc) {
+            count = strtol(c->argv[j+1]->ptr,NULL,10);
+            if (count < 1) {
+                addReply(c,shared.syntaxerr);
+                goto cleanup;
+            }
+            /* No table has that many buckets anyway: this just avoids
+             * overflowing count*10 and count*2 below. */
+            if (count > LONG_MAX/20) count = LONG_MAX/20;
+        } else if (!strcasecmp(c->argv[j]->ptr,"match") && j+1 < c->argc) {
+            pat = c->argv[j+1]->ptr;
+            patlen = sdslen(pat);
+            if (patlen == 1 && pat[0] == '*') pat = NULL;
+        } else {
+            addReply(c,shared.syntaxerr);
+            goto cleanup;
+        }
+    }
+
+    /* Collect the elements */
+    pairs = o && (o->type == REDIS_HASH || o->type == REDIS_ZSET);
+    if (o == NULL) {
+        ht = c->db->dict;
+    } else if (o->type == REDIS_SET) {
+        ht = o->ptr;
+    } else if (o->type == REDIS_ZSET) {
+        ht = ((zset*)o->ptr)->dict;
+    } else if (o->encoding == REDIS_ENCODING_HT) {
+        ht = o->ptr;
+    }
+    if (ht) {
+        void *privdata[2];
+        long maxbuckets = count*10;
+
+        if (pairs) count *= 2;
+        privdata[0] = elements;
+        privdata[1] = o;
+        do {
+            cursor = dictScan(ht,cursor,scanCallback,privdata);
+        } while (cursor && --maxbuckets &&
+                 listLength(elements) < (unsigned long)count);
+    } else {
+        unsigned char *p = zipmapRewind(o->ptr);
+        unsigned char *field, *val;
+        unsigned int flen, vlen;
+
+        while((p = zipmapNext(p,&field,&flen,&val,&vlen)) != NULL) {
+            listAddNodeTail(elements,createStringObject((char*)field,flen));
+            listAddNodeTail(elements,createStringObject((char*)val,vlen));
+        }
+        cursor = 0;
+    }
+
+    /* Filter the elements not matching the pattern, and the expired keys */
+    ln = listFirst(elements);
+    while (ln) {
+        robj *ele = listNodeValue(ln);
+        int filter = 0;
+
+        next = listNextNode(ln);
+        if (pat) {
+            robj *dec = getDecodedObject(ele);
+
+            filter = !stringmatchlen(pat,patlen,dec->ptr,sdslen(dec->ptr),0);
+            decrRefCount(dec);
+        }
+        if (!filter && o == NULL && expireIfNeeded(c->db,ele)) filter = 1;
+        if (filter) listDelNode(elements,ln);
+        if (pairs) {
+            /* The value follows the field, it goes away with it */
+            ln = next;
+            next = listNextNode(ln);
+            if (filter) listDelNode(elements,ln);
+        }
+        ln = next;
+    }
+
+    /* Reply with the new cursor and the elements */
+    addReplyMultiBulkLen(c,2);
+    cursorobj = createStringObject(buf,snprintf(buf,sizeof(buf),"%lu",cursor));
+    addReplyBulk(c,cursorobj);
+    decrRefCount(cursorobj);
+    addReplyMultiBulkLen(c,listLength(elements));
+    for (ln = listFirst(elements); ln; ln = listNextNode(ln))
+        addReplyBulk(c,listNodeValue(ln));
+
+cleanup:
+    listRelease(elements);
+}
+
+static void scanCommand(redisClient *c) {
+    unsigned long cursor;
+
+    if (parseScanCursorOrReply(c,c->argv[1],&cursor) == REDIS_ERR) return;
+    scanGenericCommand(c,NULL,cursor,2);
 }
 
 static void dbsizeCommand(redisClient *c) {
-    addReplySds(c,
-        sdscatprintf(sdsempty(),":%lu\r\n",dictSize(c->db->dict)));
+    addReplyUlong(c,dictSize(c->db->dict));
 }
 
 static void lastsaveCommand(redisClient *c) {
-    addReplySds(c,
-        sdscatprintf(sdsempty(),":%lu\r\n",server.lastsave));
+    addReplyUlong(c,server.lastsave);
 }
 
 static void typeCommand(redisClient *c) {
-    robj *o;
+    int vtype;
     char *type;
 
-    o = lookupKeyRead(c->db,c->argv[1]);
-    if (o == NULL) {
+    if (!lookupKeyMetadata(c->db,c->argv[1],&vtype,NULL)) {
         type = "+none";
     } else {
-        switch(o->type) {
+        switch(vtype) {
         case REDIS_STRING: type = "+string"; break;
         case REDIS_LIST: type = "+list"; break;
         case REDIS_SET: type = "+set"; break;
@@ -4241,129 +4954,346 @@ static void moveCommand(redisClient *c) {
 }
 
 /* =================================== Lists ================================ */
-static void pushGenericCommand(redisClient *c, int where) {
-    robj *lobj;
-    list *list;
 
-    lobj = lookupKeyWrite(c->db,c->argv[1]);
-    if (lobj == NULL) {
-        if (handleClientsWaitingListPush(c,c->argv[1],c->argv[2])) {
-            addReply(c,shared.cone);
-            return;
-        }
-        lobj = createListObject();
-        list = lobj->ptr;
-        if (where == REDIS_HEAD) {
-            listAddNodeHead(list,c->argv[2]);
-        } else {
-            listAddNodeTail(list,c->argv[2]);
-        }
-        dictAdd(c->db->dict,c->argv[1],lobj);
-        incrRefCount(c->argv[1]);
-        incrRefCount(c->argv[2]);
-    } else {
-        if (lobj->type != REDIS_LIST) {
-            addReply(c,shared.wrongtypeerr);
-            return;
-        }
-        if (handleClientsWaitingListPush(c,c->argv[1],c->argv[2])) {
-            addReply(c,shared.cone);
-            return;
-        }
-        list = lobj->ptr;
-        if (where == REDIS_HEAD) {
-            listAddNodeHead(list,c->argv[2]);
-        } else {
-            listAddNodeTail(list,c->argv[2]);
-        }
-        incrRefCount(c->argv[2]);
-    }
-    server.dirty++;
-    addReplySds(c,sdscatprintf(sdsempty(),":%d\r\n",listLength(list)));
-}
+/* ----------------------------- List type API ------------------------------
+ * Lists are encoded as linked lists of objects while small, and as seglists
+ * (see seglist.c) once they have more than list-max-linkedlist-entries
+ * elements. The following functions hide the encoding to the commands.
+ * Seglist elements are not objects, so listTypeGet() returns a new object
+ * for them: use the iterator based functions to avoid it when possible. */
 
-static void lpushCommand(redisClient *c) {
-    pushGenericCommand(c,REDIS_HEAD);
+static unsigned long listTypeLength(robj *o) {
+    if (o->encoding == REDIS_ENCODING_LINKEDLIST)
+        return listLength((list*)o->ptr);
+    return seglistLength((seglist*)o->ptr);
 }
 
-static void rpushCommand(redisClient *c) {
-    pushGenericCommand(c,REDIS_TAIL);
-}
+/* Convert a linked list into a seglist. */
+static void listTypeConvert(robj *o) {
+    seglist *sl = seglistCreate();
+    listNode *ln;
+    listIter li;
 
-static void llenCommand(redisClient *c) {
-    robj *o;
-    list *l;
+    redisAssert(o->encoding == REDIS_ENCODING_LINKEDLIST);
+    listRewind(o->ptr,&li);
+    while((ln = listNext(&li))) {
+        robj *ele = getDecodedObject(listNodeValue(ln));
 
-    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
-        checkType(c,o,REDIS_LIST)) return;
-    
-    l = o->ptr;
-    addReplyUlong(c,listLength(l));
+        seglistPush(sl,ele->ptr,sdslen(ele->ptr),SEGLIST_TAIL);
+        decrRefCount(ele);
+    }
+    listRelease(o->ptr);
+    o->ptr = sl;
+    o->encoding = REDIS_ENCODING_SEGLIST;
 }
 
-static void lindexCommand(redisClient *c) {
-    robj *o;
-    int index = atoi(c->argv[2]->ptr);
-    list *list;
-    listNode *ln;
-
-    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.nullbulk)) == NULL ||
-        checkType(c,o,REDIS_LIST)) return;
-    list = o->ptr;
-
-    ln = listIndex(list, index);
-    if (ln == NULL) {
-        addReply(c,shared.nullbulk);
+/* Add 'ele' at the head or at the tail of the list. The caller retains its
+ * own reference to 'ele'. */
+static void listTypePush(robj *o, robj *ele, int where) {
+    if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
+        if (where == REDIS_HEAD)
+            listAddNodeHead(o->ptr,ele);
+        else
+            listAddNodeTail(o->ptr,ele);
+        incrRefCount(ele);
+        if (listLength((list*)o->ptr) > server.list_max_linkedlist_entries)
+            listTypeConvert(o);
     } else {
-        robj *ele = listNodeValue(ln);
-        addReplyBulk(c,ele);
+        ele = getDecodedObject(ele);
+        seglistPush(o->ptr,ele->ptr,sdslen(ele->ptr),
+            (where == REDIS_HEAD) ? SEGLIST_HEAD : SEGLIST_TAIL);
+        decrRefCount(ele);
     }
 }
 
-static void lsetCommand(redisClient *c) {
-    robj *o;
-    int index = atoi(c->argv[2]->ptr);
-    list *list;
-    listNode *ln;
+/* Remove the head or tail element of the list and return it, or NULL if
+ * the list is empty. The caller owns a reference to the returned object. */
+static robj *listTypePop(robj *o, int where) {
+    robj *ele;
 
-    if ((o = lookupKeyWriteOrReply(c,c->argv[1],shared.nokeyerr)) == NULL ||
-        checkType(c,o,REDIS_LIST)) return;
-    list = o->ptr;
+    if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
+        list *l = o->ptr;
+        listNode *ln = (where == REDIS_HEAD) ? listFirst(l) : listLast(l);
 
-    ln = listIndex(list, index);
-    if (ln == NULL) {
-        addReply(c,shared.outofrangeerr);
-    } else {
-        robj *ele = listNodeValue(ln);
+        if (ln == NULL) return NULL;
+        ele = listNodeValue(ln);
+        incrRefCount(ele);
+        listDelNode(l,ln);
+    } else {
+        seglistIter si;
+        unsigned char *s;
+        unsigned int len;
 
-        decrRefCount(ele);
-        listNodeValue(ln) = c->argv[3];
-        incrRefCount(c->argv[3]);
+        if (!seglistIndex(o->ptr,(where == REDIS_HEAD) ? 0 : -1,&si))
+            return NULL;
+        seglistGet(&si,&s,&len);
+        ele = createStringObject((char*)s,len);
+        seglistDelete(o->ptr,&si,SEGLIST_TAIL);
+    }
+    return ele;
+}
+
+/* Remove 'ltrim' elements from the head and 'rtrim' from the tail. */
+static void listTypeTrim(robj *o, unsigned long ltrim, unsigned long rtrim) {
+    if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
+        list *l = o->ptr;
+        unsigned long j;
+
+        for (j = 0; j < ltrim; j++) listDelNode(l,listFirst(l));
+        for (j = 0; j < rtrim; j++) listDelNode(l,listLast(l));
+    } else {
+        seglistTrim(o->ptr,ltrim,rtrim);
+    }
+}
+
+/* Initialize an iterator at the element 'index' (negative indexes count
+ * from the tail) moving towards 'direction', REDIS_HEAD or REDIS_TAIL. The
+ * first call to listTypeNext() returns the element at 'index' itself:
+ *
+ *  listTypeInitIterator(&li,o,0,REDIS_TAIL);
+ *  while(listTypeNext(&li)) { ... }
+ */
+static void listTypeInitIterator(listTypeIterator *li, robj *o, long index, int direction) {
+    li->subject = o;
+    li->direction = direction;
+    li->advance = 0;
+    if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
+        li->ln = (index < INT_MIN || index > INT_MAX) ? NULL :
+                 listIndex(o->ptr,index);
+    } else {
+        seglistIndex(o->ptr,index,&li->si);
+    }
+}
+
+/* Move to the next element. Returns 0 when there are no more elements. */
+static int listTypeNext(listTypeIterator *li) {
+    if (li->subject->encoding == REDIS_ENCODING_LINKEDLIST) {
+        if (li->advance && li->ln)
+            li->ln = (li->direction == REDIS_TAIL) ? li->ln->next :
+                                                     li->ln->prev;
+        li->advance = 1;
+        return li->ln != NULL;
+    } else {
+        if (li->advance) {
+            if (li->direction == REDIS_TAIL)
+                seglistNext(&li->si);
+            else
+                seglistPrev(&li->si);
+        }
+        li->advance = 1;
+        return li->si.seg != NULL;
+    }
+}
+
+/* Return the current element. The caller owns a reference to it. */
+static robj *listTypeGet(listTypeIterator *li) {
+    robj *ele;
+
+    if (li->subject->encoding == REDIS_ENCODING_LINKEDLIST) {
+        ele = listNodeValue(li->ln);
+        incrRefCount(ele);
+    } else {
+        unsigned char *s;
+        unsigned int len;
+
+        seglistGet(&li->si,&s,&len);
+        ele = createStringObject((char*)s,len);
+    }
+    return ele;
+}
+
+/* Return non zero if the current element is equal to the string 'o'. */
+static int listTypeEqual(listTypeIterator *li, robj *o) {
+    unsigned char *s;
+    unsigned int len;
+    char buf[32];
+    char *p;
+    size_t plen;
+
+    if (li->subject->encoding == REDIS_ENCODING_LINKEDLIST)
+        return compareStringObjects(listNodeValue(li->ln),o) == 0;
+    if (o->encoding == REDIS_ENCODING_RAW) {
+        p = o->ptr;
+        plen = sdslen(o->ptr);
+    } else {
+        p = buf;
+        plen = ll2string(buf,sizeof(buf),(long)o->ptr);
+    }
+    seglistGet(&li->si,&s,&len);
+    return len == plen && memcmp(s,p,len) == 0;
+}
+
+/* Replace the current element with 'val'. */
+static void listTypeReplace(listTypeIterator *li, robj *val) {
+    if (li->subject->encoding == REDIS_ENCODING_LINKEDLIST) {
+        decrRefCount(listNodeValue(li->ln));
+        listNodeValue(li->ln) = val;
+        incrRefCount(val);
+    } else {
+        val = getDecodedObject(val);
+        seglistReplace(li->subject->ptr,&li->si,val->ptr,sdslen(val->ptr));
+        decrRefCount(val);
+    }
+}
+
+/* Delete the current element. The next call to listTypeNext() returns the
+ * element that followed it in the iteration direction. */
+static void listTypeDelete(listTypeIterator *li) {
+    if (li->subject->encoding == REDIS_ENCODING_LINKEDLIST) {
+        listNode *next = (li->direction == REDIS_TAIL) ? li->ln->next :
+                                                         li->ln->prev;
+
+        listDelNode(li->subject->ptr,li->ln);
+        li->ln = next;
+    } else {
+        seglistDelete(li->subject->ptr,&li->si,
+            (li->direction == REDIS_TAIL) ? SEGLIST_TAIL : SEGLIST_HEAD);
+    }
+    li->advance = 0;
+}
+
+/* Add the current element to the reply as a bulk. */
+static void addReplyListTypeElement(redisClient *c, listTypeIterator *li) {
+    if (li->subject->encoding == REDIS_ENCODING_LINKEDLIST) {
+        addReplyBulk(c,listNodeValue(li->ln));
+    } else {
+        unsigned char *s;
+        unsigned int len;
+
+        seglistGet(&li->si,&s,&len);
+        addReplyBulkBuffer(c,(char*)s,len);
+    }
+}
+
+/* ----------------------------- List commands ------------------------------ */
+
+/* LPUSH/RPUSH key value [value ...]. Values are pushed one after the other,
+ * so LPUSH a b c leaves c at the head. While the list is missing or empty
+ * the values are handed to clients blocked in BLPOP/BRPOP first; the reply
+ * counts them as if they had been pushed. Values handed this way are
+ * removed from the argument vector, so that only the ones actually pushed
+ * are propagated to the append only file and to the slaves. */
+static void pushGenericCommand(redisClient *c, int where) {
+    robj *lobj;
+    unsigned long served = 0;
+    int j, pushed = 2;
+
+    lobj = lookupKeyWrite(c->db,c->argv[1]);
+    if (lobj != NULL && lobj->type != REDIS_LIST) {
+        addReply(c,shared.wrongtypeerr);
+        return;
+    }
+    for (j = 2; j < c->argc; j++) {
+        if (lobj == NULL || listTypeLength(lobj) == 0) {
+            if (handleClientsWaitingListPush(c,c->argv[1],c->argv[j])) {
+                decrRefCount(c->argv[j]);
+                served++;
+                continue;
+            }
+        }
+        c->argv[pushed++] = c->argv[j];
+        if (lobj == NULL) {
+            lobj = createListObject();
+            dictAdd(c->db->dict,c->argv[1],lobj);
+            incrRefCount(c->argv[1]);
+            /* skip the linked list stage if the values won't fit in it */
+            if ((unsigned long)(c->argc-j) > server.list_max_linkedlist_entries)
+                listTypeConvert(lobj);
+        }
+        if (j < c->argc-1) tryObjectEncoding(c->argv[j]);
+        listTypePush(lobj,c->argv[j],where);
+    }
+    c->argc = pushed;
+    server.dirty += pushed-2;
+    addReplyUlong(c,served + (lobj ? listTypeLength(lobj) : 0));
+}
+
+static void lpushCommand(redisClient *c) {
+    pushGenericCommand(c,REDIS_HEAD);
+}
+
+static void rpushCommand(redisClient *c) {
+    pushGenericCommand(c,REDIS_TAIL);
+}
+
+/* LLEN, SCARD, ZCARD and HLEN implementation. The value is never loaded
+ * from the swap file, see lookupKeyMetadata(). */
+static void lenGenericCommand(redisClient *c, int type) {
+    int vtype;
+    unsigned long len;
+
+    if (!lookupKeyMetadata(c->db,c->argv[1],&vtype,&len)) {
+        addReply(c,shared.czero);
+    } else if (vtype != type) {
+        addReply(c,shared.wrongtypeerr);
+    } else {
+        addReplyUlong(c,len);
+    }
+}
+
+static void llenCommand(redisClient *c) {
+    lenGenericCommand(c,REDIS_LIST);
+}
+
+static void lindexCommand(redisClient *c) {
+    robj *o;
+    int index = atoi(c->argv[2]->ptr);
+    listTypeIterator li;
+
+    /* Big swapped lists: just read the chunk holding the element. */
+    if ((o = vmChunkedKeyRead(c->db,c->argv[1])) != NULL) {
+        robj *ele;
+
+        if (o->vtype != REDIS_LIST) {
+            addReply(c,shared.wrongtypeerr);
+        } else if ((ele = vmChunkedListIndex(o,index)) == NULL) {
+            addReply(c,shared.nullbulk);
+        } else {
+            addReplyBulk(c,ele);
+            decrRefCount(ele);
+        }
+        return;
+    }
+    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.nullbulk)) == NULL ||
+        checkType(c,o,REDIS_LIST)) return;
+
+    listTypeInitIterator(&li,o,index,REDIS_TAIL);
+    if (!listTypeNext(&li)) {
+        addReply(c,shared.nullbulk);
+    } else {
+        addReplyListTypeElement(c,&li);
+    }
+}
+
+static void lsetCommand(redisClient *c) {
+    robj *o;
+    int index = atoi(c->argv[2]->ptr);
+    listTypeIterator li;
+
+    if ((o = lookupKeyWriteOrReply(c,c->argv[1],shared.nokeyerr)) == NULL ||
+        checkType(c,o,REDIS_LIST)) return;
+
+    listTypeInitIterator(&li,o,index,REDIS_TAIL);
+    if (!listTypeNext(&li)) {
+        addReply(c,shared.outofrangeerr);
+    } else {
+        listTypeReplace(&li,c->argv[3]);
         addReply(c,shared.ok);
         server.dirty++;
     }
 }
 
 static void popGenericCommand(redisClient *c, int where) {
-    robj *o;
-    list *list;
-    listNode *ln;
+    robj *o, *ele;
 
     if ((o = lookupKeyWriteOrReply(c,c->argv[1],shared.nullbulk)) == NULL ||
         checkType(c,o,REDIS_LIST)) return;
-    list = o->ptr;
-
-    if (where == REDIS_HEAD)
-        ln = listFirst(list);
-    else
-        ln = listLast(list);
 
-    if (ln == NULL) {
+    if ((ele = listTypePop(o,where)) == NULL) {
         addReply(c,shared.nullbulk);
     } else {
-        robj *ele = listNodeValue(ln);
         addReplyBulk(c,ele);
-        listDelNode(list,ln);
+        decrRefCount(ele);
         server.dirty++;
     }
 }
@@ -4382,14 +5312,12 @@ static void lrangeCommand(redisClient *c) {
     int end = atoi(c->argv[3]->ptr);
     int llen;
     int rangelen, j;
-    list *list;
-    listNode *ln;
-    robj *ele;
+    listTypeIterator li;
+    int more;
 
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.nullmultibulk)) == NULL ||
         checkType(c,o,REDIS_LIST)) return;
-    list = o->ptr;
-    llen = listLength(list);
+    llen = listTypeLength(o);
 
     /* convert negative indexes */
     if (start < 0) start = llen+start;
@@ -4407,12 +5335,12 @@ static void lrangeCommand(redisClient *c) {
     rangelen = (end-start)+1;
 
     /* Return the result in form of a multi-bulk reply */
-    ln = listIndex(list, start);
-    addReplySds(c,sdscatprintf(sdsempty(),"*%d\r\n",rangelen));
+    listTypeInitIterator(&li,o,start,REDIS_TAIL);
+    addReplyMultiBulkLen(c,rangelen);
     for (j = 0; j < rangelen; j++) {
-        ele = listNodeValue(ln);
-        addReplyBulk(c,ele);
-        ln = ln->next;
+        more = listTypeNext(&li);
+        redisAssert(more);
+        addReplyListTypeElement(c,&li);
     }
 }
 
@@ -4421,14 +5349,11 @@ static void ltrimCommand(redisClient *c) {
     int start = atoi(c->argv[2]->ptr);
     int end = atoi(c->argv[3]->ptr);
     int llen;
-    int j, ltrim, rtrim;
-    list *list;
-    listNode *ln;
+    int ltrim, rtrim;
 
     if ((o = lookupKeyWriteOrReply(c,c->argv[1],shared.ok)) == NULL ||
         checkType(c,o,REDIS_LIST)) return;
-    list = o->ptr;
-    llen = listLength(list);
+    llen = listTypeLength(o);
 
     /* convert negative indexes */
     if (start < 0) start = llen+start;
@@ -4448,48 +5373,38 @@ static void ltrimCommand(redisClient *c) {
     }
 
     /* Remove list elements to perform the trim */
-    for (j = 0; j < ltrim; j++) {
-        ln = listFirst(list);
-        listDelNode(list,ln);
-    }
-    for (j = 0; j < rtrim; j++) {
-        ln = listLast(list);
-        listDelNode(list,ln);
-    }
+    listTypeTrim(o,ltrim,rtrim);
     server.dirty++;
     addReply(c,shared.ok);
 }
 
 static void lremCommand(redisClient *c) {
     robj *o;
-    list *list;
-    listNode *ln, *next;
+    listTypeIterator li;
     int toremove = atoi(c->argv[2]->ptr);
     int removed = 0;
     int fromtail = 0;
 
     if ((o = lookupKeyWriteOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,REDIS_LIST)) return;
-    list = o->ptr;
 
     if (toremove < 0) {
         toremove = -toremove;
         fromtail = 1;
     }
-    ln = fromtail ? list->tail : list->head;
-    while (ln) {
-        robj *ele = listNodeValue(ln);
-
-        next = fromtail ? ln->prev : ln->next;
-        if (compareStringObjects(ele,c->argv[3]) == 0) {
-            listDelNode(list,ln);
+    if (fromtail)
+        listTypeInitIterator(&li,o,-1,REDIS_HEAD);
+    else
+        listTypeInitIterator(&li,o,0,REDIS_TAIL);
+    while (listTypeNext(&li)) {
+        if (listTypeEqual(&li,c->argv[3])) {
+            listTypeDelete(&li);
             server.dirty++;
             removed++;
             if (toremove && removed == toremove) break;
         }
-        ln = next;
     }
-    addReplySds(c,sdscatprintf(sdsempty(),":%d\r\n",removed));
+    addReplyLong(c,removed);
 }
 
 /* This is the semantic of this command:
@@ -4509,26 +5424,25 @@ static void lremCommand(redisClient *c) {
  */
 static void rpoplpushcommand(redisClient *c) {
     robj *sobj;
-    list *srclist;
-    listNode *ln;
 
     if ((sobj = lookupKeyWriteOrReply(c,c->argv[1],shared.nullbulk)) == NULL ||
         checkType(c,sobj,REDIS_LIST)) return;
-    srclist = sobj->ptr;
-    ln = listLast(srclist);
 
-    if (ln == NULL) {
+    if (listTypeLength(sobj) == 0) {
         addReply(c,shared.nullbulk);
     } else {
         robj *dobj = lookupKeyWrite(c->db,c->argv[2]);
-        robj *ele = listNodeValue(ln);
-        list *dstlist;
+        robj *ele;
 
         if (dobj && dobj->type != REDIS_LIST) {
             addReply(c,shared.wrongtypeerr);
             return;
         }
 
+        /* Remove the element from the source list first: when source and
+         * destination are the same list this rotates it. */
+        ele = listTypePop(sobj,REDIS_TAIL);
+
         /* Add the element to the target list (unless it's directly
          * passed to some BLPOP-ing client */
         if (!handleClientsWaitingListPush(c,c->argv[2],ele)) {
@@ -4538,24 +5452,24 @@ static void rpoplpushcommand(redisClient *c) {
                 dictAdd(c->db->dict,c->argv[2],dobj);
                 incrRefCount(c->argv[2]);
             }
-            dstlist = dobj->ptr;
-            listAddNodeHead(dstlist,ele);
-            incrRefCount(ele);
+            listTypePush(dobj,ele,REDIS_HEAD);
         }
 
         /* Send the element to the client as reply as well */
         addReplyBulk(c,ele);
-
-        /* Finally remove the element from the source list */
-        listDelNode(srclist,ln);
+        decrRefCount(ele);
         server.dirty++;
     }
 }
 
 /* ==================================== Sets ================================ */
 
+/* SADD key member [member ...]. Replies with the number of members that
+ * were not already in the set. */
 static void saddCommand(redisClient *c) {
     robj *set;
+    long added = 0;
+    int j;
 
     set = lookupKeyWrite(c->db,c->argv[1]);
     if (set == NULL) {
@@ -4568,13 +5482,16 @@ static void saddCommand(redisClient *c) {
             return;
         }
     }
-    if (dictAdd(set->ptr,c->argv[2],NULL) == DICT_OK) {
-        incrRefCount(c->argv[2]);
-        server.dirty++;
-        addReply(c,shared.cone);
-    } else {
-        addReply(c,shared.czero);
+    if (c->argc > 3) htReserve(set->ptr,c->argc-2);
+    for (j = 2; j < c->argc; j++) {
+        if (j < c->argc-1) tryObjectEncoding(c->argv[j]);
+        if (dictAdd(set->ptr,c->argv[j],NULL) == DICT_OK) {
+            incrRefCount(c->argv[j]);
+            added++;
+        }
     }
+    server.dirty += added;
+    addReplyLong(c,added);
 }
 
 static void sremCommand(redisClient *c) {
@@ -4630,6 +5547,16 @@ static void smoveCommand(redisClient *c) {
 static void sismemberCommand(redisClient *c) {
     robj *set;
 
+    /* Big swapped sets: just read the chunks holding the bucket. */
+    if ((set = vmChunkedKeyRead(c->db,c->argv[1])) != NULL) {
+        if (set->vtype != REDIS_SET)
+            addReply(c,shared.wrongtypeerr);
+        else if (vmChunkedLookup(set,c->argv[2],NULL))
+            addReply(c,shared.cone);
+        else
+            addReply(c,shared.czero);
+        return;
+    }
     if ((set = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,set,REDIS_SET)) return;
 
@@ -4640,14 +5567,7 @@ static void sismemberCommand(redisClient *c) {
 }
 
 static void scardCommand(redisClient *c) {
-    robj *o;
-    dict *s;
-
-    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
-        checkType(c,o,REDIS_SET)) return;
-    
-    s = o->ptr;
-    addReplyUlong(c,dictSize(s));
+    lenGenericCommand(c,REDIS_SET);
 }
 
 static void spopCommand(redisClient *c) {
@@ -4693,7 +5613,10 @@ static int qsortCompareSetsByCardinality(const void *s1, const void *s2) {
     return dictSize(*d1)-dictSize(*d2);
 }
 
-static void sinterGenericCommand(redisClient *c, robj **setskeys, unsigned long setsnum, robj *dstkey) {
+/* Implements SINTER, SINTERSTORE (when 'dstkey' is not NULL) and
+ * SINTERCARD (when 'justcard' is true, only the cardinality of the
+ * intersection is replied and the result is never materialized). */
+static void sinterGenericCommand(redisClient *c, robj **setskeys, unsigned long setsnum, robj *dstkey, int justcard) {
     dict **dv = zmalloc(sizeof(dict*)*setsnum);
     dictIterator *di;
     dictEntry *de;
@@ -4713,7 +5636,7 @@ static void sinterGenericCommand(redisClient *c, robj **setskeys, unsigned long
                     server.dirty++;
                 addReply(c,shared.czero);
             } else {
-                addReply(c,shared.nullmultibulk);
+                addReply(c,justcard ? shared.czero : shared.nullmultibulk);
             }
             return;
         }
@@ -4733,35 +5656,52 @@ static void sinterGenericCommand(redisClient *c, robj **setskeys, unsigned long
      * the intersection set size, so we use a trick, append an empty object
      * to the output list and save the pointer to later modify it with the
      * right length */
-    if (!dstkey) {
-        lenobj = createObject(REDIS_STRING,NULL);
-        addReply(c,lenobj);
-        decrRefCount(lenobj);
-    } else {
+    if (dstkey) {
         /* If we have a target key where to store the resulting set
          * create this key with an empty set inside */
         dstset = createSetObject();
+    } else if (!justcard) {
+        lenobj = createObject(REDIS_STRING,NULL);
+        addReply(c,lenobj);
+        decrRefCount(lenobj);
     }
 
     /* Iterate all the elements of the first (smallest) set, and test
      * the element against all the other sets, if at least one set does
-     * not include the element it is discarded */
+     * not include the element it is discarded.
+     *
+     * Elements are processed in batches: every element is hashed a single
+     * time, as all the sets share the same dict type, and the buckets of
+     * the second set, the one most elements are discarded by, are
+     * prefetched for the whole batch before probing. */
     di = dictGetIterator(dv[0]);
+    while(1) {
+        dictEntry *batch[REDIS_SINTER_BATCH];
+        unsigned int hash[REDIS_SINTER_BATCH];
+        int n = 0, b;
 
-    while((de = dictNext(di)) != NULL) {
-        robj *ele;
+        while(n < REDIS_SINTER_BATCH && (de = dictNext(di)) != NULL) {
+            batch[n] = de;
+            hash[n] = dictHashKey(dv[0],dictGetEntryKey(de));
+            if (setsnum > 1) dictPrefetch(dv[1],hash[n]);
+            n++;
+        }
+        if (n == 0) break;
 
-        for (j = 1; j < setsnum; j++)
-            if (dictFind(dv[j],dictGetEntryKey(de)) == NULL) break;
-        if (j != setsnum)
-            continue; /* at least one set does not contain the member */
-        ele = dictGetEntryKey(de);
-        if (!dstkey) {
-            addReplyBulk(c,ele);
-            cardinality++;
-        } else {
-            dictAdd(dstset->ptr,ele,NULL);
-            incrRefCount(ele);
+        for (b = 0; b < n; b++) {
+            robj *ele = dictGetEntryKey(batch[b]);
+
+            for (j = 1; j < setsnum; j++)
+                if (dictFindWithHash(dv[j],ele,hash[b]) == NULL) break;
+            if (j != setsnum)
+                continue; /* at least one set does not contain the member */
+            if (dstkey) {
+                dictAdd(dstset->ptr,ele,NULL);
+                incrRefCount(ele);
+            } else {
+                if (!justcard) addReplyBulk(c,ele);
+                cardinality++;
+            }
         }
     }
     dictReleaseIterator(di);
@@ -4773,22 +5713,37 @@ static void sinterGenericCommand(redisClient *c, robj **setskeys, unsigned long
         incrRefCount(dstkey);
     }
 
-    if (!dstkey) {
-        lenobj->ptr = sdscatprintf(sdsempty(),"*%lu\r\n",cardinality);
-    } else {
-        addReplySds(c,sdscatprintf(sdsempty(),":%lu\r\n",
-            dictSize((dict*)dstset->ptr)));
+    if (dstkey) {
+        addReplyUlong(c,dictSize((dict*)dstset->ptr));
         server.dirty++;
+    } else if (justcard) {
+        addReplyUlong(c,cardinality);
+    } else {
+        setDeferredMultiBulkLen(lenobj,cardinality);
     }
     zfree(dv);
 }
 
+static void sscanCommand(redisClient *c) {
+    robj *o;
+    unsigned long cursor;
+
+    if (parseScanCursorOrReply(c,c->argv[2],&cursor) == REDIS_ERR) return;
+    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.emptyscan)) == NULL ||
+        checkType(c,o,REDIS_SET)) return;
+    scanGenericCommand(c,o,cursor,3);
+}
+
 static void sinterCommand(redisClient *c) {
-    sinterGenericCommand(c,c->argv+1,c->argc-1,NULL);
+    sinterGenericCommand(c,c->argv+1,c->argc-1,NULL,0);
 }
 
 static void sinterstoreCommand(redisClient *c) {
-    sinterGenericCommand(c,c->argv+2,c->argc-2,c->argv[1]);
+    sinterGenericCommand(c,c->argv+2,c->argc-2,c->argv[1],0);
+}
+
+static void sintercardCommand(redisClient *c) {
+    sinterGenericCommand(c,c->argv+1,c->argc-1,NULL,1);
 }
 
 #define REDIS_OP_UNION 0
@@ -4825,6 +5780,19 @@ static void sunionDiffGenericCommand(redisClient *c, robj **setskeys, int setsnu
      * this set object will be the resulting object to set into the target key*/
     dstset = createSetObject();
 
+    /* The result has at least as many elements as the biggest set for
+     * SUNION, and at most as many as the first set for SDIFF: size the
+     * hash table once instead of growing it step by step. */
+    if (op == REDIS_OP_UNION) {
+        unsigned long biggest = 0;
+
+        for (j = 0; j < setsnum; j++)
+            if (dv[j] && dictSize(dv[j]) > biggest) biggest = dictSize(dv[j]);
+        if (biggest) dictExpand(dstset->ptr,biggest);
+    } else if (dv[0] && dictSize(dv[0])) {
+        dictExpand(dstset->ptr,dictSize(dv[0]));
+    }
+
     /* Iterate all the elements of all the sets, add every element a single
      * time to the result set */
     for (j = 0; j < setsnum; j++) {
@@ -4856,7 +5824,7 @@ static void sunionDiffGenericCommand(redisClient *c, robj **setskeys, int setsnu
 
     /* Output the content of the resulting set, if not in STORE mode */
     if (!dstkey) {
-        addReplySds(c,sdscatprintf(sdsempty(),"*%d\r\n",cardinality));
+        addReplyMultiBulkLen(c,cardinality);
         di = dictGetIterator(dstset->ptr);
         while((de = dictNext(di)) != NULL) {
             robj *ele;
@@ -4877,8 +5845,7 @@ static void sunionDiffGenericCommand(redisClient *c, robj **setskeys, int setsnu
     if (!dstkey) {
         decrRefCount(dstset);
     } else {
-        addReplySds(c,sdscatprintf(sdsempty(),":%lu\r\n",
-            dictSize((dict*)dstset->ptr)));
+        addReplyUlong(c,dictSize((dict*)dstset->ptr));
         server.dirty++;
     }
     zfree(dv);
@@ -4920,13 +5887,11 @@ static void sdiffstoreCommand(redisClient *c) {
  * from tail to head, useful for ZREVRANGE. */
 
 static zskiplistNode *zslCreateNode(int level, double score, robj *obj) {
-    zskiplistNode *zn = zmalloc(sizeof(*zn));
+    zskiplistNode *zn = zmalloc(sizeof(*zn)+level*sizeof(struct zskiplistLevel));
 
-    zn->forward = zmalloc(sizeof(zskiplistNode*) * level);
-    if (level > 0)
-        zn->span = zmalloc(sizeof(unsigned int) * (level - 1));
     zn->score = score;
     zn->obj = obj;
+    zn->level[0].span = 1;
     return zn;
 }
 
@@ -4939,11 +5904,8 @@ static zskiplist *zslCreate(void) {
     zsl->length = 0;
     zsl->header = zslCreateNode(ZSKIPLIST_MAXLEVEL,0,NULL);
     for (j = 0; j < ZSKIPLIST_MAXLEVEL; j++) {
-        zsl->header->forward[j] = NULL;
-
-        /* span has space for ZSKIPLIST_MAXLEVEL-1 elements */
-        if (j < ZSKIPLIST_MAXLEVEL-1)
-            zsl->header->span[j] = 0;
+        zsl->header->level[j].forward = NULL;
+        if (j > 0) zsl->header->level[j].span = 0;
     }
     zsl->header->backward = NULL;
     zsl->tail = NULL;
@@ -4952,19 +5914,15 @@ static zskiplist *zslCreate(void) {
 
 static void zslFreeNode(zskiplistNode *node) {
     decrRefCount(node->obj);
-    zfree(node->forward);
-    zfree(node->span);
     zfree(node);
 }
 
 static void zslFree(zskiplist *zsl) {
-    zskiplistNode *node = zsl->header->forward[0], *next;
+    zskiplistNode *node = zsl->header->level[0].forward, *next;
 
-    zfree(zsl->header->forward);
-    zfree(zsl->header->span);
     zfree(zsl->header);
     while(node) {
-        next = node->forward[0];
+        next = node->level[0].forward;
         zslFreeNode(node);
         node = next;
     }
@@ -4988,12 +5946,12 @@ static void zslInsert(zskiplist *zsl, double score, robj *obj) {
         /* store rank that is crossed to reach the insert position */
         rank[i] = i == (zsl->level-1) ? 0 : rank[i+1];
 
-        while (x->forward[i] &&
-            (x->forward[i]->score < score ||
-                (x->forward[i]->score == score &&
-                compareStringObjects(x->forward[i]->obj,obj) < 0))) {
-            rank[i] += i > 0 ? x->span[i-1] : 1;
-            x = x->forward[i];
+        while (x->level[i].forward &&
+            (x->level[i].forward->score < score ||
+                (x->level[i].forward->score == score &&
+                compareStringObjects(x->level[i].forward->obj,obj) < 0))) {
+            rank[i] += x->level[i].span;
+            x = x->level[i].forward;
         }
         update[i] = x;
     }
@@ -5006,56 +5964,116 @@ static void zslInsert(zskiplist *zsl, double score, robj *obj) {
         for (i = zsl->level; i < level; i++) {
             rank[i] = 0;
             update[i] = zsl->header;
-            update[i]->span[i-1] = zsl->length;
+            update[i]->level[i].span = zsl->length;
         }
         zsl->level = level;
     }
     x = zslCreateNode(level,score,obj);
     for (i = 0; i < level; i++) {
-        x->forward[i] = update[i]->forward[i];
-        update[i]->forward[i] = x;
+        x->level[i].forward = update[i]->level[i].forward;
+        update[i]->level[i].forward = x;
 
         /* update span covered by update[i] as x is inserted here */
         if (i > 0) {
-            x->span[i-1] = update[i]->span[i-1] - (rank[0] - rank[i]);
-            update[i]->span[i-1] = (rank[0] - rank[i]) + 1;
+            x->level[i].span = update[i]->level[i].span - (rank[0] - rank[i]);
+            update[i]->level[i].span = (rank[0] - rank[i]) + 1;
         }
     }
 
     /* increment span for untouched levels */
     for (i = level; i < zsl->level; i++) {
-        update[i]->span[i-1]++;
+        update[i]->level[i].span++;
     }
 
     x->backward = (update[0] == zsl->header) ? NULL : update[0];
-    if (x->forward[0])
-        x->forward[0]->backward = x;
+    if (x->level[0].forward)
+        x->level[0].forward->backward = x;
     else
         zsl->tail = x;
     zsl->length++;
 }
 
+static int qsortCompareZsetEntryByScore(const void *a, const void *b) {
+    dictEntry *d1 = *(dictEntry**)a, *d2 = *(dictEntry**)b;
+    double s1 = *(double*)dictGetEntryVal(d1), s2 = *(double*)dictGetEntryVal(d2);
+
+    if (s1 != s2) return s1 < s2 ? -1 : 1;
+    return compareStringObjects(dictGetEntryKey(d1),dictGetEntryKey(d2));
+}
+
+/* Build the skiplist of 'zs' from its dictionary in a single pass. The
+ * skiplist must be empty. Entries are sorted once by score and then
+ * appended at the tail, so every node is linked with the rank it will
+ * have in the final list and no search from the header is needed. */
+static void zslBulkLoad(zset *zs) {
+    zskiplist *zsl = zs->zsl;
+    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x, *prev = NULL;
+    unsigned long rank[ZSKIPLIST_MAXLEVEL], n = dictSize(zs->dict), k;
+    dictEntry **entries, *de;
+    dictIterator *di;
+    int i, level;
+
+    redisAssert(zsl->length == 0);
+    if (n == 0) return;
+    entries = zmalloc(sizeof(dictEntry*)*n);
+    di = dictGetIterator(zs->dict);
+    for (k = 0; (de = dictNext(di)) != NULL; k++) entries[k] = de;
+    dictReleaseIterator(di);
+    qsort(entries,n,sizeof(dictEntry*),qsortCompareZsetEntryByScore);
+
+    for (i = 0; i < ZSKIPLIST_MAXLEVEL; i++) {
+        update[i] = zsl->header;
+        rank[i] = 0;
+    }
+    for (k = 0; k < n; k++) {
+        robj *o = dictGetEntryKey(entries[k]);
+
+        level = zslRandomLevel();
+        if (level > zsl->level) zsl->level = level;
+        x = zslCreateNode(level,*(double*)dictGetEntryVal(entries[k]),o);
+        incrRefCount(o); /* added to skiplist */
+        for (i = 0; i < level; i++) {
+            update[i]->level[i].forward = x;
+            if (i > 0) update[i]->level[i].span = (k+1) - rank[i];
+            update[i] = x;
+            rank[i] = k+1;
+        }
+        x->backward = prev;
+        prev = x;
+    }
+
+    /* terminate every level at the last node it reached: spans pointing
+     * past the tail count the nodes left behind, as zslInsert does */
+    for (i = 0; i < zsl->level; i++) {
+        update[i]->level[i].forward = NULL;
+        if (i > 0) update[i]->level[i].span = n - rank[i];
+    }
+    zsl->tail = prev;
+    zsl->length = n;
+    zfree(entries);
+}
+
 /* Internal function used by zslDelete, zslDeleteByScore and zslDeleteByRank */
 void zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update) {
     int i;
     for (i = 0; i < zsl->level; i++) {
-        if (update[i]->forward[i] == x) {
+        if (update[i]->level[i].forward == x) {
             if (i > 0) {
-                update[i]->span[i-1] += x->span[i-1] - 1;
+                update[i]->level[i].span += x->level[i].span - 1;
             }
-            update[i]->forward[i] = x->forward[i];
+            update[i]->level[i].forward = x->level[i].forward;
         } else {
-            /* invariant: i > 0, because update[0]->forward[0]
+            /* invariant: i > 0, because update[0]->level[0].forward
              * is always equal to x */
-            update[i]->span[i-1] -= 1;
+            update[i]->level[i].span -= 1;
         }
     }
-    if (x->forward[0]) {
-        x->forward[0]->backward = x->backward;
+    if (x->level[0].forward) {
+        x->level[0].forward->backward = x->backward;
     } else {
         zsl->tail = x->backward;
     }
-    while(zsl->level > 1 && zsl->header->forward[zsl->level-1] == NULL)
+    while(zsl->level > 1 && zsl->header->level[zsl->level-1].forward == NULL)
         zsl->level--;
     zsl->length--;
 }
@@ -5067,16 +6085,16 @@ static int zslDelete(zskiplist *zsl, double score, robj *obj) {
 
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
-        while (x->forward[i] &&
-            (x->forward[i]->score < score ||
-                (x->forward[i]->score == score &&
-                compareStringObjects(x->forward[i]->obj,obj) < 0)))
-            x = x->forward[i];
+        while (x->level[i].forward &&
+            (x->level[i].forward->score < score ||
+                (x->level[i].forward->score == score &&
+                compareStringObjects(x->level[i].forward->obj,obj) < 0)))
+            x = x->level[i].forward;
         update[i] = x;
     }
     /* We may have multiple elements with the same score, what we need
      * is to find the element with both the right score and object. */
-    x = x->forward[0];
+    x = x->level[0].forward;
     if (x && score == x->score && compareStringObjects(x->obj,obj) == 0) {
         zslDeleteNode(zsl, x, update);
         zslFreeNode(x);
@@ -5098,15 +6116,15 @@ static unsigned long zslDeleteRangeByScore(zskiplist *zsl, double min, double ma
 
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
-        while (x->forward[i] && x->forward[i]->score < min)
-            x = x->forward[i];
+        while (x->level[i].forward && x->level[i].forward->score < min)
+            x = x->level[i].forward;
         update[i] = x;
     }
     /* We may have multiple elements with the same score, what we need
      * is to find the element with both the right score and object. */
-    x = x->forward[0];
+    x = x->level[0].forward;
     while (x && x->score <= max) {
-        zskiplistNode *next = x->forward[0];
+        zskiplistNode *next = x->level[0].forward;
         zslDeleteNode(zsl, x, update);
         dictDelete(dict,x->obj);
         zslFreeNode(x);
@@ -5125,17 +6143,17 @@ static unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned int start, un
 
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
-        while (x->forward[i] && (traversed + (i > 0 ? x->span[i-1] : 1)) < start) {
-            traversed += i > 0 ? x->span[i-1] : 1;
-            x = x->forward[i];
+        while (x->level[i].forward && (traversed + x->level[i].span) < start) {
+            traversed += x->level[i].span;
+            x = x->level[i].forward;
         }
         update[i] = x;
     }
 
     traversed++;
-    x = x->forward[0];
+    x = x->level[0].forward;
     while (x && traversed <= end) {
-        zskiplistNode *next = x->forward[0];
+        zskiplistNode *next = x->level[0].forward;
         zslDeleteNode(zsl, x, update);
         dictDelete(dict,x->obj);
         zslFreeNode(x);
@@ -5146,22 +6164,6 @@ static unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned int start, un
     return removed;
 }
 
-/* Find the first node having a score equal or greater than the specified one.
- * Returns NULL if there is no match. */
-static zskiplistNode *zslFirstWithScore(zskiplist *zsl, double score) {
-    zskiplistNode *x;
-    int i;
-
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->forward[i] && x->forward[i]->score < score)
-            x = x->forward[i];
-    }
-    /* We may have multiple elements with the same score, what we need
-     * is to find the element with both the right score and object. */
-    return x->forward[0];
-}
-
 /* Find the rank for an element by both score and key.
  * Returns 0 when the element cannot be found, rank otherwise.
  * Note that the rank is 1-based due to the span of zsl->header to the
@@ -5173,12 +6175,12 @@ static unsigned long zslGetRank(zskiplist *zsl, double score, robj *o) {
 
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
-        while (x->forward[i] &&
-            (x->forward[i]->score < score ||
-                (x->forward[i]->score == score &&
-                compareStringObjects(x->forward[i]->obj,o) <= 0))) {
-            rank += i > 0 ? x->span[i-1] : 1;
-            x = x->forward[i];
+        while (x->level[i].forward &&
+            (x->level[i].forward->score < score ||
+                (x->level[i].forward->score == score &&
+                compareStringObjects(x->level[i].forward->obj,o) <= 0))) {
+            rank += x->level[i].span;
+            x = x->level[i].forward;
         }
 
         /* x might be equal to zsl->header, so test if obj is non-NULL */
@@ -5189,6 +6191,26 @@ static unsigned long zslGetRank(zskiplist *zsl, double score, robj *o) {
     return 0;
 }
 
+/* Return the number of elements with a score lower than 'score', or lower
+ * or equal if 'inclusive' is true. This is the 0-based rank of the first
+ * element past the bound, computed using the spans in O(log N). */
+static unsigned long zslGetScoreRank(zskiplist *zsl, double score, int inclusive) {
+    zskiplistNode *x;
+    unsigned long rank = 0;
+    int i;
+
+    x = zsl->header;
+    for (i = zsl->level-1; i >= 0; i--) {
+        while (x->level[i].forward &&
+            (inclusive ? (x->level[i].forward->score <= score) :
+                         (x->level[i].forward->score < score))) {
+            rank += x->level[i].span;
+            x = x->level[i].forward;
+        }
+    }
+    return rank;
+}
+
 /* Finds an element by its rank. The rank argument needs to be 1-based. */
 zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank) {
     zskiplistNode *x;
@@ -5197,10 +6219,10 @@ zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank) {
 
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
-        while (x->forward[i] && (traversed + (i>0 ? x->span[i-1] : 1)) <= rank)
+        while (x->level[i].forward && (traversed + x->level[i].span) <= rank)
         {
-            traversed += i > 0 ? x->span[i-1] : 1;
-            x = x->forward[i];
+            traversed += x->level[i].span;
+            x = x->level[i].forward;
         }
         if (traversed == rank) {
             return x;
@@ -5211,27 +6233,13 @@ zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank) {
 
 /* The actual Z-commands implementations */
 
-/* This generic command implements both ZADD and ZINCRBY.
- * scoreval is the score if the operation is a ZADD (doincrement == 0) or
- * the increment if the operation is a ZINCRBY (doincrement == 1). */
-static void zaddGenericCommand(redisClient *c, robj *key, robj *ele, double scoreval, int doincrement) {
-    robj *zsetobj;
-    zset *zs;
+/* Add 'ele' to the sorted set with the specified score, or update its score
+ * if it is already a member. If 'doincrement' is true 'scoreval' is added
+ * to the old score instead (starting from 0 for new members). The resulting
+ * score is stored in '*newscore'. Returns 1 if 'ele' was a new member. */
+static int zsetAdd(zset *zs, robj *ele, double scoreval, int doincrement, double *newscore) {
     double *score;
 
-    zsetobj = lookupKeyWrite(c->db,key);
-    if (zsetobj == NULL) {
-        zsetobj = createZsetObject();
-        dictAdd(c->db->dict,key,zsetobj);
-        incrRefCount(key);
-    } else {
-        if (zsetobj->type != REDIS_ZSET) {
-            addReply(c,shared.wrongtypeerr);
-            return;
-        }
-    }
-    zs = zsetobj->ptr;
-
     /* Ok now since we implement both ZADD and ZINCRBY here the code
      * needs to handle the two different conditions. It's all about setting
      * '*score', that is, the new score to set, to the right value. */
@@ -5250,6 +6258,7 @@ static void zaddGenericCommand(redisClient *c, robj *key, robj *ele, double scor
     } else {
         *score = scoreval;
     }
+    *newscore = *score;
 
     /* What follows is a simple remove and re-insert operation that is common
      * to both ZADD and ZINCRBY... */
@@ -5259,10 +6268,7 @@ static void zaddGenericCommand(redisClient *c, robj *key, robj *ele, double scor
         zslInsert(zs->zsl,*score,ele);
         incrRefCount(ele); /* added to skiplist */
         server.dirty++;
-        if (doincrement)
-            addReplyDouble(c,*score);
-        else
-            addReply(c,shared.cone);
+        return 1;
     } else {
         dictEntry *de;
         double *oldscore;
@@ -5285,25 +6291,58 @@ static void zaddGenericCommand(redisClient *c, robj *key, robj *ele, double scor
         } else {
             zfree(score);
         }
-        if (doincrement)
-            addReplyDouble(c,*score);
-        else
-            addReply(c,shared.czero);
+        return 0;
     }
 }
 
-static void zaddCommand(redisClient *c) {
-    double scoreval;
+/* This generic command implements both ZADD and ZINCRBY, taking the
+ * score / member pairs from c->argv[2] onward. For ZADD the scores are
+ * the new scores and the reply is the number of members added, for
+ * ZINCRBY (a single pair) the score is the increment and the reply is
+ * the new score. */
+static void zaddGenericCommand(redisClient *c, int doincrement) {
+    robj *zsetobj;
+    zset *zs;
+    double newscore = 0;
+    long added = 0;
+    int j;
+
+    if ((c->argc % 2) != 0) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+    zsetobj = lookupKeyWrite(c->db,c->argv[1]);
+    if (zsetobj == NULL) {
+        zsetobj = createZsetObject();
+        dictAdd(c->db->dict,c->argv[1],zsetobj);
+        incrRefCount(c->argv[1]);
+    } else {
+        if (zsetobj->type != REDIS_ZSET) {
+            addReply(c,shared.wrongtypeerr);
+            return;
+        }
+    }
+    zs = zsetobj->ptr;
+
+    if (c->argc > 4) htReserve(zs->dict,(c->argc-2)/2);
+    for (j = 2; j < c->argc; j += 2) {
+        double scoreval = strtod(c->argv[j]->ptr,NULL);
 
-    scoreval = strtod(c->argv[2]->ptr,NULL);
-    zaddGenericCommand(c,c->argv[1],c->argv[3],scoreval,0);
+        if (j+1 < c->argc-1) tryObjectEncoding(c->argv[j+1]);
+        added += zsetAdd(zs,c->argv[j+1],scoreval,doincrement,&newscore);
+    }
+    if (doincrement)
+        addReplyDouble(c,newscore);
+    else
+        addReplyLong(c,added);
 }
 
-static void zincrbyCommand(redisClient *c) {
-    double scoreval;
+static void zaddCommand(redisClient *c) {
+    zaddGenericCommand(c,0);
+}
 
-    scoreval = strtod(c->argv[2]->ptr,NULL);
-    zaddGenericCommand(c,c->argv[1],c->argv[3],scoreval,1);
+static void zincrbyCommand(redisClient *c) {
+    zaddGenericCommand(c,1);
 }
 
 static void zremCommand(redisClient *c) {
@@ -5495,66 +6534,64 @@ static void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
     dstobj = createZsetObject();
     dstzset = dstobj->ptr;
 
+    /* Scores are aggregated directly into the destination dictionary,
+     * pre-sized so it never rehashes while it fills up: for ZINTER the
+     * smallest source bounds the result, for ZUNION the largest one is
+     * a lower bound. The skiplist is built only once at the end. */
     if (op == REDIS_OP_INTER) {
         /* skip going over all entries if the smallest zset is NULL or empty */
         if (src[0].dict && dictSize(src[0].dict) > 0) {
             /* precondition: as src[0].dict is non-empty and the zsets are ordered
              * from small to large, all src[i > 0].dict are non-empty too */
+            dictExpand(dstzset->dict,dictSize(src[0].dict));
             di = dictGetIterator(src[0].dict);
             while((de = dictNext(di)) != NULL) {
-                double *score = zmalloc(sizeof(double)), value;
-                *score = src[0].weight * (*(double*)dictGetEntryVal(de));
+                robj *o = dictGetEntryKey(de);
+                unsigned int h = dictHashKey(src[0].dict,o);
+                double score, value;
 
+                score = src[0].weight * (*(double*)dictGetEntryVal(de));
                 for (j = 1; j < zsetnum; j++) {
-                    dictEntry *other = dictFind(src[j].dict,dictGetEntryKey(de));
+                    dictEntry *other = dictFindWithHash(src[j].dict,o,h);
                     if (other) {
                         value = src[j].weight * (*(double*)dictGetEntryVal(other));
-                        zunionInterAggregate(score, value, aggregate);
+                        zunionInterAggregate(&score, value, aggregate);
                     } else {
                         break;
                     }
                 }
 
-                /* skip entry when not present in every source dict */
-                if (j != zsetnum) {
-                    zfree(score);
-                } else {
-                    robj *o = dictGetEntryKey(de);
-                    dictAdd(dstzset->dict,o,score);
+                /* add entry only when present in every source dict */
+                if (j == zsetnum) {
+                    double *dscore = zmalloc(sizeof(double));
+                    *dscore = score;
+                    dictAdd(dstzset->dict,o,dscore);
                     incrRefCount(o); /* added to dictionary */
-                    zslInsert(dstzset->zsl,*score,o);
-                    incrRefCount(o); /* added to skiplist */
                 }
             }
             dictReleaseIterator(di);
         }
     } else if (op == REDIS_OP_UNION) {
+        if (src[zsetnum-1].dict)
+            dictExpand(dstzset->dict,dictSize(src[zsetnum-1].dict));
         for (i = 0; i < zsetnum; i++) {
             if (!src[i].dict) continue;
 
             di = dictGetIterator(src[i].dict);
             while((de = dictNext(di)) != NULL) {
-                /* skip key when already processed */
-                if (dictFind(dstzset->dict,dictGetEntryKey(de)) != NULL) continue;
-
-                double *score = zmalloc(sizeof(double)), value;
-                *score = src[i].weight * (*(double*)dictGetEntryVal(de));
+                robj *o = dictGetEntryKey(de);
+                double value = src[i].weight * (*(double*)dictGetEntryVal(de));
+                dictEntry *existing;
 
-                /* because the zsets are sorted by size, its only possible
-                 * for sets at larger indices to hold this entry */
-                for (j = (i+1); j < zsetnum; j++) {
-                    dictEntry *other = dictFind(src[j].dict,dictGetEntryKey(de));
-                    if (other) {
-                        value = src[j].weight * (*(double*)dictGetEntryVal(other));
-                        zunionInterAggregate(score, value, aggregate);
-                    }
+                if ((existing = dictFind(dstzset->dict,o)) != NULL) {
+                    zunionInterAggregate(dictGetEntryVal(existing), value,
+                        aggregate);
+                } else {
+                    double *score = zmalloc(sizeof(double));
+                    *score = value;
+                    dictAdd(dstzset->dict,o,score);
+                    incrRefCount(o); /* added to dictionary */
                 }
-
-                robj *o = dictGetEntryKey(de);
-                dictAdd(dstzset->dict,o,score);
-                incrRefCount(o); /* added to dictionary */
-                zslInsert(dstzset->zsl,*score,o);
-                incrRefCount(o); /* added to skiplist */
             }
             dictReleaseIterator(di);
         }
@@ -5562,6 +6599,7 @@ static void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
         /* unknown operator */
         redisAssert(op == REDIS_OP_INTER || op == REDIS_OP_UNION);
     }
+    zslBulkLoad(dstzset);
 
     deleteKey(c->db,dstkey);
     dictAdd(c->db->dict,dstkey,dstobj);
@@ -5626,18 +6664,17 @@ static void zrangeGenericCommand(redisClient *c, int reverse) {
         ln = start == 0 ? zsl->tail : zslGetElementByRank(zsl, llen-start);
     } else {
         ln = start == 0 ?
-            zsl->header->forward[0] : zslGetElementByRank(zsl, start+1);
+            zsl->header->level[0].forward : zslGetElementByRank(zsl, start+1);
     }
 
     /* Return the result in form of a multi-bulk reply */
-    addReplySds(c,sdscatprintf(sdsempty(),"*%d\r\n",
-        withscores ? (rangelen*2) : rangelen));
+    addReplyMultiBulkLen(c,withscores ? (rangelen*2) : rangelen);
     for (j = 0; j < rangelen; j++) {
         ele = ln->obj;
         addReplyBulk(c,ele);
         if (withscores)
             addReplyDouble(c,ln->score);
-        ln = reverse ? ln->backward : ln->forward[0];
+        ln = reverse ? ln->backward : ln->level[0].forward;
     }
 }
 
@@ -5714,52 +6751,37 @@ static void genericZrangebyscoreCommand(redisClient *c, int justcount) {
             zset *zsetobj = o->ptr;
             zskiplist *zsl = zsetobj->zsl;
             zskiplistNode *ln;
-            robj *ele, *lenobj = NULL;
-            unsigned long rangelen = 0;
-
-            /* Get the first node with the score >= min, or with
-             * score > min if 'minex' is true. */
-            ln = zslFirstWithScore(zsl,min);
-            while (minex && ln && ln->score == min) ln = ln->forward[0];
-
-            if (ln == NULL) {
-                /* No element matching the speciifed interval */
-                addReply(c,justcount ? shared.czero : shared.emptymultibulk);
+            unsigned long first, last, rangelen, j;
+
+            /* The interval covers the elements from the 0-based rank
+             * 'first' to 'last' excluded: both are computed using the
+             * spans, so neither counting nor skipping the LIMIT offset
+             * needs to walk the elements one by one. */
+            first = zslGetScoreRank(zsl,min,minex);
+            last = zslGetScoreRank(zsl,max,!maxex);
+            rangelen = (last > first) ? (last-first) : 0;
+            if (justcount) {
+                addReplyUlong(c,rangelen);
                 return;
             }
 
-            /* We don't know in advance how many matching elements there
-             * are in the list, so we push this object that will represent
-             * the multi-bulk length in the output buffer, and will "fix"
-             * it later */
-            if (!justcount) {
-                lenobj = createObject(REDIS_STRING,NULL);
-                addReply(c,lenobj);
-                decrRefCount(lenobj);
+            rangelen = ((unsigned long)offset < rangelen) ?
+                       (rangelen-offset) : 0;
+            if (limit >= 0 && (unsigned long)limit < rangelen)
+                rangelen = limit;
+            if (rangelen == 0) {
+                /* No element matching the specified interval */
+                addReply(c,shared.emptymultibulk);
+                return;
             }
 
-            while(ln && (maxex ? (ln->score < max) : (ln->score <= max))) {
-                if (offset) {
-                    offset--;
-                    ln = ln->forward[0];
-                    continue;
-                }
-                if (limit == 0) break;
-                if (!justcount) {
-                    ele = ln->obj;
-                    addReplyBulk(c,ele);
-                    if (withscores)
-                        addReplyDouble(c,ln->score);
-                }
-                ln = ln->forward[0];
-                rangelen++;
-                if (limit > 0) limit--;
-            }
-            if (justcount) {
-                addReplyLong(c,(long)rangelen);
-            } else {
-                lenobj->ptr = sdscatprintf(sdsempty(),"*%lu\r\n",
-                     withscores ? (rangelen*2) : rangelen);
+            ln = zslGetElementByRank(zsl,first+offset+1);
+            addReplyMultiBulkLen(c,withscores ? (rangelen*2) : rangelen);
+            for (j = 0; j < rangelen; j++) {
+                addReplyBulk(c,ln->obj);
+                if (withscores)
+                    addReplyDouble(c,ln->score);
+                ln = ln->level[0].forward;
             }
         }
     }
@@ -5774,14 +6796,17 @@ static void zcountCommand(redisClient *c) {
 }
 
 static void zcardCommand(redisClient *c) {
+    lenGenericCommand(c,REDIS_ZSET);
+}
+
+static void zscanCommand(redisClient *c) {
     robj *o;
-    zset *zs;
+    unsigned long cursor;
 
-    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
+    if (parseScanCursorOrReply(c,c->argv[2],&cursor) == REDIS_ERR) return;
+    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.emptyscan)) == NULL ||
         checkType(c,o,REDIS_ZSET)) return;
-
-    zs = o->ptr;
-    addReplyUlong(c,zs->zsl->length);
+    scanGenericCommand(c,o,cursor,3);
 }
 
 static void zscoreCommand(redisClient *c) {
@@ -5844,10 +6869,18 @@ static void zrevrankCommand(redisClient *c) {
 }
 
 /* =================================== Hashes =============================== */
+/* HSET key field value [field value ...]. Replies with the number of
+ * fields that were created, as opposed to updated. */
 static void hsetCommand(redisClient *c) {
-    int update = 0;
-    robj *o = lookupKeyWrite(c->db,c->argv[1]);
+    long added = 0;
+    int j, pairs = (c->argc-2)/2;
+    robj *o;
 
+    if ((c->argc % 2) != 0) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+    o = lookupKeyWrite(c->db,c->argv[1]);
     if (o == NULL) {
         o = createHashObject();
         dictAdd(c->db->dict,c->argv[1],o);
@@ -5858,52 +6891,93 @@ static void hsetCommand(redisClient *c) {
             return;
         }
     }
-    /* We want to convert the zipmap into an hash table right now if the
-     * entry to be added is too big. Note that we check if the object
-     * is integer encoded before to try fetching the length in the test below.
-     * This is because integers are small, but currently stringObjectLen()
-     * performs a slow conversion: not worth it. */
-    if (o->encoding == REDIS_ENCODING_ZIPMAP &&
-        ((c->argv[2]->encoding == REDIS_ENCODING_RAW &&
-          sdslen(c->argv[2]->ptr) > server.hash_max_zipmap_value) ||
-         (c->argv[3]->encoding == REDIS_ENCODING_RAW &&
-          sdslen(c->argv[3]->ptr) > server.hash_max_zipmap_value)))
-    {
-        convertToRealHash(o);
+    /* We want to convert the zipmap into an hash table right now if any
+     * entry to be added is too big, or if the new fields could not fit
+     * anyway: fields already in the zipmap are just updated, so they are
+     * not counted. Note that we check if the object is integer encoded
+     * before to try fetching the length in the test below. This is because
+     * integers are small, but currently stringObjectLen() performs a slow
+     * conversion: not worth it. */
+    if (o->encoding == REDIS_ENCODING_ZIPMAP) {
+        unsigned long len = 0;
+
+        if (pairs > 1) {
+            len = zipmapLen(o->ptr);
+            for (j = 2; j < c->argc &&
+                        len <= server.hash_max_zipmap_entries; j += 2)
+            {
+                if (!zipmapExists(o->ptr,c->argv[j]->ptr,
+                                  sdslen(c->argv[j]->ptr))) len++;
+            }
+        }
+        if (len > server.hash_max_zipmap_entries) {
+            convertToRealHash(o);
+        } else {
+            for (j = 2; j < c->argc; j++) {
+                if (c->argv[j]->encoding == REDIS_ENCODING_RAW &&
+                    sdslen(c->argv[j]->ptr) > server.hash_max_zipmap_value)
+                {
+                    convertToRealHash(o);
+                    break;
+                }
+            }
+        }
     }
 
     if (o->encoding == REDIS_ENCODING_ZIPMAP) {
         unsigned char *zm = o->ptr;
-        robj *valobj = getDecodedObject(c->argv[3]);
 
-        zm = zipmapSet(zm,c->argv[2]->ptr,sdslen(c->argv[2]->ptr),
-            valobj->ptr,sdslen(valobj->ptr),&update);
-        decrRefCount(valobj);
+        for (j = 2; j < c->argc; j += 2) {
+            robj *valobj = getDecodedObject(c->argv[j+1]);
+            int update = 0;
+
+            zm = zipmapSet(zm,c->argv[j]->ptr,sdslen(c->argv[j]->ptr),
+                valobj->ptr,sdslen(valobj->ptr),&update);
+            decrRefCount(valobj);
+            if (!update) added++;
+        }
         o->ptr = zm;
 
         /* And here there is the second check for hash conversion...
          * we want to do it only if the operation was not just an update as
          * zipmapLen() is O(N). */
-        if (!update && zipmapLen(zm) > server.hash_max_zipmap_entries)
+        if (added && zipmapLen(zm) > server.hash_max_zipmap_entries)
             convertToRealHash(o);
     } else {
-        tryObjectEncoding(c->argv[2]);
-        /* note that c->argv[3] is already encoded, as the latest arg
-         * of a bulk command is always integer encoded if possible. */
-        if (dictReplace(o->ptr,c->argv[2],c->argv[3])) {
-            incrRefCount(c->argv[2]);
-        } else {
-            update = 1;
+        if (pairs > 1) htReserve(o->ptr,pairs);
+        for (j = 2; j < c->argc; j += 2) {
+            tryObjectEncoding(c->argv[j]);
+            /* note that the last value is already encoded, as the latest
+             * arg of a bulk command is always integer encoded if possible. */
+            if (j+1 < c->argc-1) tryObjectEncoding(c->argv[j+1]);
+            if (dictReplace(o->ptr,c->argv[j],c->argv[j+1])) {
+                incrRefCount(c->argv[j]);
+                added++;
+            }
+            incrRefCount(c->argv[j+1]);
         }
-        incrRefCount(c->argv[3]);
     }
-    server.dirty++;
-    addReplySds(c,sdscatprintf(sdsempty(),":%d\r\n",update == 0));
+    server.dirty += pairs;
+    addReplyLong(c,added);
 }
 
 static void hgetCommand(redisClient *c) {
     robj *o;
 
+    /* Big swapped hashes: just read the chunks holding the bucket. */
+    if ((o = vmChunkedKeyRead(c->db,c->argv[1])) != NULL) {
+        robj *val;
+
+        if (o->vtype != REDIS_HASH) {
+            addReply(c,shared.wrongtypeerr);
+        } else if (vmChunkedLookup(o,c->argv[2],&val)) {
+            addReplyBulk(c,val);
+            decrRefCount(val);
+        } else {
+            addReply(c,shared.nullbulk);
+        }
+        return;
+    }
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.nullbulk)) == NULL ||
         checkType(c,o,REDIS_HASH)) return;
 
@@ -5939,36 +7013,37 @@ static void hgetCommand(redisClient *c) {
     }
 }
 
+/* HDEL key field [field ...]. Replies with the number of fields removed. */
 static void hdelCommand(redisClient *c) {
     robj *o;
-    int deleted = 0;
+    long deleted = 0;
+    int j;
 
     if ((o = lookupKeyWriteOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,REDIS_HASH)) return;
 
-    if (o->encoding == REDIS_ENCODING_ZIPMAP) {
-        robj *field = getDecodedObject(c->argv[2]);
+    for (j = 2; j < c->argc; j++) {
+        if (o->encoding == REDIS_ENCODING_ZIPMAP) {
+            robj *field = getDecodedObject(c->argv[j]);
+            int found = 0;
 
-        o->ptr = zipmapDel((unsigned char*) o->ptr,
-            (unsigned char*) field->ptr,
-            sdslen(field->ptr), &deleted);
-        decrRefCount(field);
-    } else {
-        deleted = dictDelete((dict*)o->ptr,c->argv[2]) == DICT_OK;
+            o->ptr = zipmapDel((unsigned char*) o->ptr,
+                (unsigned char*) field->ptr,
+                sdslen(field->ptr), &found);
+            decrRefCount(field);
+            deleted += found;
+        } else {
+            deleted += dictDelete((dict*)o->ptr,c->argv[j]) == DICT_OK;
+        }
     }
-    addReply(c,deleted ? shared.cone : shared.czero);
+    if (deleted && o->encoding != REDIS_ENCODING_ZIPMAP &&
+        htNeedsResize(o->ptr)) dictResize(o->ptr);
+    server.dirty += deleted;
+    addReplyLong(c,deleted);
 }
 
 static void hlenCommand(redisClient *c) {
-    robj *o;
-    unsigned long len;
-
-    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
-        checkType(c,o,REDIS_HASH)) return;
-
-    len = (o->encoding == REDIS_ENCODING_ZIPMAP) ?
-            zipmapLen((unsigned char*)o->ptr) : dictSize((dict*)o->ptr);
-    addReplyUlong(c,len);
+    lenGenericCommand(c,REDIS_HASH);
 }
 
 #define REDIS_GETALL_KEYS 1
@@ -6024,7 +7099,7 @@ static void genericHgetallCommand(redisClient *c, int flags) {
         }
         dictReleaseIterator(di);
     }
-    lenobj->ptr = sdscatprintf(sdsempty(),"*%lu\r\n",count);
+    setDeferredMultiBulkLen(lenobj,count);
 }
 
 static void hkeysCommand(redisClient *c) {
@@ -6039,6 +7114,16 @@ static void hgetallCommand(redisClient *c) {
     genericHgetallCommand(c,REDIS_GETALL_KEYS|REDIS_GETALL_VALS);
 }
 
+static void hscanCommand(redisClient *c) {
+    robj *o;
+    unsigned long cursor;
+
+    if (parseScanCursorOrReply(c,c->argv[2],&cursor) == REDIS_ERR) return;
+    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.emptyscan)) == NULL ||
+        checkType(c,o,REDIS_HASH)) return;
+    scanGenericCommand(c,o,cursor,3);
+}
+
 static void hexistsCommand(redisClient *c) {
     robj *o;
     int exists = 0;
@@ -6106,9 +7191,10 @@ static redisSortOperation *createSortOperation(int type, robj *pattern) {
 /* Return the value associated to the key with a name obtained
  * substituting the first occurence of '*' in 'pattern' with 'subst' */
 static robj *lookupKeyByPattern(redisDb *db, robj *pattern, robj *subst) {
-    char *p;
-    sds spat, ssub;
+    char *p, *ssub;
+    sds spat;
     robj keyobj;
+    char numbuf[32];
     int prefixlen, sublen, postfixlen;
     /* Expoit the internal sds representation to create a sds string allocated on the stack in order to make this function faster */
     struct {
@@ -6124,21 +7210,21 @@ static robj *lookupKeyByPattern(redisDb *db, robj *pattern, robj *subst) {
         return subst;
     }
 
-    /* The substitution object may be specially encoded. If so we create
-     * a decoded object on the fly. Otherwise getDecodedObject will just
-     * increment the ref count, that we'll decrement later. */
-    subst = getDecodedObject(subst);
-
-    ssub = subst->ptr;
-    if (sdslen(spat)+sdslen(ssub)-1 > REDIS_SORTKEY_MAX) return NULL;
-    p = strchr(spat,'*');
-    if (!p) {
-        decrRefCount(subst);
-        return NULL;
+    /* The substitution object may be specially encoded. Integers are
+     * formatted on the stack, as this is called for every element sorted
+     * by a pattern and allocating a decoded object each time is slow. */
+    if (subst->encoding == REDIS_ENCODING_RAW) {
+        ssub = subst->ptr;
+        sublen = sdslen(ssub);
+    } else {
+        ssub = numbuf;
+        sublen = ll2string(numbuf,sizeof(numbuf),(long)subst->ptr);
     }
+    if (sdslen(spat)+sublen-1 > REDIS_SORTKEY_MAX) return NULL;
+    p = strchr(spat,'*');
+    if (!p) return NULL;
 
     prefixlen = p-spat;
-    sublen = sdslen(ssub);
     postfixlen = sdslen(spat)-(prefixlen+1);
     memcpy(keyname.buf,spat,prefixlen);
     memcpy(keyname.buf+prefixlen,ssub,sublen);
@@ -6147,7 +7233,6 @@ static robj *lookupKeyByPattern(redisDb *db, robj *pattern, robj *subst) {
     keyname.len = prefixlen+sublen+postfixlen;
 
     initStaticStringObject(keyobj,((char*)&keyname)+(sizeof(long)*2))
-    decrRefCount(subst);
 
     /* printf("lookup '%s' => %p\n", keyname.buf,de); */
     return lookupKeyRead(db,&keyobj);
@@ -6198,6 +7283,84 @@ static int sortCompare(const void *s1, const void *s2) {
     return server.sort_desc ? -cmp : cmp;
 }
 
+static void sortHeapSiftDown(redisSortObject *v, int k, int i) {
+    redisSortObject tmp;
+
+    while(1) {
+        int l = 2*i+1, r = l+1, m = i;
+
+        if (l < k && sortCompare(&v[l],&v[m]) > 0) m = l;
+        if (r < k && sortCompare(&v[r],&v[m]) > 0) m = r;
+        if (m == i) break;
+        tmp = v[i]; v[i] = v[m]; v[m] = tmp;
+        i = m;
+    }
+}
+
+/* Move the 'k' elements that sort first to the start of the vector, in
+ * order, using a max-heap of 'k' elements: O(N log k) compared to sorting
+ * the whole vector when just a small LIMIT is requested. The other
+ * elements are left in the vector in no particular order. */
+static void sortTopK(redisSortObject *v, int len, int k) {
+    redisSortObject tmp;
+    int j;
+
+    for (j = k/2-1; j >= 0; j--) sortHeapSiftDown(v,k,j);
+    for (j = k; j < len; j++) {
+        if (sortCompare(&v[j],&v[0]) < 0) {
+            tmp = v[0]; v[0] = v[j]; v[j] = tmp;
+            sortHeapSiftDown(v,k,0);
+        }
+    }
+    qsort(v,k,sizeof(redisSortObject),sortCompare);
+}
+
+/* Map a double to an unsigned integer with the same ordering. */
+static uint64_t sortScoreKey(double score, int desc) {
+    uint64_t u;
+
+    memcpy(&u,&score,sizeof(u));
+    u = (u & ((uint64_t)1<<63)) ? ~u : (u | ((uint64_t)1<<63));
+    return desc ? ~u : u;
+}
+
+/* Sort a vector by the precomputed numeric scores with a LSD radix sort,
+ * one byte of the score key per pass. Passes where all the elements have
+ * the same byte, like the low mantissa bytes of integer scores, are
+ * skipped. */
+static void sortRadix(redisSortObject *vector, int len, int desc) {
+    redisSortObject *v = vector, *tmp;
+    redisSortObject *aux = zmalloc(sizeof(redisSortObject)*len);
+    int count[256], shift, j;
+
+    for (shift = 0; shift < 64; shift += 8) {
+        int pos = 0;
+
+        memset(count,0,sizeof(count));
+        for (j = 0; j < len; j++)
+            count[(sortScoreKey(v[j].u.score,desc) >> shift) & 0xff]++;
+        if (count[(sortScoreKey(v[0].u.score,desc) >> shift) & 0xff] == len)
+            continue;
+        for (j = 0; j < 256; j++) {
+            int c = count[j];
+
+            count[j] = pos;
+            pos += c;
+        }
+        for (j = 0; j < len; j++)
+            aux[count[(sortScoreKey(v[j].u.score,desc) >> shift) & 0xff]++] =
+                v[j];
+        tmp = v; v = aux; aux = tmp;
+    }
+    /* The passes swap the two vectors, so the result may be in the
+     * auxiliary one. */
+    if (v != vector) {
+        memcpy(vector,v,sizeof(redisSortObject)*len);
+        aux = v;
+    }
+    zfree(aux);
+}
+
 /* The SORT command is the most complex command in Redis. Warning: this code
  * is optimized for speed and a bit less for readability */
 static void sortCommand(redisClient *c) {
@@ -6205,7 +7368,7 @@ static void sortCommand(redisClient *c) {
     int outputlen = 0;
     int desc = 0, alpha = 0;
     int limit_start = 0, limit_count = -1, start, end;
-    int j, dontsort = 0, vectorlen;
+    int j, dontsort = 0, vectorlen, skip = 0;
     int getop = 0; /* GET operation counter */
     robj *sortval, *sortby = NULL, *storekey = NULL;
     redisSortObject *vector; /* Resulting vector to sort */
@@ -6272,23 +7435,40 @@ static void sortCommand(redisClient *c) {
 
     /* Load the sorting vector with all the objects to sort */
     switch(sortval->type) {
-    case REDIS_LIST: vectorlen = listLength((list*)sortval->ptr); break;
+    case REDIS_LIST: vectorlen = listTypeLength(sortval); break;
     case REDIS_SET: vectorlen =  dictSize((dict*)sortval->ptr); break;
     case REDIS_ZSET: vectorlen = dictSize(((zset*)sortval->ptr)->dict); break;
     default: vectorlen = 0; redisAssert(0); /* Avoid GCC warning */
     }
+
+    /* Perform a bit of sanity check on the LIMIT option */
+    start = (limit_start < 0) ? 0 : limit_start;
+    end = (limit_count < 0) ? vectorlen-1 : start+limit_count-1;
+    if (start >= vectorlen) {
+        start = vectorlen-1;
+        end = vectorlen-2;
+    }
+    if (end >= vectorlen) end = vectorlen-1;
+
+    /* With a constant BY pattern the elements are not sorted, so only the
+     * elements in the LIMIT range are loaded. */
+    if (dontsort) {
+        skip = start;
+        vectorlen = (end >= start) ? end-start+1 : 0;
+        end -= start;
+        start = 0;
+    }
     vector = zmalloc(sizeof(redisSortObject)*vectorlen);
     j = 0;
 
     if (sortval->type == REDIS_LIST) {
-        list *list = sortval->ptr;
-        listNode *ln;
-        listIter li;
+        listTypeIterator li;
 
-        listRewind(list,&li);
-        while((ln = listNext(&li))) {
-            robj *ele = ln->value;
-            vector[j].obj = ele;
+        /* The vector owns a reference to list elements, as seglist
+         * elements are created on the fly. */
+        listTypeInitIterator(&li,sortval,skip,REDIS_TAIL);
+        while(j < vectorlen && listTypeNext(&li)) {
+            vector[j].obj = listTypeGet(&li);
             vector[j].u.score = 0;
             vector[j].u.cmpobj = NULL;
             j++;
@@ -6306,7 +7486,11 @@ static void sortCommand(redisClient *c) {
         }
 
         di = dictGetIterator(set);
-        while((setele = dictNext(di)) != NULL) {
+        while(j < vectorlen && (setele = dictNext(di)) != NULL) {
+            if (skip) {
+                skip--;
+                continue;
+            }
             vector[j].obj = dictGetEntryKey(setele);
             vector[j].u.score = 0;
             vector[j].u.cmpobj = NULL;
@@ -6354,22 +7538,19 @@ static void sortCommand(redisClient *c) {
         }
     }
 
-    /* We are ready to sort the vector... perform a bit of sanity check
-     * on the LIMIT option too. We'll use a partial version of quicksort. */
-    start = (limit_start < 0) ? 0 : limit_start;
-    end = (limit_count < 0) ? vectorlen-1 : start+limit_count-1;
-    if (start >= vectorlen) {
-        start = vectorlen-1;
-        end = vectorlen-2;
-    }
-    if (end >= vectorlen) end = vectorlen-1;
-
-    if (dontsort == 0) {
+    /* We are ready to sort the vector. When just the first elements are
+     * needed a top-K heap selection is used, or a partial version of
+     * quicksort for bigger ranges. Big numeric sorts use a radix sort. */
+    if (dontsort == 0 && end >= start) {
         server.sort_desc = desc;
         server.sort_alpha = alpha;
         server.sort_bypattern = sortby ? 1 : 0;
-        if (sortby && (start != 0 || end != vectorlen-1))
+        if (end != vectorlen-1 && (end+1) <= vectorlen/4)
+            sortTopK(vector,vectorlen,end+1);
+        else if (start != 0 || end != vectorlen-1)
             pqsort(vector,vectorlen,sizeof(redisSortObject),sortCompare, start,end);
+        else if (!alpha && vectorlen >= REDIS_SORT_RADIX_MIN)
+            sortRadix(vector,vectorlen,desc);
         else
             qsort(vector,vectorlen,sizeof(redisSortObject),sortCompare);
     }
@@ -6379,7 +7560,7 @@ static void sortCommand(redisClient *c) {
     outputlen = getop ? getop*(end-start+1) : end-start+1;
     if (storekey == NULL) {
         /* STORE option not specified, sent the sorting result to client */
-        addReplySds(c,sdscatprintf(sdsempty(),"*%d\r\n",outputlen));
+        addReplyMultiBulkLen(c,outputlen);
         for (j = start; j <= end; j++) {
             listNode *ln;
             listIter li;
@@ -6404,17 +7585,13 @@ static void sortCommand(redisClient *c) {
         }
     } else {
         robj *listObject = createListObject();
-        list *listPtr = (list*) listObject->ptr;
 
         /* STORE option specified, set the sorting result as a List object */
         for (j = start; j <= end; j++) {
             listNode *ln;
             listIter li;
 
-            if (!getop) {
-                listAddNodeTail(listPtr,vector[j].obj);
-                incrRefCount(vector[j].obj);
-            }
+            if (!getop) listTypePush(listObject,vector[j].obj,REDIS_TAIL);
             listRewind(operations,&li);
             while((ln = listNext(&li))) {
                 redisSortOperation *sop = ln->value;
@@ -6423,10 +7600,12 @@ static void sortCommand(redisClient *c) {
 
                 if (sop->type == REDIS_SORT_GET) {
                     if (!val || val->type != REDIS_STRING) {
-                        listAddNodeTail(listPtr,createStringObject("",0));
+                        robj *empty = createStringObject("",0);
+
+                        listTypePush(listObject,empty,REDIS_TAIL);
+                        decrRefCount(empty);
                     } else {
-                        listAddNodeTail(listPtr,val);
-                        incrRefCount(val);
+                        listTypePush(listObject,val,REDIS_TAIL);
                     }
                 } else {
                     redisAssert(sop->type == REDIS_SORT_GET); /* always fails */
@@ -6440,16 +7619,17 @@ static void sortCommand(redisClient *c) {
          * SORT result is empty a new key is set and maybe the old content
          * replaced. */
         server.dirty += 1+outputlen;
-        addReplySds(c,sdscatprintf(sdsempty(),":%d\r\n",outputlen));
+        addReplyLong(c,outputlen);
     }
 
     /* Cleanup */
-    decrRefCount(sortval);
     listRelease(operations);
     for (j = 0; j < vectorlen; j++) {
         if (sortby && alpha && vector[j].u.cmpobj)
             decrRefCount(vector[j].u.cmpobj);
+        if (sortval->type == REDIS_LIST) decrRefCount(vector[j].obj);
     }
+    decrRefCount(sortval);
     zfree(vector);
 }
 
@@ -6545,15 +7725,35 @@ static sds genRedisInfoString(void) {
         );
     }
     if (server.vm_enabled) {
+        unsigned long queued, processing;
+        vmExtentNode *largest = vmExtentLast(server.vm_free_bysize);
+        off_t freepages = server.vm_pages-server.vm_stats_used_pages;
+        off_t maxextent = largest ? largest->key[0] : 0;
+
+        lockIOThreads();
+        vmIOThreadsStats(&queued,&processing);
+        unlockIOThreads();
         lockThreadedIO();
         info = sdscatprintf(info,
             "vm_conf_max_memory:%llu\r\n"
             "vm_conf_page_size:%llu\r\n"
             "vm_conf_pages:%llu\r\n"
+            "vm_conf_io_engine:%s\r\n"
             "vm_stats_used_pages:%llu\r\n"
             "vm_stats_swapped_objects:%llu\r\n"
             "vm_stats_swappin_count:%llu\r\n"
             "vm_stats_swappout_count:%llu\r\n"
+            "vm_stats_free_extents:%lu\r\n"
+            "vm_stats_largest_free_extent:%llu\r\n"
+            "vm_stats_fragmentation:%.2f\r\n"
+            "vm_stats_page_allocs:%llu\r\n"
+            "vm_stats_page_alloc_failures:%llu\r\n"
+            "vm_stats_page_alloc_avg_usec:%.2f\r\n"
+            "vm_stats_page_alloc_max_usec:%llu\r\n"
+            "vm_stats_chunk_loads:%llu\r\n"
+            "vm_stats_compressed_swapouts:%llu\r\n"
+            "vm_stats_tier_memory:%llu\r\n"
+            "vm_stats_tier_stranded_memory:%llu\r\n"
             "vm_stats_io_newjobs_len:%lu\r\n"
             "vm_stats_io_processing_len:%lu\r\n"
             "vm_stats_io_processed_len:%lu\r\n"
@@ -6562,14 +7762,29 @@ static sds genRedisInfoString(void) {
             ,(unsigned long long) server.vm_max_memory,
             (unsigned long long) server.vm_page_size,
             (unsigned long long) server.vm_pages,
+            (server.vm_tier_node != -1) ? "tier" :
+            (server.vm_max_threads == 0) ? "blocking" :
+                (server.io_uring ? "uring" : "threads"),
             (unsigned long long) server.vm_stats_used_pages,
             (unsigned long long) server.vm_stats_swapped_objects,
             (unsigned long long) server.vm_stats_swapins,
             (unsigned long long) server.vm_stats_swapouts,
-            (unsigned long) listLength(server.io_newjobs),
-            (unsigned long) listLength(server.io_processing),
+            server.vm_free_byoffset->length,
+            (unsigned long long) maxextent,
+            freepages ? 100-((double)maxextent*100/freepages) : 0,
+            server.vm_stats_allocs,
+            server.vm_stats_alloc_failures,
+            server.vm_stats_allocs ?
+                (double)server.vm_stats_alloc_usec/server.vm_stats_allocs : 0,
+            server.vm_stats_alloc_max_usec,
+            server.vm_stats_chunk_loads,
+            server.vm_stats_compressed_swapouts,
+            (unsigned long long) server.vm_tier_memory,
+            server.vm_stats_tier_stranded,
+            queued,
+            processing,
             (unsigned long) listLength(server.io_processed),
-            (unsigned long) server.io_active_threads,
+            (unsigned long) server.vm_max_threads,
             (unsigned long) server.vm_blocked_clients
         );
         unlockThreadedIO();
@@ -6706,7 +7921,7 @@ static void ttlCommand(redisClient *c) {
         ttl = (int) (expire-time(NULL));
         if (ttl < 0) ttl = -1;
     }
-    addReplySds(c,sdscatprintf(sdsempty(),":%d\r\n",ttl));
+    addReplyLong(c,ttl);
 }
 
 /* ================================ MULTI/EXEC ============================== */
@@ -6778,11 +7993,13 @@ static void execCommand(redisClient *c) {
 
     orig_argv = c->argv;
     orig_argc = c->argc;
-    addReplySds(c,sdscatprintf(sdsempty(),"*%d\r\n",c->mstate.count));
+    addReplyMultiBulkLen(c,c->mstate.count);
     for (j = 0; j < c->mstate.count; j++) {
         c->argc = c->mstate.commands[j].argc;
         c->argv = c->mstate.commands[j].argv;
         call(c,c->mstate.commands[j].cmd);
+        /* The command may have dropped arguments, see pushGenericCommand() */
+        c->mstate.commands[j].argc = c->argc;
     }
     c->argv = orig_argv;
     c->argc = orig_argc;
@@ -6932,8 +8149,7 @@ static void blockingPopGenericCommand(redisClient *c, int where) {
                 addReply(c,shared.wrongtypeerr);
                 return;
             } else {
-                list *list = o->ptr;
-                if (listLength(list) != 0) {
+                if (listTypeLength(o) != 0) {
                     /* If the list contains elements fall back to the usual
                      * non-blocking POP operation */
                     robj *argv[2], **orig_argv;
@@ -7594,7 +8810,7 @@ int loadAppendOnlyFile(char *filename) {
         /* Handle swapping while loading big datasets when VM is on */
         loadedkeys++;
         if (server.vm_enabled && (loadedkeys % 5000) == 0) {
-            while (zmalloc_used_memory() > server.vm_max_memory) {
+            while (vmUsedMemory() > server.vm_max_memory) {
                 if (vmSwapOneObjectBlocking() == REDIS_ERR) break;
             }
         }
@@ -7739,18 +8955,24 @@ static int rewriteAppendOnlyFile(char *filename) {
                 if (fwriteBulkObject(fp,o) == 0) goto werr;
             } else if (o->type == REDIS_LIST) {
                 /* Emit the RPUSHes needed to rebuild the list */
-                list *list = o->ptr;
-                listNode *ln;
-                listIter li;
+                listTypeIterator li;
 
-                listRewind(list,&li);
-                while((ln = listNext(&li))) {
+                listTypeInitIterator(&li,o,0,REDIS_TAIL);
+                while(listTypeNext(&li)) {
                     char cmd[]="*3\r\n$5\r\nRPUSH\r\n";
-                    robj *eleobj = listNodeValue(ln);
 
                     if (fwrite(cmd,sizeof(cmd)-1,1,fp) == 0) goto werr;
                     if (fwriteBulkObject(fp,key) == 0) goto werr;
-                    if (fwriteBulkObject(fp,eleobj) == 0) goto werr;
+                    if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
+                        if (fwriteBulkObject(fp,listNodeValue(li.ln)) == 0)
+                            goto werr;
+                    } else {
+                        unsigned char *s;
+                        unsigned int len;
+
+                        seglistGet(&li.si,&s,&len);
+                        if (fwriteBulkString(fp,(char*)s,len) == 0) goto werr;
+                    }
                 }
             } else if (o->type == REDIS_SET) {
                 /* Emit the SADDs needed to rebuild the set */
@@ -7970,50 +9192,63 @@ static void vmInit(void) {
     int pipefds[2];
     size_t stacksize;
 
+    /* Swapping to a memory tier is synchronous, see vmTierInit() */
+    if (server.vm_tier_node != -1) server.vm_max_threads = 0;
     if (server.vm_max_threads != 0)
         zmalloc_enable_thread_safeness(); /* we need thread safe zmalloc() */
 
-    expandVmSwapFilename();
-    redisLog(REDIS_NOTICE,"Using '%s' as swap file",server.vm_swap_file);
-    if ((server.vm_fp = fopen(server.vm_swap_file,"r+b")) == NULL) {
-        server.vm_fp = fopen(server.vm_swap_file,"w+b");
-    }
-    if (server.vm_fp == NULL) {
-        redisLog(REDIS_WARNING,
-            "Impossible to open the swap file: %s. Exiting.",
-            strerror(errno));
-        exit(1);
-    }
-    server.vm_fd = fileno(server.vm_fp);
-    server.vm_next_page = 0;
-    server.vm_near_pages = 0;
+    server.vm_pool = zmalloc(sizeof(vmSwapCandidate)*REDIS_VM_POOL_SIZE);
+    server.vm_pool_len = 0;
     server.vm_stats_used_pages = 0;
     server.vm_stats_swapped_objects = 0;
     server.vm_stats_swapouts = 0;
     server.vm_stats_swapins = 0;
-    totsize = server.vm_pages*server.vm_page_size;
-    redisLog(REDIS_NOTICE,"Allocating %lld bytes of swap file",totsize);
-    if (ftruncate(server.vm_fd,totsize) == -1) {
-        redisLog(REDIS_WARNING,"Can't ftruncate swap file: %s. Exiting.",
-            strerror(errno));
-        exit(1);
+    server.vm_stats_allocs = 0;
+    server.vm_stats_alloc_failures = 0;
+    server.vm_stats_alloc_usec = 0;
+    server.vm_stats_alloc_max_usec = 0;
+    server.vm_stats_chunk_loads = 0;
+    server.vm_stats_compressed_swapouts = 0;
+    server.vm_stats_tier_stranded = 0;
+    server.vm_free_byoffset = vmExtentListCreate();
+    server.vm_free_bysize = vmExtentListCreate();
+    if (server.vm_tier_node != -1) {
+        vmTierInit();
     } else {
-        redisLog(REDIS_NOTICE,"Swap file allocated with success");
+        expandVmSwapFilename();
+        redisLog(REDIS_NOTICE,"Using '%s' as swap file",server.vm_swap_file);
+        if ((server.vm_fd = open(server.vm_swap_file,O_RDWR|O_CREAT,0644)) == -1) {
+            redisLog(REDIS_WARNING,
+                "Impossible to open the swap file: %s. Exiting.",
+                strerror(errno));
+            exit(1);
+        }
+        totsize = server.vm_pages*server.vm_page_size;
+        redisLog(REDIS_NOTICE,"Allocating %lld bytes of swap file",totsize);
+        if (ftruncate(server.vm_fd,totsize) == -1) {
+            redisLog(REDIS_WARNING,"Can't ftruncate swap file: %s. Exiting.",
+                strerror(errno));
+            exit(1);
+        } else {
+            redisLog(REDIS_NOTICE,"Swap file allocated with success");
+        }
+        server.vm_bitmap = zmalloc((server.vm_pages+7)/8);
+        redisLog(REDIS_VERBOSE,"Allocated %lld bytes page table for %lld pages",
+            (long long) (server.vm_pages+7)/8, server.vm_pages);
+        memset(server.vm_bitmap,0,(server.vm_pages+7)/8);
+        /* At startup the whole swap file is a single free extent */
+        vmAddFreeExtent(0,server.vm_pages);
     }
-    server.vm_bitmap = zmalloc((server.vm_pages+7)/8);
-    redisLog(REDIS_VERBOSE,"Allocated %lld bytes page table for %lld pages",
-        (long long) (server.vm_pages+7)/8, server.vm_pages);
-    memset(server.vm_bitmap,0,(server.vm_pages+7)/8);
 
     /* Initialize threaded I/O (used by Virtual Memory) */
-    server.io_newjobs = listCreate();
-    server.io_processing = listCreate();
+    server.io_threads = NULL;
+    server.io_threads_num = 0;
+    server.io_next_thread = 0;
+    server.io_uring = NULL;
     server.io_processed = listCreate();
     server.io_ready_clients = listCreate();
     pthread_mutex_init(&server.io_mutex,NULL);
     pthread_mutex_init(&server.obj_freelist_mutex,NULL);
-    pthread_mutex_init(&server.io_swapfile_mutex,NULL);
-    server.io_active_threads = 0;
     if (pipe(pipefds) == -1) {
         redisLog(REDIS_WARNING,"Unable to intialized VM: pipe(2): %s. Exiting."
             ,strerror(errno));
@@ -8021,18 +9256,166 @@ static void vmInit(void) {
     }
     server.io_ready_pipe_read = pipefds[0];
     server.io_ready_pipe_write = pipefds[1];
+    server.io_ready_pipe_pending = 0;
     redisAssert(anetNonBlock(NULL,server.io_ready_pipe_read) != ANET_ERR);
     /* LZF requires a lot of stack */
     pthread_attr_init(&server.io_threads_attr);
     pthread_attr_getstacksize(&server.io_threads_attr, &stacksize);
     while (stacksize < REDIS_THREAD_STACK_SIZE) stacksize *= 2;
     pthread_attr_setstacksize(&server.io_threads_attr, stacksize);
+    /* Start the I/O threads. They live as long as the server does. */
+    if (server.vm_max_threads > REDIS_VM_MAX_THREADS) {
+        redisLog(REDIS_WARNING,"vm-max-threads is too big, using %d threads",
+            REDIS_VM_MAX_THREADS);
+        server.vm_max_threads = REDIS_VM_MAX_THREADS;
+    }
+    if (server.vm_max_threads && server.vm_io_engine == REDIS_VM_IO_URING) {
+        vmUringInit();
+    } else if (server.vm_max_threads) {
+        int j;
+
+        /* Every thread may steal jobs from the others as soon as it starts,
+         * so all the queues must be ready before creating the threads. */
+        server.io_threads_num = server.vm_max_threads;
+        server.io_threads = zmalloc(sizeof(iothread)*server.io_threads_num);
+        for (j = 0; j < server.io_threads_num; j++) {
+            iothread *t = server.io_threads+j;
+
+            pthread_mutex_init(&t->mutex,NULL);
+            pthread_cond_init(&t->cond,NULL);
+            t->jobs = listCreate();
+            t->current = NULL;
+            if ((t->devnull = fopen("/dev/null","w")) == NULL ||
+                (t->fd = open(server.vm_swap_file,O_RDWR)) == -1)
+            {
+                redisLog(REDIS_WARNING,
+                    "Can't open files for the I/O threads: %s. Exiting.",
+                    strerror(errno));
+                exit(1);
+            }
+        }
+        for (j = 0; j < server.io_threads_num; j++)
+            spawnIOThread(server.io_threads+j);
+    }
     /* Listen for events in the threaded I/O pipe */
     if (aeCreateFileEvent(server.el, server.io_ready_pipe_read, AE_READABLE,
         vmThreadedIOCompletedJob, NULL) == AE_ERR)
         oom("creating file event");
 }
 
+/* Free extents index. Both the indexes are skiplists of vmExtentNode:
+ * the offset index is used to find the extents near to a freed range in
+ * order to coalesce them, while the size index is used to find the smallest
+ * free extent large enough to satisfy an allocation (best fit). All the
+ * operations are O(log N) where N is the number of free extents. */
+static vmExtentNode *vmExtentCreateNode(int level, off_t a, off_t b) {
+    vmExtentNode *n = zmalloc(sizeof(*n)+sizeof(vmExtentNode*)*level);
+
+    n->key[0] = a;
+    n->key[1] = b;
+    return n;
+}
+
+static vmExtentList *vmExtentListCreate(void) {
+    vmExtentList *l = zmalloc(sizeof(*l));
+    int j;
+
+    l->level = 1;
+    l->length = 0;
+    l->header = vmExtentCreateNode(ZSKIPLIST_MAXLEVEL,0,0);
+    for (j = 0; j < ZSKIPLIST_MAXLEVEL; j++)
+        l->header->forward[j] = NULL;
+    return l;
+}
+
+/* Return true if the key of node 'n' is less than (a,b) */
+static int vmExtentKeyLess(vmExtentNode *n, off_t a, off_t b) {
+    return n->key[0] < a || (n->key[0] == a && n->key[1] < b);
+}
+
+/* Return the first node with key >= (a,b), or NULL if there is no such node.
+ * If 'prev' is not NULL it is set to the last node with key < (a,b), or
+ * NULL if there is no such node. */
+static vmExtentNode *vmExtentSearch(vmExtentList *l, off_t a, off_t b,
+                                    vmExtentNode **prev)
+{
+    vmExtentNode *x = l->header;
+    int i;
+
+    for (i = l->level-1; i >= 0; i--) {
+        while (x->forward[i] && vmExtentKeyLess(x->forward[i],a,b))
+            x = x->forward[i];
+    }
+    if (prev) *prev = (x == l->header) ? NULL : x;
+    return x->forward[0];
+}
+
+/* Return the node with the greatest key, or NULL if the list is empty */
+static vmExtentNode *vmExtentLast(vmExtentList *l) {
+    vmExtentNode *x = l->header;
+    int i;
+
+    for (i = l->level-1; i >= 0; i--) {
+        while (x->forward[i]) x = x->forward[i];
+    }
+    return (x == l->header) ? NULL : x;
+}
+
+static void vmExtentInsert(vmExtentList *l, off_t a, off_t b) {
+    vmExtentNode *update[ZSKIPLIST_MAXLEVEL], *x = l->header;
+    int i, level;
+
+    for (i = l->level-1; i >= 0; i--) {
+        while (x->forward[i] && vmExtentKeyLess(x->forward[i],a,b))
+            x = x->forward[i];
+        update[i] = x;
+    }
+    level = zslRandomLevel();
+    if (level > ZSKIPLIST_MAXLEVEL) level = ZSKIPLIST_MAXLEVEL;
+    if (level > l->level) {
+        for (i = l->level; i < level; i++)
+            update[i] = l->header;
+        l->level = level;
+    }
+    x = vmExtentCreateNode(level,a,b);
+    for (i = 0; i < level; i++) {
+        x->forward[i] = update[i]->forward[i];
+        update[i]->forward[i] = x;
+    }
+    l->length++;
+}
+
+static void vmExtentDelete(vmExtentList *l, off_t a, off_t b) {
+    vmExtentNode *update[ZSKIPLIST_MAXLEVEL], *x = l->header;
+    int i;
+
+    for (i = l->level-1; i >= 0; i--) {
+        while (x->forward[i] && vmExtentKeyLess(x->forward[i],a,b))
+            x = x->forward[i];
+        update[i] = x;
+    }
+    x = x->forward[0];
+    redisAssert(x != NULL && x->key[0] == a && x->key[1] == b);
+    for (i = 0; i < l->level; i++) {
+        if (update[i]->forward[i] != x) break;
+        update[i]->forward[i] = x->forward[i];
+    }
+    while (l->level > 1 && l->header->forward[l->level-1] == NULL)
+        l->level--;
+    zfree(x);
+    l->length--;
+}
+
+static void vmAddFreeExtent(off_t page, off_t count) {
+    vmExtentInsert(server.vm_free_byoffset,page,count);
+    vmExtentInsert(server.vm_free_bysize,count,page);
+}
+
+static void vmDelFreeExtent(off_t page, off_t count) {
+    vmExtentDelete(server.vm_free_byoffset,page,count);
+    vmExtentDelete(server.vm_free_bysize,count,page);
+}
+
 /* Mark the page as used */
 static void vmMarkPageUsed(off_t page) {
     off_t byte = page/8;
@@ -8041,9 +9424,23 @@ static void vmMarkPageUsed(off_t page) {
     server.vm_bitmap[byte] |= 1<<bit;
 }
 
-/* Mark N contiguous pages as used, with 'page' being the first. */
+/* Mark N contiguous pages as used, with 'page' being the first.
+ * The pages must belong to a single free extent, as returned by
+ * vmFindContiguousPages(). */
 static void vmMarkPagesUsed(off_t page, off_t count) {
-    off_t j;
+    vmExtentNode *prev;
+    off_t start, len, j;
+
+    /* Find the free extent containing the pages, that is, the last one
+     * starting at or before 'page', and split it. */
+    vmExtentSearch(server.vm_free_byoffset,page+1,0,&prev);
+    redisAssert(prev != NULL && prev->key[0]+prev->key[1] >= page+count);
+    start = prev->key[0];
+    len = prev->key[1];
+    vmDelFreeExtent(start,len);
+    if (page > start) vmAddFreeExtent(start,page-start);
+    if (start+len > page+count)
+        vmAddFreeExtent(page+count,(start+len)-(page+count));
 
     for (j = 0; j < count; j++)
         vmMarkPageUsed(page+j);
@@ -8060,14 +9457,29 @@ static void vmMarkPageFree(off_t page) {
     server.vm_bitmap[byte] &= ~(1<<bit);
 }
 
-/* Mark N contiguous pages as free, with 'page' being the first. */
+/* Mark N contiguous pages as free, with 'page' being the first.
+ * The pages are coalesced with the adjacent free extents, if any. */
 static void vmMarkPagesFree(off_t page, off_t count) {
-    off_t j;
+    vmExtentNode *prev, *next;
+    off_t start = page, len = count, j;
 
     for (j = 0; j < count; j++)
         vmMarkPageFree(page+j);
-    server.vm_stats_used_pages -= count;
-    redisLog(REDIS_DEBUG,"Mark FREE pages: %lld pages at %lld\n",
+
+    next = vmExtentSearch(server.vm_free_byoffset,page,0,&prev);
+    if (next && next->key[0] == page+count) {
+        len += next->key[1];
+        vmDelFreeExtent(next->key[0],next->key[1]);
+    }
+    if (prev && prev->key[0]+prev->key[1] == page) {
+        start = prev->key[0];
+        len += prev->key[1];
+        vmDelFreeExtent(prev->key[0],prev->key[1]);
+    }
+    vmAddFreeExtent(start,len);
+
+    server.vm_stats_used_pages -= count;
+    redisLog(REDIS_DEBUG,"Mark FREE pages: %lld pages at %lld\n",
         (long long)count, (long long)page);
 }
 
@@ -8082,88 +9494,241 @@ static int vmFreePage(off_t page) {
  * Returns REDIS_OK if it was able to find N contiguous pages, otherwise 
  * REDIS_ERR is returned.
  *
- * This function uses a simple algorithm: we try to allocate
- * REDIS_VM_MAX_NEAR_PAGES sequentially, when we reach this limit we start
- * again from the start of the swap file searching for free spaces.
- *
- * If it looks pretty clear that there are no free pages near our offset
- * we try to find less populated places doing a forward jump of
- * REDIS_VM_MAX_RANDOM_JUMP, then we start scanning again a few pages
- * without hurry, and then we jump again and so forth...
- * 
- * This function can be improved using a free list to avoid to guess
- * too much, since we could collect data about freed pages.
+ * We use the smallest free extent that is large enough (best fit), taking
+ * the one with the lower offset if there are many of the same size. This
+ * keeps large extents available for large objects, and allocates pages
+ * sequentially from the start of the swap file while it is not fragmented.
  *
- * note: I implemented this function just after watching an episode of
- * Battlestar Galactica, where the hybrid was continuing to say "JUMP!"
- */
+ * Note that the pages are not marked as used: the caller will do it with
+ * vmMarkPagesUsed() once it is sure the pages are going to be used. */
 static int vmFindContiguousPages(off_t *first, off_t n) {
-    off_t base, offset = 0, since_jump = 0, numfree = 0;
-
-    if (server.vm_near_pages == REDIS_VM_MAX_NEAR_PAGES) {
-        server.vm_near_pages = 0;
-        server.vm_next_page = 0;
+    vmExtentNode *x;
+    long long start = ustime(), elapsed;
+
+    x = vmExtentSearch(server.vm_free_bysize,n,0,NULL);
+    elapsed = ustime()-start;
+    server.vm_stats_allocs++;
+    server.vm_stats_alloc_usec += elapsed;
+    if ((unsigned long long) elapsed > server.vm_stats_alloc_max_usec)
+        server.vm_stats_alloc_max_usec = elapsed;
+    if (x == NULL) {
+        server.vm_stats_alloc_failures++;
+        return REDIS_ERR;
     }
-    server.vm_near_pages++; /* Yet another try for pages near to the old ones */
-    base = server.vm_next_page;
-
-    while(offset < server.vm_pages) {
-        off_t this = base+offset;
+    *first = x->key[1];
+    redisLog(REDIS_DEBUG, "FOUND CONTIGUOUS PAGES: %lld pages at %lld\n", (long long) n, (long long) *first);
+    return REDIS_OK;
+}
 
-        /* If we overflow, restart from page zero */
-        if (this >= server.vm_pages) {
-            this -= server.vm_pages;
-            if (this == 0) {
-                /* Just overflowed, what we found on tail is no longer
-                 * interesting, as it's no longer contiguous. */
-                numfree = 0;
+/* Return the number of elements of 'o' if it should be swapped in chunks,
+ * otherwise zero. Zipmap encoded hashes are small by definition, and sorted
+ * sets are not chunked as they are not accessed by hash nor by position.
+ *
+ * Chunks are read synchronously by the main thread, see vmOpenChunks(), so
+ * objects are only chunked when the VM is in blocking mode: with I/O threads
+ * or io_uring the main thread must not wait for the disk, and commands just
+ * load the whole value in background. */
+static unsigned long vmChunkedObjectLen(robj *o) {
+    unsigned long len = 0;
+
+    if (server.vm_chunk_entries == 0 || server.vm_max_threads != 0) return 0;
+    if (o->type == REDIS_LIST)
+        len = listTypeLength(o);
+    else if (o->type == REDIS_SET ||
+             (o->type == REDIS_HASH && o->encoding == REDIS_ENCODING_HT))
+        len = dictSize((dict*)o->ptr);
+    return (len > server.vm_chunk_entries) ? len : 0;
+}
+
+/* Like rdbSaveObject() for big lists, sets and hashes, but building the chunk
+ * index of the object as well. The output is exactly the same, so the object
+ * can still be loaded as a whole with rdbLoadObject(). */
+static int vmSaveChunkedObject(FILE *fp, robj *o, unsigned long len,
+                               vmChunkIndex **chunks)
+{
+    unsigned long entries = server.vm_chunk_entries, j = 0;
+    vmChunkIndex *ci;
+
+    ci = zmalloc(sizeof(*ci)+
+                 sizeof(struct vmChunk)*((len+entries-1)/entries));
+    ci->entries = entries;
+    ci->elements = len;
+    ci->mask = 0;
+    ci->chunks = 0;
+    if (rdbSaveLen(fp,len) == -1) goto werr;
+    if (o->type == REDIS_LIST) {
+        listTypeIterator li;
+
+        listTypeInitIterator(&li,o,0,REDIS_TAIL);
+        while(listTypeNext(&li)) {
+            if ((j++ % entries) == 0) {
+                ci->chunk[ci->chunks].offset = ftello(fp);
+                ci->chunk[ci->chunks].bucket = 0;
+                ci->chunks++;
             }
+            if (rdbSaveListTypeElement(fp,&li) == -1) goto werr;
         }
-        if (vmFreePage(this)) {
-            /* This is a free page */
-            numfree++;
-            /* Already got N free pages? Return to the caller, with success */
-            if (numfree == n) {
-                *first = this-(n-1);
-                server.vm_next_page = this+1;
-                redisLog(REDIS_DEBUG, "FOUND CONTIGUOUS PAGES: %lld pages at %lld\n", (long long) n, (long long) *first);
-                return REDIS_OK;
+    } else {
+        dict *d = o->ptr;
+        dictIterator *di = dictGetIterator(d);
+        dictEntry *de;
+
+        ci->mask = d->sizemask;
+        while((de = dictNext(di)) != NULL) {
+            robj *ele = dictGetEntryKey(de);
+
+            if ((j++ % entries) == 0) {
+                ci->chunk[ci->chunks].offset = ftello(fp);
+                ci->chunk[ci->chunks].bucket = dictHashKey(d,ele) & d->sizemask;
+                ci->chunks++;
+            }
+            if (rdbSaveStringObject(fp,ele) == -1 ||
+                (o->type == REDIS_HASH &&
+                 rdbSaveStringObject(fp,dictGetEntryVal(de)) == -1))
+            {
+                dictReleaseIterator(di);
+                goto werr;
             }
-        } else {
-            /* The current one is not a free page */
-            numfree = 0;
-        }
-
-        /* Fast-forward if the current page is not free and we already
-         * searched enough near this place. */
-        since_jump++;
-        if (!numfree && since_jump >= REDIS_VM_MAX_RANDOM_JUMP/4) {
-            offset += random() % REDIS_VM_MAX_RANDOM_JUMP;
-            since_jump = 0;
-            /* Note that even if we rewind after the jump, we are don't need
-             * to make sure numfree is set to zero as we only jump *if* it
-             * is set to zero. */
-        } else {
-            /* Otherwise just check the next page */
-            offset++;
         }
+        dictReleaseIterator(di);
     }
-    return REDIS_ERR;
+    ci->len = ftello(fp);
+    *chunks = ci;
+    return 0;
+
+werr:
+    zfree(ci);
+    return -1;
 }
 
-/* Write the specified object at the specified page of the swap file */
-static int vmWriteObjectOnSwap(robj *o, off_t page) {
-    if (server.vm_enabled) pthread_mutex_lock(&server.io_swapfile_mutex);
-    if (fseeko(server.vm_fp,page*server.vm_page_size,SEEK_SET) == -1) {
-        if (server.vm_enabled) pthread_mutex_unlock(&server.io_swapfile_mutex);
+/* Serialize the object in a memory buffer, allocated by open_memstream():
+ * the caller should release it with free(). On error *buf is set to NULL.
+ *
+ * If 'chunks' is not NULL it is set to the chunk index of the object if it
+ * is big enough to be swapped in chunks, otherwise to NULL. */
+static int vmSerializeObject(robj *o, char **buf, size_t *len,
+                             vmChunkIndex **chunks)
+{
+    FILE *fp;
+    unsigned long elements = chunks ? vmChunkedObjectLen(o) : 0;
+    int retval;
+
+    if (chunks) *chunks = NULL;
+    if ((fp = open_memstream(buf,len)) == NULL) return REDIS_ERR;
+    if (elements)
+        retval = vmSaveChunkedObject(fp,o,elements,chunks);
+    else
+        retval = rdbSaveObject(fp,o);
+    if (retval == -1) {
+        fclose(fp);
+        free(*buf);
+        *buf = NULL;
+        *len = 0;
+        return REDIS_ERR;
+    }
+    fclose(fp);
+    return REDIS_OK;
+}
+
+/* Compress the serialized object in *buf (*len bytes) if vm-compression is
+ * enabled and this saves at least a page of the swap file. On success *buf
+ * and *len are replaced by the compressed data prefixed by its
+ * vmCompressedHeader, and 1 is returned, otherwise 0 is returned and
+ * nothing is changed. The new buffer is released with free() as well.
+ *
+ * This is called by the I/O threads, so no server state is modified. */
+static int vmCompressObject(char **buf, size_t *len) {
+    size_t pages = (*len+(server.vm_page_size-1))/server.vm_page_size;
+    size_t outlen;
+    vmCompressedHeader *h;
+    char *out;
+
+    if (!server.vm_compression || pages <= 1 || *len > UINT32_MAX) return 0;
+    outlen = (pages-1)*server.vm_page_size;
+    if (outlen <= sizeof(*h)) return 0;
+    if ((out = malloc(outlen)) == NULL) return 0;
+    h = (vmCompressedHeader*) out;
+    h->clen = lzf_compress(*buf,*len,out+sizeof(*h),outlen-sizeof(*h));
+    if (h->clen == 0) {
+        free(out);
+        return 0;
+    }
+    h->len = *len;
+    free(*buf);
+    *buf = out;
+    *len = sizeof(*h)+h->clen;
+    return 1;
+}
+
+/* Serialize the object like vmSerializeObject(), then compress it if
+ * possible. *compressed is set to true if the object was compressed. */
+static int vmEncodeObject(robj *o, char **buf, size_t *len,
+                          vmChunkIndex **chunks, int *compressed)
+{
+    if (vmSerializeObject(o,buf,len,chunks) == REDIS_ERR) return REDIS_ERR;
+    *compressed = (*chunks == NULL) && vmCompressObject(buf,len);
+    return REDIS_OK;
+}
+
+/* Read (or write if 'write' is true) 'len' bytes at 'offset' of the swap
+ * file with pread(2) / pwrite(2). Returns REDIS_ERR on I/O error, or if
+ * the file is too short. */
+static int vmPositionalIO(int fd, void *buf, size_t len, off_t offset,
+                          int write)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = write ?
+            pwrite(fd,(char*)buf+done,len-done,offset+done) :
+            pread(fd,(char*)buf+done,len-done,offset+done);
+
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO; /* premature end of file */
+            return REDIS_ERR;
+        }
+        done += n;
+    }
+    return REDIS_OK;
+}
+
+/* Write an object already serialized (and possibly compressed) in 'buf' at
+ * the specified page of the swap file, using the file descriptor 'fd'. */
+static int vmWriteBufferOnSwap(int fd, void *buf, size_t len, off_t page) {
+    if (vmPositionalIO(fd,buf,len,page*server.vm_page_size,1) == REDIS_ERR) {
         redisLog(REDIS_WARNING,
-            "Critical VM problem in vmWriteObjectOnSwap(): can't seek: %s",
+            "Critical VM problem in vmWriteObjectOnSwap(): can't write: %s",
             strerror(errno));
         return REDIS_ERR;
     }
-    rdbSaveObject(server.vm_fp,o);
-    fflush(server.vm_fp);
-    if (server.vm_enabled) pthread_mutex_unlock(&server.io_swapfile_mutex);
+    return REDIS_OK;
+}
+
+/* Write the specified object at the specified page of the swap file, using
+ * the file descriptor 'fd'. The object is serialized in memory and then
+ * written with pwrite(2): no lock is needed, and different threads can
+ * write different pages of the swap file at the same time.
+ *
+ * The chunk index of the object, if any, is returned in *chunks. */
+static int vmWriteObjectOnSwap(int fd, robj *o, off_t page,
+                               vmChunkIndex **chunks)
+{
+    char *buf;
+    size_t len;
+
+    if (vmSerializeObject(o,&buf,&len,chunks) == REDIS_ERR) {
+        redisLog(REDIS_WARNING,
+            "Critical VM problem in vmWriteObjectOnSwap(): can't serialize: %s",
+            strerror(errno));
+        return REDIS_ERR;
+    }
+    if (vmWriteBufferOnSwap(fd,buf,len,page) == REDIS_ERR) {
+        free(buf);
+        zfree(*chunks);
+        return REDIS_ERR;
+    }
+    free(buf); /* allocated by open_memstream(), not zmalloc() */
     return REDIS_OK;
 }
 
@@ -8172,15 +9737,36 @@ static int vmWriteObjectOnSwap(robj *o, off_t page) {
  * If we can't find enough contiguous empty pages to swap the object on disk
  * REDIS_ERR is returned. */
 static int vmSwapObjectBlocking(robj *key, robj *val) {
-    off_t pages = rdbSavedObjectPages(val,NULL);
-    off_t page;
+    off_t pages, page;
+    vmChunkIndex *chunks;
+    char *buf;
+    size_t len;
+    int compressed;
 
     assert(key->storage == REDIS_VM_MEMORY);
     assert(key->refcount == 1);
-    if (vmFindContiguousPages(&page,pages) == REDIS_ERR) return REDIS_ERR;
-    if (vmWriteObjectOnSwap(val,page) == REDIS_ERR) return REDIS_ERR;
+    if (server.vm_tier_node != -1) return vmTierSwapObject(key,val);
+    if (vmEncodeObject(val,&buf,&len,&chunks,&compressed) == REDIS_ERR) {
+        redisLog(REDIS_WARNING,
+            "Critical VM problem in vmSwapObjectBlocking(): can't serialize: %s",
+            strerror(errno));
+        return REDIS_ERR;
+    }
+    pages = (len+(server.vm_page_size-1))/server.vm_page_size;
+    if (vmFindContiguousPages(&page,pages) == REDIS_ERR ||
+        vmWriteBufferOnSwap(server.vm_fd,buf,len,page) == REDIS_ERR)
+    {
+        free(buf);
+        zfree(chunks);
+        return REDIS_ERR;
+    }
+    free(buf);
     key->vm.page = page;
     key->vm.usedpages = pages;
+    key->vm.chunks = chunks;
+    key->vm.vlen = objectLength(val);
+    key->vm.compressed = compressed;
+    if (compressed) server.vm_stats_compressed_swapouts++;
     key->storage = REDIS_VM_SWAPPED;
     key->vtype = val->type;
     decrRefCount(val); /* Deallocate the object from memory. */
@@ -8193,22 +9779,60 @@ static int vmSwapObjectBlocking(robj *key, robj *val) {
     return REDIS_OK;
 }
 
-static robj *vmReadObjectFromSwap(off_t page, int type) {
-    robj *o;
+/* Load an object of the specified type from the swap file pages read in
+ * 'buf', decompressing it first if 'compressed' is true. On error the
+ * process is terminated, as the swap file is corrupted. */
+static robj *vmLoadObjectFromBuffer(void *buf, size_t len, int type,
+                                    int compressed)
+{
+    void *raw = NULL;
+    robj *o = NULL;
+    FILE *fp;
 
-    if (server.vm_enabled) pthread_mutex_lock(&server.io_swapfile_mutex);
-    if (fseeko(server.vm_fp,page*server.vm_page_size,SEEK_SET) == -1) {
-        redisLog(REDIS_WARNING,
-            "Unrecoverable VM problem in vmReadObjectFromSwap(): can't seek: %s",
-            strerror(errno));
-        _exit(1);
+    if (compressed) {
+        vmCompressedHeader *h = buf;
+
+        errno = EINVAL;
+        if (h->clen > len-sizeof(*h)) goto corrupted;
+        raw = zmalloc(h->len);
+        if (lzf_decompress((char*)buf+sizeof(*h),h->clen,raw,h->len) !=
+            h->len) goto corrupted;
+        len = h->len;
+        buf = raw;
+    }
+    if ((fp = fmemopen(buf,len,"r")) != NULL) {
+        o = rdbLoadObject(type,fp);
+        fclose(fp);
     }
-    o = rdbLoadObject(type,server.vm_fp);
+
+corrupted:
+    zfree(raw);
     if (o == NULL) {
         redisLog(REDIS_WARNING, "Unrecoverable VM problem in vmReadObjectFromSwap(): can't load object from swap file: %s", strerror(errno));
         _exit(1);
     }
-    if (server.vm_enabled) pthread_mutex_unlock(&server.io_swapfile_mutex);
+    return o;
+}
+
+/* Read the object of type 'type' stored at 'page' (using 'pages' pages) from
+ * the swap file, using the file descriptor 'fd'. Like vmWriteObjectOnSwap()
+ * this is lock free: the pages are read with pread(2) and the object is
+ * loaded from the memory buffer. */
+static robj *vmReadObjectFromSwap(int fd, off_t page, off_t pages, int type,
+                                  int compressed)
+{
+    size_t len = pages*server.vm_page_size;
+    unsigned char *buf = zmalloc(len);
+    robj *o;
+
+    if (vmPositionalIO(fd,buf,len,page*server.vm_page_size,0) == REDIS_ERR) {
+        redisLog(REDIS_WARNING,
+            "Unrecoverable VM problem in vmReadObjectFromSwap(): can't read: %s",
+            strerror(errno));
+        _exit(1);
+    }
+    o = vmLoadObjectFromBuffer(buf,len,type,compressed);
+    zfree(buf);
     return o;
 }
 
@@ -8221,11 +9845,18 @@ static robj *vmGenericLoadObject(robj *key, int preview) {
     robj *val;
 
     redisAssert(key->storage == REDIS_VM_SWAPPED || key->storage == REDIS_VM_LOADING);
-    val = vmReadObjectFromSwap(key->vm.page,key->vtype);
+    if (server.vm_tier_node != -1)
+        val = vmTierLoadObject(key,preview);
+    else
+        val = vmReadObjectFromSwap(server.vm_fd,key->vm.page,
+                    key->vm.usedpages,key->vtype,key->vm.compressed);
     if (!preview) {
         key->storage = REDIS_VM_MEMORY;
         key->vm.atime = server.unixtime;
-        vmMarkPagesFree(key->vm.page,key->vm.usedpages);
+        if (server.vm_tier_node == -1)
+            vmMarkPagesFree(key->vm.page,key->vm.usedpages);
+        zfree(key->vm.chunks);
+        key->vm.chunks = NULL;
         redisLog(REDIS_DEBUG, "VM: object %s loaded from disk",
             (unsigned char*) key->ptr);
         server.vm_stats_swapped_objects--;
@@ -8254,26 +9885,354 @@ static robj *vmPreviewObject(robj *key) {
     return vmGenericLoadObject(key,1);
 }
 
-/* How a good candidate is this object for swapping?
- * The better candidate it is, the greater the returned value.
+/* ===================== Virtual Memory - Memory tier ======================= */
+
+/* With vm-tier-node set, values are not serialized into a swap file: they
+ * are swapped out migrating their memory to a far NUMA node, like a CXL
+ * memory expander, with move_pages(2). The swapped value is referenced by
+ * key->vm.tierval and stays valid where it is. Loading it just means moving
+ * its memory back to the nearest node. As there is no I/O at all, swapping
+ * is synchronous: no I/O threads are started and no swap file is created.
  *
- * Currently we try to perform a fast estimation of the object size in
- * memory, and combine it with aging informations.
+ * move_pages(2) moves whole pages, while small allocations share their
+ * pages with other keys: only the pages lying entirely inside one of the
+ * allocations of the value are moved, and a value without any such page,
+ * like one smaller than a page, is never swapped. So the tier works well
+ * for big strings, lists and hash tables, less for values made of many
+ * small allocations, whose memory mostly stays where it is.
  *
- * Basically swappability = idle-time * log(estimated size)
+ * Memory migrated to the tier node is still accounted by zmalloc, so the
+ * vm-max-memory limit is checked against vmUsedMemory(). */
+
+static void vmTierInit(void) {
+    if (!zmalloc_numa_node_available(server.vm_tier_node)) {
+        redisLog(REDIS_WARNING,
+            "vm-tier-node %d is not an available NUMA node. Exiting.",
+            server.vm_tier_node);
+        exit(1);
+    }
+    server.vm_fd = -1;
+    server.vm_tier_memory = 0;
+    redisLog(REDIS_NOTICE,"Swapping values to NUMA node %d",
+        server.vm_tier_node);
+}
+
+/* Memory used by the dataset for the vm-max-memory limit: values swapped
+ * to the tier node are not counted. */
+static size_t vmUsedMemory(void) {
+    return zmalloc_used_memory()-server.vm_tier_memory;
+}
+
+static void vmTierQueueDict(zmalloc_move_batch *b, dict *d, int objkeys,
+                            int objvals);
+
+/* Add all the memory of the object 'o' to the batch of allocations to move
+ * to another NUMA node. */
+static void vmTierQueueObject(zmalloc_move_batch *b, robj *o) {
+    zmalloc_move_batch_add(b,o);
+
+    switch(o->type) {
+    case REDIS_STRING:
+        if (o->encoding == REDIS_ENCODING_RAW)
+            zmalloc_move_batch_add(b,(char*)o->ptr-sizeof(struct sdshdr));
+        break;
+    case REDIS_LIST:
+        if (o->encoding == REDIS_ENCODING_LINKEDLIST) {
+            list *l = o->ptr;
+            listNode *ln;
+            listIter li;
+
+            zmalloc_move_batch_add(b,l);
+            listRewind(l,&li);
+            while((ln = listNext(&li))) {
+                zmalloc_move_batch_add(b,ln);
+                vmTierQueueObject(b,listNodeValue(ln));
+            }
+        } else {
+            seglist *sl = o->ptr;
+            seglistSegment *seg;
+
+            zmalloc_move_batch_add(b,sl);
+            for (seg = sl->head; seg; seg = seg->next)
+                zmalloc_move_batch_add(b,seg);
+        }
+        break;
+    case REDIS_SET:
+        vmTierQueueDict(b,o->ptr,1,0);
+        break;
+    case REDIS_ZSET: {
+        zset *zs = o->ptr;
+        zskiplistNode *zn = zs->zsl->header;
+
+        /* Elements are shared by the dict and the skiplist, and the dict
+         * values are the scores, allocated one by one. */
+        zmalloc_move_batch_add(b,zs);
+        zmalloc_move_batch_add(b,zs->zsl);
+        vmTierQueueDict(b,zs->dict,1,0);
+        while(zn) {
+            zmalloc_move_batch_add(b,zn);
+            if (zn->obj) {
+                dictEntry *de = dictFind(zs->dict,zn->obj);
+
+                zmalloc_move_batch_add(b,dictGetEntryVal(de));
+            }
+            zn = zn->level[0].forward;
+        }
+        break;
+    }
+    case REDIS_HASH:
+        if (o->encoding == REDIS_ENCODING_ZIPMAP)
+            zmalloc_move_batch_add(b,o->ptr);
+        else
+            vmTierQueueDict(b,o->ptr,1,1);
+        break;
+    default:
+        redisAssert(0);
+    }
+}
+
+/* Add a dict, its table and entries to the batch, and the keys and values as
+ * well if 'objkeys' / 'objvals' are true (that is, they are objects). */
+static void vmTierQueueDict(zmalloc_move_batch *b, dict *d, int objkeys,
+                            int objvals)
+{
+    dictIterator *di = dictGetIterator(d);
+    dictEntry *de;
+
+    zmalloc_move_batch_add(b,d);
+    zmalloc_move_batch_add(b,d->table);
+    while((de = dictNext(di)) != NULL) {
+        zmalloc_move_batch_add(b,de);
+        if (objkeys) vmTierQueueObject(b,dictGetEntryKey(de));
+        if (objvals) vmTierQueueObject(b,dictGetEntryVal(de));
+    }
+    dictReleaseIterator(di);
+}
+
+/* Move the whole pages of the object 'o' to the NUMA node 'node' with a
+ * single move_pages(2) call. Returns the bytes of the pages that are now on
+ * 'node': pages the kernel could not migrate stay where they are, and are
+ * not accounted as moved. The bytes of all the pages of the object are
+ * stored in *total. */
+static size_t vmTierMoveObject(robj *o, int node, size_t *total) {
+    zmalloc_move_batch *b = zmalloc_move_batch_create(node);
+
+    vmTierQueueObject(b,o);
+    return zmalloc_move_batch_commit(b,total);
+}
+
+/* Swap out 'val' moving it to the tier node. Like vmSwapObjectBlocking()
+ * the caller should then set the value in the DB to NULL, but the object is
+ * not released: its reference is now owned by the key. If no page of the
+ * value could be moved REDIS_ERR is returned and the value is left as it
+ * is. */
+static int vmTierSwapObject(robj *key, robj *val) {
+    size_t total, moved;
+
+    moved = vmTierMoveObject(val,server.vm_tier_node,&total);
+    if (moved == 0) return REDIS_ERR;
+    key->vm.usedpages = moved;
+    key->vm.page = 0;
+    key->vm.chunks = NULL;
+    key->vm.vlen = objectLength(val);
+    key->vm.compressed = 0;
+    key->vm.tierval = val;
+    key->storage = REDIS_VM_SWAPPED;
+    key->vtype = val->type;
+    server.vm_tier_memory += key->vm.usedpages;
+    redisLog(REDIS_DEBUG,"VM: object %s moved to NUMA node %d (%lld bytes)",
+        (unsigned char*) key->ptr, server.vm_tier_node,
+        (long long) key->vm.usedpages);
+    server.vm_stats_swapped_objects++;
+    server.vm_stats_swapouts++;
+    return REDIS_OK;
+}
+
+/* Return the value swapped to the tier node, moving it back to the nearest
+ * node. If 'preview' is true the value is just returned with an additional
+ * reference, see vmGenericLoadObject(). */
+static robj *vmTierLoadObject(robj *key, int preview) {
+    robj *val = key->vm.tierval;
+    size_t total, moved;
+
+    if (preview) {
+        incrRefCount(val);
+        return val;
+    }
+    /* Pages the kernel can't move back stay on the tier node, or wherever
+     * they are: the value is usable anyway, just slower to access. */
+    moved = vmTierMoveObject(val,zmalloc_get_current_numa_node(),&total);
+    if (moved < total) {
+        server.vm_stats_tier_stranded += total-moved;
+        redisLog(REDIS_VERBOSE,
+            "VM: %lld bytes of %s could not be moved back from NUMA node %d",
+            (long long) (total-moved), (unsigned char*) key->ptr,
+            server.vm_tier_node);
+    }
+    server.vm_tier_memory -= key->vm.usedpages;
+    key->vm.tierval = NULL;
+    return val;
+}
+
+/* Release the value swapped to the tier node, as the key is deleted */
+static void vmTierFreeObject(robj *key) {
+    server.vm_tier_memory -= key->vm.usedpages;
+    decrRefCount(key->vm.tierval);
+    key->vm.tierval = NULL;
+}
+
+/* ======================= Virtual Memory - Chunked objects ================== */
+
+/* Return the key object if 'key' is swapped out as a chunked object, so that
+ * commands accessing a few elements can read just the chunks they need
+ * instead of loading the whole value. Otherwise NULL is returned. */
+static robj *vmChunkedKey(redisDb *db, robj *key) {
+    struct dictEntry *de;
+    robj *o;
+
+    if (!server.vm_enabled) return NULL;
+    if ((de = dictFind(db->dict,key)) == NULL) return NULL;
+    o = dictGetEntryKey(de);
+    if (o->storage != REDIS_VM_SWAPPED || o->vm.chunks == NULL) return NULL;
+    return o;
+}
+
+/* Like vmChunkedKey() but expiring the key if needed, like lookupKeyRead() */
+static robj *vmChunkedKeyRead(redisDb *db, robj *key) {
+    if (!server.vm_enabled) return NULL;
+    expireIfNeeded(db,key);
+    return vmChunkedKey(db,key);
+}
+
+/* Read the chunks from 'first' to 'last' of the swapped object of 'key'.
+ * The returned stream is positioned at the first element of 'first', the
+ * caller should fclose() it and zfree() *buf. */
+static FILE *vmOpenChunks(robj *key, unsigned long first, unsigned long last,
+                          void **buf)
+{
+    vmChunkIndex *ci = key->vm.chunks;
+    off_t start = ci->chunk[first].offset;
+    off_t end = (last+1 < ci->chunks) ? ci->chunk[last+1].offset : ci->len;
+    FILE *fp;
+
+    *buf = zmalloc(end-start);
+    if (vmPositionalIO(server.vm_fd,*buf,end-start,
+            key->vm.page*server.vm_page_size+start,0) == REDIS_ERR ||
+        (fp = fmemopen(*buf,end-start,"r")) == NULL)
+    {
+        redisLog(REDIS_WARNING,
+            "Unrecoverable VM problem in vmOpenChunks(): can't read: %s",
+            strerror(errno));
+        _exit(1);
+    }
+    server.vm_stats_chunk_loads++;
+    return fp;
+}
+
+/* Load the next element from a stream returned by vmOpenChunks() */
+static robj *vmLoadChunkElement(FILE *fp) {
+    robj *o = rdbLoadStringObject(fp);
+
+    if (o == NULL) {
+        redisLog(REDIS_WARNING,
+            "Unrecoverable VM problem in vmLoadChunkElement(): "
+            "swap file corrupted");
+        _exit(1);
+    }
+    return o;
+}
+
+/* Return the element at 'index' of the chunked swapped list of 'key' as a
+ * new object, or NULL if the index is out of range. */
+static robj *vmChunkedListIndex(robj *key, long index) {
+    vmChunkIndex *ci = key->vm.chunks;
+    unsigned long c, j;
+    robj *ele = NULL;
+    void *buf;
+    FILE *fp;
+
+    if (index < 0) index += ci->elements;
+    if (index < 0 || (unsigned long) index >= ci->elements) return NULL;
+    c = index/ci->entries;
+    fp = vmOpenChunks(key,c,c,&buf);
+    for (j = c*ci->entries; j <= (unsigned long) index; j++) {
+        if (ele) decrRefCount(ele);
+        ele = vmLoadChunkElement(fp);
+    }
+    fclose(fp);
+    zfree(buf);
+    return ele;
+}
+
+/* Search 'field' in the chunked swapped set or hash of 'key'. Returns 1 if
+ * the field was found, otherwise 0. For hashes, if 'val' is not NULL, the
+ * associated value is returned in *val as a new object.
  *
- * Bigger objects are preferred over smaller objects, but not
- * proportionally, this is why we use the logarithm. This algorithm is
- * just a first try and will probably be tuned later. */
-static double computeObjectSwappability(robj *o) {
-    time_t age = server.unixtime - o->vm.atime;
-    long asize = 0;
+ * Only the chunks covering the bucket of the field are read. As a bucket can
+ * span two chunks, the chunk starting with the same bucket is read as well. */
+static int vmChunkedLookup(robj *key, robj *field, robj **val) {
+    vmChunkIndex *ci = key->vm.chunks;
+    unsigned long bucket = dictEncObjHash(field) & ci->mask;
+    unsigned long first, last, j, count;
+    long lo = 0, hi = ci->chunks-1;
+    int found = 0, hash = (key->vtype == REDIS_HASH);
+    void *buf;
+    FILE *fp;
+
+    /* Find the last chunk starting at a bucket <= 'bucket' */
+    if (ci->chunk[0].bucket > bucket) return 0;
+    while (lo < hi) {
+        long mid = (lo+hi+1)/2;
+
+        if (ci->chunk[mid].bucket <= bucket)
+            lo = mid;
+        else
+            hi = mid-1;
+    }
+    last = first = lo;
+    while (first > 0 && ci->chunk[first].bucket == bucket) first--;
+
+    fp = vmOpenChunks(key,first,last,&buf);
+    count = (last+1)*ci->entries;
+    if (count > ci->elements) count = ci->elements;
+    count -= first*ci->entries;
+    for (j = 0; j < count && !found; j++) {
+        robj *ele = vmLoadChunkElement(fp);
+        robj *v = hash ? vmLoadChunkElement(fp) : NULL;
+
+        if (dictEncObjKeyCompare(NULL,ele,field)) {
+            found = 1;
+            if (val && v) {
+                *val = v;
+                v = NULL;
+            }
+        }
+        decrRefCount(ele);
+        if (v) decrRefCount(v);
+    }
+    fclose(fp);
+    zfree(buf);
+    return found;
+}
+
+/* Preload the key of commands able to read single chunks of swapped objects
+ * (LINDEX, SISMEMBER, HGET): if the key is swapped in chunks it is not
+ * loaded at all. */
+static void chunkedBlockClientOnSwappedKeys(redisClient *c) {
+    if (vmChunkedKey(c->db,c->argv[1]) == NULL)
+        waitForSwappedKey(c,c->argv[1]);
+}
+
+/* Fast estimation of the memory used by an object. Collections are
+ * estimated multiplying the size of a single element by the number of
+ * elements. */
+static size_t estimateObjectSize(robj *o) {
+    size_t asize = 0;
     list *l;
     dict *d;
     struct dictEntry *de;
     int z;
 
-    if (age <= 0) return 0;
     switch(o->type) {
     case REDIS_STRING:
         if (o->encoding != REDIS_ENCODING_RAW) {
@@ -8283,6 +10242,10 @@ static double computeObjectSwappability(robj *o) {
         }
         break;
     case REDIS_LIST:
+        if (o->encoding == REDIS_ENCODING_SEGLIST) {
+            asize = seglistBytes((seglist*)o->ptr);
+            break;
+        }
         l = o->ptr;
         listNode *ln = listFirst(l);
 
@@ -8308,31 +10271,118 @@ static double computeObjectSwappability(robj *o) {
             long elesize;
             robj *ele;
 
-            de = dictGetRandomKey(d);
-            ele = dictGetEntryKey(de);
+            /* Sorted sets have a cheap first element: the skiplist head.
+             * Sets need a random bucket scan. */
+            if (z) {
+                ele = ((zset*)o->ptr)->zsl->header->level[0].forward->obj;
+            } else {
+                de = dictGetRandomKey(d);
+                ele = dictGetEntryKey(de);
+            }
             elesize = (ele->encoding == REDIS_ENCODING_RAW) ?
                             (sizeof(*o)+sdslen(ele->ptr)) :
                             sizeof(*o);
             asize += (sizeof(struct dictEntry)+elesize)*dictSize(d);
-            if (z) asize += sizeof(zskiplistNode)*dictSize(d);
+            /* Skiplist nodes have 1/(1-ZSKIPLIST_P) levels on average */
+            if (z) asize += (sizeof(zskiplistNode)+
+                             sizeof(struct zskiplistLevel)*4/3)*dictSize(d);
+        }
+        break;
+    case REDIS_HASH:
+        if (o->encoding == REDIS_ENCODING_ZIPMAP) {
+            asize = sizeof(*o)+zipmapBlobLen(o->ptr);
+        } else {
+            d = o->ptr;
+            asize = sizeof(dict)+(sizeof(struct dictEntry*)*dictSlots(d));
+            if (dictSize(d)) {
+                long elesize;
+                robj *ele;
+
+                de = dictGetRandomKey(d);
+                ele = dictGetEntryKey(de);
+                elesize = (ele->encoding == REDIS_ENCODING_RAW) ?
+                                (sizeof(*o)+sdslen(ele->ptr)) :
+                                sizeof(*o);
+                ele = dictGetEntryVal(de);
+                elesize += (ele->encoding == REDIS_ENCODING_RAW) ?
+                                (sizeof(*o)+sdslen(ele->ptr)) :
+                                sizeof(*o);
+                asize += (sizeof(struct dictEntry)+elesize)*dictSize(d);
+            }
         }
         break;
     }
-    return (double)age*log(1+asize);
+    return asize;
 }
 
-/* Try to swap an object that's a good candidate for swapping.
- * Returns REDIS_OK if the object was swapped, REDIS_ERR if it's not possible
- * to swap any object at all.
+/* How a good candidate is this object for swapping?
+ * The better candidate it is, the greater the returned value.
  *
- * If 'usethreaded' is true, Redis will try to swap the object in background
- * using I/O threads. */
-static int vmSwapOneObject(int usethreads) {
+ * Currently we try to perform a fast estimation of the object size in
+ * memory, and combine it with aging informations.
+ *
+ * Basically swappability = idle-time * log(estimated size)
+ *
+ * Bigger objects are preferred over smaller objects, but not
+ * proportionally, this is why we use the logarithm. This algorithm is
+ * just a first try and will probably be tuned later. */
+static double computeObjectSwappability(robj *o) {
+    time_t age = server.unixtime - o->vm.atime;
+
+    if (age <= 0) return 0;
+    return (double)age*log(1+estimateObjectSize(o));
+}
+
+/* Objects we can swap: only objects that are currently in memory.
+ *
+ * Also don't swap shared objects if threaded VM is on, as we
+ * try to ensure that the main thread does not touch the
+ * object while the I/O thread is using it, but we can't
+ * control other keys without adding additional mutex. */
+static int vmIsSwappable(robj *key, robj *val) {
+    return key->storage == REDIS_VM_MEMORY &&
+           (server.vm_max_threads == 0 || val->refcount == 1);
+}
+
+/* Add a candidate to the swap pool, that is kept sorted by ascending
+ * swappability. If the key is already in the pool its swappability is
+ * updated, if the pool is full the worst candidate is evicted (or the new
+ * one is discarded if it's not better than the worst). */
+static void vmSwapPoolInsert(robj *key, int dbid, double swappability) {
+    vmSwapCandidate *pool = server.vm_pool;
+    int j;
+
+    for (j = 0; j < server.vm_pool_len; j++) {
+        if (pool[j].dbid == dbid && !compareStringObjects(pool[j].key,key)) {
+            decrRefCount(pool[j].key);
+            memmove(pool+j,pool+j+1,
+                sizeof(vmSwapCandidate)*(server.vm_pool_len-j-1));
+            server.vm_pool_len--;
+            break;
+        }
+    }
+    if (server.vm_pool_len == REDIS_VM_POOL_SIZE) {
+        if (swappability <= pool[0].swappability) return;
+        decrRefCount(pool[0].key);
+        memmove(pool,pool+1,sizeof(vmSwapCandidate)*(REDIS_VM_POOL_SIZE-1));
+        server.vm_pool_len--;
+    }
+    for (j = server.vm_pool_len; j > 0; j--) {
+        if (pool[j-1].swappability <= swappability) break;
+        pool[j] = pool[j-1];
+    }
+    pool[j].key = dupStringObject(key);
+    pool[j].dbid = dbid;
+    pool[j].swappability = swappability;
+    server.vm_pool_len++;
+}
+
+/* Sample a few random keys from every DB and add the good ones to the pool
+ * of swap candidates. This is called at every cron tick, so the pool
+ * converges towards the best candidates of the whole dataset over time
+ * while the cost of a single call stays small. */
+static void vmSwapPoolRefresh(void) {
     int j, i;
-    struct dictEntry *best = NULL;
-    double best_swappability = 0;
-    redisDb *best_db = NULL;
-    robj *key, *val;
 
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
@@ -8342,66 +10392,96 @@ static int vmSwapOneObject(int usethreads) {
         int maxtries = 100;
 
         if (dictSize(db->dict) == 0) continue;
-        for (i = 0; i < 5; i++) {
+        for (i = 0; i < REDIS_VM_POOL_SAMPLES; i++) {
             dictEntry *de;
+            robj *key, *val;
             double swappability;
 
             if (maxtries) maxtries--;
             de = dictGetRandomKey(db->dict);
             key = dictGetEntryKey(de);
             val = dictGetEntryVal(de);
-            /* Only swap objects that are currently in memory.
-             *
-             * Also don't swap shared objects if threaded VM is on, as we
-             * try to ensure that the main thread does not touch the
-             * object while the I/O thread is using it, but we can't
-             * control other keys without adding additional mutex. */
-            if (key->storage != REDIS_VM_MEMORY ||
-                (server.vm_max_threads != 0 && val->refcount != 1)) {
+            if (!vmIsSwappable(key,val)) {
                 if (maxtries) i--; /* don't count this try */
                 continue;
             }
             swappability = computeObjectSwappability(val);
-            if (!best || swappability > best_swappability) {
-                best = de;
-                best_swappability = swappability;
-                best_db = db;
-            }
+            if (swappability > 0) vmSwapPoolInsert(key,j,swappability);
+        }
+    }
+}
+
+/* Try to swap an object that's a good candidate for swapping.
+ * Returns REDIS_OK if the object was swapped, REDIS_ERR if it's not possible
+ * to swap any object at all.
+ *
+ * The best candidate of the pool is used, refreshing the pool once if it's
+ * empty. Candidates that were deleted, touched or swapped since they entered
+ * the pool are discarded.
+ *
+ * If 'usethreaded' is true, Redis will try to swap the object in background
+ * using I/O threads, and if 'queued' is not NULL the estimated size of the
+ * object is added to *queued. */
+static int vmSwapOneObject(int usethreads, size_t *queued) {
+    int refreshed = 0;
+
+    while(1) {
+        vmSwapCandidate c;
+        redisDb *db;
+        struct dictEntry *de;
+        robj *key, *val;
+        double swappability;
+
+        if (server.vm_pool_len == 0) {
+            if (refreshed) return REDIS_ERR;
+            vmSwapPoolRefresh();
+            refreshed = 1;
+            continue;
         }
-    }
-    if (best == NULL) return REDIS_ERR;
-    key = dictGetEntryKey(best);
-    val = dictGetEntryVal(best);
+        c = server.vm_pool[--server.vm_pool_len];
+        db = server.db+c.dbid;
+        de = dictFind(db->dict,c.key);
+        decrRefCount(c.key);
+        if (de == NULL) continue;
+        key = dictGetEntryKey(de);
+        val = dictGetEntryVal(de);
+        if (!vmIsSwappable(key,val)) continue;
+        swappability = computeObjectSwappability(val);
+        if (swappability == 0) continue;
 
-    redisLog(REDIS_DEBUG,"Key with best swappability: %s, %f",
-        key->ptr, best_swappability);
+        redisLog(REDIS_DEBUG,"Key with best swappability: %s, %f",
+            key->ptr, swappability);
 
-    /* Unshare the key if needed */
-    if (key->refcount > 1) {
-        robj *newkey = dupStringObject(key);
-        decrRefCount(key);
-        key = dictGetEntryKey(best) = newkey;
-    }
-    /* Swap it */
-    if (usethreads) {
-        vmSwapObjectThreaded(key,val,best_db);
-        return REDIS_OK;
-    } else {
-        if (vmSwapObjectBlocking(key,val) == REDIS_OK) {
-            dictGetEntryVal(best) = NULL;
+        /* Unshare the key if needed */
+        if (key->refcount > 1) {
+            robj *newkey = dupStringObject(key);
+            decrRefCount(key);
+            key = dictGetEntryKey(de) = newkey;
+        }
+        /* Swap it */
+        if (usethreads) {
+            if (queued) *queued += estimateObjectSize(val);
+            vmSwapObjectThreaded(key,val,db);
             return REDIS_OK;
         } else {
-            return REDIS_ERR;
+            if (vmSwapObjectBlocking(key,val) == REDIS_OK) {
+                dictGetEntryVal(de) = NULL;
+                return REDIS_OK;
+            } else if (server.vm_tier_node == -1) {
+                return REDIS_ERR;
+            }
+            /* Nothing of the value could be moved to the tier node, see
+             * vmTierSwapObject(): try with the next candidate. */
         }
     }
 }
 
 static int vmSwapOneObjectBlocking() {
-    return vmSwapOneObject(0);
+    return vmSwapOneObject(0,NULL);
 }
 
-static int vmSwapOneObjectThreaded() {
-    return vmSwapOneObject(1);
+static int vmSwapOneObjectThreaded(size_t *queued) {
+    return vmSwapOneObject(1,queued);
 }
 
 /* Return true if it's safe to swap out objects in a given moment.
@@ -8432,6 +10512,8 @@ static void freeIOJob(iojob *j) {
         j->type == REDIS_IOJOB_LOAD) && j->val != NULL)
         decrRefCount(j->val);
     decrRefCount(j->key);
+    free(j->buf); /* allocated by open_memstream() or posix_memalign() */
+    zfree(j->chunks);
     zfree(j);
 }
 
@@ -8441,33 +10523,53 @@ static void freeIOJob(iojob *j) {
 static void vmThreadedIOCompletedJob(aeEventLoop *el, int fd, void *privdata,
             int mask)
 {
-    char buf[1];
+    char buf[64];
     int retval, processed = 0, toprocess = -1, trytoswap = 1;
     REDIS_NOTUSED(el);
     REDIS_NOTUSED(mask);
     REDIS_NOTUSED(privdata);
 
-    /* For every byte we read in the read side of the pipe, there is one
-     * I/O job completed to process. */
-    while((retval = read(fd,buf,1)) == 1) {
+    /* The bytes in the pipe are just a wakeup signal: the jobs to
+     * process are the ones found in the io_processed list. */
+    while((retval = read(fd,buf,sizeof(buf))) > 0);
+    if (retval < 0 && errno != EAGAIN) {
+        redisLog(REDIS_WARNING,
+            "WARNING: read(2) error in vmThreadedIOCompletedJob() %s",
+            strerror(errno));
+    }
+
+    while(1) {
         iojob *j;
         listNode *ln;
         robj *key;
         struct dictEntry *de;
 
-        redisLog(REDIS_DEBUG,"Processing I/O completed job");
-
         /* Get the processed element (the oldest one) */
         lockThreadedIO();
-        assert(listLength(server.io_processed) != 0);
+        if (listLength(server.io_processed) == 0) {
+            /* All done, the next completed job will signal us again. */
+            server.io_ready_pipe_pending = 0;
+            unlockThreadedIO();
+            return;
+        }
         if (toprocess == -1) {
             toprocess = (listLength(server.io_processed)*REDIS_MAX_COMPLETED_JOBS_PROCESSED)/100;
-            if (toprocess <= 0) toprocess = 1;
+            if (toprocess < REDIS_MIN_COMPLETED_JOBS_PROCESSED)
+                toprocess = REDIS_MIN_COMPLETED_JOBS_PROCESSED;
+        }
+        if (processed == toprocess) {
+            /* Enough for now: serve the clients and call us again in the
+             * next event loop iteration for the remaining jobs. */
+            assert(write(server.io_ready_pipe_write,"x",1) == 1);
+            unlockThreadedIO();
+            return;
         }
+        redisLog(REDIS_DEBUG,"Processing I/O completed job");
         ln = listFirst(server.io_processed);
         j = ln->value;
         listDelNode(server.io_processed,ln);
         unlockThreadedIO();
+        processed++;
         /* If this job is marked as canceled, just ignore it */
         if (j->canceled) {
             freeIOJob(j);
@@ -8486,6 +10588,8 @@ static void vmThreadedIOCompletedJob(aeEventLoop *el, int fd, void *privdata,
             key->storage = REDIS_VM_MEMORY;
             key->vm.atime = server.unixtime;
             vmMarkPagesFree(key->vm.page,key->vm.usedpages);
+            zfree(key->vm.chunks);
+            key->vm.chunks = NULL;
             redisLog(REDIS_DEBUG, "VM: object %s loaded from disk (threaded)",
                 (unsigned char*) key->ptr);
             server.vm_stats_swapped_objects--;
@@ -8513,9 +10617,7 @@ static void vmThreadedIOCompletedJob(aeEventLoop *el, int fd, void *privdata,
                  * again. */
                 vmMarkPagesUsed(j->page,j->pages);
                 j->type = REDIS_IOJOB_DO_SWAP;
-                lockThreadedIO();
                 queueIOJob(j);
-                unlockThreadedIO();
             }
         } else if (j->type == REDIS_IOJOB_DO_SWAP) {
             robj *val;
@@ -8533,6 +10635,11 @@ static void vmThreadedIOCompletedJob(aeEventLoop *el, int fd, void *privdata,
             val = dictGetEntryVal(de);
             key->vm.page = j->page;
             key->vm.usedpages = j->pages;
+            key->vm.chunks = j->chunks;
+            key->vm.vlen = objectLength(j->val);
+            key->vm.compressed = j->compressed;
+            if (j->compressed) server.vm_stats_compressed_swapouts++;
+            j->chunks = NULL;
             key->storage = REDIS_VM_SWAPPED;
             key->vtype = j->val->type;
             decrRefCount(val); /* Deallocate the object from memory. */
@@ -8547,29 +10654,24 @@ static void vmThreadedIOCompletedJob(aeEventLoop *el, int fd, void *privdata,
             /* Put a few more swap requests in queue if we are still
              * out of memory */
             if (trytoswap && vmCanSwapOut() &&
-                zmalloc_used_memory() > server.vm_max_memory)
+                vmUsedMemory() > server.vm_max_memory)
             {
                 int more = 1;
                 while(more) {
-                    lockThreadedIO();
-                    more = listLength(server.io_newjobs) <
-                            (unsigned) server.vm_max_threads;
-                    unlockThreadedIO();
+                    unsigned long queued, processing;
+
+                    lockIOThreads();
+                    vmIOThreadsStats(&queued,&processing);
+                    unlockIOThreads();
+                    more = queued+processing < (unsigned) server.vm_max_threads;
                     /* Don't waste CPU time if swappable objects are rare. */
-                    if (vmSwapOneObjectThreaded() == REDIS_ERR) {
+                    if (vmSwapOneObjectThreaded(NULL) == REDIS_ERR) {
                         trytoswap = 0;
                         break;
                     }
                 }
             }
         }
-        processed++;
-        if (processed == toprocess) return;
-    }
-    if (retval < 0 && errno != EAGAIN) {
-        redisLog(REDIS_WARNING,
-            "WARNING: read(2) error in vmThreadedIOCompletedJob() %s",
-            strerror(errno));
     }
 }
 
@@ -8581,143 +10683,246 @@ static void unlockThreadedIO(void) {
     pthread_mutex_unlock(&server.io_mutex);
 }
 
+/* Lock the queues of all the I/O threads. The locks are always taken in the
+ * same order, and before server.io_mutex when both are needed, so there is
+ * no way to deadlock against the I/O threads. */
+static void lockIOThreads(void) {
+    int j;
+
+    for (j = 0; j < server.io_threads_num; j++)
+        pthread_mutex_lock(&server.io_threads[j].mutex);
+}
+
+static void unlockIOThreads(void) {
+    int j;
+
+    for (j = server.io_threads_num-1; j >= 0; j--)
+        pthread_mutex_unlock(&server.io_threads[j].mutex);
+}
+
+/* Return the number of jobs queued and the number of jobs being processed
+ * right now. Must be called with the I/O threads locked. */
+static void vmIOThreadsStats(unsigned long *queued, unsigned long *processing) {
+    int j;
+
+    *queued = *processing = 0;
+    for (j = 0; j < server.io_threads_num; j++) {
+        *queued += listLength(server.io_threads[j].jobs);
+        if (server.io_threads[j].current) (*processing)++;
+    }
+    if (server.io_uring) {
+        *queued += listLength(server.io_uring_waiting);
+        *processing += listLength(server.io_uring_inflight);
+    }
+}
+
+/* Return the node of the list 'l' holding a not canceled job about the
+ * key object 'o' stored in the DB, or NULL if there is no such job. */
+static listNode *vmFindIOJob(list *l, robj *o) {
+    listNode *ln;
+    listIter li;
+
+    listRewind(l,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        iojob *job = ln->value;
+
+        if (job->canceled) continue; /* Skip this, already canceled. */
+        if (job->dbkey == o) return ln;
+    }
+    return NULL;
+}
+
 /* Remove the specified object from the threaded I/O queue if still not
  * processed, otherwise make sure to flag it as canceled. */
 static void vmCancelThreadedIOJob(robj *o) {
-    list *lists[3] = {
-        server.io_newjobs,      /* 0 */
-        server.io_processing,   /* 1 */
-        server.io_processed     /* 2 */
-    };
-    int i;
+    listNode *ln = NULL;
+    list *l = NULL;
+    iojob *job;
+    int t;
 
     assert(o->storage == REDIS_VM_LOADING || o->storage == REDIS_VM_SWAPPING);
 again:
+    /* With all the I/O threads locked a job can't move from a queue to
+     * another one (or from a thread to io_processed) while we search it. */
+    lockIOThreads();
     lockThreadedIO();
-    /* Search for a matching key in one of the queues */
-    for (i = 0; i < 3; i++) {
-        listNode *ln;
-        listIter li;
+    for (t = 0; t < server.io_threads_num; t++) {
+        iothread *th = server.io_threads+t;
 
-        listRewind(lists[i],&li);
-        while ((ln = listNext(&li)) != NULL) {
-            iojob *job = ln->value;
-
-            if (job->canceled) continue; /* Skip this, already canceled. */
-            if (compareStringObjects(job->key,o) == 0) {
-                redisLog(REDIS_DEBUG,"*** CANCELED %p (%s) (type %d) (LIST ID %d)\n",
-                    (void*)job, (char*)o->ptr, job->type, i);
-                /* Mark the pages as free since the swap didn't happened
-                 * or happened but is now discarded. */
-                if (i != 1 && job->type == REDIS_IOJOB_DO_SWAP)
-                    vmMarkPagesFree(job->page,job->pages);
-                /* Cancel the job. It depends on the list the job is
-                 * living in. */
-                switch(i) {
-                case 0: /* io_newjobs */
-                    /* If the job was yet not processed the best thing to do
-                     * is to remove it from the queue at all */
-                    freeIOJob(job);
-                    listDelNode(lists[i],ln);
-                    break;
-                case 1: /* io_processing */
-                    /* Oh Shi- the thread is messing with the Job:
-                     *
-                     * Probably it's accessing the object if this is a
-                     * PREPARE_SWAP or DO_SWAP job.
-                     * If it's a LOAD job it may be reading from disk and
-                     * if we don't wait for the job to terminate before to
-                     * cancel it, maybe in a few microseconds data can be
-                     * corrupted in this pages. So the short story is:
-                     *
-                     * Better to wait for the job to move into the
-                     * next queue (processed)... */
-
-                    /* We try again and again until the job is completed. */
-                    unlockThreadedIO();
-                    /* But let's wait some time for the I/O thread
-                     * to finish with this job. After all this condition
-                     * should be very rare. */
-                    usleep(1);
-                    goto again;
-                case 2: /* io_processed */
-                    /* The job was already processed, that's easy...
-                     * just mark it as canceled so that we'll ignore it
-                     * when processing completed jobs. */
-                    job->canceled = 1;
-                    break;
-                }
-                /* Finally we have to adjust the storage type of the object
-                 * in order to "UNDO" the operaiton. */
-                if (o->storage == REDIS_VM_LOADING)
-                    o->storage = REDIS_VM_SWAPPED;
-                else if (o->storage == REDIS_VM_SWAPPING)
-                    o->storage = REDIS_VM_MEMORY;
-                unlockThreadedIO();
-                return;
-            }
+        if ((ln = vmFindIOJob(th->jobs,o)) != NULL) {
+            l = th->jobs;
+            break;
         }
+        job = th->current;
+        if (job && !job->canceled && job->dbkey == o) {
+            /* Oh Shi- the thread is messing with the Job:
+             *
+             * Probably it's accessing the object if this is a
+             * PREPARE_SWAP or DO_SWAP job.
+             * If it's a LOAD job it may be reading from disk and
+             * if we don't wait for the job to terminate before to
+             * cancel it, maybe in a few microseconds data can be
+             * corrupted in this pages. So the short story is:
+             *
+             * Better to wait for the job to move into the
+             * next queue (processed)... */
+
+            /* We try again and again until the job is completed. */
+            unlockThreadedIO();
+            unlockIOThreads();
+            /* But let's wait some time for the I/O thread
+             * to finish with this job. After all this condition
+             * should be very rare. */
+            usleep(1);
+            goto again;
+        }
+    }
+    if (server.io_uring && ln == NULL) {
+        /* Jobs in the ring can't be canceled: reap completions until the
+         * job is moved into io_processed, like we do with I/O threads. */
+        if (vmFindIOJob(server.io_uring_inflight,o) != NULL) {
+            unlockThreadedIO();
+            unlockIOThreads();
+            vmUringWait();
+            goto again;
+        }
+        if ((ln = vmFindIOJob(server.io_uring_waiting,o)) != NULL)
+            l = server.io_uring_waiting;
+    }
+    if (ln == NULL && (ln = vmFindIOJob(server.io_processed,o)) != NULL)
+        l = server.io_processed;
+    assert(ln != NULL); /* We should always find the job */
+
+    job = ln->value;
+    redisLog(REDIS_DEBUG,"*** CANCELED %p (%s) (type %d) (%s)\n",
+        (void*)job, (char*)o->ptr, job->type,
+        (l == server.io_processed) ? "processed" : "queued");
+    /* Mark the pages as free since the swap didn't happened
+     * or happened but is now discarded. */
+    if (job->type == REDIS_IOJOB_DO_SWAP)
+        vmMarkPagesFree(job->page,job->pages);
+    if (l == server.io_processed) {
+        /* The job was already processed, that's easy...
+         * just mark it as canceled so that we'll ignore it
+         * when processing completed jobs. */
+        job->canceled = 1;
+    } else {
+        /* If the job was yet not processed the best thing to do
+         * is to remove it from the queue at all */
+        freeIOJob(job);
+        listDelNode(l,ln);
     }
+    /* Finally we have to adjust the storage type of the object
+     * in order to "UNDO" the operaiton. */
+    if (o->storage == REDIS_VM_LOADING)
+        o->storage = REDIS_VM_SWAPPED;
+    else if (o->storage == REDIS_VM_SWAPPING)
+        o->storage = REDIS_VM_MEMORY;
     unlockThreadedIO();
-    assert(1 != 1); /* We should never reach this */
+    unlockIOThreads();
+}
+
+/* Get the next job the I/O thread 't' should process and set it as the
+ * current job of the thread. Jobs are taken from the thread own queue,
+ * or stolen from the queue of some other thread if the own queue is empty.
+ * Returns NULL if there is nothing to do at all.
+ *
+ * Must be called with t->mutex locked. Other queues are only locked with
+ * pthread_mutex_trylock(), as the main thread may hold them all. */
+static iojob *vmGetIOJob(iothread *t) {
+    int i, self = t-server.io_threads;
+    listNode *ln;
+    iojob *j = NULL;
+
+    if ((ln = listFirst(t->jobs)) != NULL) {
+        j = ln->value;
+        listDelNode(t->jobs,ln);
+    }
+    for (i = 1; j == NULL && i < server.io_threads_num; i++) {
+        iothread *victim = server.io_threads+((self+i)%server.io_threads_num);
+
+        if (pthread_mutex_trylock(&victim->mutex) != 0) continue;
+        if ((ln = listFirst(victim->jobs)) != NULL) {
+            j = ln->value;
+            listDelNode(victim->jobs,ln);
+        }
+        pthread_mutex_unlock(&victim->mutex);
+    }
+    if (j) {
+        j->thread = t->thread;
+        t->current = j;
+    }
+    return j;
 }
 
 static void *IOThreadEntryPoint(void *arg) {
+    iothread *t = arg;
     iojob *j;
-    listNode *ln;
-    REDIS_NOTUSED(arg);
 
     pthread_detach(pthread_self());
     while(1) {
-        /* Get a new job to process */
-        lockThreadedIO();
-        if (listLength(server.io_newjobs) == 0) {
-            /* No new jobs in queue, exit. */
-            redisLog(REDIS_DEBUG,"Thread %ld exiting, nothing to do",
-                (long) pthread_self());
-            server.io_active_threads--;
-            unlockThreadedIO();
-            return NULL;
-        }
-        ln = listFirst(server.io_newjobs);
-        j = ln->value;
-        listDelNode(server.io_newjobs,ln);
-        /* Add the job in the processing queue */
-        j->thread = pthread_self();
-        listAddNodeTail(server.io_processing,j);
-        ln = listLast(server.io_processing); /* We use ln later to remove it */
-        unlockThreadedIO();
+        /* Get a new job to process, sleeping until there is one */
+        pthread_mutex_lock(&t->mutex);
+        while ((j = vmGetIOJob(t)) == NULL)
+            pthread_cond_wait(&t->cond,&t->mutex);
+        pthread_mutex_unlock(&t->mutex);
         redisLog(REDIS_DEBUG,"Thread %ld got a new job (type %d): %p about key '%s'",
             (long) pthread_self(), j->type, (void*)j, (char*)j->key->ptr);
 
         /* Process the Job */
         if (j->type == REDIS_IOJOB_LOAD) {
-            j->val = vmReadObjectFromSwap(j->page,j->key->vtype);
+            j->val = vmReadObjectFromSwap(t->fd,j->page,j->pages,
+                                          j->key->vtype,j->compressed);
         } else if (j->type == REDIS_IOJOB_PREPARE_SWAP) {
-            FILE *fp = fopen("/dev/null","w+");
-            j->pages = rdbSavedObjectPages(j->val,fp);
-            fclose(fp);
+            /* With compression the pages needed depend on the compressed
+             * length: the compressed object is kept in the job, ready to
+             * be written by DO_SWAP. */
+            if (server.vm_compression &&
+                vmEncodeObject(j->val,(char**)&j->buf,&j->buflen,
+                               &j->chunks,&j->compressed) == REDIS_OK)
+            {
+                j->pages = (j->buflen+(server.vm_page_size-1))/
+                           server.vm_page_size;
+            } else {
+                /* DO_SWAP will serialize the object again, directly */
+                j->buf = NULL;
+                j->pages = rdbSavedObjectPages(j->val,t->devnull);
+            }
         } else if (j->type == REDIS_IOJOB_DO_SWAP) {
-            if (vmWriteObjectOnSwap(j->val,j->page) == REDIS_ERR)
-                j->canceled = 1;
+            int retval = j->buf ?
+                vmWriteBufferOnSwap(t->fd,j->buf,j->buflen,j->page) :
+                vmWriteObjectOnSwap(t->fd,j->val,j->page,&j->chunks);
+
+            if (retval == REDIS_ERR) j->canceled = 1;
         }
 
-        /* Done: insert the job into the processed queue */
+        /* Done: insert the job into the processed queue. Our own lock is
+         * held while doing so, in order for vmCancelThreadedIOJob() to
+         * always find the job either as current or in io_processed. */
         redisLog(REDIS_DEBUG,"Thread %ld completed the job: %p (key %s)",
             (long) pthread_self(), (void*)j, (char*)j->key->ptr);
-        lockThreadedIO();
-        listDelNode(server.io_processing,ln);
-        listAddNodeTail(server.io_processed,j);
-        unlockThreadedIO();
-        
-        /* Signal the main thread there is new stuff to process */
-        assert(write(server.io_ready_pipe_write,"x",1) == 1);
+        pthread_mutex_lock(&t->mutex);
+        t->current = NULL;
+        vmIOJobProcessed(j);
+        pthread_mutex_unlock(&t->mutex);
     }
     return NULL; /* never reached */
 }
 
-static void spawnIOThread(void) {
-    pthread_t thread;
+/* Put the job in the processed queue, and signal the main thread there is
+ * new stuff to process, unless it was already signaled and did not
+ * processed the jobs yet. */
+static void vmIOJobProcessed(iojob *j) {
+    lockThreadedIO();
+    listAddNodeTail(server.io_processed,j);
+    if (!server.io_ready_pipe_pending) {
+        server.io_ready_pipe_pending = 1;
+        assert(write(server.io_ready_pipe_write,"x",1) == 1);
+    }
+    unlockThreadedIO();
+}
+
+static void spawnIOThread(iothread *t) {
     sigset_t mask, omask;
 
     sigemptyset(&mask);
@@ -8725,29 +10930,39 @@ static void spawnIOThread(void) {
     sigaddset(&mask,SIGHUP);
     sigaddset(&mask,SIGPIPE);
     pthread_sigmask(SIG_SETMASK, &mask, &omask);
-    pthread_create(&thread,&server.io_threads_attr,IOThreadEntryPoint,NULL);
+    if (pthread_create(&t->thread,&server.io_threads_attr,
+            IOThreadEntryPoint,t) != 0)
+    {
+        redisLog(REDIS_WARNING,"Can't create the I/O thread. Exiting.");
+        exit(1);
+    }
     pthread_sigmask(SIG_SETMASK, &omask, NULL);
-    server.io_active_threads++;
 }
 
-/* We need to wait for the last thread to exit before we are able to
+/* We need to wait for all the I/O threads to be idle before we are able to
  * fork() in order to BGSAVE or BGREWRITEAOF. */
 static void waitEmptyIOJobsQueue(void) {
+    /* Nothing to wait for without I/O threads. This is also the case of
+     * the saving child, see vmReopenSwapFile(). */
+    if (server.vm_max_threads == 0) return;
     while(1) {
+        unsigned long queued, processing;
         int io_processed_len;
 
+        /* Without I/O threads nobody will reap the io_uring completions
+         * while we wait. */
+        if (server.io_uring) vmUringWait();
+        lockIOThreads();
+        vmIOThreadsStats(&queued,&processing);
+        unlockIOThreads();
         lockThreadedIO();
-        if (listLength(server.io_newjobs) == 0 &&
-            listLength(server.io_processing) == 0 &&
-            server.io_active_threads == 0)
-        {
+        if (queued == 0 && processing == 0) {
             unlockThreadedIO();
             return;
         }
         /* While waiting for empty jobs queue condition we post-process some
-         * finshed job, as I/O threads may be hanging trying to write against
-         * the io_ready_pipe_write FD but there are so much pending jobs that
-         * it's blocking. */
+         * finshed job, as completed PREPARE_SWAP jobs must be queued again
+         * as DO_SWAP jobs by the main thread. */
         io_processed_len = listLength(server.io_processed);
         unlockThreadedIO();
         if (io_processed_len) {
@@ -8762,22 +10977,48 @@ static void waitEmptyIOJobsQueue(void) {
 static void vmReopenSwapFile(void) {
     /* Note: we don't close the old one as we are in the child process
      * and don't want to mess at all with the original file object. */
-    server.vm_fp = fopen(server.vm_swap_file,"r+b");
-    if (server.vm_fp == NULL) {
+    if (server.vm_tier_node == -1 &&
+        (server.vm_fd = open(server.vm_swap_file,O_RDWR)) == -1)
+    {
         redisLog(REDIS_WARNING,"Can't re-open the VM swap file: %s. Exiting.",
             server.vm_swap_file);
         _exit(1);
     }
-    server.vm_fd = fileno(server.vm_fp);
+    /* The I/O threads don't exist in the child, and their locks may be
+     * in any state: make sure nothing will try to use them. */
+    server.vm_max_threads = 0;
 }
 
-/* This function must be called while with threaded IO locked */
+/* Queue the job to an I/O thread. Idle threads are preferred, starting from
+ * the one following the last used so that jobs are spread among the threads.
+ * If all the threads are busy the job is queued round robin, and will be
+ * processed (or stolen) by the first thread that completes its work. */
 static void queueIOJob(iojob *j) {
+    iothread *t = NULL;
+    int i;
+
     redisLog(REDIS_DEBUG,"Queued IO Job %p type %d about key '%s'\n",
         (void*)j, j->type, (char*)j->key->ptr);
-    listAddNodeTail(server.io_newjobs,j);
-    if (server.io_active_threads < server.vm_max_threads)
-        spawnIOThread();
+    if (server.io_uring) {
+        vmUringQueueJob(j);
+        return;
+    }
+    for (i = 0; i < server.io_threads_num; i++) {
+        t = server.io_threads+
+            ((server.io_next_thread+i) % server.io_threads_num);
+        pthread_mutex_lock(&t->mutex);
+        if (t->current == NULL && listLength(t->jobs) == 0) break;
+        pthread_mutex_unlock(&t->mutex);
+        t = NULL;
+    }
+    if (t == NULL) {
+        t = server.io_threads+server.io_next_thread;
+        pthread_mutex_lock(&t->mutex);
+    }
+    server.io_next_thread = ((t-server.io_threads)+1) % server.io_threads_num;
+    listAddNodeTail(t->jobs,j);
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->mutex);
 }
 
 static int vmSwapObjectThreaded(robj *key, robj *val, redisDb *db) {
@@ -8790,18 +11031,220 @@ static int vmSwapObjectThreaded(robj *key, robj *val, redisDb *db) {
     j->type = REDIS_IOJOB_PREPARE_SWAP;
     j->db = db;
     j->key = dupStringObject(key);
+    j->dbkey = key;
     j->val = val;
     incrRefCount(val);
     j->canceled = 0;
     j->thread = (pthread_t) -1;
+    j->buf = NULL;
+    j->chunks = NULL;
+    j->compressed = 0;
     key->storage = REDIS_VM_SWAPPING;
 
-    lockThreadedIO();
     queueIOJob(j);
-    unlockThreadedIO();
     return REDIS_OK;
 }
 
+/* ================= Virtual Memory - io_uring I/O engine =================== */
+
+/* When vm-io-engine is set to uring there are no I/O threads at all: swap
+ * file reads and writes are queued by the main thread as io_uring requests,
+ * and all the requests queued while processing a batch of events (for
+ * instance the loads needed by a MGET against many swapped keys) are passed
+ * to the kernel with a single system call in beforeSleep().
+ *
+ * Completions are signaled by an eventfd handled by the event loop. The
+ * completed jobs are then put in the io_processed queue exactly like the
+ * I/O threads do, so that vmThreadedIOCompletedJob() will post process them.
+ *
+ * Objects are serialized and deserialized in the main thread, that also
+ * means PREPARE_SWAP jobs are processed as soon as they are queued. */
+
+static void vmUringInit(void) {
+    if (server.vm_direct_io &&
+        (server.vm_page_size % REDIS_VM_DIRECT_IO_ALIGN) != 0)
+    {
+        redisLog(REDIS_WARNING,
+            "vm-direct-io requires vm-page-size to be a multiple of %d. Exiting.",
+            REDIS_VM_DIRECT_IO_ALIGN);
+        exit(1);
+    }
+    if ((server.io_uring = uringCreate(REDIS_VM_URING_ENTRIES)) == NULL ||
+        (server.io_uring_efd = uringEventFd(server.io_uring)) == -1 ||
+        (server.io_uring_fd = uringOpen(server.vm_swap_file,
+                                        server.vm_direct_io)) == -1)
+    {
+        redisLog(REDIS_WARNING,
+            "Can't initialize the io_uring VM I/O engine: %s. Exiting.",
+            strerror(errno));
+        exit(1);
+    }
+    server.io_uring_waiting = listCreate();
+    server.io_uring_inflight = listCreate();
+    if (aeCreateFileEvent(server.el, server.io_uring_efd, AE_READABLE,
+        vmUringCompletedJob, NULL) == AE_ERR)
+        oom("creating file event");
+    redisLog(REDIS_NOTICE,"Using io_uring for swap file I/O%s",
+        server.vm_direct_io ? " (direct I/O)" : "");
+}
+
+/* Buffers are always aligned as required by direct I/O. Like the buffers
+ * allocated by open_memstream() they are released with free(). */
+static void *vmUringAllocBuffer(size_t len) {
+    void *buf;
+
+    if (posix_memalign(&buf,REDIS_VM_DIRECT_IO_ALIGN,len) != 0)
+        oom("posix_memalign");
+    return buf;
+}
+
+/* Move the jobs waiting for a free slot into the ring. The requests are
+ * not passed to the kernel until vmUringSubmit() is called. The number of
+ * jobs in the ring is limited to the size of the submission queue, so
+ * that the completion queue (twice as big) can never overflow. */
+static void vmUringFill(void) {
+    listNode *ln;
+
+    while ((ln = listFirst(server.io_uring_waiting)) != NULL &&
+           listLength(server.io_uring_inflight) <
+           uringEntries(server.io_uring))
+    {
+        iojob *j = ln->value;
+        off_t offset = j->page*server.vm_page_size;
+        int retval;
+
+        if (j->type == REDIS_IOJOB_LOAD)
+            retval = uringPrepRead(server.io_uring,server.io_uring_fd,
+                                   j->buf,j->buflen,offset,j);
+        else
+            retval = uringPrepWrite(server.io_uring,server.io_uring_fd,
+                                    j->buf,j->buflen,offset,j);
+        if (retval == -1) break;
+        listDelNode(server.io_uring_waiting,ln);
+        listAddNodeTail(server.io_uring_inflight,j);
+    }
+}
+
+static void vmUringSubmit(void) {
+    vmUringFill();
+    if (uringSubmit(server.io_uring,0) == -1) {
+        redisLog(REDIS_WARNING,"Can't submit swap file I/O requests: %s",
+            strerror(errno));
+    }
+}
+
+static void vmUringQueueJob(iojob *j) {
+    if (j->type == REDIS_IOJOB_PREPARE_SWAP) {
+        struct dictEntry *de = dictFind(j->db->dict,j->key);
+        robj *key;
+
+        /* Serialize the object now, keeping the result in the job, and
+         * allocate the pages as vmThreadedIOCompletedJob() would do. */
+        redisAssert(de != NULL);
+        key = dictGetEntryKey(de);
+        if (vmEncodeObject(j->val,(char**)&j->buf,&j->buflen,
+                           &j->chunks,&j->compressed) == REDIS_ERR)
+            j->buf = NULL;
+        else
+            j->pages = (j->buflen+(server.vm_page_size-1))/
+                       server.vm_page_size;
+        if (j->buf == NULL || !vmCanSwapOut() ||
+            vmFindContiguousPages(&j->page,j->pages) == REDIS_ERR)
+        {
+            freeIOJob(j);
+            key->storage = REDIS_VM_MEMORY; /* undo operation */
+            return;
+        }
+        vmMarkPagesUsed(j->page,j->pages);
+        j->type = REDIS_IOJOB_DO_SWAP;
+    }
+
+    if (j->type == REDIS_IOJOB_DO_SWAP) {
+        if (server.vm_direct_io) {
+            /* Direct I/O needs an aligned buffer, and whole blocks. */
+            size_t len = j->pages*server.vm_page_size;
+            void *buf = vmUringAllocBuffer(len);
+
+            memcpy(buf,j->buf,j->buflen);
+            memset((char*)buf+j->buflen,0,len-j->buflen);
+            free(j->buf);
+            j->buf = buf;
+            j->buflen = len;
+        }
+    } else if (j->type == REDIS_IOJOB_LOAD) {
+        j->buflen = j->pages*server.vm_page_size;
+        j->buf = vmUringAllocBuffer(j->buflen);
+    }
+    listAddNodeTail(server.io_uring_waiting,j);
+    vmUringFill();
+}
+
+/* Reap all the available completions, moving the completed jobs into the
+ * io_processed queue. */
+static void vmUringReap(void) {
+    void *udata;
+    int res;
+
+    while (uringNextCompletion(server.io_uring,&udata,&res)) {
+        iojob *j = udata;
+        listNode *ln = listSearchKey(server.io_uring_inflight,j);
+        int write = (j->type == REDIS_IOJOB_DO_SWAP);
+        size_t done = (res > 0) ? (size_t) res : 0;
+
+        redisAssert(ln != NULL);
+        listDelNode(server.io_uring_inflight,ln);
+        /* Short reads/writes are completed synchronously. */
+        if (done < j->buflen &&
+            vmPositionalIO(server.vm_fd,(char*)j->buf+done,j->buflen-done,
+                j->page*server.vm_page_size+done,write) == REDIS_ERR)
+        {
+            redisLog(REDIS_WARNING,
+                "%s VM problem in the io_uring engine: can't %s: %s",
+                write ? "Critical" : "Unrecoverable",
+                write ? "write" : "read",
+                strerror(res < 0 ? -res : errno));
+            if (!write) _exit(1);
+            j->canceled = 1;
+        }
+        if (j->type == REDIS_IOJOB_LOAD)
+            j->val = vmLoadObjectFromBuffer(j->buf,j->buflen,j->key->vtype,
+                                            j->compressed);
+        free(j->buf);
+        j->buf = NULL;
+        vmIOJobProcessed(j);
+    }
+    vmUringFill();
+}
+
+/* Submit the queued requests and wait for at least one of the jobs in
+ * the ring to complete. */
+static void vmUringWait(void) {
+    vmUringFill();
+    if (listLength(server.io_uring_inflight) &&
+        uringSubmit(server.io_uring,1) == -1)
+    {
+        redisLog(REDIS_WARNING,"Can't wait for swap file I/O requests: %s",
+            strerror(errno));
+    }
+    vmUringReap();
+}
+
+static void vmUringCompletedJob(aeEventLoop *el, int fd, void *privdata,
+            int mask)
+{
+    uint64_t count;
+    REDIS_NOTUSED(el);
+    REDIS_NOTUSED(mask);
+    REDIS_NOTUSED(privdata);
+
+    if (read(fd,&count,sizeof(count)) == -1 && errno != EAGAIN) {
+        redisLog(REDIS_WARNING,
+            "WARNING: read(2) error in vmUringCompletedJob() %s",
+            strerror(errno));
+    }
+    vmUringReap();
+}
+
 /* ============ Virtual Memory - Blocking clients on missing keys =========== */
 
 /* This function makes the clinet 'c' waiting for the key 'key' to be loaded.
@@ -8858,14 +11301,17 @@ static int waitForSwappedKey(redisClient *c, robj *key) {
         j->type = REDIS_IOJOB_LOAD;
         j->db = c->db;
         j->key = dupStringObject(key);
+        j->dbkey = o;
         j->key->vtype = o->vtype;
         j->page = o->vm.page;
+        j->pages = o->vm.usedpages;
         j->val = NULL;
         j->canceled = 0;
         j->thread = (pthread_t) -1;
-        lockThreadedIO();
+        j->buf = NULL;
+        j->chunks = NULL;
+        j->compressed = o->vm.compressed;
         queueIOJob(j);
-        unlockThreadedIO();
     }
     return 1;
 }
@@ -8874,11 +11320,156 @@ static int waitForSwappedKey(redisClient *c, robj *key) {
 static void zunionInterBlockClientOnSwappedKeys(redisClient *c) {
     int i, num;
     num = atoi(c->argv[2]->ptr);
+    if (num > c->argc-3) num = c->argc-3;
     for (i = 0; i < num; i++) {
         waitForSwappedKey(c,c->argv[3+i]);
     }
 }
 
+/* Make the client wait for the keys the command 'cmd' is going to access, as
+ * specified by vm_preload_proc or vm_firstkey and friends in the command
+ * table. 'argv' and 'argc' are the arguments of the command, that are not
+ * the ones of the client for commands queued by MULTI or still in the
+ * query buffer. */
+static void waitForSwappedKeysOfCommand(redisClient *c,
+                                        struct redisCommand *cmd,
+                                        robj **argv, int argc)
+{
+    int j, last;
+
+    if (cmd->vm_preload_proc != NULL) {
+        robj **orig_argv = c->argv;
+        int orig_argc = c->argc;
+
+        /* Preload procs take the arguments from the client */
+        c->argv = argv;
+        c->argc = argc;
+        cmd->vm_preload_proc(c);
+        c->argv = orig_argv;
+        c->argc = orig_argc;
+    } else {
+        if (cmd->vm_firstkey == 0) return;
+        last = cmd->vm_lastkey;
+        if (last < 0) last = argc+last;
+        for (j = cmd->vm_firstkey; j <= last; j += cmd->vm_keystep)
+            waitForSwappedKey(c,argv[j]);
+    }
+}
+
+/* Preload the keys of all the commands queued by MULTI, so that EXEC will
+ * load them in parallel and block the client just once. Commands after a
+ * SELECT are not considered, as they are about another DB. */
+static void execBlockClientOnSwappedKeys(redisClient *c) {
+    int j;
+
+    if (!(c->flags & REDIS_MULTI)) return;
+    for (j = 0; j < c->mstate.count; j++) {
+        multiCmd *mc = c->mstate.commands+j;
+
+        if (mc->cmd->proc == selectCommand) break;
+        waitForSwappedKeysOfCommand(c,mc->cmd,mc->argv,mc->argc);
+    }
+}
+
+/* Parse the command at the start of the 'len' bytes at 'p', part of a client
+ * query buffer, without consuming it. Both the inline protocol (including
+ * the bulk argument of REDIS_CMD_BULK commands) and the multi bulk protocol
+ * are understood.
+ *
+ * On success the length of the command is returned, and *argvp / *argcp are
+ * set to a new vector of string objects the caller should release. Zero is
+ * returned if the command is incomplete or on protocol errors. */
+static size_t parseQueryBufferCommand(char *p, size_t len, robj ***argvp,
+                                      int *argcp)
+{
+    char *start = p, *end = p+len, *nl;
+    robj **argv = NULL;
+    int argc = 0, j;
+    long bulklen;
+
+    if ((nl = memchr(p,'\n',end-p)) == NULL) return 0;
+    if (*p == '*') {
+        long count = strtol(p+1,NULL,10);
+
+        /* Every argument needs at least "$0\r\n\r\n" */
+        p = nl+1;
+        if (count <= 0 || count > (end-p)/6) return 0;
+        argv = zmalloc(sizeof(robj*)*count);
+        while (argc < count) {
+            if (p >= end || *p != '$' ||
+                (nl = memchr(p,'\n',end-p)) == NULL) goto badcmd;
+            bulklen = strtol(p+1,NULL,10);
+            p = nl+1;
+            if (bulklen < 0 || end-p < bulklen+2) goto badcmd;
+            argv[argc++] = createStringObject(p,bulklen);
+            p += bulklen+2;
+        }
+    } else {
+        struct redisCommand *cmd;
+        int nargs;
+        sds *args;
+
+        args = sdssplitlen(p,(nl > p && *(nl-1) == '\r') ? nl-p-1 : nl-p,
+                           " ",1,&nargs);
+        p = nl+1;
+        argv = zmalloc(sizeof(robj*)*(nargs ? nargs : 1));
+        for (j = 0; j < nargs; j++) {
+            if (sdslen(args[j]))
+                argv[argc++] = createObject(REDIS_STRING,args[j]);
+            else
+                sdsfree(args[j]);
+        }
+        zfree(args);
+        cmd = argc ? lookupCommand(argv[0]->ptr) : NULL;
+        if (cmd && cmd->flags & REDIS_CMD_BULK && argc > 1) {
+            bulklen = strtol(argv[argc-1]->ptr,NULL,10);
+            if (bulklen < 0 || end-p < bulklen+2) goto badcmd;
+            decrRefCount(argv[argc-1]);
+            argv[argc-1] = createStringObject(p,bulklen);
+            p += bulklen+2;
+        }
+    }
+    *argvp = argv;
+    *argcp = argc;
+    return p-start;
+
+badcmd:
+    for (j = 0; j < argc; j++) decrRefCount(argv[j]);
+    zfree(argv);
+    return 0;
+}
+
+/* Called when the client is going to wait for the keys of the current
+ * command. As it has to wait anyway, make it wait for the keys of the
+ * commands pipelined after this one as well: they are loaded in parallel,
+ * instead of blocking the client again for every command.
+ *
+ * Up to REDIS_VM_PREFETCH_MAX commands already in the query buffer are
+ * considered, stopping at the first SELECT. */
+static void waitForSwappedKeysOfPipeline(redisClient *c) {
+    char *p = c->querybuf;
+    size_t len = sdslen(c->querybuf), used;
+    int n, j, argc, stop = 0;
+    robj **argv;
+
+    for (n = 0; n < REDIS_VM_PREFETCH_MAX && !stop; n++) {
+        struct redisCommand *cmd;
+
+        if ((used = parseQueryBufferCommand(p,len,&argv,&argc)) == 0) break;
+        p += used;
+        len -= used;
+        cmd = argc ? lookupCommand(argv[0]->ptr) : NULL;
+        if (cmd && cmd->proc == selectCommand) {
+            stop = 1;
+        } else if (cmd && !((cmd->arity > 0 && cmd->arity != argc) ||
+                            (argc < -cmd->arity))) {
+            waitForSwappedKeysOfCommand(c,cmd,argv,argc);
+        }
+        for (j = 0; j < argc; j++) decrRefCount(argv[j]);
+        zfree(argv);
+    }
+}
+
 /* Is this client attempting to run a command against swapped keys?
  * If so, block it ASAP, load the keys in background, then resume it.
  *
@@ -8890,20 +11481,11 @@ static void zunionInterBlockClientOnSwappedKeys(redisClient *c) {
  * Return 1 if the client is marked as blocked, 0 if the client can
  * continue as the keys it is going to access appear to be in memory. */
 static int blockClientOnSwappedKeys(struct redisCommand *cmd, redisClient *c) {
-    int j, last;
-
-    if (cmd->vm_preload_proc != NULL) {
-        cmd->vm_preload_proc(c);
-    } else {
-        if (cmd->vm_firstkey == 0) return 0;
-        last = cmd->vm_lastkey;
-        if (last < 0) last = c->argc+last;
-        for (j = cmd->vm_firstkey; j <= last; j += cmd->vm_keystep)
-            waitForSwappedKey(c,c->argv[j]);
-    }
+    waitForSwappedKeysOfCommand(c,cmd,c->argv,c->argc);
 
     /* If the client was blocked for at least one key, mark it as blocked. */
     if (listLength(c->io_keys)) {
+        waitForSwappedKeysOfPipeline(c);
         c->flags |= REDIS_IO_WAIT;
         aeDeleteFileEvent(server.el,c->fd,AE_READABLE);
         server.vm_blocked_clients++;
@@ -9022,12 +11604,22 @@ static void debugCommand(redisClient *c) {
                 "encoding:%s serializedlength:%lld\r\n",
                 (void*)key, key->refcount, (void*)val, val->refcount,
                 strenc, (long long) rdbSavedObjectLen(val,NULL)));
+        } else if (server.vm_tier_node != -1) {
+            addReplySds(c,sdscatprintf(sdsempty(),
+                "+Key at:%p refcount:%d, value at:%p moved to NUMA node %d "
+                "using %llu bytes, length:%lu\r\n",
+                (void*)key, key->refcount, (void*)key->vm.tierval,
+                server.vm_tier_node, (unsigned long long) key->vm.usedpages,
+                key->vm.vlen));
         } else {
             addReplySds(c,sdscatprintf(sdsempty(),
                 "+Key at:%p refcount:%d, value swapped at: page %llu "
-                "using %llu pages\r\n",
+                "using %llu pages in %lu chunks%s, length:%lu\r\n",
                 (void*)key, key->refcount, (unsigned long long) key->vm.page,
-                (unsigned long long) key->vm.usedpages));
+                (unsigned long long) key->vm.usedpages,
+                key->vm.chunks ? key->vm.chunks->chunks : 1,
+                key->vm.compressed ? " (compressed)" : "",
+                key->vm.vlen));
         }
     } else if (!strcasecmp(c->argv[1]->ptr,"swapout") && c->argc == 3) {
         dictEntry *de = dictFind(c->db->dict,c->argv[2]);
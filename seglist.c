@@ -0,0 +1,362 @@
+/* Segmented list: a list of strings stored in packed segments.
+ *
+ * This file implements a doubly linked list of segments, where every segment
+ * is a single allocation holding many elements packed one after the other.
+ * Compared to a linked list of objects this uses one allocation every few
+ * hundred elements instead of three allocations per element, and every
+ * segment caches the number of elements it contains, so that seeking to a
+ * given index only needs to walk the segments, and then a single segment.
+ *
+ * The Redis List type uses this data structure for lists composed of many
+ * elements, after the small linked list encoding reaches the configured
+ * number of elements.
+ *
+ * --------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2010, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Memory layout of a segment holding the elements "foo" and "hello":
+ *
+ * <len>"foo"<len><len>"hello"<len>
+ *
+ * Every element is stored with its length both before and after the string,
+ * so that a segment can be walked in both directions.
+ *
+ * <len> is encoded in a single byte if the length is between 0 and 253.
+ * Otherwise it is encoded as the byte 254 plus a four bytes unsigned integer
+ * (in the host byte ordering): the marker byte comes first in the leading
+ * length, and last in the trailing length.
+ *
+ * Elements are never split across segments. An element that does not fit a
+ * standard segment gets a dedicated segment of the right size. Segments are
+ * freed as soon as they get empty, but are never merged.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "seglist.h"
+#include "zmalloc.h"
+
+#define SEGLIST_BIGLEN 254
+
+/* Return the number of bytes needed to store an element of 'len' bytes. */
+static unsigned int seglistEntryBytes(unsigned int len) {
+    return len + (len < SEGLIST_BIGLEN ? 2 : 10);
+}
+
+/* Return the size of the element starting at 'p'. */
+static unsigned int seglistEntrySize(unsigned char *p) {
+    unsigned int len;
+
+    if (p[0] < SEGLIST_BIGLEN) return p[0]+2;
+    memcpy(&len,p+1,sizeof(len));
+    return len+10;
+}
+
+/* Return the size of the element ending just before 'p'. */
+static unsigned int seglistPrevEntrySize(unsigned char *p) {
+    unsigned int len;
+
+    if (p[-1] < SEGLIST_BIGLEN) return p[-1]+2;
+    memcpy(&len,p-5,sizeof(len));
+    return len+10;
+}
+
+static void seglistWriteEntry(unsigned char *p, unsigned char *s, unsigned int len) {
+    if (len < SEGLIST_BIGLEN) {
+        p[0] = len;
+        memcpy(p+1,s,len);
+        p[len+1] = len;
+    } else {
+        p[0] = SEGLIST_BIGLEN;
+        memcpy(p+1,&len,sizeof(len));
+        memcpy(p+5,s,len);
+        memcpy(p+5+len,&len,sizeof(len));
+        p[len+9] = SEGLIST_BIGLEN;
+    }
+}
+
+/* Allocate a new segment and link it at the head or at the tail of 'sl'. */
+static seglistSegment *seglistAddSegment(seglist *sl, unsigned int size, int where) {
+    seglistSegment *seg;
+
+    if (size < SEGLIST_SEGMENT_BYTES) size = SEGLIST_SEGMENT_BYTES;
+    seg = zmalloc(sizeof(*seg)+size);
+    seg->count = 0;
+    seg->used = 0;
+    seg->size = size;
+    if (where == SEGLIST_HEAD) {
+        seg->prev = NULL;
+        seg->next = sl->head;
+        if (sl->head) sl->head->prev = seg; else sl->tail = seg;
+        sl->head = seg;
+    } else {
+        seg->prev = sl->tail;
+        seg->next = NULL;
+        if (sl->tail) sl->tail->next = seg; else sl->head = seg;
+        sl->tail = seg;
+    }
+    sl->segments++;
+    sl->bytes += sizeof(*seg)+size;
+    return seg;
+}
+
+static void seglistFreeSegment(seglist *sl, seglistSegment *seg) {
+    if (seg->prev) seg->prev->next = seg->next; else sl->head = seg->next;
+    if (seg->next) seg->next->prev = seg->prev; else sl->tail = seg->prev;
+    sl->segments--;
+    sl->bytes -= sizeof(*seg)+seg->size;
+    zfree(seg);
+}
+
+/* Create a new empty seglist. */
+seglist *seglistCreate(void) {
+    seglist *sl = zmalloc(sizeof(*sl));
+
+    sl->head = sl->tail = NULL;
+    sl->len = 0;
+    sl->segments = 0;
+    sl->bytes = sizeof(*sl);
+    return sl;
+}
+
+void seglistRelease(seglist *sl) {
+    seglistSegment *seg = sl->head, *next;
+
+    while(seg) {
+        next = seg->next;
+        zfree(seg);
+        seg = next;
+    }
+    zfree(sl);
+}
+
+/* Add the string 's' of 'len' bytes at the head or at the tail of the list,
+ * accordingly to 'where' (SEGLIST_HEAD or SEGLIST_TAIL). */
+void seglistPush(seglist *sl, unsigned char *s, unsigned int len, int where) {
+    unsigned int need = seglistEntryBytes(len);
+    seglistSegment *seg;
+
+    if (where == SEGLIST_HEAD) {
+        seg = sl->head;
+        if (!seg || seg->size - seg->used < need)
+            seg = seglistAddSegment(sl,need,SEGLIST_HEAD);
+        memmove(seg->data+need,seg->data,seg->used);
+        seglistWriteEntry(seg->data,s,len);
+    } else {
+        seg = sl->tail;
+        if (!seg || seg->size - seg->used < need)
+            seg = seglistAddSegment(sl,need,SEGLIST_TAIL);
+        seglistWriteEntry(seg->data+seg->used,s,len);
+    }
+    seg->used += need;
+    seg->count++;
+    sl->len++;
+}
+
+/* Point 'it' to the element at 'index'. Negative indexes count from the
+ * tail, -1 being the last element. Only the segments between the nearest
+ * end of the list and the target segment are visited, using the cached
+ * element counts, then the target segment is scanned from its nearest end.
+ *
+ * Returns 0 (and sets it->seg to NULL) if the index is out of range. */
+int seglistIndex(seglist *sl, long index, seglistIter *it) {
+    seglistSegment *seg;
+    unsigned long i;
+    unsigned int off;
+
+    if (index < 0) index += sl->len;
+    if (index < 0 || (unsigned long)index >= sl->len) {
+        it->seg = NULL;
+        return 0;
+    }
+    if ((unsigned long)index < sl->len/2) {
+        seg = sl->head;
+        i = index;
+        while(i >= seg->count) {
+            i -= seg->count;
+            seg = seg->next;
+        }
+    } else {
+        seg = sl->tail;
+        i = sl->len-1-index;
+        while(i >= seg->count) {
+            i -= seg->count;
+            seg = seg->prev;
+        }
+        i = seg->count-1-i;
+    }
+    if (i < seg->count/2) {
+        off = 0;
+        while(i--) off += seglistEntrySize(seg->data+off);
+    } else {
+        i = seg->count-i;
+        off = seg->used;
+        while(i--) off -= seglistPrevEntrySize(seg->data+off);
+    }
+    it->seg = seg;
+    it->offset = off;
+    return 1;
+}
+
+/* Get the string of the element the iterator points to. The returned
+ * pointer is only valid until the list is modified. */
+void seglistGet(seglistIter *it, unsigned char **s, unsigned int *len) {
+    unsigned char *p = it->seg->data+it->offset;
+
+    if (p[0] < SEGLIST_BIGLEN) {
+        *len = p[0];
+        *s = p+1;
+    } else {
+        memcpy(len,p+1,sizeof(*len));
+        *s = p+5;
+    }
+}
+
+/* Move the iterator to the next element. Returns 0 when the tail is passed. */
+int seglistNext(seglistIter *it) {
+    seglistSegment *seg = it->seg;
+
+    if (!seg) return 0;
+    it->offset += seglistEntrySize(seg->data+it->offset);
+    if (it->offset >= seg->used) {
+        it->seg = seg->next;
+        it->offset = 0;
+    }
+    return it->seg != NULL;
+}
+
+/* Move the iterator to the previous element. Returns 0 when the head is
+ * passed. */
+int seglistPrev(seglistIter *it) {
+    seglistSegment *seg = it->seg;
+
+    if (!seg) return 0;
+    if (it->offset == 0) {
+        seg = it->seg = seg->prev;
+        if (!seg) return 0;
+        it->offset = seg->used;
+    }
+    it->offset -= seglistPrevEntrySize(seg->data+it->offset);
+    return 1;
+}
+
+/* Delete the element the iterator points to. The iterator is updated to
+ * point to the element that followed the deleted one in the specified
+ * direction (SEGLIST_TAIL to move towards the tail, SEGLIST_HEAD towards the
+ * head), so that deletions can be performed while iterating. */
+void seglistDelete(seglist *sl, seglistIter *it, int direction) {
+    seglistSegment *seg = it->seg;
+    unsigned int off = it->offset;
+    unsigned int n = seglistEntrySize(seg->data+off);
+
+    memmove(seg->data+off,seg->data+off+n,seg->used-off-n);
+    seg->used -= n;
+    seg->count--;
+    sl->len--;
+    if (seg->count == 0) {
+        seglistSegment *prev = seg->prev, *next = seg->next;
+
+        seglistFreeSegment(sl,seg);
+        if (direction == SEGLIST_TAIL) {
+            it->seg = next;
+            it->offset = 0;
+        } else {
+            it->seg = prev;
+            if (prev)
+                it->offset = prev->used-seglistPrevEntrySize(prev->data+prev->used);
+        }
+    } else if (direction == SEGLIST_TAIL) {
+        if (off >= seg->used) {
+            it->seg = seg->next;
+            it->offset = 0;
+        }
+    } else {
+        seglistPrev(it);
+    }
+}
+
+/* Replace the element the iterator points to with the string 's' of 'len'
+ * bytes. The segment is reallocated if the new element does not fit. */
+void seglistReplace(seglist *sl, seglistIter *it, unsigned char *s, unsigned int len) {
+    seglistSegment *seg = it->seg;
+    unsigned int off = it->offset;
+    unsigned int oldn = seglistEntrySize(seg->data+off);
+    unsigned int newn = seglistEntryBytes(len);
+    unsigned int used = seg->used-oldn+newn;
+
+    if (used > seg->size) {
+        sl->bytes += used-seg->size;
+        seg = zrealloc(seg,sizeof(*seg)+used);
+        seg->size = used;
+        if (seg->prev) seg->prev->next = seg; else sl->head = seg;
+        if (seg->next) seg->next->prev = seg; else sl->tail = seg;
+        it->seg = seg;
+    }
+    memmove(seg->data+off+newn,seg->data+off+oldn,seg->used-off-oldn);
+    seglistWriteEntry(seg->data+off,s,len);
+    seg->used = used;
+}
+
+/* Remove 'ltrim' elements from the head and 'rtrim' elements from the tail
+ * of the list. Whole segments are dropped without scanning them. */
+void seglistTrim(seglist *sl, unsigned long ltrim, unsigned long rtrim) {
+    seglistSegment *seg;
+    unsigned int off;
+    unsigned long j;
+
+    if (ltrim+rtrim >= sl->len) {
+        ltrim = sl->len;
+        rtrim = 0;
+    }
+    sl->len -= ltrim+rtrim;
+    while(ltrim && sl->head->count <= ltrim) {
+        ltrim -= sl->head->count;
+        seglistFreeSegment(sl,sl->head);
+    }
+    if (ltrim) {
+        seg = sl->head;
+        off = 0;
+        for (j = 0; j < ltrim; j++) off += seglistEntrySize(seg->data+off);
+        memmove(seg->data,seg->data+off,seg->used-off);
+        seg->used -= off;
+        seg->count -= ltrim;
+    }
+    while(rtrim && sl->tail->count <= rtrim) {
+        rtrim -= sl->tail->count;
+        seglistFreeSegment(sl,sl->tail);
+    }
+    if (rtrim) {
+        seg = sl->tail;
+        off = seg->used;
+        for (j = 0; j < rtrim; j++) off -= seglistPrevEntrySize(seg->data+off);
+        seg->used = off;
+        seg->count -= rtrim;
+    }
+}
@@ -0,0 +1,85 @@
+/* Segmented list: a list of strings stored in packed segments.
+ *
+ * See seglist.c for more info.
+ *
+ * --------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2010, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __SEGLIST_H
+#define __SEGLIST_H
+
+#include <stddef.h>
+
+/* Data bytes of a standard segment, chosen so that a segment together with
+ * its header and the allocator header fits a 4k page. */
+#define SEGLIST_SEGMENT_BYTES 4000
+
+#define SEGLIST_HEAD 0
+#define SEGLIST_TAIL 1
+
+typedef struct seglistSegment {
+    struct seglistSegment *prev;
+    struct seglistSegment *next;
+    unsigned int count;     /* Number of elements stored in data[] */
+    unsigned int used;      /* Bytes of data[] in use */
+    unsigned int size;      /* Bytes of data[] allocated */
+    unsigned char data[];
+} seglistSegment;
+
+typedef struct seglist {
+    seglistSegment *head;
+    seglistSegment *tail;
+    unsigned long len;      /* Total number of elements */
+    unsigned long segments; /* Number of segments */
+    size_t bytes;           /* Allocated bytes, headers included */
+} seglist;
+
+/* An iterator points to a single element: seg is NULL when the iterator
+ * moved past the head or the tail of the list. */
+typedef struct seglistIter {
+    seglistSegment *seg;
+    unsigned int offset;    /* Offset of the element inside seg->data */
+} seglistIter;
+
+#define seglistLength(sl) ((sl)->len)
+#define seglistBytes(sl) ((sl)->bytes)
+
+seglist *seglistCreate(void);
+void seglistRelease(seglist *sl);
+void seglistPush(seglist *sl, unsigned char *s, unsigned int len, int where);
+int seglistIndex(seglist *sl, long index, seglistIter *it);
+void seglistGet(seglistIter *it, unsigned char **s, unsigned int *len);
+int seglistNext(seglistIter *it);
+int seglistPrev(seglistIter *it);
+void seglistDelete(seglist *sl, seglistIter *it, int direction);
+void seglistReplace(seglist *sl, seglistIter *it, unsigned char *s, unsigned int len);
+void seglistTrim(seglist *sl, unsigned long ltrim, unsigned long rtrim);
+
+#endif /* __SEGLIST_H */
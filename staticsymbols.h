@@ -3,15 +3,23 @@ static struct redisFunctionSym symsTable[] = {
 {"_redisAssert",(unsigned long)_redisAssert},
 {"acceptHandler",(unsigned long)acceptHandler},
 {"addReply",(unsigned long)addReply},
+{"addReplyBuffer",(unsigned long)addReplyBuffer},
 {"addReplyBulk",(unsigned long)addReplyBulk},
+{"addReplyBulkBuffer",(unsigned long)addReplyBulkBuffer},
 {"addReplyBulkLen",(unsigned long)addReplyBulkLen},
 {"addReplyDouble",(unsigned long)addReplyDouble},
+{"addReplyListTypeElement",(unsigned long)addReplyListTypeElement},
 {"addReplyLong",(unsigned long)addReplyLong},
+{"addReplyLongLong",(unsigned long)addReplyLongLong},
+{"addReplyLongWithPrefix",(unsigned long)addReplyLongWithPrefix},
+{"addReplyMultiBulkLen",(unsigned long)addReplyMultiBulkLen},
 {"addReplySds",(unsigned long)addReplySds},
+{"addReplyShared",(unsigned long)addReplyShared},
 {"addReplyUlong",(unsigned long)addReplyUlong},
 {"aofRemoveTempFile",(unsigned long)aofRemoveTempFile},
 {"appendCommand",(unsigned long)appendCommand},
 {"appendServerSaveParams",(unsigned long)appendServerSaveParams},
+{"appendToReplyTail",(unsigned long)appendToReplyTail},
 {"authCommand",(unsigned long)authCommand},
 {"beforeSleep",(unsigned long)beforeSleep},
 {"bgrewriteaofCommand",(unsigned long)bgrewriteaofCommand},
@@ -21,9 +29,11 @@ static struct redisFunctionSym symsTable[] = {
 {"blockingPopGenericCommand",(unsigned long)blockingPopGenericCommand},
 {"blpopCommand",(unsigned long)blpopCommand},
 {"brpopCommand",(unsigned long)brpopCommand},
+{"bulkHeader",(unsigned long)bulkHeader},
 {"bytesToHuman",(unsigned long)bytesToHuman},
 {"call",(unsigned long)call},
 {"checkType",(unsigned long)checkType},
+{"chunkedBlockClientOnSwappedKeys",(unsigned long)chunkedBlockClientOnSwappedKeys},
 {"closeTimedoutClients",(unsigned long)closeTimedoutClients},
 {"compareStringObjects",(unsigned long)compareStringObjects},
 {"computeObjectSwappability",(unsigned long)computeObjectSwappability},
@@ -33,6 +43,7 @@ static struct redisFunctionSym symsTable[] = {
 {"createListObject",(unsigned long)createListObject},
 {"createObject",(unsigned long)createObject},
 {"createSetObject",(unsigned long)createSetObject},
+{"createSharedHeaders",(unsigned long)createSharedHeaders},
 {"createSharedObjects",(unsigned long)createSharedObjects},
 {"createSortOperation",(unsigned long)createSortOperation},
 {"createStringObject",(unsigned long)createStringObject},
@@ -57,6 +68,8 @@ static struct redisFunctionSym symsTable[] = {
 {"dupClientReplyValue",(unsigned long)dupClientReplyValue},
 {"dupStringObject",(unsigned long)dupStringObject},
 {"echoCommand",(unsigned long)echoCommand},
+{"estimateObjectSize",(unsigned long)estimateObjectSize},
+{"execBlockClientOnSwappedKeys",(unsigned long)execBlockClientOnSwappedKeys},
 {"execCommand",(unsigned long)execCommand},
 {"existsCommand",(unsigned long)existsCommand},
 {"expandVmSwapFilename",(unsigned long)expandVmSwapFilename},
@@ -101,8 +114,10 @@ static struct redisFunctionSym symsTable[] = {
 {"hgetallCommand",(unsigned long)hgetallCommand},
 {"hkeysCommand",(unsigned long)hkeysCommand},
 {"hlenCommand",(unsigned long)hlenCommand},
+{"hscanCommand",(unsigned long)hscanCommand},
 {"hsetCommand",(unsigned long)hsetCommand},
 {"htNeedsResize",(unsigned long)htNeedsResize},
+{"htReserve",(unsigned long)htReserve},
 {"hvalsCommand",(unsigned long)hvalsCommand},
 {"incrCommand",(unsigned long)incrCommand},
 {"incrDecrCommand",(unsigned long)incrDecrCommand},
@@ -115,12 +130,27 @@ static struct redisFunctionSym symsTable[] = {
 {"isStringRepresentableAsLong",(unsigned long)isStringRepresentableAsLong},
 {"keysCommand",(unsigned long)keysCommand},
 {"lastsaveCommand",(unsigned long)lastsaveCommand},
+{"lenGenericCommand",(unsigned long)lenGenericCommand},
 {"lindexCommand",(unsigned long)lindexCommand},
+{"listTypeConvert",(unsigned long)listTypeConvert},
+{"listTypeDelete",(unsigned long)listTypeDelete},
+{"listTypeEqual",(unsigned long)listTypeEqual},
+{"listTypeGet",(unsigned long)listTypeGet},
+{"listTypeInitIterator",(unsigned long)listTypeInitIterator},
+{"listTypeLength",(unsigned long)listTypeLength},
+{"listTypeNext",(unsigned long)listTypeNext},
+{"listTypePop",(unsigned long)listTypePop},
+{"listTypePush",(unsigned long)listTypePush},
+{"listTypeReplace",(unsigned long)listTypeReplace},
+{"listTypeTrim",(unsigned long)listTypeTrim},
+{"ll2string",(unsigned long)ll2string},
 {"llenCommand",(unsigned long)llenCommand},
 {"loadServerConfig",(unsigned long)loadServerConfig},
+{"lockIOThreads",(unsigned long)lockIOThreads},
 {"lockThreadedIO",(unsigned long)lockThreadedIO},
 {"lookupKey",(unsigned long)lookupKey},
 {"lookupKeyByPattern",(unsigned long)lookupKeyByPattern},
+{"lookupKeyMetadata",(unsigned long)lookupKeyMetadata},
 {"lookupKeyRead",(unsigned long)lookupKeyRead},
 {"lookupKeyReadOrReply",(unsigned long)lookupKeyReadOrReply},
 {"lookupKeyWrite",(unsigned long)lookupKeyWrite},
@@ -139,12 +169,16 @@ static struct redisFunctionSym symsTable[] = {
 {"msetnxCommand",(unsigned long)msetnxCommand},
 {"multiCommand",(unsigned long)multiCommand},
 {"oom",(unsigned long)oom},
+{"parseQueryBufferCommand",(unsigned long)parseQueryBufferCommand},
+{"parseScanCursorOrReply",(unsigned long)parseScanCursorOrReply},
 {"pingCommand",(unsigned long)pingCommand},
 {"popGenericCommand",(unsigned long)popGenericCommand},
+{"prepareClientToWrite",(unsigned long)prepareClientToWrite},
 {"processCommand",(unsigned long)processCommand},
 {"processInputBuffer",(unsigned long)processInputBuffer},
 {"pushGenericCommand",(unsigned long)pushGenericCommand},
 {"qsortCompareSetsByCardinality",(unsigned long)qsortCompareSetsByCardinality},
+{"qsortCompareZsetEntryByScore",(unsigned long)qsortCompareZsetEntryByScore},
 {"qsortCompareZsetopsrcByCardinality",(unsigned long)qsortCompareZsetopsrcByCardinality},
 {"queueIOJob",(unsigned long)queueIOJob},
 {"queueMultiCommand",(unsigned long)queueMultiCommand},
@@ -163,6 +197,7 @@ static struct redisFunctionSym symsTable[] = {
 {"rdbSaveBackground",(unsigned long)rdbSaveBackground},
 {"rdbSaveDoubleValue",(unsigned long)rdbSaveDoubleValue},
 {"rdbSaveLen",(unsigned long)rdbSaveLen},
+{"rdbSaveListTypeElement",(unsigned long)rdbSaveListTypeElement},
 {"rdbSaveLzfStringObject",(unsigned long)rdbSaveLzfStringObject},
 {"rdbSaveObject",(unsigned long)rdbSaveObject},
 {"rdbSaveRawString",(unsigned long)rdbSaveRawString},
@@ -188,6 +223,9 @@ static struct redisFunctionSym symsTable[] = {
 {"rpushCommand",(unsigned long)rpushCommand},
 {"saddCommand",(unsigned long)saddCommand},
 {"saveCommand",(unsigned long)saveCommand},
+{"scanCallback",(unsigned long)scanCallback},
+{"scanCommand",(unsigned long)scanCommand},
+{"scanGenericCommand",(unsigned long)scanGenericCommand},
 {"scardCommand",(unsigned long)scardCommand},
 {"sdiffCommand",(unsigned long)sdiffCommand},
 {"sdiffstoreCommand",(unsigned long)sdiffstoreCommand},
@@ -200,6 +238,7 @@ static struct redisFunctionSym symsTable[] = {
 {"sendReplyToClientWritev",(unsigned long)sendReplyToClientWritev},
 {"serverCron",(unsigned long)serverCron},
 {"setCommand",(unsigned long)setCommand},
+{"setDeferredMultiBulkLen",(unsigned long)setDeferredMultiBulkLen},
 {"setExpire",(unsigned long)setExpire},
 {"setGenericCommand",(unsigned long)setGenericCommand},
 {"setnxCommand",(unsigned long)setnxCommand},
@@ -207,16 +246,22 @@ static struct redisFunctionSym symsTable[] = {
 {"shutdownCommand",(unsigned long)shutdownCommand},
 {"sinterCommand",(unsigned long)sinterCommand},
 {"sinterGenericCommand",(unsigned long)sinterGenericCommand},
+{"sintercardCommand",(unsigned long)sintercardCommand},
 {"sinterstoreCommand",(unsigned long)sinterstoreCommand},
 {"sismemberCommand",(unsigned long)sismemberCommand},
 {"slaveofCommand",(unsigned long)slaveofCommand},
 {"smoveCommand",(unsigned long)smoveCommand},
 {"sortCommand",(unsigned long)sortCommand},
 {"sortCompare",(unsigned long)sortCompare},
+{"sortHeapSiftDown",(unsigned long)sortHeapSiftDown},
+{"sortRadix",(unsigned long)sortRadix},
+{"sortScoreKey",(unsigned long)sortScoreKey},
+{"sortTopK",(unsigned long)sortTopK},
 {"spawnIOThread",(unsigned long)spawnIOThread},
 {"spopCommand",(unsigned long)spopCommand},
 {"srandmemberCommand",(unsigned long)srandmemberCommand},
 {"sremCommand",(unsigned long)sremCommand},
+{"sscanCommand",(unsigned long)sscanCommand},
 {"stringObjectLen",(unsigned long)stringObjectLen},
 {"substrCommand",(unsigned long)substrCommand},
 {"sunionCommand",(unsigned long)sunionCommand},
@@ -234,31 +279,79 @@ static struct redisFunctionSym symsTable[] = {
 {"ttlCommand",(unsigned long)ttlCommand},
 {"typeCommand",(unsigned long)typeCommand},
 {"unblockClientWaitingData",(unsigned long)unblockClientWaitingData},
+{"unlockIOThreads",(unsigned long)unlockIOThreads},
 {"unlockThreadedIO",(unsigned long)unlockThreadedIO},
 {"updateSlavesWaitingBgsave",(unsigned long)updateSlavesWaitingBgsave},
+{"vmAddFreeExtent",(unsigned long)vmAddFreeExtent},
 {"vmCanSwapOut",(unsigned long)vmCanSwapOut},
 {"vmCancelThreadedIOJob",(unsigned long)vmCancelThreadedIOJob},
+{"vmChunkedKey",(unsigned long)vmChunkedKey},
+{"vmChunkedKeyRead",(unsigned long)vmChunkedKeyRead},
+{"vmChunkedListIndex",(unsigned long)vmChunkedListIndex},
+{"vmChunkedLookup",(unsigned long)vmChunkedLookup},
+{"vmCompressObject",(unsigned long)vmCompressObject},
+{"vmDelFreeExtent",(unsigned long)vmDelFreeExtent},
+{"vmEncodeObject",(unsigned long)vmEncodeObject},
+{"vmExtentCreateNode",(unsigned long)vmExtentCreateNode},
+{"vmExtentDelete",(unsigned long)vmExtentDelete},
+{"vmExtentInsert",(unsigned long)vmExtentInsert},
+{"vmExtentKeyLess",(unsigned long)vmExtentKeyLess},
+{"vmExtentLast",(unsigned long)vmExtentLast},
+{"vmExtentListCreate",(unsigned long)vmExtentListCreate},
+{"vmExtentSearch",(unsigned long)vmExtentSearch},
 {"vmFindContiguousPages",(unsigned long)vmFindContiguousPages},
+{"vmFindIOJob",(unsigned long)vmFindIOJob},
 {"vmFreePage",(unsigned long)vmFreePage},
 {"vmGenericLoadObject",(unsigned long)vmGenericLoadObject},
+{"vmGetIOJob",(unsigned long)vmGetIOJob},
+{"vmIOJobProcessed",(unsigned long)vmIOJobProcessed},
+{"vmIOThreadsStats",(unsigned long)vmIOThreadsStats},
 {"vmInit",(unsigned long)vmInit},
+{"vmIsSwappable",(unsigned long)vmIsSwappable},
+{"vmLoadChunkElement",(unsigned long)vmLoadChunkElement},
 {"vmLoadObject",(unsigned long)vmLoadObject},
+{"vmLoadObjectFromBuffer",(unsigned long)vmLoadObjectFromBuffer},
 {"vmMarkPageFree",(unsigned long)vmMarkPageFree},
 {"vmMarkPageUsed",(unsigned long)vmMarkPageUsed},
 {"vmMarkPagesFree",(unsigned long)vmMarkPagesFree},
 {"vmMarkPagesUsed",(unsigned long)vmMarkPagesUsed},
+{"vmOpenChunks",(unsigned long)vmOpenChunks},
+{"vmPositionalIO",(unsigned long)vmPositionalIO},
 {"vmPreviewObject",(unsigned long)vmPreviewObject},
 {"vmReadObjectFromSwap",(unsigned long)vmReadObjectFromSwap},
 {"vmReopenSwapFile",(unsigned long)vmReopenSwapFile},
+{"vmSaveChunkedObject",(unsigned long)vmSaveChunkedObject},
+{"vmSerializeObject",(unsigned long)vmSerializeObject},
 {"vmSwapObjectBlocking",(unsigned long)vmSwapObjectBlocking},
 {"vmSwapObjectThreaded",(unsigned long)vmSwapObjectThreaded},
 {"vmSwapOneObject",(unsigned long)vmSwapOneObject},
 {"vmSwapOneObjectBlocking",(unsigned long)vmSwapOneObjectBlocking},
 {"vmSwapOneObjectThreaded",(unsigned long)vmSwapOneObjectThreaded},
+{"vmSwapPoolInsert",(unsigned long)vmSwapPoolInsert},
+{"vmSwapPoolRefresh",(unsigned long)vmSwapPoolRefresh},
 {"vmThreadedIOCompletedJob",(unsigned long)vmThreadedIOCompletedJob},
+{"vmTierFreeObject",(unsigned long)vmTierFreeObject},
+{"vmTierInit",(unsigned long)vmTierInit},
+{"vmTierLoadObject",(unsigned long)vmTierLoadObject},
+{"vmTierMoveObject",(unsigned long)vmTierMoveObject},
+{"vmTierQueueDict",(unsigned long)vmTierQueueDict},
+{"vmTierQueueObject",(unsigned long)vmTierQueueObject},
+{"vmTierSwapObject",(unsigned long)vmTierSwapObject},
+{"vmUringAllocBuffer",(unsigned long)vmUringAllocBuffer},
+{"vmUringCompletedJob",(unsigned long)vmUringCompletedJob},
+{"vmUringFill",(unsigned long)vmUringFill},
+{"vmUringInit",(unsigned long)vmUringInit},
+{"vmUringQueueJob",(unsigned long)vmUringQueueJob},
+{"vmUringReap",(unsigned long)vmUringReap},
+{"vmUringSubmit",(unsigned long)vmUringSubmit},
+{"vmUringWait",(unsigned long)vmUringWait},
+{"vmUsedMemory",(unsigned long)vmUsedMemory},
+{"vmWriteBufferOnSwap",(unsigned long)vmWriteBufferOnSwap},
 {"vmWriteObjectOnSwap",(unsigned long)vmWriteObjectOnSwap},
 {"waitEmptyIOJobsQueue",(unsigned long)waitEmptyIOJobsQueue},
 {"waitForSwappedKey",(unsigned long)waitForSwappedKey},
+{"waitForSwappedKeysOfCommand",(unsigned long)waitForSwappedKeysOfCommand},
+{"waitForSwappedKeysOfPipeline",(unsigned long)waitForSwappedKeysOfPipeline},
 {"yesnotoi",(unsigned long)yesnotoi},
 {"zaddCommand",(unsigned long)zaddCommand},
 {"zaddGenericCommand",(unsigned long)zaddGenericCommand},
@@ -276,13 +369,16 @@ static struct redisFunctionSym symsTable[] = {
 {"zremrangebyscoreCommand",(unsigned long)zremrangebyscoreCommand},
 {"zrevrangeCommand",(unsigned long)zrevrangeCommand},
 {"zrevrankCommand",(unsigned long)zrevrankCommand},
+{"zscanCommand",(unsigned long)zscanCommand},
 {"zscoreCommand",(unsigned long)zscoreCommand},
+{"zsetAdd",(unsigned long)zsetAdd},
+{"zslBulkLoad",(unsigned long)zslBulkLoad},
 {"zslCreate",(unsigned long)zslCreate},
 {"zslCreateNode",(unsigned long)zslCreateNode},
 {"zslDelete",(unsigned long)zslDelete},
-{"zslFirstWithScore",(unsigned long)zslFirstWithScore},
 {"zslFree",(unsigned long)zslFree},
 {"zslFreeNode",(unsigned long)zslFreeNode},
+{"zslGetScoreRank",(unsigned long)zslGetScoreRank},
 {"zslInsert",(unsigned long)zslInsert},
 {"zslRandomLevel",(unsigned long)zslRandomLevel},
 {"zunionCommand",(unsigned long)zunionCommand},
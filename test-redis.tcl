@@ -287,6 +287,93 @@ proc main {server port} {
         $r dbsize
     } {0}
 
+    test {SCAN basics} {
+        for {set j 0} {$j < 1000} {incr j} {
+            $r set key:$j $j
+        }
+        set cur 0
+        set keys {}
+        while 1 {
+            set res [$r scan $cur]
+            set cur [lindex $res 0]
+            lappend keys {*}[lindex $res 1]
+            if {$cur == 0} break
+        }
+        llength [lsort -unique $keys]
+    } {1000}
+
+    test {SCAN COUNT and MATCH} {
+        set cur 0
+        set keys {}
+        while 1 {
+            set res [$r scan $cur count 100 match key:1??]
+            set cur [lindex $res 0]
+            lappend keys {*}[lindex $res 1]
+            if {$cur == 0} break
+        }
+        llength [lsort -unique $keys]
+    } {100}
+
+    test {SCAN returns every key even if the DB is resized while scanning} {
+        set cur 0
+        set keys {}
+        set j 1000
+        while 1 {
+            set res [$r scan $cur]
+            set cur [lindex $res 0]
+            lappend keys {*}[lindex $res 1]
+            for {set i 0} {$i < 50} {incr i} {
+                $r set key:$j $j
+                incr j
+            }
+            if {$cur == 0} break
+        }
+        set keys [lsort -unique $keys]
+        set missing 0
+        for {set i 0} {$i < 1000} {incr i} {
+            if {[lsearch -exact -sorted $keys key:$i] == -1} {incr missing}
+        }
+        $r flushdb
+        set missing
+    } {0}
+
+    test {SCAN with an invalid cursor} {
+        catch {$r scan foo} err
+        set err
+    } {ERR*}
+
+    test {SSCAN, HSCAN and ZSCAN} {
+        foreach j {1 2 3 4 5} {
+            $r sadd set $j
+            $r hset smallhash f$j v$j
+            $r zadd zset $j m$j
+        }
+        for {set j 0} {$j < 500} {incr j} {
+            $r hset bighash field:$j $j
+        }
+        set res {}
+        foreach {cmd key} {sscan set hscan smallhash hscan bighash
+                           zscan zset} {
+            set cur 0
+            set items {}
+            while 1 {
+                set reply [$r $cmd $key $cur]
+                set cur [lindex $reply 0]
+                lappend items {*}[lindex $reply 1]
+                if {$cur == 0} break
+            }
+            if {$cmd eq {sscan}} {
+                lappend res [lsort -unique $items]
+            } else {
+                lappend res [dict size $items]
+            }
+        }
+        lappend res [lindex [$r zscan zset 0 match m3] 1]
+        lappend res [$r sscan nokey 0]
+        $r del set smallhash bighash zset
+        set res
+    } {{1 2 3 4 5} 5 500 5 {m3 3} {0 {}}}
+
     test {Very big payload in GET/SET} {
         set buf [string repeat "abcd" 1000000]
         $r set foo $buf
@@ -478,6 +565,86 @@ proc main {server port} {
         format $ok
     } {2000}
 
+    test {Lists are converted into seglists once they grow} {
+        $r del biglist
+        for {set i 0} {$i < 10} {incr i} {$r rpush biglist $i}
+        set small [string match {*encoding:linkedlist*} [$r debug object biglist]]
+        for {set i 10} {$i < 1000} {incr i} {$r rpush biglist $i}
+        set big [string match {*encoding:seglist*} [$r debug object biglist]]
+        list $small $big [$r llen biglist] [$r lindex biglist 500]
+    } {1 1 1000 500}
+
+    test {Seglist LPUSH/RPUSH/LINDEX/LSET with small and big elements} {
+        $r del biglist
+        set model {}
+        set err {}
+        for {set i 0} {$i < 2000} {incr i} {
+            set rnd [expr {rand()}]
+            if {$rnd < 0.02} {
+                set ele "[string repeat x 5000]$i"
+            } elseif {$rnd < 0.2} {
+                set ele "[string repeat y 300]$i"
+            } else {
+                set ele $i
+            }
+            if {rand() < 0.5} {
+                $r lpush biglist $ele
+                set model [linsert $model 0 $ele]
+            } else {
+                $r rpush biglist $ele
+                lappend model $ele
+            }
+        }
+        for {set i 0} {$i < 200} {incr i} {
+            set idx [expr {int(rand()*2000)}]
+            set ele [lindex {a bb} [expr {$i%2}]][string repeat z [expr {$i*30}]]
+            $r lset biglist $idx $ele
+            lset model $idx $ele
+        }
+        for {set i 0} {$i < 500} {incr i} {
+            set idx [expr {int(rand()*2000)}]
+            if {[$r lindex biglist $idx] ne [lindex $model $idx]} {
+                set err "LINDEX $idx mismatch"
+            }
+            if {[$r lindex biglist [expr {-$idx-1}]] ne [lindex $model end-$idx]} {
+                set err "LINDEX -$idx-1 mismatch"
+            }
+        }
+        list $err [expr {[$r lrange biglist 0 -1] eq $model}] \
+            [expr {[$r lrange biglist 1500 1700] eq [lrange $model 1500 1700]}]
+    } {{} 1 1}
+
+    test {Seglist LREM, LTRIM, LPOP/RPOP and RPOPLPUSH} {
+        $r del biglist
+        set model {}
+        for {set i 0} {$i < 1000} {incr i} {
+            set ele [expr {($i % 7) == 0 ? "dup" : $i}]
+            $r rpush biglist $ele
+            lappend model $ele
+        }
+        set res {}
+        lappend res [$r lrem biglist -10 dup]
+        for {set i 0} {$i < 10} {incr i} {
+            set last [lindex [lsearch -exact -all $model dup] end]
+            set model [lreplace $model $last $last]
+        }
+        lappend res [expr {[$r lrange biglist 0 -1] eq $model}]
+        lappend res [$r lrem biglist 0 dup]
+        set model [lsearch -exact -all -inline -not $model dup]
+        $r ltrim biglist 10 -11
+        set model [lrange $model 10 end-10]
+        lappend res [expr {[$r lrange biglist 0 -1] eq $model}]
+        lappend res [expr {[$r lpop biglist] eq [lindex $model 0]}]
+        lappend res [expr {[$r rpop biglist] eq [lindex $model end]}]
+        set model [lrange $model 1 end-1]
+        for {set i 0} {$i < 300} {incr i} {$r rpoplpush biglist biglist}
+        set model [concat [lrange $model end-299 end] [lrange $model 0 end-300]]
+        lappend res [expr {[$r lrange biglist 0 -1] eq $model}]
+        $r debug reload
+        lappend res [expr {[$r lrange biglist 0 -1] eq $model}]
+        lappend res [string match {*encoding:seglist*} [$r debug object biglist]]
+    } {10 1 133 1 1 1 1 1 1}
+
     test {LLEN against non-list value error} {
         $r del mylist
         $r set mylist foobar
@@ -508,6 +675,20 @@ proc main {server port} {
         format $err
     } {ERR*}
 
+    test {LPUSH and RPUSH with multiple values} {
+        $r del varlist biglist
+        set rv {}
+        lappend rv [$r lpush varlist a b c]
+        lappend rv [$r rpush varlist d e]
+        lappend rv [$r lrange varlist 0 -1]
+        set vals {}
+        for {set i 0} {$i < 200} {incr i} {lappend vals $i}
+        lappend rv [$r rpush biglist {*}$vals]
+        lappend rv [$r lindex biglist 150]
+        $r del varlist biglist
+        set _ $rv
+    } {3 5 {c b a d e} 200 150}
+
     test {RPOPLPUSH base case} {
         $r del mylist
         $r rpush mylist a
@@ -814,6 +995,12 @@ proc main {server port} {
         format $err
     } {ERR*kind*}
 
+    test {SADD with multiple members} {
+        $r del varset
+        list [$r sadd varset a b c a 1] [$r sadd varset b d] \
+            [lsort [$r smembers varset]] [$r del varset]
+    } {4 1 {1 a b c d} 1}
+
     test {SREM basics} {
         $r sadd myset ciao
         $r srem myset foo
@@ -866,6 +1053,18 @@ proc main {server port} {
         lsort [$r smembers setres]
     } {995 999}
 
+    test {SINTERCARD against two and three sets, and non existing keys} {
+        $r sadd set3 abc
+        list [$r sintercard set1 set2] [$r sintercard set1 set2 set3] \
+             [$r sintercard set3] [$r sintercard set1 nokey]
+    } {5 2 5 0}
+
+    test {SINTER with mixed integer and string encoded members} {
+        foreach x {1 2 3 foo 10 bar} {$r sadd mixset1 $x}
+        foreach x {2 foo 3 zap 100} {$r sadd mixset2 $x}
+        list [lsort [$r sinter mixset1 mixset2]] [$r sintercard mixset2 mixset1]
+    } {{2 3 foo} 3}
+
     test {SUNION with non existing keys} {
         lsort [$r sunion nokey1 set1 set2 nokey2]
     } [lsort -uniq "[$r smembers set1] [$r smembers set2]"]
@@ -970,6 +1169,19 @@ proc main {server port} {
         $r sort tosort {DESC}
     } [lsort -decreasing -integer $res]
 
+    test {SORT with BY and LIMIT against the newly created list and set} {
+        list [expr {[$r sort tosort {BY weight_* LIMIT 0 20}] eq [lrange $res 0 19]}] \
+             [expr {[$r sort tosort-set {BY weight_* LIMIT 100 20}] eq [lrange $res 100 119]}] \
+             [expr {[$r sort tosort {BY weight_* LIMIT 5000 20}] eq [lrange $res 5000 5019]}] \
+             [expr {[$r sort tosort {BY weight_* DESC LIMIT 0 20}] eq [lrange [lreverse $res] 0 19]}]
+    } {1 1 1 1}
+
+    test {SORT with constant BY and LIMIT returns the requested window} {
+        list [expr {[$r sort tosort {BY nokey LIMIT 10 5}] eq [lrange [$r lrange tosort 0 -1] 10 14]}] \
+             [$r sort tosort {BY nokey LIMIT 20000 5}] \
+             [llength [$r sort tosort {BY nokey LIMIT 9998 5}]]
+    } {1 {} 2}
+
     test {SORT speed, sorting 10000 elements list using BY, 100 times} {
         set start [clock clicks -milliseconds]
         for {set i 0} {$i < 100} {incr i} {
@@ -1202,6 +1414,18 @@ proc main {server port} {
         list $aux1 $aux2
     } {{x y z} {y x z}}
 
+    test {ZADD with multiple score member pairs} {
+        $r del varzset
+        set rv {}
+        lappend rv [$r zadd varzset 3 c 1 a 2 b]
+        lappend rv [$r zadd varzset 0 c 4 d]
+        lappend rv [$r zrange varzset 0 -1]
+        catch {$r zadd varzset 1 a 2} err
+        lappend rv $err
+        $r del varzset
+        set _ $rv
+    } {3 1 {c a b d} {ERR*syntax*}}
+
     test {ZCARD basics} {
         $r zcard ztmp
     } {3}
@@ -1459,6 +1683,27 @@ proc main {server port} {
         $r zrangebyscore zset 20 50 LIMIT 2 3 withscores
     } {d 40 e 50}
 
+    test {ZRANGEBYSCORE with LIMIT, paginating with duplicated scores} {
+        set err {}
+        $r del zset
+        for {set i 0} {$i < 1000} {incr i} {
+            $r zadd zset [expr {$i/10}] $i
+        }
+        foreach {min max} {0 99 10 20 (10 (20 (15 55 50 (50} {
+            set all [$r zrangebyscore zset $min $max]
+            if {[$r zcount zset $min $max] != [llength $all]} {
+                append err "ZCOUNT $min $max mismatch\n"
+            }
+            for {set off 0} {$off < [llength $all]+10} {incr off 7} {
+                set page [$r zrangebyscore zset $min $max LIMIT $off 7]
+                if {$page ne [lrange $all $off [expr {$off+6}]]} {
+                    append err "LIMIT $off 7 in $min $max mismatch\n"
+                }
+            }
+        }
+        set _ $err
+    } {}
+
     test {ZREMRANGEBYSCORE basics} {
         $r del zset
         $r zadd zset 1 a
@@ -1528,6 +1773,47 @@ proc main {server port} {
         list [$r zinter zsetc 2 zseta zsetb aggregate max] [$r zrange zsetc 0 -1 withscores]
     } {2 {b 2 c 3}}
 
+    test {ZUNION result skiplist is consistent with ranks and updates} {
+        $r del zseta zsetb zsetc
+        array set expected {}
+        for {set i 0} {$i < 300} {incr i} {
+            set score [expr {int(rand()*50)}]
+            $r zadd zseta $score m$i
+            set expected(m$i) $score
+            if {$i % 3 == 0} {
+                $r zadd zsetb 7 m$i
+                incr expected(m$i) 7
+            }
+        }
+        $r zunion zsetc 2 zseta zsetb
+        $r zadd zsetc -1 newmin
+        $r zadd zsetc 1000 newmax
+        $r zrem zsetc m0
+        set expected(newmin) -1
+        set expected(newmax) 1000
+        unset expected(m0)
+        set pairs {}
+        foreach {k v} [array get expected] {lappend pairs [list $k $v]}
+        set sorted {}
+        foreach p [lsort -integer -index 1 [lsort -index 0 $pairs]] {
+            lappend sorted [lindex $p 0]
+        }
+        set err {}
+        if {[$r zrange zsetc 0 -1] ne $sorted} {
+            set err "zrange mismatch"
+        }
+        if {[$r zrevrange zsetc 0 -1] ne [lreverse $sorted]} {
+            set err "zrevrange mismatch"
+        }
+        for {set i 0} {$i < [llength $sorted]} {incr i} {
+            if {[$r zrank zsetc [lindex $sorted $i]] != $i} {
+                set err "rank mismatch at $i"
+                break
+            }
+        }
+        list [$r zcard zsetc] $err
+    } {301 {}}
+
     test {SORT against sorted sets} {
         $r del zset
         $r zadd zset 1 a
@@ -1682,6 +1968,22 @@ proc main {server port} {
         set _ $rv
     } {0 0 1 0 {} 1 0 {}}
 
+    test {HSET and HDEL with multiple fields} {
+        $r del varhash
+        set rv {}
+        lappend rv [$r hset varhash a 1 b 2 c 3]
+        lappend rv [$r hset varhash a 10 d 4]
+        lappend rv [$r hdel varhash a c nokey]
+        lappend rv [lsort [$r hgetall varhash]]
+        set args {}
+        for {set i 0} {$i < 300} {incr i} {lappend args f$i v$i}
+        lappend rv [$r hset varhash {*}$args]
+        lappend rv [$r hget varhash f299]
+        lappend rv [string match {*hashtable*} [$r debug object varhash]]
+        $r del varhash
+        set _ $rv
+    } {3 1 2 {2 4 b d} 300 v299 1}
+
     test {HEXISTS} {
         set rv {}
         set k [lindex [array names smallhash *] 0]
@@ -0,0 +1,291 @@
+/* Minimal io_uring(7) interface, used by the Virtual Memory subsystem to
+ * perform swap file I/O asynchronously without I/O threads.
+ *
+ * This is just a thin layer over the io_uring_setup(2), io_uring_enter(2)
+ * and io_uring_register(2) system calls, in order to avoid depending on
+ * liburing. Read and write requests are queued in the submission ring with
+ * uringPrepRead() / uringPrepWrite(), and passed to the kernel with a single
+ * uringSubmit() call for the whole batch. When uringEventFd() is used the
+ * returned file descriptor becomes readable every time new completions are
+ * available, so that they can be reaped with uringNextCompletion() from the
+ * event loop.
+ *
+ * On systems without io_uring support uringCreate() always fails.
+ *
+ * --------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2010, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE /* O_DIRECT */
+#include "fmacros.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+
+#include "config.h"
+#include "uring.h"
+#include "zmalloc.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;                 /* io_uring instance */
+    int efd;                /* eventfd signaled on completions, or -1 */
+    unsigned int entries;   /* Size of the submission ring */
+    unsigned int tosubmit;  /* Requests queued but not yet submitted */
+    /* Submission ring */
+    void *sqring;
+    size_t sqring_size;
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    /* Completion ring */
+    void *cqring;
+    size_t cqring_size;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_cqe *cqes;
+};
+
+uring *uringCreate(unsigned int entries) {
+    struct io_uring_params p;
+    uring *r = zmalloc(sizeof(*r));
+    int fd;
+
+    memset(&p,0,sizeof(p));
+    r->sqring = r->cqring = r->sqes = MAP_FAILED;
+    r->efd = -1;
+    r->fd = fd = syscall(__NR_io_uring_setup,entries,&p);
+    if (fd == -1) goto err;
+    r->entries = p.sq_entries;
+    r->tosubmit = 0;
+
+    r->sqring_size = p.sq_off.array+p.sq_entries*sizeof(unsigned);
+    r->sqring = mmap(NULL,r->sqring_size,PROT_READ|PROT_WRITE,MAP_SHARED,
+                     fd,IORING_OFF_SQ_RING);
+    r->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL,r->sqes_size,PROT_READ|PROT_WRITE,MAP_SHARED,
+                   fd,IORING_OFF_SQES);
+    r->cqring_size = p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+    r->cqring = mmap(NULL,r->cqring_size,PROT_READ|PROT_WRITE,MAP_SHARED,
+                     fd,IORING_OFF_CQ_RING);
+    if (r->sqring == MAP_FAILED || r->sqes == MAP_FAILED ||
+        r->cqring == MAP_FAILED) goto err;
+
+    r->sqhead = (unsigned*)((char*)r->sqring+p.sq_off.head);
+    r->sqtail = (unsigned*)((char*)r->sqring+p.sq_off.tail);
+    r->sqmask = (unsigned*)((char*)r->sqring+p.sq_off.ring_mask);
+    r->sqarray = (unsigned*)((char*)r->sqring+p.sq_off.array);
+    r->cqhead = (unsigned*)((char*)r->cqring+p.cq_off.head);
+    r->cqtail = (unsigned*)((char*)r->cqring+p.cq_off.tail);
+    r->cqmask = (unsigned*)((char*)r->cqring+p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)((char*)r->cqring+p.cq_off.cqes);
+    return r;
+
+err:
+    uringFree(r);
+    return NULL;
+}
+
+void uringFree(uring *r) {
+    int saved_errno = errno;
+
+    if (r->sqring != MAP_FAILED) munmap(r->sqring,r->sqring_size);
+    if (r->sqes != MAP_FAILED) munmap(r->sqes,r->sqes_size);
+    if (r->cqring != MAP_FAILED) munmap(r->cqring,r->cqring_size);
+    if (r->efd != -1) close(r->efd);
+    if (r->fd != -1) close(r->fd);
+    zfree(r);
+    errno = saved_errno;
+}
+
+/* Return the number of requests that can be queued at the same time */
+unsigned int uringEntries(uring *r) {
+    return r->entries;
+}
+
+/* Create an eventfd signaled by the kernel on every completion. Returns the
+ * file descriptor, or -1 on error. */
+int uringEventFd(uring *r) {
+    int efd;
+
+    if (r->efd != -1) return r->efd;
+    if ((efd = eventfd(0,EFD_NONBLOCK)) == -1) return -1;
+    if (syscall(__NR_io_uring_register,r->fd,IORING_REGISTER_EVENTFD,
+                &efd,1) == -1)
+    {
+        close(efd);
+        return -1;
+    }
+    r->efd = efd;
+    return efd;
+}
+
+static int uringPrep(uring *r, int op, int fd, void *buf, size_t len,
+                     off_t offset, void *udata)
+{
+    unsigned head = __atomic_load_n(r->sqhead,__ATOMIC_ACQUIRE);
+    unsigned tail = *r->sqtail;
+    unsigned idx = tail & *r->sqmask;
+    struct io_uring_sqe *sqe;
+
+    if (tail-head == r->entries || len > UINT_MAX) {
+        errno = (len > UINT_MAX) ? EINVAL : EBUSY;
+        return -1;
+    }
+    sqe = &r->sqes[idx];
+    memset(sqe,0,sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = (uintptr_t) udata;
+    r->sqarray[idx] = idx;
+    __atomic_store_n(r->sqtail,tail+1,__ATOMIC_RELEASE);
+    r->tosubmit++;
+    return 0;
+}
+
+/* Queue a read of 'len' bytes at 'offset' of 'fd' into 'buf'. The request
+ * is not passed to the kernel until uringSubmit() is called. Returns -1 if
+ * the submission ring is full. */
+int uringPrepRead(uring *r, int fd, void *buf, size_t len, off_t offset,
+                  void *udata)
+{
+    return uringPrep(r,IORING_OP_READ,fd,buf,len,offset,udata);
+}
+
+/* Like uringPrepRead() but writing 'buf' into the file. */
+int uringPrepWrite(uring *r, int fd, void *buf, size_t len, off_t offset,
+                   void *udata)
+{
+    return uringPrep(r,IORING_OP_WRITE,fd,buf,len,offset,udata);
+}
+
+/* Submit all the queued requests with a single system call, waiting for at
+ * least 'wait' completions. Returns the number of submitted requests, or -1
+ * on error. */
+int uringSubmit(uring *r, unsigned int wait) {
+    int retval;
+
+    if (r->tosubmit == 0 && wait == 0) return 0;
+    do {
+        retval = syscall(__NR_io_uring_enter,r->fd,r->tosubmit,wait,
+                         wait ? IORING_ENTER_GETEVENTS : 0,NULL,0);
+    } while (retval == -1 && errno == EINTR);
+    if (retval == -1) return -1;
+    r->tosubmit -= retval;
+    return retval;
+}
+
+/* Get the next completed request: the 'udata' pointer passed when the
+ * request was queued is stored in *udata, and the result of the operation
+ * (like the return value of read(2)/write(2), or -errno) in *res.
+ * Returns 1 if a completion was reaped, 0 if there are no completions. */
+int uringNextCompletion(uring *r, void **udata, int *res) {
+    unsigned head = *r->cqhead;
+    struct io_uring_cqe *cqe;
+
+    if (head == __atomic_load_n(r->cqtail,__ATOMIC_ACQUIRE)) return 0;
+    cqe = &r->cqes[head & *r->cqmask];
+    *udata = (void*)(uintptr_t) cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(r->cqhead,head+1,__ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Open 'filename' for reading and writing requests. If 'direct' is true
+ * the page cache is bypassed (O_DIRECT): buffers, lengths and offsets of the
+ * requests must then be aligned to the block size of the device. */
+int uringOpen(const char *filename, int direct) {
+    return open(filename,O_RDWR|(direct ? O_DIRECT : 0));
+}
+
+#else /* !HAVE_IO_URING */
+
+int uringOpen(const char *filename, int direct) {
+    (void) filename; (void) direct;
+    errno = ENOSYS;
+    return -1;
+}
+
+uring *uringCreate(unsigned int entries) {
+    (void) entries;
+    errno = ENOSYS;
+    return NULL;
+}
+
+void uringFree(uring *r) {
+    (void) r;
+}
+
+unsigned int uringEntries(uring *r) {
+    (void) r;
+    return 0;
+}
+
+int uringEventFd(uring *r) {
+    (void) r;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uringPrepRead(uring *r, int fd, void *buf, size_t len, off_t offset, void *udata) {
+    (void) r; (void) fd; (void) buf; (void) len; (void) offset; (void) udata;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uringPrepWrite(uring *r, int fd, void *buf, size_t len, off_t offset, void *udata) {
+    (void) r; (void) fd; (void) buf; (void) len; (void) offset; (void) udata;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uringSubmit(uring *r, unsigned int wait) {
+    (void) r; (void) wait;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uringNextCompletion(uring *r, void **udata, int *res) {
+    (void) r; (void) udata; (void) res;
+    return 0;
+}
+
+#endif
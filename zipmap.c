@@ -363,6 +363,20 @@ int zipmapExists(unsigned char *zm, unsigned char *key, unsigned int klen) {
     return zipmapLookupRaw(zm,key,klen,NULL,NULL,NULL) != NULL;
 }
 
+/* Return the number of bytes used by the zipmap, including the free space
+ * left inside entries and the empty blocks. */
+size_t zipmapBlobLen(unsigned char *zm) {
+    unsigned char *p = zm+1;
+
+    while(*p != ZIPMAP_END) {
+        if (*p == ZIPMAP_EMPTY)
+            p += zipmapDecodeLength(p+1);
+        else
+            p += zipmapRawEntryLength(p);
+    }
+    return (p-zm)+1;
+}
+
 /* Return the number of entries inside a zipmap */
 unsigned int zipmapLen(unsigned char *zm) {
     unsigned char *p = zipmapRewind(zm);
@@ -40,6 +40,7 @@
 #include <numaif.h>
 #include <sched.h>
 #include <limits.h>
+#include <stdint.h>
 #include "config.h"
 
 // ============================================================================
@@ -559,6 +560,111 @@ void zmalloc_set_numa_node(int node) {
     }
 }
 
+/**
+ * 检查NUMA节点是否可用（可作为zmalloc_move_batch_create()的目标节点）
+ */
+int zmalloc_numa_node_available(int node) {
+    if (!numa_initialized) zmalloc_numa_init();
+
+    return numa_support_available == 0 && node >= 0 &&
+           node <= numa_max_node() &&
+           numa_bitmask_isbitset(numa_all_nodes_ptr, node);
+}
+
+/* 一批待迁移的页：所有页通过一次move_pages(2)迁移 */
+struct zmalloc_move_batch {
+    int node;
+    void **pages;       // 所有内存块的整页，可能重复
+    size_t numpages, pagesalloc;
+};
+
+/**
+ * 创建迁移到指定NUMA节点的内存块批次
+ */
+struct zmalloc_move_batch *zmalloc_move_batch_create(int node) {
+    struct zmalloc_move_batch *b = calloc(1, sizeof(*b));
+
+    if (b == NULL) zmalloc_oom(sizeof(*b), sizeof(*b));
+    b->node = node;
+    return b;
+}
+
+/**
+ * 将一块已分配内存加入批次，实际迁移在zmalloc_move_batch_commit()中进行。
+ * move_pages(2)迁移的是整页，而小内存块与其他内存块（可能属于别的key）
+ * 共享页，所以只加入完全位于内存块内部的页：首尾不完整的页，以及小于
+ * 一页的内存块都不会被迁移。
+ */
+void zmalloc_move_batch_add(struct zmalloc_move_batch *b, void *ptr) {
+    char *realptr;
+    size_t size, pagesize, n;
+    uintptr_t first, last;
+
+    if (ptr == NULL) return;
+#ifdef HAVE_MALLOC_SIZE
+    realptr = ptr;
+    size = redis_malloc_size(ptr);
+#else
+    realptr = (char*)ptr - PREFIX_SIZE;
+    size = *((size_t*)realptr) + PREFIX_SIZE;
+#endif
+    pagesize = numa_pagesize();
+    first = ((uintptr_t)realptr+pagesize-1) & ~(uintptr_t)(pagesize-1);
+    last = ((uintptr_t)realptr+size) & ~(uintptr_t)(pagesize-1);
+    if (last <= first) return;
+    n = (last-first)/pagesize;
+
+    if (b->numpages+n > b->pagesalloc) {
+        b->pagesalloc = (b->numpages+n)*2;
+        b->pages = realloc(b->pages, sizeof(void*)*b->pagesalloc);
+        if (b->pages == NULL) zmalloc_oom(sizeof(void*)*b->pagesalloc, 0);
+    }
+    for (; first < last; first += pagesize)
+        b->pages[b->numpages++] = (void*)first;
+}
+
+static int zmalloc_page_compare(const void *a, const void *b) {
+    uintptr_t pa = (uintptr_t)*(void**)a, pb = (uintptr_t)*(void**)b;
+
+    return pa < pb ? -1 : (pa > pb);
+}
+
+/**
+ * 用一次move_pages(2)将批次中的所有页迁移到目标节点（去重后），不复制
+ * 数据，指针保持不变。迁移是尽力而为的：迁移后再查询每一页实际所在的
+ * 节点，只计入位于目标节点的页。
+ * 返回这些页的总字节数，total不为NULL时设置为批次中所有页的总字节数，
+ * 并释放批次。NUMA节点不可用时返回0。
+ */
+size_t zmalloc_move_batch_commit(struct zmalloc_move_batch *b, size_t *total) {
+    size_t moved = 0, n = 0, j, pagesize = numa_pagesize();
+    int *nodes = NULL, *status = NULL;
+
+    // 排序去重：同一内存块可能被加入多次（共享的对象）
+    qsort(b->pages, b->numpages, sizeof(void*), zmalloc_page_compare);
+    for (j = 0; j < b->numpages; j++)
+        if (n == 0 || b->pages[j] != b->pages[n-1]) b->pages[n++] = b->pages[j];
+    if (total) *total = n*pagesize;
+    if (n == 0 || !zmalloc_numa_node_available(b->node)) goto cleanup;
+
+    nodes = malloc(sizeof(int)*n);
+    status = malloc(sizeof(int)*n);
+    if (nodes == NULL || status == NULL) zmalloc_oom(sizeof(int)*n*2, 0);
+    for (j = 0; j < n; j++) nodes[j] = b->node;
+    numa_move_pages(0, n, b->pages, nodes, status, MPOL_MF_MOVE);
+    // nodes为NULL时只查询每一页当前所在的节点
+    if (numa_move_pages(0, n, b->pages, NULL, status, 0) < 0) goto cleanup;
+    for (j = 0; j < n; j++)
+        if (status[j] == b->node) moved += pagesize;
+
+cleanup:
+    free(nodes);
+    free(status);
+    free(b->pages);
+    free(b);
+    return moved;
+}
+
 /**
  * 设置NUMA分配策略
  */
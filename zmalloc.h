@@ -45,6 +45,13 @@ void zmalloc_set_numa_node(int node);  // 设置默认的NUMA节点
 int zmalloc_get_current_numa_node(void);  // 获取当前线程的NUMA节点
 void *zmalloc_on_node(size_t size, int node);  // 在指定NUMA节点分配内存
 void *zrealloc_on_node(void *ptr, size_t size, int node);  // 在指定NUMA节点重新分配
+int zmalloc_numa_node_available(int node);  // 检查NUMA节点是否可用
+
+// 批量将已分配内存的整页迁移到指定NUMA节点，每批只进行一次move_pages(2)
+typedef struct zmalloc_move_batch zmalloc_move_batch;
+zmalloc_move_batch *zmalloc_move_batch_create(int node);
+void zmalloc_move_batch_add(zmalloc_move_batch *b, void *ptr);
+size_t zmalloc_move_batch_commit(zmalloc_move_batch *b, size_t *total);  // 返回迁移成功的字节数，*total为批次的总字节数
 
 // NUMA策略相关函数
 typedef enum {